@@ -0,0 +1,702 @@
+/*
+ * bench.c - Load generator for the Text Conferencing Server
+ *
+ * Usage: ./bench [-h <host>] [-p <port>] [-c <clients>] [-S <sizes>]
+ *                [-r <msgs/s>] [-P <payload>] [-t <seconds>] [-w <seconds>]
+ *                [-C <connects>] [-s <seed>] [-o <result-file>] [-b <baseline-file>]
+ *
+ * Simulates many clients from one epoll-driven process using the normal
+ * LOGIN / NEW_SESS / JOIN / MESSAGE protocol.  Clients are split into
+ * sessions whose sizes follow <sizes>:
+ *   fixed:<n>              every session has n members (default fixed:10)
+ *   uniform:<min>-<max>    sizes drawn uniformly
+ *   zipf:<s>:<max>         P(size = k) ~ 1/k^s for k in 1..max (many small, few large)
+ * Once everyone has joined, each client sends <msgs/s> MESSAGE frames of
+ * <payload> bytes to its session.  Every message carries its send time, so
+ * each delivered copy yields one fan-out latency sample (send -> member
+ * receives it).  After a warm-up of -w seconds the tool measures for -t
+ * seconds and prints throughput and latency percentiles.
+ *
+ * The last line of the report ("RESULT key=value ...") can be saved with
+ * -o and compared against a later run with -b.
+ *
+ * The server must accept the generated user names; start it with -o
+ * (open logins) and, for more than a hundred clients, build it with a
+ * larger MAX_CLIENTS ("make server_bench").
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <math.h>
+ #include <time.h>
+ #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <sys/socket.h>
+ #include <sys/epoll.h>
+ #include <sys/resource.h>
+
+ #include "chatproto.h"
+
+ #define BENCH_TAG         "BNCH "      // Start of every benchmark payload
+ #define SETUP_TIMEOUT     60.0         // Seconds to get every client into its session
+ #define MAX_OUTBUF        (64 * 1024)  // Unsent bytes per client before sends are skipped
+ #define MAX_EVENTS        1024
+
+ // Latency histogram: 32 sub-buckets per power of two, values in ns
+ #define LAT_SUB_BITS      5
+ #define LAT_MAX_BITS      40
+ #define LAT_BUCKETS       ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+ // Life cycle of one simulated client
+ #define ST_CONNECTING 0
+ #define ST_LOGIN      1   // LOGIN sent
+ #define ST_WAITING    2   // Logged in, waiting for its session to be created
+ #define ST_JOINING    3   // NEW_SESS or JOIN sent
+ #define ST_READY      4
+ #define ST_DEAD       5
+
+ typedef struct {
+     int  fd;
+     int  state;
+     int  session;                     // Index into bench_sessions
+     char name[MAX_NAME];
+     unsigned char in[sizeof(struct message)] CHAT_FRAME_ALIGNED;
+     size_t in_len;
+     unsigned char *out;               // Pending output
+     size_t out_len;
+     size_t out_off;
+     size_t out_cap;
+     double next_send;                 // Monotonic time of the next MESSAGE
+ } bench_client_t;
+
+ typedef struct {
+     char name[MAX_NAME];
+     int  first;                       // Index of the first member (the creator)
+     int  size;
+     int  created;
+ } bench_session_t;
+
+ typedef struct {
+     unsigned long counts[LAT_BUCKETS];
+     unsigned long total;
+     unsigned long max;
+     double sum;
+ } hist_t;
+
+ // Options
+ static const char *host = "127.0.0.1";
+ static int    port = 5000;
+ static int    num_clients = 100;
+ static char   size_spec[64] = "fixed:10";
+ static double rate = 1.0;             // Messages per second per client
+ static int    payload = 128;
+ static double duration = 10.0;
+ static double warmup = 2.0;
+ static int    max_connecting = 32;    // Logins in flight (the server logs in one at a time)
+ static unsigned int seed = 1;
+ static const char *result_path = NULL;
+ static const char *baseline_path = NULL;
+
+ // State
+ static bench_client_t  *clients;
+ static bench_session_t *bench_sessions;
+ static int  num_bench_sessions = 0;
+ static int  epfd;
+ static int  connecting = 0;           // Clients between connect() and ready
+ static int  next_connect = 0;
+ static int  num_ready = 0;
+ static int  num_dead = 0;
+ static int  measuring = 0;
+ static double measure_start, measure_end;
+ static unsigned long msgs_sent, msgs_skipped, frames_recv, bytes_recv, throttled;
+ static unsigned long copies_expected;  // Session size summed over measured sends
+ static hist_t latency;
+
+ // --------------------- Utility Functions ---------------------
+
+ static double now_sec(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+ }
+
+ static unsigned long now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+ }
+
+ static int hist_bucket(unsigned long v) {
+     if (v >= (1UL << LAT_MAX_BITS)) {
+         v = (1UL << LAT_MAX_BITS) - 1;
+     }
+     if (v < (1UL << LAT_SUB_BITS)) {
+         return (int)v;
+     }
+     int shift = (63 - __builtin_clzl(v)) - LAT_SUB_BITS;
+     return ((shift + 1) << LAT_SUB_BITS) + (int)(v >> shift) - (1 << LAT_SUB_BITS);
+ }
+
+ static unsigned long hist_bucket_high(int b) {
+     if (b < (1 << LAT_SUB_BITS)) {
+         return b;
+     }
+     int shift = (b >> LAT_SUB_BITS) - 1;
+     unsigned long sub = (b & ((1 << LAT_SUB_BITS) - 1)) + (1 << LAT_SUB_BITS);
+     return ((sub + 1) << shift) - 1;
+ }
+
+ static void hist_record(hist_t *h, unsigned long ns) {
+     h->counts[hist_bucket(ns)]++;
+     h->total++;
+     h->sum += ns;
+     if (ns > h->max) {
+         h->max = ns;
+     }
+ }
+
+ static unsigned long hist_percentile(const hist_t *h, double q) {
+     if (h->total == 0) {
+         return 0;
+     }
+     unsigned long rank = (unsigned long)(q * h->total + 0.5);
+     unsigned long seen = 0;
+     if (rank < 1) {
+         rank = 1;
+     }
+     for (int b = 0; b < LAT_BUCKETS; b++) {
+         seen += h->counts[b];
+         if (seen >= rank) {
+             unsigned long v = hist_bucket_high(b);
+             return v < h->max ? v : h->max;
+         }
+     }
+     return h->max;
+ }
+
+ static void usage(const char *prog) {
+     fprintf(stderr,
+             "Usage: %s [-h host] [-p port] [-c clients] [-S fixed:N|uniform:A-B|zipf:S:MAX]\n"
+             "          [-r msgs/s] [-P payload] [-t seconds] [-w seconds] [-C connects]\n"
+             "          [-s seed] [-o result-file] [-b baseline-file]\n", prog);
+     exit(EXIT_FAILURE);
+ }
+
+ // --------------------- Session Layout ---------------------
+
+ /**
+  * Draw one session size from the -S distribution.
+  */
+ static int draw_size(void) {
+     int a, b;
+     double s;
+     if (sscanf(size_spec, "fixed:%d", &a) == 1) {
+         return a;
+     }
+     if (sscanf(size_spec, "uniform:%d-%d", &a, &b) == 2 && a <= b) {
+         return a + rand_r(&seed) % (b - a + 1);
+     }
+     if (sscanf(size_spec, "zipf:%lf:%d", &s, &b) == 2 && b >= 1) {
+         static double *cdf = NULL;    // Built on first use
+         if (!cdf) {
+             cdf = malloc(b * sizeof(double));
+             double total = 0;
+             for (int k = 1; k <= b; k++) {
+                 total += 1.0 / pow(k, s);
+                 cdf[k - 1] = total;
+             }
+             for (int k = 0; k < b; k++) {
+                 cdf[k] /= total;
+             }
+         }
+         double u = rand_r(&seed) / (RAND_MAX + 1.0);
+         for (int k = 0; k < b; k++) {
+             if (u < cdf[k]) {
+                 return k + 1;
+             }
+         }
+         return b;
+     }
+     fprintf(stderr, "Invalid session size spec '%s'\n", size_spec);
+     exit(EXIT_FAILURE);
+ }
+
+ /**
+  * Split the clients into consecutive sessions.
+  */
+ static void layout_sessions(void) {
+     bench_sessions = calloc(num_clients, sizeof(bench_session_t));
+     int pid = (int)getpid();
+     for (int i = 0; i < num_clients; ) {
+         int size = draw_size();
+         if (size < 1) {
+             size = 1;
+         }
+         if (size > num_clients - i) {
+             size = num_clients - i;
+         }
+         bench_session_t *s = &bench_sessions[num_bench_sessions];
+         snprintf(s->name, MAX_NAME, "bench%d-%d", pid, num_bench_sessions);
+         s->first = i;
+         s->size = size;
+         for (int j = i; j < i + size; j++) {
+             clients[j].session = num_bench_sessions;
+         }
+         num_bench_sessions++;
+         i += size;
+     }
+ }
+
+ // --------------------- Connections ---------------------
+
+ static void watch(bench_client_t *c, int op) {
+     struct epoll_event ev;
+     ev.events = EPOLLIN | ((c->state == ST_CONNECTING || c->out_len > c->out_off) ? EPOLLOUT : 0);
+     ev.data.u32 = (unsigned int)(c - clients);
+     if (epoll_ctl(epfd, op, c->fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+         perror("epoll_ctl");
+     }
+ }
+
+ static void kill_client(bench_client_t *c, const char *why) {
+     if (c->state == ST_DEAD) {
+         return;
+     }
+     if (c->state != ST_READY) {
+         connecting--;
+     } else {
+         num_ready--;
+     }
+     if (num_dead < 5) {
+         fprintf(stderr, "%s: %s\n", c->name, why);
+     }
+     c->state = ST_DEAD;
+     num_dead++;
+     epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+     close(c->fd);
+ }
+
+ /**
+  * Write as much pending output as the socket takes.
+  */
+ static void flush_out(bench_client_t *c) {
+     int had_pending = c->out_len > c->out_off;
+     while (c->out_len > c->out_off) {
+         ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+         if (n < 0) {
+             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                 break;
+             }
+             if (errno == EINTR) {
+                 continue;
+             }
+             kill_client(c, strerror(errno));
+             return;
+         }
+         c->out_off += n;
+     }
+     if (c->out_off == c->out_len) {
+         c->out_off = c->out_len = 0;
+     }
+     if (had_pending != (c->out_len > c->out_off)) {
+         watch(c, EPOLL_CTL_MOD);
+     }
+ }
+
+ /**
+  * Queue a frame; returns -1 if the client is too far behind.
+  */
+ static int send_frame(bench_client_t *c, unsigned int type, const char *session,
+                       const char *data, size_t data_len) {
+     if (c->out_len - c->out_off + sizeof(struct message) > MAX_OUTBUF) {
+         return -1;
+     }
+     if (c->out_len + sizeof(struct message) > c->out_cap) {
+         c->out_cap = c->out_cap ? c->out_cap * 2 : 4 * sizeof(struct message);
+         c->out = realloc(c->out, c->out_cap);
+     }
+     struct message *m = (struct message *)(c->out + c->out_len);
+     memset(m, 0, sizeof(*m));
+     m->type = type;
+     m->size = data_len;
+     snprintf((char *)m->source, MAX_NAME, "%s", c->name);
+     if (session) {
+         snprintf((char *)m->session, MAX_NAME, "%s", session);
+     }
+     memcpy(m->data, data, data_len < MAX_DATA ? data_len : MAX_DATA - 1);
+     chat_encode(m);
+     c->out_len += sizeof(struct message);
+     flush_out(c);
+     return 0;
+ }
+
+ static void start_connect(bench_client_t *c) {
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_port = htons(port);
+     inet_pton(AF_INET, host, &addr.sin_addr);
+
+     c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+     if (c->fd < 0) {
+         perror("socket");
+         exit(EXIT_FAILURE);
+     }
+     int one = 1;
+     setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+     c->state = ST_CONNECTING;
+     connecting++;
+     if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+         watch(c, EPOLL_CTL_ADD);
+         kill_client(c, strerror(errno));
+         return;
+     }
+     watch(c, EPOLL_CTL_ADD);
+ }
+
+ static void send_join(bench_client_t *c) {
+     bench_session_t *s = &bench_sessions[c->session];
+     int creator = (c - clients) == s->first;
+     c->state = ST_JOINING;
+     send_frame(c, creator ? NEW_SESS : JOIN, NULL, s->name, strlen(s->name) + 1);
+ }
+
+ /**
+  * React to one frame from the server.
+  */
+ static void handle_frame(bench_client_t *c, struct message *m) {
+     switch (m->type) {
+         case LO_ACK:
+             if (c->state == ST_LOGIN) {
+                 bench_session_t *s = &bench_sessions[c->session];
+                 if ((c - clients) == s->first || s->created) {
+                     send_join(c);
+                 } else {
+                     c->state = ST_WAITING;  // joined when the creator's NS_ACK arrives
+                 }
+             }
+             break;
+         case NS_ACK:
+         case JN_ACK:
+             if (c->state == ST_JOINING) {
+                 bench_session_t *s = &bench_sessions[c->session];
+                 c->state = ST_READY;
+                 connecting--;
+                 num_ready++;
+                 if (m->type == NS_ACK) {
+                     s->created = 1;
+                     for (int i = s->first + 1; i < s->first + s->size; i++) {
+                         if (clients[i].state == ST_WAITING) {
+                             send_join(&clients[i]);
+                         }
+                     }
+                 }
+             }
+             break;
+         case LO_NAK:
+         case JN_NAK:
+             m->data[MAX_DATA - 1] = '\0';
+             kill_client(c, (char *)m->data);
+             break;
+         case MESSAGE:
+             if (measuring && strncmp((char *)m->data, BENCH_TAG, strlen(BENCH_TAG)) == 0) {
+                 unsigned long sent = strtoul((char *)m->data + strlen(BENCH_TAG), NULL, 16);
+                 unsigned long now = now_ns();
+                 if (sent >= (unsigned long)(measure_start * 1e9) && now >= sent) {
+                     hist_record(&latency, now - sent);
+                     frames_recv++;
+                     bytes_recv += sizeof(struct message);
+                 }
+             }
+             break;
+         case THROTTLE:
+             if (measuring) {
+                 throttled++;
+             }
+             break;
+         default:
+             break;
+     }
+ }
+
+ static void handle_readable(bench_client_t *c) {
+     while (c->state != ST_DEAD) {
+         ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+         if (n < 0) {
+             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                 return;
+             }
+             if (errno == EINTR) {
+                 continue;
+             }
+             kill_client(c, strerror(errno));
+             return;
+         }
+         if (n == 0) {
+             kill_client(c, "server closed the connection");
+             return;
+         }
+         c->in_len += n;
+         if (c->in_len == sizeof(c->in)) {
+             c->in_len = 0;
+             handle_frame(c, chat_decode(c->in));
+         }
+     }
+ }
+
+ static void handle_writable(bench_client_t *c) {
+     if (c->state == ST_CONNECTING) {
+         int err = 0;
+         socklen_t len = sizeof(err);
+         getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+         if (err) {
+             kill_client(c, strerror(err));
+             return;
+         }
+         c->state = ST_LOGIN;
+         watch(c, EPOLL_CTL_MOD);
+         send_frame(c, LOGIN, NULL, "bench", 6);
+         return;
+     }
+     flush_out(c);
+ }
+
+ // --------------------- Load ---------------------
+
+ static void send_traffic(double now) {
+     char data[MAX_DATA];
+     for (int i = 0; i < num_clients; i++) {
+         bench_client_t *c = &clients[i];
+         if (c->state != ST_READY || now < c->next_send) {
+             continue;
+         }
+         c->next_send += 1.0 / rate;
+         if (c->next_send < now) {
+             c->next_send = now + 1.0 / rate;  // fell behind; do not burst to catch up
+         }
+         int len = snprintf(data, sizeof(data), BENCH_TAG "%016lx ", now_ns());
+         if (len < payload) {
+             memset(data + len, 'x', payload - len);
+             len = payload;
+         }
+         data[len] = '\0';
+         if (send_frame(c, MESSAGE, bench_sessions[c->session].name, data, len + 1) < 0) {
+             msgs_skipped++;
+         } else if (now >= measure_start && now < measure_end) {
+             msgs_sent++;
+             copies_expected += bench_sessions[c->session].size;  // the sender gets a copy too
+         }
+     }
+ }
+
+ // --------------------- Results ---------------------
+
+ /**
+  * Compare a RESULT line against the one saved in 'path'.
+  */
+ static void compare_baseline(const char *result, const char *path) {
+     FILE *f = fopen(path, "r");
+     if (!f) {
+         perror(path);
+         return;
+     }
+     char line[1024], base[1024] = "";
+     while (fgets(line, sizeof(line), f)) {
+         if (strncmp(line, "RESULT ", 7) == 0) {
+             strcpy(base, line);
+         }
+     }
+     fclose(f);
+     if (!base[0]) {
+         fprintf(stderr, "%s: no RESULT line\n", path);
+         return;
+     }
+     printf("Compared with %s:\n", path);
+     char copy[1024];
+     strcpy(copy, result);
+     for (char *tok = strtok(copy + 7, " \n"); tok; tok = strtok(NULL, " \n")) {
+         char *eq = strchr(tok, '=');
+         if (!eq) {
+             continue;
+         }
+         *eq = '\0';
+         char key[64];
+         snprintf(key, sizeof(key), " %s=", tok);
+         char *old = strstr(base + 6, key);
+         if (!old) {
+             continue;
+         }
+         double was = atof(old + strlen(key));
+         double now = atof(eq + 1);
+         if (was != 0) {
+             printf("  %-16s %12.1f -> %12.1f  (%+.1f%%)\n", tok, was, now, 100.0 * (now - was) / was);
+         } else {
+             printf("  %-16s %12.1f -> %12.1f\n", tok, was, now);
+         }
+     }
+ }
+
+ static void report(double setup_time) {
+     int min = num_clients, max = 0;
+     for (int i = 0; i < num_bench_sessions; i++) {
+         min = bench_sessions[i].size < min ? bench_sessions[i].size : min;
+         max = bench_sessions[i].size > max ? bench_sessions[i].size : max;
+     }
+     printf("Clients:    %d ready, %d failed, %d sessions (%s: %d-%d members, mean %.1f)\n",
+            num_ready, num_dead, num_bench_sessions, size_spec, min, max,
+            (double)num_clients / num_bench_sessions);
+     printf("Setup:      %.2f s\n", setup_time);
+     printf("Sent:       %lu messages (%.1f/s), %lu skipped by backpressure, %lu throttled\n",
+            msgs_sent, msgs_sent / duration, msgs_skipped, throttled);
+     printf("Delivered:  %lu of %lu copies (%.1f%%; %.1f/s, %.2f MB/s)\n",
+            frames_recv, copies_expected,
+            copies_expected ? 100.0 * frames_recv / copies_expected : 0.0,
+            frames_recv / duration, bytes_recv / duration / 1e6);
+     printf("Fan-out latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f  mean %.1f\n",
+            hist_percentile(&latency, 0.5) / 1e3, hist_percentile(&latency, 0.9) / 1e3,
+            hist_percentile(&latency, 0.99) / 1e3, hist_percentile(&latency, 0.999) / 1e3,
+            latency.max / 1e3, latency.total ? latency.sum / latency.total / 1e3 : 0.0);
+
+     char result[1024];
+     snprintf(result, sizeof(result),
+              "RESULT clients=%d sent_per_s=%.1f delivered_per_s=%.1f mb_per_s=%.2f "
+              "delivered_pct=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f "
+              "throttled=%lu\n",
+              num_ready, msgs_sent / duration, frames_recv / duration, bytes_recv / duration / 1e6,
+              copies_expected ? 100.0 * frames_recv / copies_expected : 0.0,
+              hist_percentile(&latency, 0.5) / 1e3, hist_percentile(&latency, 0.9) / 1e3,
+              hist_percentile(&latency, 0.99) / 1e3, hist_percentile(&latency, 0.999) / 1e3,
+              latency.max / 1e3, throttled);
+     fputs(result, stdout);
+     if (baseline_path) {
+         compare_baseline(result, baseline_path);
+     }
+     if (result_path) {
+         FILE *f = fopen(result_path, "w");
+         if (f) {
+             fputs(result, f);
+             fclose(f);
+         } else {
+             perror(result_path);
+         }
+     }
+ }
+
+ // --------------------- Main ---------------------
+
+ int main(int argc, char *argv[]) {
+     int opt;
+     while ((opt = getopt(argc, argv, "h:p:c:S:r:P:t:w:C:s:o:b:")) != -1) {
+         switch (opt) {
+             case 'h': host = optarg; break;
+             case 'p': port = atoi(optarg); break;
+             case 'c': num_clients = atoi(optarg); break;
+             case 'S': snprintf(size_spec, sizeof(size_spec), "%s", optarg); break;
+             case 'r': rate = atof(optarg); break;
+             case 'P': payload = atoi(optarg); break;
+             case 't': duration = atof(optarg); break;
+             case 'w': warmup = atof(optarg); break;
+             case 'C': max_connecting = atoi(optarg); break;
+             case 's': seed = (unsigned int)atoi(optarg); break;
+             case 'o': result_path = optarg; break;
+             case 'b': baseline_path = optarg; break;
+             default: usage(argv[0]);
+         }
+     }
+     if (optind != argc || num_clients < 1 || rate <= 0 || duration <= 0 || max_connecting < 1) {
+         usage(argv[0]);
+     }
+     if (payload < 32) {
+         payload = 32;  // room for the tag and timestamp
+     }
+     if (payload > MAX_DATA - 1) {
+         payload = MAX_DATA - 1;
+     }
+
+     // One socket per client.
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
+
+     clients = calloc(num_clients, sizeof(bench_client_t));
+     for (int i = 0; i < num_clients; i++) {
+         snprintf(clients[i].name, MAX_NAME, "bench%d-u%d", (int)getpid(), i);
+         clients[i].fd = -1;
+     }
+     layout_sessions();
+
+     epfd = epoll_create1(0);
+     if (epfd < 0) {
+         perror("epoll_create1");
+         exit(EXIT_FAILURE);
+     }
+
+     struct epoll_event events[MAX_EVENTS];
+     double start = now_sec();
+     double setup_time = 0;
+     double run_start = 0;
+     while (1) {
+         double now = now_sec();
+         if (!run_start) {
+             while (next_connect < num_clients && connecting < max_connecting) {
+                 start_connect(&clients[next_connect++]);
+             }
+             if (num_ready + num_dead == num_clients || now - start > SETUP_TIMEOUT) {
+                 if (num_ready == 0) {
+                     fprintf(stderr, "No client got into its session.\n");
+                     exit(EXIT_FAILURE);
+                 }
+                 setup_time = now - start;
+                 run_start = now;
+                 measure_start = run_start + warmup;
+                 measure_end = measure_start + duration;
+                 for (int i = 0; i < num_clients; i++) {
+                     // Spread the first sends over one interval.
+                     clients[i].next_send = now + (rand_r(&seed) / (RAND_MAX + 1.0)) / rate;
+                 }
+                 printf("%d clients ready after %.2f s; warming up for %.0f s, measuring for %.0f s\n",
+                        num_ready, setup_time, warmup, duration);
+                 fflush(stdout);
+             }
+         } else {
+             measuring = (now >= measure_start);
+             if (now >= measure_end + 1.0) {
+                 break;  // one extra second for copies still in flight
+             }
+             if (now < measure_end) {
+                 send_traffic(now);
+             }
+         }
+
+         int n = epoll_wait(epfd, events, MAX_EVENTS, run_start ? 1 : 10);
+         for (int i = 0; i < n; i++) {
+             bench_client_t *c = &clients[events[i].data.u32];
+             if (c->state == ST_DEAD) {
+                 continue;
+             }
+             if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                 if (c->state != ST_CONNECTING) {
+                     handle_readable(c);  // pick up a final NAK
+                 }
+                 kill_client(c, "connection error");
+                 continue;
+             }
+             if (events[i].events & EPOLLOUT) {
+                 handle_writable(c);
+             }
+             if ((events[i].events & EPOLLIN) && c->state != ST_DEAD) {
+                 handle_readable(c);
+             }
+         }
+     }
+     // Copies of measured messages that arrived in the extra second count too.
+     report(setup_time);
+     return 0;
+ }
@@ -0,0 +1,879 @@
+/*
+ * chatclient.c - Non-blocking client library for the Text Conferencing Server
+ *
+ * See chatclient.h for the interface.  Every connection owns a small input
+ * buffer that is filled until the socket would block and decoded in place,
+ * and an output queue that grows on demand up to CHAT_MAX_QUEUED frames.
+ * On a compressed connection (chat_compress) queued frames are deflated
+ * into a second buffer at flush time, and received bytes are inflated into
+ * the input buffer before parsing.  On a shared-memory connection
+ * (chat_shared_memory) frames are copied straight between these buffers
+ * and the rings of chatshm.h, and the socket only reports hangups.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <poll.h>
+ #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <sys/socket.h>
+ #include <sys/un.h>
+ #include <sys/epoll.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <zlib.h>
+
+ #include "chatclient.h"
+ #include "chatzip.h"
+ #include "chatshm.h"
+
+ #define CHAT_RX_BYTES    (64 * 1024)  // Default input buffer per connection, ~57 frames
+ #define CHAT_MAX_QUEUED  256          // Queued output frames before chat_send fails
+ #define CHAT_ZIP_MEM     5            // deflate memLevel; about 48KB per stream
+
+ enum { CHAT_CONNECTING, CHAT_OPEN };
+ enum { CHAT_ZIP_OFF, CHAT_ZIP_WAIT, CHAT_ZIP_ON };  // WAIT: asked, no LO_ACK yet
+ enum { CHAT_SHM_OFF, CHAT_SHM_WAIT, CHAT_SHM_ON };
+
+ struct chat_conn {
+     int fd;
+     int state;
+     int dispatching;           // Inside a callback; chat_close is deferred
+     int close_requested;
+     char user[MAX_NAME];
+     unsigned int next_id;      // Request ID of the next frame
+     chat_callbacks_t cb;
+     void *user_data;
+     unsigned char *rx;         // Received frames, rx[0..rx_len) not yet handled
+     size_t rx_len, rx_cap;
+     unsigned char *tx;         // Queued frames, tx[tx_off..tx_len) unsent
+     size_t tx_off, tx_len, tx_cap;
+     size_t login_left;         // Bytes of the LOGIN frame not yet sent
+     int zip;                   // CHAT_ZIP_*
+     int zip_dict;              // Asked for ZIP_MODE_DICT
+     z_stream zin, zout;        // Set up once the server accepts
+     unsigned char *zrx;        // Received, not inflated; rx_cap bytes
+     unsigned char *ztx;        // Deflated output, ztx[ztx_off..ztx_len) unsent
+     size_t ztx_off, ztx_len, ztx_cap;
+     int local;                 // Connected to the server's Unix socket
+     int shm;                   // CHAT_SHM_*
+     int ep;                    // chat_fd() once shared memory is asked for, else -1
+     int ep_out;                // ep watches the socket for POLLOUT
+     int shm_fd[SHM_FDS];       // Received with the LO_ACK (SHM_FD_*), -1 if not
+     chat_shm_t *area;          // Mapped once the server accepts
+ };
+
+ static void conn_free(chat_conn_t *c) {
+     close(c->fd);
+     if (c->ep >= 0) {
+         close(c->ep);
+     }
+     for (int i = 0; i < SHM_FDS; i++) {
+         if (c->shm_fd[i] >= 0) {
+             close(c->shm_fd[i]);
+         }
+     }
+     if (c->area) {
+         munmap(c->area, sizeof(chat_shm_t));
+     }
+     if (c->zip == CHAT_ZIP_ON) {
+         inflateEnd(&c->zin);
+         deflateEnd(&c->zout);
+     }
+     free(c->zrx);
+     free(c->ztx);
+     free(c->tx);
+     free(c->rx);
+     free(c);
+ }
+
+ /**
+  * Start connecting to 'addr', of family 'domain', and queue the LOGIN.
+  */
+ static chat_conn_t *conn_start(int domain, const struct sockaddr *addr, socklen_t addr_len,
+                                const char *user, const char *password,
+                                const chat_callbacks_t *cb, void *user_data) {
+     chat_conn_t *c = calloc(1, sizeof(*c));
+     if (!c) {
+         return NULL;
+     }
+     c->rx = malloc(CHAT_RX_BYTES);
+     if (!c->rx) {
+         free(c);
+         return NULL;
+     }
+     c->rx_cap = CHAT_RX_BYTES;
+     c->ep = -1;
+     for (int i = 0; i < SHM_FDS; i++) {
+         c->shm_fd[i] = -1;
+     }
+     c->local = (domain == AF_UNIX);
+     c->fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+     if (c->fd < 0) {
+         free(c->rx);
+         free(c);
+         return NULL;
+     }
+     if (domain == AF_INET) {
+         int one = 1;
+         setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+     }
+     if (connect(c->fd, addr, addr_len) == 0) {
+         c->state = CHAT_OPEN;
+     } else if (errno == EINPROGRESS) {
+         c->state = CHAT_CONNECTING;
+     } else {
+         int err = errno;
+         conn_free(c);
+         errno = err;
+         return NULL;
+     }
+     strncpy(c->user, user, MAX_NAME - 1);
+     if (cb) {
+         c->cb = *cb;
+     }
+     c->user_data = user_data;
+     c->login_left = sizeof(struct message);
+     if (chat_send(c, LOGIN, NULL, password) < 0) {
+         int err = errno;
+         conn_free(c);
+         errno = err;
+         return NULL;
+     }
+     return c;
+ }
+
+ chat_conn_t *chat_connect(const char *host, int port, const char *user,
+                           const char *password, const chat_callbacks_t *cb,
+                           void *user_data) {
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_port = htons(port);
+     if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+         errno = EINVAL;
+         return NULL;
+     }
+     return conn_start(AF_INET, (struct sockaddr *)&addr, sizeof(addr), user, password,
+                       cb, user_data);
+ }
+
+ chat_conn_t *chat_connect_local(const char *path, const char *user, const char *password,
+                                 const chat_callbacks_t *cb, void *user_data) {
+     struct sockaddr_un addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     if (strlen(path) >= sizeof(addr.sun_path)) {
+         errno = ENAMETOOLONG;
+         return NULL;
+     }
+     strcpy(addr.sun_path, path);
+     return conn_start(AF_UNIX, (struct sockaddr *)&addr, sizeof(addr), user, password,
+                       cb, user_data);
+ }
+
+ void chat_close(chat_conn_t *c) {
+     if (!c) {
+         return;
+     }
+     if (c->dispatching) {
+         c->close_requested = 1;
+         return;
+     }
+     if (c->state == CHAT_OPEN && chat_send(c, EXIT, NULL, NULL) > 0) {
+         chat_flush(c);
+     }
+     conn_free(c);
+ }
+
+ int chat_fd(const chat_conn_t *c) {
+     return c->ep >= 0 ? c->ep : c->fd;
+ }
+
+ void *chat_user_data(const chat_conn_t *c) {
+     return c->user_data;
+ }
+
+ const char *chat_user(const chat_conn_t *c) {
+     return c->user;
+ }
+
+ int chat_compress(chat_conn_t *c, int use_dict) {
+     if (c->login_left != sizeof(struct message) || c->tx_off != 0 || c->shm != CHAT_SHM_OFF) {
+         errno = EINVAL;
+         return -1;
+     }
+     struct message *login = (struct message *)c->tx;
+     strcpy((char *)login->session, use_dict ? ZIP_MODE_DICT : ZIP_MODE);
+     c->zip = CHAT_ZIP_WAIT;
+     c->zip_dict = use_dict;
+     return 0;
+ }
+
+ int chat_compressed(const chat_conn_t *c) {
+     return c->zip == CHAT_ZIP_ON;
+ }
+
+ int chat_set_rx_buffer(chat_conn_t *c, size_t bytes) {
+     if (bytes < sizeof(struct message) || bytes < c->rx_len || c->zrx || c->dispatching) {
+         errno = EINVAL;
+         return -1;
+     }
+     unsigned char *rx = realloc(c->rx, bytes);
+     if (!rx) {
+         return -1;
+     }
+     c->rx = rx;
+     c->rx_cap = bytes;
+     return 0;
+ }
+
+ int chat_shared_memory(chat_conn_t *c) {
+     if (!c->local || c->login_left != sizeof(struct message) || c->tx_off != 0 ||
+         c->zip != CHAT_ZIP_OFF || c->shm != CHAT_SHM_OFF) {
+         errno = EINVAL;
+         return -1;
+     }
+     c->ep = epoll_create1(EPOLL_CLOEXEC);
+     if (c->ep < 0) {
+         return -1;
+     }
+     struct epoll_event ev;
+     memset(&ev, 0, sizeof(ev));
+     ev.events = EPOLLIN | EPOLLOUT;
+     ev.data.fd = c->fd;
+     if (epoll_ctl(c->ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+         int err = errno;
+         close(c->ep);
+         c->ep = -1;
+         errno = err;
+         return -1;
+     }
+     c->ep_out = 1;
+     struct message *login = (struct message *)c->tx;
+     strcpy((char *)login->session, SHM_MODE);
+     c->shm = CHAT_SHM_WAIT;
+     return 0;
+ }
+
+ int chat_shared(const chat_conn_t *c) {
+     return c->shm == CHAT_SHM_ON;
+ }
+
+ /**
+  * Bytes that chat_flush() could send now.  Frames after LOGIN are held
+  * until the server has answered a compression or shared-memory request.
+  */
+ static size_t tx_ready(const chat_conn_t *c) {
+     if (c->zip == CHAT_ZIP_ON) {
+         return c->ztx_len - c->ztx_off + (c->tx_len - c->tx_off);
+     }
+     size_t n = c->tx_len - c->tx_off;
+     if ((c->zip == CHAT_ZIP_WAIT || c->shm == CHAT_SHM_WAIT) && n > c->login_left) {
+         n = c->login_left;
+     }
+     return n;
+ }
+
+ /**
+  * When chat_fd() is an epoll descriptor, have it watch the socket for
+  * POLLOUT exactly when chat_events() would otherwise ask for it.
+  */
+ static void ep_watch(chat_conn_t *c) {
+     int out = c->shm != CHAT_SHM_ON && (c->state == CHAT_CONNECTING || tx_ready(c) > 0);
+     if (c->ep < 0 || out == c->ep_out) {
+         return;
+     }
+     struct epoll_event ev;
+     memset(&ev, 0, sizeof(ev));
+     ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+     ev.data.fd = c->fd;
+     if (epoll_ctl(c->ep, EPOLL_CTL_MOD, c->fd, &ev) == 0) {
+         c->ep_out = out;
+     }
+ }
+
+ int chat_events(const chat_conn_t *c) {
+     if (c->ep >= 0) {
+         return POLLIN;  // the epoll descriptor turns readable for whatever it watches
+     }
+     if (c->state == CHAT_CONNECTING || tx_ready(c) > 0) {
+         return POLLIN | POLLOUT;
+     }
+     return POLLIN;
+ }
+
+ /**
+  * Send buf[*off..len) until done or the socket is full.  Returns 0 or -1.
+  */
+ static int send_some(int fd, const unsigned char *buf, size_t *off, size_t len) {
+     while (*off < len) {
+         ssize_t n = send(fd, buf + *off, len - *off, MSG_NOSIGNAL);
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+         }
+         *off += n;
+     }
+     return 0;
+ }
+
+ /**
+  * Deflate every queued frame onto the end of ztx and sync-flush, so the
+  * server can decode all of them on arrival.
+  */
+ static int zip_deflate(chat_conn_t *c) {
+     if (c->ztx_off > 0) {
+         memmove(c->ztx, c->ztx + c->ztx_off, c->ztx_len - c->ztx_off);
+         c->ztx_len -= c->ztx_off;
+         c->ztx_off = 0;
+     }
+     c->zout.next_in = c->tx + c->tx_off;
+     c->zout.avail_in = c->tx_len - c->tx_off;
+     do {
+         if (c->ztx_cap - c->ztx_len < 64) {
+             size_t cap = c->ztx_cap ? c->ztx_cap * 2 : 4096;
+             unsigned char *ztx = realloc(c->ztx, cap);
+             if (!ztx) {
+                 return -1;
+             }
+             c->ztx = ztx;
+             c->ztx_cap = cap;
+         }
+         c->zout.next_out = c->ztx + c->ztx_len;
+         c->zout.avail_out = c->ztx_cap - c->ztx_len;
+         deflate(&c->zout, Z_SYNC_FLUSH);
+         c->ztx_len = c->ztx_cap - c->zout.avail_out;
+     } while (c->zout.avail_out == 0);
+     c->tx_off = c->tx_len = 0;
+     return 0;
+ }
+
+ static int shm_kick(chat_conn_t *c, int which) {
+     uint64_t one = 1;
+     return write(c->shm_fd[which], &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+ }
+
+ /**
+  * Move queued frames into the 'up' ring and wake the server's reader if it
+  * sleeps.  Frames that do not fit stay queued; the server wakes us once it
+  * has taken some.
+  */
+ static int shm_flush(chat_conn_t *c) {
+     chat_ring_t *r = &c->area->up;
+     while (c->tx_off < c->tx_len) {
+         if (chat_ring_put(r, c->tx + c->tx_off) == 0) {
+             c->tx_off += sizeof(struct message);
+         } else if (chat_ring_sleep_producer(r)) {
+             break;
+         }
+     }
+     if (c->tx_off == c->tx_len) {
+         c->tx_off = c->tx_len = 0;
+     }
+     if (chat_ring_wake_consumer(r) && shm_kick(c, SHM_FD_READER) < 0) {
+         return -1;
+     }
+     return 0;
+ }
+
+ int chat_flush(chat_conn_t *c) {
+     if (c->state != CHAT_OPEN) {
+         return 0;
+     }
+     if (c->shm == CHAT_SHM_ON) {
+         return shm_flush(c);
+     }
+     if (c->zip == CHAT_ZIP_ON) {
+         if (c->tx_off < c->tx_len && zip_deflate(c) < 0) {
+             return -1;
+         }
+         if (send_some(c->fd, c->ztx, &c->ztx_off, c->ztx_len) < 0) {
+             return -1;
+         }
+         if (c->ztx_off == c->ztx_len) {
+             c->ztx_off = c->ztx_len = 0;
+         }
+         return 0;
+     }
+     size_t start = c->tx_off;
+     if (send_some(c->fd, c->tx, &c->tx_off, c->tx_off + tx_ready(c)) < 0) {
+         return -1;
+     }
+     size_t sent = c->tx_off - start;
+     c->login_left -= sent < c->login_left ? sent : c->login_left;
+     if (c->tx_off == c->tx_len) {
+         c->tx_off = c->tx_len = 0;
+     }
+     return 0;
+ }
+
+ int chat_send(chat_conn_t *c, int type, const char *session, const char *data) {
+     size_t need = c->tx_len + sizeof(struct message);
+     if (need > c->tx_cap && c->tx_off > 0) {
+         memmove(c->tx, c->tx + c->tx_off, c->tx_len - c->tx_off);
+         c->tx_len -= c->tx_off;
+         c->tx_off = 0;
+         need = c->tx_len + sizeof(struct message);
+     }
+     if (need > c->tx_cap) {
+         size_t cap = c->tx_cap ? c->tx_cap * 2 : 4 * sizeof(struct message);
+         if (cap > CHAT_MAX_QUEUED * sizeof(struct message)) {
+             cap = CHAT_MAX_QUEUED * sizeof(struct message);
+         }
+         if (need > cap) {
+             errno = ENOBUFS;
+             return -1;
+         }
+         unsigned char *tx = realloc(c->tx, cap);
+         if (!tx) {
+             return -1;
+         }
+         c->tx = tx;
+         c->tx_cap = cap;
+     }
+     struct message *msg = (struct message *)(c->tx + c->tx_len);
+     memset(msg, 0, sizeof(*msg));
+     msg->type = type;
+     memcpy(msg->source, c->user, MAX_NAME);
+     if (session) {
+         strncpy((char *)msg->session, session, MAX_NAME - 1);
+     }
+     if (data) {
+         strncpy((char *)msg->data, data, REQ_ID_OFF - 1);
+         msg->size = strlen((char *)msg->data);
+     }
+     if (++c->next_id == 0 || c->next_id > 0x7fffffff) {
+         c->next_id = 1;
+     }
+     unsigned char *p = msg->data + REQ_ID_OFF;
+     memcpy(p, "\0RQI", 4);
+     p[4] = c->next_id >> 24;
+     p[5] = c->next_id >> 16;
+     p[6] = c->next_id >> 8;
+     p[7] = c->next_id;
+     chat_encode(msg);
+     c->tx_len += sizeof(*msg);
+     if (c->shm == CHAT_SHM_ON) {
+         shm_flush(c);  // no syscall unless the server's reader sleeps
+     } else {
+         ep_watch(c);
+     }
+     return c->next_id;
+ }
+
+ unsigned int chat_reply_id(const struct message *msg) {
+     const unsigned char *p = msg->data + REQ_ID_OFF;
+     if (memcmp(p, "\0RQI", 4) != 0) {
+         return 0;
+     }
+     return (unsigned int)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+ }
+
+ /**
+  * Handle the server's answer to a compression request: start both streams
+  * if it accepted, and move what followed the LO_ACK in rx, which is
+  * already compressed, to the inflate input.
+  */
+ static int zip_start(chat_conn_t *c, const struct message *ack, size_t off) {
+     if (ack->session[0] == '\0') {
+         c->zip = CHAT_ZIP_OFF;
+         return 0;
+     }
+     c->zrx = malloc(c->rx_cap);
+     if (!c->zrx || inflateInit2(&c->zin, -ZIP_WINDOW_BITS) != Z_OK) {
+         errno = ENOMEM;
+         return -1;
+     }
+     if (deflateInit2(&c->zout, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ZIP_WINDOW_BITS,
+                      CHAT_ZIP_MEM, Z_DEFAULT_STRATEGY) != Z_OK) {
+         inflateEnd(&c->zin);
+         errno = ENOMEM;
+         return -1;
+     }
+     if (c->zip_dict) {
+         inflateSetDictionary(&c->zin, (const Bytef *)zip_dict, sizeof(zip_dict) - 1);
+         deflateSetDictionary(&c->zout, (const Bytef *)zip_dict, sizeof(zip_dict) - 1);
+     }
+     c->zip = CHAT_ZIP_ON;
+     memcpy(c->zrx, c->rx + off, c->rx_len - off);
+     c->zin.next_in = c->zrx;
+     c->zin.avail_in = c->rx_len - off;
+     c->rx_len = off;
+     return 0;
+ }
+
+ /**
+  * Handle the server's answer to a shared-memory request: map the rings
+  * whose descriptors came with the LO_ACK and watch our eventfd, or stay on
+  * the socket if the server declined.
+  */
+ static int shm_start(chat_conn_t *c, const struct message *ack) {
+     if (ack->session[0] == '\0') {
+         for (int i = 0; i < SHM_FDS; i++) {
+             if (c->shm_fd[i] >= 0) {
+                 close(c->shm_fd[i]);
+                 c->shm_fd[i] = -1;
+             }
+         }
+         c->shm = CHAT_SHM_OFF;
+         return 0;
+     }
+     struct stat st;
+     if (c->shm_fd[SHM_FDS - 1] < 0 || fstat(c->shm_fd[SHM_FD_AREA], &st) < 0 ||
+         st.st_size != sizeof(chat_shm_t)) {
+         errno = EPROTO;
+         return -1;
+     }
+     void *area = mmap(NULL, sizeof(chat_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                       c->shm_fd[SHM_FD_AREA], 0);
+     if (area == MAP_FAILED) {
+         return -1;
+     }
+     c->area = area;
+     close(c->shm_fd[SHM_FD_AREA]);
+     c->shm_fd[SHM_FD_AREA] = -1;
+     if (c->area->magic != SHM_MAGIC || c->area->frame_size != sizeof(struct message)) {
+         errno = EPROTO;
+         return -1;
+     }
+     struct epoll_event ev;
+     memset(&ev, 0, sizeof(ev));
+     ev.events = EPOLLIN;
+     ev.data.fd = c->shm_fd[SHM_FD_CLIENT];
+     if (epoll_ctl(c->ep, EPOLL_CTL_ADD, c->shm_fd[SHM_FD_CLIENT], &ev) < 0) {
+         return -1;
+     }
+     c->shm = CHAT_SHM_ON;
+     // Frames may already wait in the ring, put there before we looked.
+     return shm_kick(c, SHM_FD_CLIENT);
+ }
+
+ /**
+  * recv() that keeps the descriptors the server attaches to its LO_ACK.
+  */
+ static ssize_t recv_fds(chat_conn_t *c, void *dst, size_t room) {
+     union {
+         struct cmsghdr hdr;
+         char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+     } ctl;
+     struct iovec iov = { dst, room };
+     struct msghdr mh;
+     memset(&mh, 0, sizeof(mh));
+     mh.msg_iov = &iov;
+     mh.msg_iovlen = 1;
+     mh.msg_control = ctl.buf;
+     mh.msg_controllen = sizeof(ctl.buf);
+     ssize_t n = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+     if (n <= 0) {
+         return n;
+     }
+     for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+         if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+             continue;
+         }
+         int fds[SHM_FDS];
+         size_t k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         k = k < SHM_FDS ? k : SHM_FDS;
+         memcpy(fds, CMSG_DATA(cm), k * sizeof(int));
+         for (size_t i = 0; i < k; i++) {
+             if (c->shm_fd[i] >= 0) {
+                 close(c->shm_fd[i]);
+             }
+             c->shm_fd[i] = fds[i];
+         }
+     }
+     return n;
+ }
+
+ /**
+  * Append received bytes to rx, inflating them on a compressed connection.
+  * Returns the number added, 0 on EOF, or -1 with errno set (EAGAIN once
+  * the socket is drained).
+  */
+ static ssize_t conn_recv(chat_conn_t *c) {
+     unsigned char *dst = c->rx + c->rx_len;
+     size_t room = c->rx_cap - c->rx_len;
+     if (c->shm == CHAT_SHM_WAIT) {
+         return recv_fds(c, dst, room);
+     }
+     if (c->zip != CHAT_ZIP_ON) {
+         return recv(c->fd, dst, room, 0);
+     }
+     while (1) {
+         if (c->zin.avail_in > 0) {
+             uInt avail = c->zin.avail_in;
+             c->zin.next_out = dst;
+             c->zin.avail_out = room;
+             int rc = inflate(&c->zin, Z_SYNC_FLUSH);
+             size_t got = room - c->zin.avail_out;
+             if ((rc != Z_OK && rc != Z_BUF_ERROR) || (got == 0 && c->zin.avail_in == avail)) {
+                 errno = EPROTO;
+                 return -1;
+             }
+             if (got > 0) {
+                 return got;
+             }
+         }
+         ssize_t n = recv(c->fd, c->zrx, c->rx_cap, 0);
+         if (n <= 0) {
+             return n;
+         }
+         c->zin.next_in = c->zrx;
+         c->zin.avail_in = n;
+     }
+ }
+
+ static void dispatch(chat_conn_t *c, const struct message *msg) {
+     switch (msg->type) {
+         case MESSAGE:
+         case DIRECT:
+             if (c->cb.on_message) {
+                 c->cb.on_message(c, msg, c->user_data);
+             }
+             break;
+         case PRESENCE:
+             if (c->cb.on_presence) {
+                 c->cb.on_presence(c, msg, c->user_data);
+             }
+             break;
+         default:
+             if (c->cb.on_ack) {
+                 c->cb.on_ack(c, msg, c->user_data);
+             }
+             break;
+     }
+ }
+
+ /**
+  * Read until the socket would block, handing every complete frame to its
+  * callback.  Returns 0, or -1 if the connection ended (errno 0 on EOF).
+  */
+ static int conn_read(chat_conn_t *c) {
+     while (1) {
+         ssize_t n = conn_recv(c);
+         if (n == 0) {
+             errno = 0;
+             return -1;
+         }
+         if (n < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+         }
+         c->rx_len += n;
+         size_t off = 0;
+         c->dispatching = 1;
+         while (c->rx_len - off >= sizeof(struct message) && !c->close_requested) {
+             struct message *msg = chat_decode(c->rx + off);
+             off += sizeof(*msg);
+             if (msg->type == LO_ACK && c->zip == CHAT_ZIP_WAIT && zip_start(c, msg, off) < 0) {
+                 c->dispatching = 0;
+                 return -1;
+             }
+             if (msg->type == LO_ACK && c->shm == CHAT_SHM_WAIT && shm_start(c, msg) < 0) {
+                 c->dispatching = 0;
+                 return -1;
+             }
+             dispatch(c, msg);
+         }
+         c->dispatching = 0;
+         if (c->close_requested) {
+             errno = 0;
+             return -1;
+         }
+         memmove(c->rx, c->rx + off, c->rx_len - off);
+         c->rx_len -= off;
+     }
+ }
+
+ /**
+  * Hand the frames waiting in the 'down' ring to their callbacks, at most
+  * one ringful so other connections get their turn, and sleep once it is
+  * empty.  Returns 0, or -1 if a callback closed the connection (errno 0).
+  */
+ static int shm_read(chat_conn_t *c) {
+     chat_ring_t *r = &c->area->down;
+     unsigned char frame[sizeof(struct message)] CHAT_FRAME_ALIGNED;
+     for (int n = 0; n < SHM_RING_FRAMES; n++) {
+         if (!chat_ring_get(r, frame)) {
+             if (chat_ring_sleep_consumer(r)) {
+                 return 0;
+             }
+             continue;
+         }
+         if (chat_ring_wake_producer(r) && shm_kick(c, SHM_FD_WRITER) < 0) {
+             return -1;
+         }
+         c->dispatching = 1;
+         dispatch(c, chat_decode(frame));
+         c->dispatching = 0;
+         if (c->close_requested) {
+             errno = 0;
+             return -1;
+         }
+     }
+     return shm_kick(c, SHM_FD_CLIENT);  // more to do: stay readable
+ }
+
+ /**
+  * The socket's share of what chat_fd() reported when it is an epoll
+  * descriptor.  A wakeup on our eventfd is consumed here; the rings are
+  * looked at on every chat_process() anyway.
+  */
+ static int ep_revents(chat_conn_t *c) {
+     struct epoll_event ev[2];
+     int revents = 0;
+     int n = epoll_wait(c->ep, ev, 2, 0);
+     for (int i = 0; i < n; i++) {
+         if (ev[i].data.fd == c->fd) {
+             revents |= ev[i].events;
+         } else {
+             uint64_t count;
+             ssize_t got = read(c->shm_fd[SHM_FD_CLIENT], &count, sizeof(count));
+             (void)got;
+         }
+     }
+     return revents;
+ }
+
+ int chat_process(chat_conn_t *c, int revents) {
+     if (c->ep >= 0) {
+         revents = ep_revents(c);
+     }
+     if (c->state == CHAT_CONNECTING) {
+         if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+             return 0;
+         }
+         int err = 0;
+         socklen_t len = sizeof(err);
+         getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+         if (err) {
+             conn_free(c);
+             errno = err;
+             return -1;
+         }
+         c->state = CHAT_OPEN;
+     }
+     // Ring first: what the server put there before hanging up still counts.
+     if ((c->shm == CHAT_SHM_ON && shm_read(c) < 0) ||
+         ((revents & (POLLIN | POLLERR | POLLHUP)) && conn_read(c) < 0)) {
+         int err = errno;
+         if (c->close_requested) {
+             c->close_requested = 0;
+             chat_close(c);
+         } else {
+             conn_free(c);
+         }
+         errno = err;
+         return -1;
+     }
+     if (chat_flush(c) < 0) {
+         int err = errno;
+         conn_free(c);
+         errno = err;
+         return -1;
+     }
+     ep_watch(c);
+     return 0;
+ }
+
+ int chat_create(chat_conn_t *c, const char *session) {
+     return chat_send(c, NEW_SESS, NULL, session);
+ }
+
+ int chat_join(chat_conn_t *c, const char *session) {
+     return chat_send(c, JOIN, NULL, session);
+ }
+
+ int chat_leave(chat_conn_t *c, const char *session) {
+     return chat_send(c, LEAVE_SESS, session, NULL);
+ }
+
+ int chat_say(chat_conn_t *c, const char *session, const char *text) {
+     return chat_send(c, MESSAGE, session, text);
+ }
+
+ int chat_direct(chat_conn_t *c, const char *to, const char *text) {
+     return chat_send(c, DIRECT, to, text);
+ }
+
+ int chat_query(chat_conn_t *c, const char *args) {
+     return chat_send(c, QUERY, NULL, args);
+ }
+
+ int chat_subscribe(chat_conn_t *c, const char *pattern, int on) {
+     return chat_send(c, on ? SUBSCRIBE : UNSUBSCRIBE, NULL, pattern);
+ }
+
+ int chat_watch(chat_conn_t *c, int on) {
+     return chat_send(c, PRESENCE_SUB, NULL, on ? "on" : "off");
+ }
+
+ int chat_search(chat_conn_t *c, const char *session, const char *query) {
+     return chat_send(c, SEARCH, session, query);
+ }
+
+ /**
+  * Write 'n' session names separated by spaces to 'list' (REQ_ID_OFF
+  * bytes).  Returns the length, or -1 with errno EMSGSIZE if they do not
+  * fit.
+  */
+ static int join_names(char *list, const char *const *sessions, int n) {
+     size_t len = 0;
+     for (int i = 0; i < n; i++) {
+         size_t name = strnlen(sessions[i], MAX_NAME - 1);
+         if (len + name + 1 >= REQ_ID_OFF) {
+             errno = EMSGSIZE;
+             return -1;
+         }
+         memcpy(list + len, sessions[i], name);
+         len += name;
+         list[len++] = ' ';
+     }
+     len = len ? len - 1 : 0;
+     list[len] = '\0';
+     return len;
+ }
+ 
+ /**
+  * Queue a JOIN_BATCH or LEAVE_BATCH naming 'n' sessions.
+  */
+ static int send_batch(chat_conn_t *c, int type, const char *const *sessions, int n) {
+     char list[REQ_ID_OFF];
+     if (join_names(list, sessions, n) < 0) {
+         return -1;
+     }
+     return chat_send(c, type, NULL, list);
+ }
+
+ int chat_join_many(chat_conn_t *c, const char *const *sessions, int n) {
+     return send_batch(c, JOIN_BATCH, sessions, n);
+ }
+
+ int chat_leave_many(chat_conn_t *c, const char *const *sessions, int n) {
+     return send_batch(c, LEAVE_BATCH, sessions, n);
+ }
+
+ int chat_say_many(chat_conn_t *c, const char *const *sessions, int n, const char *text) {
+     if (n < 1 || n > CROSSPOST_MAX) {
+         errno = EINVAL;
+         return -1;
+     }
+     char data[REQ_ID_OFF];
+     int len = join_names(data, sessions, n);
+     if (len < 0) {
+         return -1;
+     }
+     snprintf(data + len, sizeof(data) - len, "\n%s", text);
+     return chat_send(c, CROSSPOST, NULL, data);
+ }
+
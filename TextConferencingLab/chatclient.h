@@ -0,0 +1,182 @@
+/*
+ * chatclient.h - Non-blocking client library for the Text Conferencing Server
+ *
+ * Each chat_conn_t is one server connection with its own buffers and no
+ * threads or globals, so one process can hold thousands of them.  The
+ * caller owns the event loop: register chat_fd() for chat_events() with
+ * poll/epoll (POLLIN/POLLOUT and EPOLLIN/EPOLLOUT share values on Linux)
+ * and hand readiness back to chat_process(), which runs the callbacks.
+ *
+ *   chat_conn_t *c = chat_connect("127.0.0.1", 5000, "bot", "pw", &cb, ctx);
+ *   chat_join(c, "lobby");
+ *   loop: poll({chat_fd(c), chat_events(c)}) -> chat_process(c, revents)
+ *
+ * Frames from chat_send() and friends are queued and written when the
+ * socket is writable, so frames sent in one pass of the loop share a
+ * syscall.  Each frame is tagged with a request ID that the server echoes
+ * in its replies, so any number of requests may be outstanding:
+ *
+ *   unsigned int id = chat_join(c, "lobby");
+ *   on_ack: if (chat_reply_id(msg) == id) ...
+ *
+ * Bots on the server's host can connect to its Unix socket instead
+ * (chat_connect_local) and skip TCP, or also move their frames into shared
+ * memory (chat_shared_memory) and skip the socket as well.
+ */
+
+ #ifndef CHATCLIENT_H
+ #define CHATCLIENT_H
+
+ #include <stddef.h>
+
+ #include "chatproto.h"
+
+ typedef struct chat_conn chat_conn_t;
+
+ /**
+  * Event callbacks; any may be NULL.  'msg' is only valid during the call.
+  * A callback may send on, or chat_close(), its own connection.
+  */
+ typedef struct {
+     void (*on_message)(chat_conn_t *c, const struct message *msg, void *user);  // MESSAGE, DIRECT
+     void (*on_ack)(chat_conn_t *c, const struct message *msg, void *user);      // replies, NAKs, THROTTLE
+     void (*on_presence)(chat_conn_t *c, const struct message *msg, void *user); // PRESENCE
+ } chat_callbacks_t;
+
+ /**
+  * Start connecting to 'host' (an IPv4 address) and queue the LOGIN.
+  * Returns NULL with errno set if the connection cannot be started.
+  */
+ chat_conn_t *chat_connect(const char *host, int port, const char *user,
+                           const char *password, const chat_callbacks_t *cb,
+                           void *user_data);
+
+ /**
+  * Connect to the Unix socket at 'path' of a server started with -l.  The
+  * connection otherwise behaves like one from chat_connect(); it fails
+  * with EAGAIN if the server's backlog is full.
+  */
+ chat_conn_t *chat_connect_local(const char *path, const char *user, const char *password,
+                                 const chat_callbacks_t *cb, void *user_data);
+
+ /**
+  * Ask for a compressed connection, with the shared preset dictionary if
+  * 'use_dict'.  Must be called before the first chat_process().  Frames
+  * queued after the LOGIN are held until the server answers; if it does not
+  * offer compression the connection simply stays plain.  Returns 0, or -1
+  * with errno EINVAL if the LOGIN has already been sent.
+  */
+ int chat_compress(chat_conn_t *c, int use_dict);
+
+ /**
+  * 1 once the server has accepted compression.
+  */
+ int chat_compressed(const chat_conn_t *c);
+
+ /**
+  * Ask to exchange frames through shared-memory rings (chatshm.h) on a
+  * connection from chat_connect_local().  Must be called before the first
+  * chat_process() and before chat_fd() is registered: from here on
+  * chat_fd() is an epoll descriptor that covers the socket and the ring
+  * wakeups, and chat_events() is always POLLIN.  Once the server has
+  * accepted, chat_send() and friends put the frame straight into the ring,
+  * without a syscall unless the server is idle.  If the server declines,
+  * the connection stays on the socket.  Returns 0, or -1 with errno EINVAL
+  * if the connection is not local, compression was asked for, or the LOGIN
+  * has already been sent.
+  */
+ int chat_shared_memory(chat_conn_t *c);
+
+ /**
+  * 1 once the server has accepted shared memory.
+  */
+ int chat_shared(const chat_conn_t *c);
+
+ /**
+  * Resize the input buffer of 'c' (64KB by default, about 57 frames).  One
+  * recv fills it, so a busy connection makes one syscall per bufferful; a
+  * compressed one keeps a second buffer of the same size for input not yet
+  * inflated.  Processes with thousands of mostly idle connections may want
+  * less.  Returns 0, or -1 with errno EINVAL if 'bytes' is under one frame
+  * or under what is buffered, compression has started, or one of the
+  * callbacks of 'c' is running.
+  */
+ int chat_set_rx_buffer(chat_conn_t *c, size_t bytes);
+
+ /**
+  * Send EXIT if connected, close the socket and free 'c'.
+  */
+ void chat_close(chat_conn_t *c);
+
+ int chat_fd(const chat_conn_t *c);
+ void *chat_user_data(const chat_conn_t *c);
+ const char *chat_user(const chat_conn_t *c);
+
+ /**
+  * Poll events the connection is waiting for: POLLIN, plus POLLOUT while
+  * connecting or while frames are queued.
+  */
+ int chat_events(const chat_conn_t *c);
+
+ /**
+  * Handle readiness 'revents' on chat_fd(c): finish connecting, write queued
+  * frames and read until the socket would block, dispatching every complete
+  * frame.  Returns 0, or -1 once the connection has ended and 'c' has been
+  * freed; errno is 0 if the server closed it or a callback called
+  * chat_close(), otherwise the socket error.
+  */
+ int chat_process(chat_conn_t *c, int revents);
+
+ /**
+  * Write queued frames now instead of waiting for chat_process().
+  * Returns 0, including when the socket is full, or -1 on a socket error.
+  */
+ int chat_flush(chat_conn_t *c);
+
+ /**
+  * Queue one frame.  'session' and 'data' may be NULL; data is cut short
+  * of the request ID.  Returns the frame's request ID (never 0), or -1
+  * with errno ENOBUFS if too much output is already queued.
+  */
+ int chat_send(chat_conn_t *c, int type, const char *session, const char *data);
+
+ /**
+  * The request ID a reply answers, or 0 for unsolicited frames.
+  */
+ unsigned int chat_reply_id(const struct message *msg);
+
+ int chat_create(chat_conn_t *c, const char *session);
+ int chat_join(chat_conn_t *c, const char *session);
+ int chat_leave(chat_conn_t *c, const char *session);
+ int chat_say(chat_conn_t *c, const char *session, const char *text);
+ int chat_direct(chat_conn_t *c, const char *to, const char *text);
+ int chat_query(chat_conn_t *c, const char *args);
+ int chat_subscribe(chat_conn_t *c, const char *pattern, int on);
+ int chat_watch(chat_conn_t *c, int on);
+
+ /**
+  * Search earlier traffic of 'session', or of every joined session if it is
+  * NULL.  'query' is "<words> [since=<t>] [until=<t>] [limit=<n>]" with
+  * times in Unix seconds, or negative for seconds ago.  Matches arrive as
+  * SE_HIT frames, newest first, then one SE_ACK; all go to on_ack.
+  */
+ int chat_search(chat_conn_t *c, const char *session, const char *query);
+
+ /**
+  * Join or leave 'n' sessions with one request.  Joins are answered with a
+  * JN_ACK or JN_NAK per session, then one BATCH_ACK; leaves with just the
+  * BATCH_ACK.  Returns -1 with errno EMSGSIZE if the names do not fit in
+  * one frame.
+  */
+ int chat_join_many(chat_conn_t *c, const char *const *sessions, int n);
+ int chat_leave_many(chat_conn_t *c, const char *const *sessions, int n);
+
+ /**
+  * Post 'text' to 'n' sessions (at most CROSSPOST_MAX) with one frame.
+  * Every member of any of them gets one copy, labelled with the first
+  * listed session they are in.  Returns -1 with errno EINVAL for a bad 'n'
+  * or EMSGSIZE if the names do not fit; long text is cut short.
+  */
+ int chat_say_many(chat_conn_t *c, const char *const *sessions, int n, const char *text);
+
+ #endif
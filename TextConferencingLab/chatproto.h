@@ -0,0 +1,128 @@
+/*
+ * chatproto.h - Wire protocol of the Text Conferencing Server, shared by
+ *               server.c, the client library, bench.c and replay.c
+ *
+ * The frame layout is written down once, in CHAT_FRAME_FIELDS.  struct
+ * message, the wire size, the layout check and the codec are all expanded
+ * from that list by the preprocessor, so every program picks up a new field
+ * at its next build and no two copies can drift apart.
+ *
+ * Integer fields travel in network byte order.  A frame on the wire has
+ * exactly the layout of struct message, so the codec works in place:
+ * chat_encode() converts a frame that is about to be written, and
+ * chat_decode() converts a received frame where it lies in the receive
+ * buffer and returns it, without copying it out first.
+ */
+
+ #ifndef CHATPROTO_H
+ #define CHATPROTO_H
+
+ #include <stdint.h>
+ #include <arpa/inet.h>
+
+ #define MAX_NAME  50
+ #define MAX_DATA  1024
+
+ // --------------------- Packet Types ---------------------
+ #define LOGIN       1   // session may name a compression mode (chatzip.h) or SHM_MODE (chatshm.h)
+ #define LO_ACK      2
+ #define LO_NAK      3
+ #define EXIT        4
+ #define JOIN        5
+ #define JN_ACK      6
+ #define JN_NAK      7
+ #define LEAVE_SESS  8
+ #define NEW_SESS    9
+ #define NS_ACK      10
+ #define MESSAGE     11
+ #define QUERY       12
+ #define QU_ACK      13
+ #define DIRECT      14  // private message; session field holds the recipient ID
+ #define DM_NAK      15
+ #define SUBSCRIBE   16  // data holds a topic pattern, e.g. "alerts.*"
+ #define UNSUBSCRIBE 17
+ #define SUB_ACK     18
+ #define SUB_NAK     19
+ #define PRESENCE_SUB 20 // data "on" or "off"
+ #define PRESENCE    21  // data "<version> login|logout <user>" or "<version> join|leave <user> <session>"
+ #define QU_PART     22  // non-final chunk of a listing; QU_ACK ends it
+ #define THROTTLE    23  // traffic was shed; data holds the reason
+ #define JOIN_BATCH  24  // data holds session IDs separated by spaces
+ #define LEAVE_BATCH 25
+ #define BATCH_ACK   26  // data "join|leave <done>/<total>", after any per-session replies
+ #define CROSSPOST   27  // one MESSAGE to several sessions; data "<session> <session>...\n<text>"
+ #define SEARCH      28  // session names one joined session, or "" for all; data "<words> [since=<t>] [until=<t>] [limit=<n>]"
+ #define SE_HIT      29  // one match, newest first; source and session as posted, data "<unix ms> <text>"
+ #define SE_ACK      30  // ends a search: data "<n> hits", or why it was refused
+ #define QU_NAK      31  // malformed QUERY; data holds the accepted syntax
+ #define CP_NAK      32  // malformed CROSSPOST, not delivered; data holds the reason
+
+ #define CROSSPOST_MAX 16   // Sessions one CROSSPOST may name
+
+ // --------------------- Data Trailers ---------------------
+ // A server started with -t ends the data of relayed traffic with "\0LTS"
+ // and its receive time (8 bytes, microseconds, big endian).  A client may
+ // put a request ID trailer, "\0RQI" and a 4-byte ID (big endian), just
+ // before where that stamp would go; every reply carries the same trailer.
+ #define LAT_STAMP_LEN 12
+ #define REQ_ID_LEN    8
+ #define REQ_ID_OFF    (MAX_DATA - LAT_STAMP_LEN - REQ_ID_LEN)
+
+ // --------------------- Frame Schema ---------------------
+ // One entry per field, in wire order: U32(name) for a 32-bit integer,
+ // BYTES(name, length) for a fixed-size byte array.
+ #define CHAT_FRAME_FIELDS(U32, BYTES) \
+     U32(type)                         \
+     U32(size)                         \
+     BYTES(source, MAX_NAME)           \
+     BYTES(session, MAX_NAME)          \
+     BYTES(data, MAX_DATA)
+
+ #define CHAT_STRUCT_U32(name)         uint32_t name;
+ #define CHAT_STRUCT_BYTES(name, len)  unsigned char name[len];
+ #define CHAT_SIZE_U32(name)           + 4
+ #define CHAT_SIZE_BYTES(name, len)    + (len)
+ #define CHAT_HTON_U32(name)           m->name = htonl(m->name);
+ #define CHAT_NTOH_U32(name)           m->name = ntohl(m->name);
+ #define CHAT_SKIP_BYTES(name, len)
+
+ // The session field holds the session ID (or, for DIRECT, the recipient).
+ struct message {
+     CHAT_FRAME_FIELDS(CHAT_STRUCT_U32, CHAT_STRUCT_BYTES)
+ };
+
+ #define CHAT_WIRE_SIZE  (0 CHAT_FRAME_FIELDS(CHAT_SIZE_U32, CHAT_SIZE_BYTES))
+
+ _Static_assert(sizeof(struct message) == CHAT_WIRE_SIZE,
+                "struct message must match the wire layout; reorder CHAT_FRAME_FIELDS");
+
+ // Receive buffers that frames are decoded in place from need this alignment.
+ #define CHAT_FRAME_ALIGNED __attribute__((aligned(__alignof__(struct message))))
+
+ /**
+  * Convert 'm' to wire order in place; it must not be read as a host-order
+  * frame afterwards.  Returns 'm'.
+  */
+ static inline struct message *chat_encode(struct message *m) {
+     CHAT_FRAME_FIELDS(CHAT_HTON_U32, CHAT_SKIP_BYTES)
+     return m;
+ }
+
+ /**
+  * Convert the frame at 'wire' (CHAT_WIRE_SIZE bytes, CHAT_FRAME_ALIGNED)
+  * to host order in place and return it.
+  */
+ static inline struct message *chat_decode(void *wire) {
+     struct message *m = wire;
+     CHAT_FRAME_FIELDS(CHAT_NTOH_U32, CHAT_SKIP_BYTES)
+     return m;
+ }
+
+ /**
+  * The type of an encoded frame, without decoding it.
+  */
+ static inline unsigned int chat_wire_type(const struct message *m) {
+     return ntohl(m->type);
+ }
+
+ #endif
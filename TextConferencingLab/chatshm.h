@@ -0,0 +1,125 @@
+/*
+ * chatshm.h - Shared-memory transport shared by server.c and chatclient.c
+ *
+ * A client connected to the server's Unix socket (server -l) may put
+ * SHM_MODE in the session field of its LOGIN.  If the server accepts, its
+ * LO_ACK names the mode and carries SHM_FDS descriptors (SCM_RIGHTS): a
+ * shared-memory file holding one chat_shm_t and three eventfds.  From then
+ * on frames no longer cross the socket.  They travel, encoded exactly as on
+ * the wire, through two single-producer single-consumer rings: 'up' from
+ * the client to the server's reader thread and 'down' from the server's
+ * writer thread to the client.  The socket stays open only so that either
+ * side notices when the other one goes away.
+ *
+ * A side that finds its ring empty (consumer) or full (producer) raises the
+ * ring's waiting flag, looks once more and then sleeps on its eventfd; the
+ * other side writes that eventfd only if it sees the flag.  A connection
+ * that keeps both sides busy therefore makes no syscalls at all.
+ */
+
+ #ifndef CHATSHM_H
+ #define CHATSHM_H
+
+ #include <string.h>
+ #include <stdint.h>
+ #include <stdatomic.h>
+
+ #include "chatproto.h"
+
+ #define SHM_MODE         "shm"
+ #define SHM_MAGIC        0x43534D31u  // "CSM1"
+ #define SHM_RING_FRAMES  256          // Frames per direction (power of 2)
+
+ // Descriptors passed with the LO_ACK, in this order
+ #define SHM_FD_AREA      0   // The chat_shm_t; the client maps it and closes it
+ #define SHM_FD_CLIENT    1   // Client sleeps here: 'down' empty or 'up' full
+ #define SHM_FD_READER    2   // Server reader sleeps here: 'up' empty
+ #define SHM_FD_WRITER    3   // Server writer sleeps here: 'down' full
+ #define SHM_FDS          4
+
+ // The producer owns 'head' and 'producer_waiting', the consumer 'tail'
+ // and 'consumer_waiting'; each pair has a cache line to itself.
+ typedef struct {
+     _Atomic uint32_t head __attribute__((aligned(64)));  // Next slot to fill
+     _Atomic uint32_t producer_waiting;
+     _Atomic uint32_t tail __attribute__((aligned(64)));  // Next slot to empty
+     _Atomic uint32_t consumer_waiting;
+     struct message frames[SHM_RING_FRAMES] __attribute__((aligned(64)));
+ } chat_ring_t;
+
+ typedef struct {
+     uint32_t magic;
+     uint32_t frame_size;             // CHAT_WIRE_SIZE of the server
+     chat_ring_t up;                  // Client -> server
+     chat_ring_t down;                // Server -> client
+ } chat_shm_t;
+
+ /**
+  * Copy the encoded frame 'wire' into 'r'.  Returns 0, or -1 if the ring is
+  * full.  Producer only.
+  */
+ static inline int chat_ring_put(chat_ring_t *r, const void *wire) {
+     uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+     if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= SHM_RING_FRAMES) {
+         return -1;
+     }
+     memcpy(&r->frames[head % SHM_RING_FRAMES], wire, sizeof(struct message));
+     atomic_store(&r->head, head + 1);
+     return 0;
+ }
+
+ /**
+  * Copy the oldest frame of 'r', still encoded, to 'wire'.  Returns 1, or
+  * 0 if the ring is empty.  Consumer only.
+  */
+ static inline int chat_ring_get(chat_ring_t *r, void *wire) {
+     uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+     if (tail == atomic_load(&r->head)) {
+         return 0;
+     }
+     memcpy(wire, &r->frames[tail % SHM_RING_FRAMES], sizeof(struct message));
+     atomic_store(&r->tail, tail + 1);
+     return 1;
+ }
+
+ /**
+  * Announce that the consumer is about to sleep.  Returns 1 if it should:
+  * the ring is still empty, so the producer will see the flag and wake it.
+  */
+ static inline int chat_ring_sleep_consumer(chat_ring_t *r) {
+     atomic_store(&r->consumer_waiting, 1);
+     if (atomic_load(&r->head) != atomic_load_explicit(&r->tail, memory_order_relaxed)) {
+         atomic_store(&r->consumer_waiting, 0);
+         return 0;
+     }
+     return 1;
+ }
+
+ /**
+  * The producer's counterpart: returns 1 if the ring is still full.
+  */
+ static inline int chat_ring_sleep_producer(chat_ring_t *r) {
+     atomic_store(&r->producer_waiting, 1);
+     if (atomic_load_explicit(&r->head, memory_order_relaxed) - atomic_load(&r->tail) <
+         SHM_RING_FRAMES) {
+         atomic_store(&r->producer_waiting, 0);
+         return 0;
+     }
+     return 1;
+ }
+
+ /**
+  * After putting frames: 1 if the consumer sleeps and must be woken.
+  */
+ static inline int chat_ring_wake_consumer(chat_ring_t *r) {
+     return atomic_load(&r->consumer_waiting) && atomic_exchange(&r->consumer_waiting, 0);
+ }
+
+ /**
+  * After taking frames: 1 if the producer sleeps and must be woken.
+  */
+ static inline int chat_ring_wake_producer(chat_ring_t *r) {
+     return atomic_load(&r->producer_waiting) && atomic_exchange(&r->producer_waiting, 0);
+ }
+
+ #endif
@@ -0,0 +1,50 @@
+/*
+ * chatzip.h - Stream compression parameters shared by server.c and
+ *             chatclient.c
+ *
+ * A client asks for compression by putting ZIP_MODE or ZIP_MODE_DICT in the
+ * session field of its LOGIN.  The server answers with a plain LO_ACK whose
+ * session field names the mode it accepted (empty if none).  With a mode
+ * accepted, everything the client sends after LOGIN and everything the
+ * server sends after LO_ACK is one raw deflate stream per direction
+ * (window 2^ZIP_WINDOW_BITS), sync-flushed at the end of each batch of
+ * frames so every frame can be decoded as soon as it arrives.  The stream
+ * persists for the whole connection, so later frames are encoded against
+ * earlier ones.  With ZIP_MODE_DICT both streams start from zip_dict, which
+ * lets even the first short messages compress well.
+ */
+
+ #ifndef CHATZIP_H
+ #define CHATZIP_H
+
+ #define ZIP_MODE         "deflate"
+ #define ZIP_MODE_DICT    "deflate:d1"
+ #define ZIP_WINDOW_BITS  13      // 8KB of history per direction, about 7 frames
+
+ // Preset dictionary "d1": protocol strings and common chat words.  Deflate
+ // reaches back from the end, so the most frequent strings come last.
+ static const char zip_dict[] =
+     "Session is over its fan-out budget, message dropped"
+     "Rate limit exceeded, message dropped"
+     "Session is full or error adding"
+     "Invalid query. Use: [users|sessions|all] [prefix=<p>] [after=<cursor>] [limit=<n>]\n"
+     "Client ID already in use"
+     "Invalid username/password"
+     "Failed to create session "
+     ": invalid pattern or too many subscriptions"
+     ": not subscribed"
+     ": user not logged in"
+     ": session not found"
+     "Login successful"
+     "Users:\n  "
+     "Sessions:\n  "
+     " members)\n  "
+     "next: "
+     " login  logout  join  leave "
+     "sorry thanks thank you please sure maybe today tomorrow tonight "
+     "morning meeting later again about could would should there their "
+     "what when where which will with have this that from your just know "
+     "don't I'm it's can't not but are was for and the you yes no ok lol "
+     "hello hi hey ";
+
+ #endif
@@ -5,61 +5,50 @@
  * Usage: ./client
  *
  * Commands:
- *   /login <clientID> <password> <server-IP> <server-port>
+ *   /login <clientID> <password> <server-IP> <server-port> [zip]  (zip: compress traffic)
+ *   /login <clientID> <password> <socket-path> [shm]  (server -l on this host; shm: shared memory)
  *   /logout
- *   /joinsession <sessionID>
- *   /leavesession         (leaves the active session)
+ *   /joinsession <sessionID> [<sessionID>...]
+ *   /leavesession [<sessionID>...]  (default: the active session)
  *   /createsession <sessionID>
  *   /switchsession <sessionID>   (switch active session)
- *   /list
+ *   /list [users|sessions] [prefix=<p>] [limit=<n>]
+ *   /more                        (next page of the last /list)
+ *   /msg <clientID> <text>       (private message to one user)
+ *   /post <sessionID>[,<sessionID>...]|* <text>  (one message to several sessions; *: all joined)
+ *   /subscribe <pattern>         (e.g. alerts.* or alerts.#)
+ *   /unsubscribe <pattern>
+ *   /watch on|off                (push presence changes instead of polling /list)
+ *   /search [#<sessionID>] <words> [since=<t>] [until=<t>] [limit=<n>]  (t: Unix time, or -<seconds> ago)
  *   /quit
  *   <text>   (sends a message to the active session)
  *
- * This client uses a separate thread to receive messages from the server.
+ * The protocol side lives in chatclient.c; this file is the interactive
+ * front end.  One poll loop waits on stdin and the server connection, and
+ * commands piped in faster than they are typed are coalesced into one write
+ * per batch.
  * It will gracefully handle disconnection if the server disconnects the client.
+ * If the server runs with -t, chat messages show their end-to-end latency.
  */
 
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
  #include <unistd.h>
- #include <pthread.h>
  #include <errno.h>
- #include <arpa/inet.h>
- #include <sys/socket.h>
- 
- #define MAX_NAME  50
- #define MAX_DATA  1024
- 
- // --------------------- Packet Types ---------------------
- #define LOGIN       1
- #define LO_ACK      2
- #define LO_NAK      3
- #define EXIT        4
- #define JOIN        5
- #define JN_ACK      6
- #define JN_NAK      7
- #define LEAVE_SESS  8
- #define NEW_SESS    9
- #define NS_ACK      10
- #define MESSAGE     11
- #define QUERY       12
- #define QU_ACK      13
- 
- // --------------------- Message Structure ---------------------
- // Added a new field 'session' to hold the session ID.
- struct message {
-     unsigned int type;
-     unsigned int size;
-     unsigned char source[MAX_NAME];
-     unsigned char session[MAX_NAME];  // holds session id for this message
-     unsigned char data[MAX_DATA];
- };
+ #include <poll.h>
+ #include <stdint.h>
+ #include <time.h>
+ 
+ #include "chatclient.h"
+ 
+ #define IN_BUF_SIZE   (64 * 1024)  // stdin read-ahead
+ #define CMD_BATCH     32           // commands run per pass before sending
+ #define MAX_NAMES     64           // sessions named in one /joinsession or /leavesession
  
  // Global variables
- int sockfd = -1;            // Socket descriptor for server
- int loggedIn = 0;           // 1 if logged in, 0 otherwise
- pthread_t recv_thread;      // Thread to receive server messages
+ chat_conn_t *conn = NULL;   // Server connection, NULL when logged out
+ int loggedIn = 0;           // 1 once the server accepted the login
  char clientID[MAX_NAME] = {0};
  
  // For multiple sessions support:
@@ -69,132 +58,619 @@
  int session_count = 0;
  char active_session[MAX_NAME] = {0};
  
+ // Paging state for /list and /more.
+ char last_query[MAX_DATA - 64] = {0};  // Arguments of the last /list (room left for a cursor)
+ char next_cursor[MAX_NAME + 2] = {0};  // "next:" cursor from its last page
+ int  listing_open = 0;                 // 1 while QU_PART chunks are arriving
+ 
+ // Stdin read-ahead, so a script of commands is read in large chunks.
+ char in_buf[IN_BUF_SIZE];
+ size_t in_head = 0, in_len = 0;
+ int in_eof = 0;
+ 
  // --------------------- Utility Functions ---------------------
  
  /**
-  * Send a struct message to the server.
+  * Returns 1 if a complete input line is already buffered.
   */
- int send_message(struct message *msg) {
-     int total = sizeof(struct message);
-     int sent = 0;
-     int n;
-     while (sent < total) {
-         n = write(sockfd, ((char *)msg) + sent, total - sent);
-         if (n <= 0) {
-             perror("write");
-             return -1;
-         }
-         sent += n;
+ int line_pending(void) {
+     return memchr(in_buf + in_head, '\n', in_len - in_head) != NULL ||
+            (in_eof && in_head < in_len) || in_len - in_head == sizeof(in_buf);
+ }
+ 
+ /**
+  * Take the next buffered line of input, without its newline, into 'out'.
+  * Longer lines are truncated.  Returns -1 if no complete line is buffered.
+  */
+ int next_line(char *out, size_t len) {
+     char *nl = memchr(in_buf + in_head, '\n', in_len - in_head);
+     if (!line_pending()) {
+         return -1;
      }
+     size_t n = nl ? (size_t)(nl - (in_buf + in_head)) : in_len - in_head;
+     size_t copy = n < len - 1 ? n : len - 1;
+     memcpy(out, in_buf + in_head, copy);
+     out[copy] = '\0';
+     in_head += n + (nl != NULL);
      return 0;
  }
  
  /**
-  * Receive a struct message from the server.
+  * Read whatever stdin has ready into the read-ahead buffer.
   */
- int recv_message(struct message *msg) {
-     int total = sizeof(struct message);
-     int recvd = 0;
-     int n;
-     while (recvd < total) {
-         n = read(sockfd, ((char *)msg) + recvd, total - recvd);
-         if (n <= 0) {
-             return -1;
-         }
-         recvd += n;
+ void fill_input(void) {
+     memmove(in_buf, in_buf + in_head, in_len - in_head);
+     in_len -= in_head;
+     in_head = 0;
+     ssize_t n = read(STDIN_FILENO, in_buf + in_len, sizeof(in_buf) - in_len);
+     if (n == 0 || (n < 0 && errno != EINTR)) {
+         in_eof = 1;
+     } else if (n > 0) {
+         in_len += n;
      }
-     return 0;
  }
  
  /**
-  * Thread function to continuously receive messages from the server.
+  * Format the latency since the server received 'msg' into 'out' (" (x ms)"),
+  * or an empty string if the frame carries no timestamp.
   */
- void *receive_handler(void *arg) {
-     struct message msg;
-     while (1) {
-         if (recv_message(&msg) < 0) {
-             // Connection lost or server closed
-             printf("\nDisconnected from server.\n");
-             close(sockfd);
-             sockfd = -1;
-             loggedIn = 0;
-             pthread_exit(NULL);
-         }
-         // Handle received messages
-         switch (msg.type) {
-             case MESSAGE:
-                 // Print message along with session ID and source
-                 printf("[%s][%s]: %s\n", msg.session, msg.source, msg.data);
-                 break;
-             case LO_ACK:
-                 printf("Login successful.\n");
-                 break;
-             case LO_NAK:
-                 printf("Login failed: %s\n", msg.data);
-                 break;
-             case JN_ACK:
-                 printf("Joined session: %s\n", msg.data);
-                 {
-                     int exists = 0;
-                     for (int i = 0; i < session_count; i++) {
-                         if (strcmp(joined_sessions[i], (char *)msg.data) == 0) {
-                             exists = 1;
-                             break;
-                         }
-                     }
-                     if (!exists && session_count < MAX_SESSIONS) {
-                         strncpy(joined_sessions[session_count], (char *)msg.data, MAX_NAME - 1);
-                         session_count++;
-                     }
-                     if (strlen(active_session) == 0) {
-                         strncpy(active_session, (char *)msg.data, MAX_NAME - 1);
+ const char *stamp_latency(const struct message *msg, char *out, size_t len) {
+     const unsigned char *p = msg->data + MAX_DATA - LAT_STAMP_LEN;
+     out[0] = '\0';
+     if (memcmp(p, "\0LTS", 4) != 0) {
+         return out;
+     }
+     uint64_t sent = 0;
+     for (int i = 0; i < 8; i++) {
+         sent = (sent << 8) | p[4 + i];
+     }
+     struct timespec ts;
+     clock_gettime(CLOCK_REALTIME, &ts);
+     uint64_t now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+     snprintf(out, len, " (%.1f ms)", ((double)now - (double)sent) / 1000.0);
+     return out;
+ }
+ 
+ /**
+  * Print a chat message (MESSAGE) or private message (DIRECT).
+  */
+ void on_message(chat_conn_t *c, const struct message *msg, void *user) {
+     char latency[32];
+     if (msg->type == DIRECT) {
+         printf("[DM][%s]: %s%s\n", msg->source, msg->data,
+                stamp_latency(msg, latency, sizeof(latency)));
+     } else {
+         // Print message along with session ID and source
+         printf("[%s][%s]: %s%s\n", msg->session, msg->source, msg->data,
+                stamp_latency(msg, latency, sizeof(latency)));
+     }
+ }
+ 
+ void on_presence(chat_conn_t *c, const struct message *msg, void *user) {
+     printf("[presence] %s\n", msg->data);
+ }
+ 
+ /**
+  * Handle every other frame: acknowledgements, listings and errors.
+  */
+ void on_ack(chat_conn_t *c, const struct message *msg, void *user) {
+     switch (msg->type) {
+         case LO_ACK:
+             loggedIn = 1;
+             printf("Login successful%s.\n", chat_compressed(c) ? " (compressed)" :
+                                            chat_shared(c) ? " (shared memory)" : "");
+             break;
+         case LO_NAK:
+             printf("Login failed: %s\n", msg->data);
+             break;
+         case JN_ACK:
+             printf("Joined session: %s\n", msg->data);
+             {
+                 int exists = 0;
+                 for (int i = 0; i < session_count; i++) {
+                     if (strcmp(joined_sessions[i], (char *)msg->data) == 0) {
+                         exists = 1;
+                         break;
                      }
                  }
-                 break;
-             case JN_NAK:
-                 printf("Failed to join session: %s\n", msg.data);
-                 break;
-             case NS_ACK:
-                 printf("Created and joined new session: %s\n", msg.data);
-                 {
-                     int exists = 0;
-                     for (int i = 0; i < session_count; i++) {
-                         if (strcmp(joined_sessions[i], (char *)msg.data) == 0) {
-                             exists = 1;
-                             break;
-                         }
-                     }
-                     if (!exists && session_count < MAX_SESSIONS) {
-                         strncpy(joined_sessions[session_count], (char *)msg.data, MAX_NAME - 1);
-                         session_count++;
-                     }
-                     if (strlen(active_session) == 0) {
-                         strncpy(active_session, (char *)msg.data, MAX_NAME - 1);
+                 if (!exists && session_count < MAX_SESSIONS) {
+                     strncpy(joined_sessions[session_count], (char *)msg->data, MAX_NAME - 1);
+                     session_count++;
+                 }
+                 if (strlen(active_session) == 0) {
+                     strncpy(active_session, (char *)msg->data, MAX_NAME - 1);
+                 }
+             }
+             break;
+         case JN_NAK:
+             printf("Failed to join session: %s\n", msg->data);
+             break;
+         case NS_ACK:
+             printf("Created and joined new session: %s\n", msg->data);
+             {
+                 int exists = 0;
+                 for (int i = 0; i < session_count; i++) {
+                     if (strcmp(joined_sessions[i], (char *)msg->data) == 0) {
+                         exists = 1;
+                         break;
                      }
                  }
-                 break;
-             case QU_ACK:
-                 printf("List of users and sessions:\n%s\n", msg.data);
-                 break;
-             default:
-                 printf("Received unknown message type: %d\n", msg.type);
-                 break;
+                 if (!exists && session_count < MAX_SESSIONS) {
+                     strncpy(joined_sessions[session_count], (char *)msg->data, MAX_NAME - 1);
+                     session_count++;
+                 }
+                 if (strlen(active_session) == 0) {
+                     strncpy(active_session, (char *)msg->data, MAX_NAME - 1);
+                 }
+             }
+             break;
+         case QU_PART:
+             if (!listing_open) {
+                 printf("List of users and sessions:\n");
+                 listing_open = 1;
+             }
+             printf("%s", msg->data);
+             break;
+         case QU_NAK:
+             printf("Query failed: %s\n", msg->data);
+             break;
+         case CP_NAK:
+             printf("Cross-post failed: %s\n", msg->data);
+             break;
+         case QU_ACK:
+             if (!listing_open) {
+                 printf("List of users and sessions:\n");
+             }
+             listing_open = 0;
+             {
+                 char text[MAX_DATA];
+                 memcpy(text, msg->data, MAX_DATA);
+                 text[MAX_DATA - 1] = '\0';
+                 char *next = strstr(text, "next: ");
+                 next_cursor[0] = '\0';
+                 if (next) {
+                     sscanf(next + 6, "%51s", next_cursor);
+                     *next = '\0';
+                 }
+                 printf("%s\n", text);
+                 if (next_cursor[0]) {
+                     printf("(more results: /more)\n");
+                 }
+             }
+             break;
+         case DM_NAK:
+             printf("Private message not delivered: %s\n", msg->data);
+             break;
+         case SUB_ACK:
+             printf("%s %s\n", msg->data[0] == '+' ? "Subscribed to" : "Unsubscribed from",
+                    msg->data + 1);
+             break;
+         case SUB_NAK:
+             printf("Subscription failed: %s\n", msg->data);
+             break;
+         case THROTTLE:
+             printf("Slow down: %s\n", msg->data);
+             break;
+         case BATCH_ACK:
+             printf("Batch done: %s\n", msg->data);
+             break;
+         case SE_HIT:
+             {
+                 char when[32] = "?";
+                 char *text = NULL;
+                 unsigned long long ms = strtoull((char *)msg->data, &text, 10);
+                 time_t t = (time_t)(ms / 1000);
+                 struct tm tm;
+                 if (localtime_r(&t, &tm)) {
+                     strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+                 }
+                 printf("  %s [%s][%s]:%s\n", when, msg->session, msg->source, text);
+             }
+             break;
+         case SE_ACK:
+             printf("Search: %s\n", msg->data);
+             break;
+         default:
+             printf("Received unknown message type: %d\n", msg->type);
+             break;
+     }
+ }
+ 
+ const chat_callbacks_t callbacks = { on_message, on_ack, on_presence };
+ 
+ /**
+  * Send everything queued before the connection is closed.
+  */
+ void finish_sends(void) {
+     while (conn && (chat_events(conn) & POLLOUT)) {
+         struct pollfd pfd = { chat_fd(conn), chat_events(conn), 0 };
+         if (poll(&pfd, 1, 1000) <= 0) {
+             break;
+         }
+         if (chat_process(conn, pfd.revents) < 0) {
+             conn = NULL;
+         }
+     }
+ }
+ 
+ /**
+  * Forget the connection and per-login state.
+  */
+ void reset_login(void) {
+     conn = NULL;
+     loggedIn = 0;
+     session_count = 0;
+     active_session[0] = '\0';
+ }
+ 
+ // --------------------- Commands ---------------------
+ 
+ /**
+  * Split whitespace-separated session names from 'args' into 'names', with
+  * 'list' pointing at each.  Returns how many were found.
+  */
+ int split_names(const char *args, char names[][MAX_NAME], const char **list) {
+     int n = 0, used = 0;
+     while (n < MAX_NAMES && sscanf(args, " %49s%n", names[n], &used) == 1) {
+         list[n] = names[n];
+         args += used;
+         n++;
+     }
+     return n;
+ }
+ 
+ /**
+  * Drop a session from the joined list, moving the active session to
+  * another joined one if it was the one dropped.
+  */
+ void forget_session(const char *sessionID) {
+     int found_index = -1;
+     for (int i = 0; i < session_count; i++) {
+         if (strcmp(joined_sessions[i], sessionID) == 0) {
+             found_index = i;
+             break;
+         }
+     }
+     if (found_index != -1) {
+         for (int i = found_index; i < session_count - 1; i++) {
+             strcpy(joined_sessions[i], joined_sessions[i+1]);
+         }
+         session_count--;
+     }
+     if (strcmp(active_session, sessionID) == 0) {
+         if (session_count > 0) {
+             strncpy(active_session, joined_sessions[0], MAX_NAME - 1);
+         } else {
+             active_session[0] = '\0';
          }
      }
-     return NULL;
  }
  
  /**
-  * Helper function to clear a message struct.
+  * Run one line of input.
   */
- void clear_message(struct message *msg) {
-     memset(msg, 0, sizeof(struct message));
+ void run_command(const char *input) {
+     char command[50];
+ 
+     // Parse first token as command
+     if (sscanf(input, "%49s", command) != 1) {
+         return;
+     }
+ 
+     // ----------------------------------------------------
+     // /login <clientID> <password> <server-IP> <server-port> [zip]
+     // /login <clientID> <password> <socket-path> [shm]
+     // ----------------------------------------------------
+     if (strcmp(command, "/login") == 0) {
+         if (conn) {
+             printf("Already logged in.\n");
+             return;
+         }
+ 
+         char password[50], server[50], port[16] = "", option[16] = "";
+         int n = sscanf(input, "/login %49s %49s %49s %15s %15s", clientID, password, server,
+                        port, option);
+         int local = (n >= 3 && server[0] == '/');  // a socket path rather than an address
+         if (local ? (n > 4 || (n == 4 && strcmp(port, "shm") != 0))
+                   : (n < 4 || (n == 5 && strcmp(option, "zip") != 0))) {
+             printf("Usage: /login <clientID> <password> <server-IP> <server-port> [zip]\n"
+                    "       /login <clientID> <password> <socket-path> [shm]\n");
+             return;
+         }
+ 
+         // Reset session state upon login
+         session_count = 0;
+         active_session[0] = '\0';
+ 
+         if (local) {
+             conn = chat_connect_local(server, clientID, password, &callbacks, NULL);
+         } else {
+             conn = chat_connect(server, atoi(port), clientID, password, &callbacks, NULL);
+         }
+         if (!conn) {
+             perror("connect");
+             return;
+         }
+         if (local && n == 4) {
+             chat_shared_memory(conn);
+         } else if (n == 5) {
+             chat_compress(conn, 1);
+         }
+     }
+     // -------------
+     // /logout
+     // -------------
+     else if (strcmp(command, "/logout") == 0) {
+         if (!conn) {
+             printf("Not logged in.\n");
+             return;
+         }
+         finish_sends();
+         chat_close(conn);
+         reset_login();
+         printf("Logged out.\n");
+     }
+     // ----------------
+     // /joinsession <sessionID>
+     // ----------------
+     else if (strcmp(command, "/joinsession") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char names[MAX_NAMES][MAX_NAME];
+         const char *list[MAX_NAMES];
+         int n = split_names(input + strlen("/joinsession"), names, list);
+         if (n == 0) {
+             printf("Usage: /joinsession <sessionID> [<sessionID>...]\n");
+             return;
+         }
+         if (n == 1) {
+             chat_join(conn, names[0]);
+         } else if (chat_join_many(conn, list, n) < 0) {
+             printf("Too many sessions for one request.\n");
+         }
+     }
+     // -------------
+     // /leavesession (leaves the active session)
+     // -------------
+     else if (strcmp(command, "/leavesession") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char names[MAX_NAMES][MAX_NAME];
+         const char *list[MAX_NAMES];
+         int n = split_names(input + strlen("/leavesession"), names, list);
+         if (n == 0) {
+             if (strlen(active_session) == 0) {
+                 printf("No active session to leave.\n");
+                 return;
+             }
+             strcpy(names[0], active_session);
+             n = 1;
+         }
+         if (n == 1) {
+             chat_leave(conn, names[0]);
+         } else if (chat_leave_many(conn, list, n) < 0) {
+             printf("Too many sessions for one request.\n");
+             return;
+         }
+         for (int i = 0; i < n; i++) {
+             forget_session(names[i]);
+             printf("Left session: %s\n", names[i]);
+         }
+     }
+     // ----------------
+     // /createsession <sessionID>
+     // ----------------
+     else if (strcmp(command, "/createsession") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char sessionID[50];
+         if (sscanf(input, "/createsession %s", sessionID) != 1) {
+             printf("Usage: /createsession <sessionID>\n");
+             return;
+         }
+         chat_create(conn, sessionID);
+     }
+     // ----------------
+     // /switchsession <sessionID>  (switch active session)
+     // ----------------
+     else if (strcmp(command, "/switchsession") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char sessionID[50];
+         if (sscanf(input, "/switchsession %s", sessionID) != 1) {
+             printf("Usage: /switchsession <sessionID>\n");
+             return;
+         }
+         int exists = 0;
+         for (int i = 0; i < session_count; i++) {
+             if (strcmp(joined_sessions[i], sessionID) == 0) {
+                 exists = 1;
+                 break;
+             }
+         }
+         if (!exists) {
+             printf("You are not part of session %s.\n", sessionID);
+             return;
+         }
+         strncpy(active_session, sessionID, MAX_NAME - 1);
+         printf("Switched active session to: %s\n", active_session);
+     }
+     // -------------
+     // /list [users|sessions] [prefix=<p>] [limit=<n>]
+     // -------------
+     else if (strcmp(command, "/list") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         const char *args = input + strlen("/list");
+         while (*args == ' ') {
+             args++;
+         }
+         strncpy(last_query, args, sizeof(last_query) - 1);
+         next_cursor[0] = '\0';
+         chat_query(conn, last_query);
+     }
+     // -------------
+     // /more
+     // -------------
+     else if (strcmp(command, "/more") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         if (next_cursor[0] == '\0') {
+             printf("No more results.\n");
+             return;
+         }
+         char query[MAX_DATA];
+         snprintf(query, sizeof(query), "%s after=%s", last_query, next_cursor);
+         chat_query(conn, query);
+     }
+     // ----------------
+     // /msg <clientID> <text>
+     // ----------------
+     else if (strcmp(command, "/msg") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char targetID[50];
+         int offset = 0;
+         if (sscanf(input, "/msg %49s %n", targetID, &offset) != 1 || input[offset] == '\0') {
+             printf("Usage: /msg <clientID> <text>\n");
+             return;
+         }
+         chat_direct(conn, targetID, input + offset);
+     }
+     // ----------------
+     // /post <sessionID>[,<sessionID>...]|* <text>
+     // ----------------
+     else if (strcmp(command, "/post") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char targets[MAX_DATA];
+         int offset = 0;
+         if (sscanf(input, "/post %1023s %n", targets, &offset) != 1 || input[offset] == '\0') {
+             printf("Usage: /post <sessionID>[,<sessionID>...]|* <text>\n");
+             return;
+         }
+         const char *list[CROSSPOST_MAX];
+         int n = 0;
+         if (strcmp(targets, "*") == 0) {
+             for (; n < session_count && n < CROSSPOST_MAX; n++) {
+                 list[n] = joined_sessions[n];
+             }
+         } else {
+             char *save = NULL;
+             for (char *name = strtok_r(targets, ",", &save); name && n < CROSSPOST_MAX;
+                  name = strtok_r(NULL, ",", &save)) {
+                 list[n++] = name;
+             }
+         }
+         if (n == 0) {
+             printf("No sessions to post to.\n");
+             return;
+         }
+         if (chat_say_many(conn, list, n, input + offset) < 0) {
+             printf("Cannot post to those sessions: %s\n", strerror(errno));
+         }
+     }
+     // ----------------
+     // /search [#<sessionID>] <words> [since=<t>] [until=<t>] [limit=<n>]
+     // ----------------
+     else if (strcmp(command, "/search") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         const char *args = input + strlen("/search");
+         while (*args == ' ') {
+             args++;
+         }
+         char session[MAX_NAME] = "";
+         int offset = 0;
+         if (args[0] == '#' && sscanf(args, "#%49s %n", session, &offset) == 1) {
+             args += offset;
+         }
+         if (*args == '\0') {
+             printf("Usage: /search [#<sessionID>] <words> [since=<t>] [until=<t>] [limit=<n>]\n");
+             return;
+         }
+         chat_search(conn, session[0] ? session : NULL, args);
+     }
+     // ----------------
+     // /subscribe <pattern>, /unsubscribe <pattern>
+     // ----------------
+     else if (strcmp(command, "/subscribe") == 0 || strcmp(command, "/unsubscribe") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char pattern[50];
+         if (sscanf(input, "%*s %49s", pattern) != 1) {
+             printf("Usage: %s <pattern>\n", command);
+             return;
+         }
+         chat_subscribe(conn, pattern, strcmp(command, "/subscribe") == 0);
+     }
+     // ----------------
+     // /watch on|off
+     // ----------------
+     else if (strcmp(command, "/watch") == 0) {
+         if (!conn) {
+             printf("You must be logged in first.\n");
+             return;
+         }
+         char mode[8];
+         if (sscanf(input, "/watch %7s", mode) != 1 ||
+             (strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0)) {
+             printf("Usage: /watch on|off\n");
+             return;
+         }
+         chat_watch(conn, strcmp(mode, "on") == 0);
+     }
+     // -------------
+     // /quit
+     // -------------
+     else if (strcmp(command, "/quit") == 0) {
+         if (conn) {
+             finish_sends();
+             chat_close(conn);
+         }
+         printf("Exiting client.\n");
+         exit(0);
+     }
+     // -------------
+     // Send text message to active session
+     // -------------
+     else {
+         if (!conn) {
+             printf("You must be logged in to send messages.\n");
+             return;
+         }
+         if (strlen(active_session) == 0) {
+             printf("No active session selected. Use /joinsession, /createsession, or /switchsession.\n");
+             return;
+         }
+         chat_say(conn, active_session, input);
+     }
  }
  
  // --------------------- Main ---------------------
  int main() {
      char input[MAX_DATA];
-     char command[50];
+     int prompt = 1;
  
      // Clear local session state on startup
      session_count = 0;
@@ -202,278 +678,67 @@
  
      printf("Text Conferencing Client\n");
      printf("Commands:\n");
-     printf("  /login <clientID> <password> <server-IP> <server-port>\n");
+     printf("  /login <clientID> <password> <server-IP> <server-port> [zip]\n");
+     printf("  /login <clientID> <password> <socket-path> [shm]\n");
      printf("  /logout\n");
-     printf("  /joinsession <sessionID>\n");
-     printf("  /leavesession         (leaves the active session)\n");
+     printf("  /joinsession <sessionID> [<sessionID>...]\n");
+     printf("  /leavesession [<sessionID>...]  (default: the active session)\n");
      printf("  /createsession <sessionID>\n");
      printf("  /switchsession <sessionID>   (switch active session)\n");
-     printf("  /list\n");
+     printf("  /list [users|sessions] [prefix=<p>] [limit=<n>]\n");
+     printf("  /more                        (next page of the last /list)\n");
+     printf("  /msg <clientID> <text>       (private message to one user)\n");
+     printf("  /post <sessionID>[,<sessionID>...]|* <text>  (one message to several sessions; *: all joined)\n");
+     printf("  /subscribe <pattern>         (e.g. alerts.* or alerts.#)\n");
+     printf("  /unsubscribe <pattern>\n");
+     printf("  /watch on|off                (push presence changes instead of polling /list)\n");
+     printf("  /search [#<sessionID>] <words> [since=<t>] [until=<t>] [limit=<n>]\n");
      printf("  /quit\n");
      printf("  <text>   (sends a message to the active session)\n\n");
  
      while (1) {
-         // If already logged in and connection is lost, then exit.
-         if (loggedIn && sockfd < 0) {
-             printf("Server disconnected. Exiting client.\n");
-             exit(0);
-         }
- 
-         printf("> ");
-         fflush(stdout);
-         if (fgets(input, sizeof(input), stdin) == NULL) {
-             continue;
+         // Run the commands already buffered, then send them together.
+         for (int n = 0; n < CMD_BATCH && next_line(input, sizeof(input)) == 0; n++) {
+             run_command(input);
+             prompt = 1;
          }
-         // Remove trailing newline
-         input[strcspn(input, "\n")] = '\0';
- 
-         // Parse first token as command
-         if (sscanf(input, "%s", command) != 1) {
-             continue;
+         if (in_eof && !line_pending()) {
+             run_command("/quit");   // end of input
          }
  
-         // ----------------------------------------------------
-         // /login <clientID> <password> <server-IP> <server-port>
-         // ----------------------------------------------------
-         if (strcmp(command, "/login") == 0) {
-             if (loggedIn) {
-                 printf("Already logged in.\n");
-                 continue;
-             }
- 
-             char password[50], serverIP[50];
-             int serverPort;
-             if (sscanf(input, "/login %s %s %s %d", clientID, password, serverIP, &serverPort) != 4) {
-                 printf("Usage: /login <clientID> <password> <server-IP> <server-port>\n");
-                 continue;
-             }
- 
-             sockfd = socket(AF_INET, SOCK_STREAM, 0);
-             if (sockfd < 0) {
-                 perror("socket");
-                 continue;
-             }
- 
-             struct sockaddr_in serv_addr;
-             memset(&serv_addr, 0, sizeof(serv_addr));
-             serv_addr.sin_family = AF_INET;
-             serv_addr.sin_port = htons(serverPort);
-             if (inet_pton(AF_INET, serverIP, &serv_addr.sin_addr) <= 0) {
-                 perror("inet_pton");
-                 close(sockfd);
-                 sockfd = -1;
-                 continue;
-             }
- 
-             if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-                 perror("connect");
-                 close(sockfd);
-                 sockfd = -1;
-                 continue;
+         struct pollfd pfd[2] = {
+             { STDIN_FILENO, line_pending() ? 0 : POLLIN, 0 },
+             { conn ? chat_fd(conn) : -1, conn ? chat_events(conn) : 0, 0 },
+         };
+         if (!line_pending()) {
+             if (prompt) {
+                 printf("> ");
+                 prompt = 0;
              }
- 
-             struct message msg;
-             clear_message(&msg);
-             msg.type = LOGIN;
-             strncpy((char *)msg.source, clientID, MAX_NAME - 1);
-             strncpy((char *)msg.data, password, MAX_DATA - 1);
-             msg.size = strlen((char *)msg.data);
- 
-             if (send_message(&msg) < 0) {
-                 printf("Failed to send login message.\n");
-                 close(sockfd);
-                 sockfd = -1;
-                 continue;
-             }
- 
-             // Reset session state upon login
-             session_count = 0;
-             active_session[0] = '\0';
- 
-             if (pthread_create(&recv_thread, NULL, receive_handler, NULL) != 0) {
-                 perror("pthread_create");
-                 close(sockfd);
-                 sockfd = -1;
-                 continue;
-             }
- 
-             loggedIn = 1;
+             fflush(stdout);
          }
-         // -------------
-         // /logout
-         // -------------
-         else if (strcmp(command, "/logout") == 0) {
-             if (!loggedIn || sockfd < 0) {
-                 printf("Not logged in.\n");
-                 continue;
-             }
-             struct message msg;
-             clear_message(&msg);
-             msg.type = EXIT;
-             send_message(&msg);
- 
-             pthread_cancel(recv_thread);
-             pthread_join(recv_thread, NULL);
-             close(sockfd);
-             sockfd = -1;
-             loggedIn = 0;
-             session_count = 0;
-             active_session[0] = '\0';
-             printf("Logged out.\n");
-         }
-         // ----------------
-         // /joinsession <sessionID>
-         // ----------------
-         else if (strcmp(command, "/joinsession") == 0) {
-             if (!loggedIn || sockfd < 0) {
-                 printf("You must be logged in first.\n");
-                 continue;
-             }
-             char sessionID[50];
-             if (sscanf(input, "/joinsession %s", sessionID) != 1) {
-                 printf("Usage: /joinsession <sessionID>\n");
-                 continue;
-             }
-             struct message msg;
-             clear_message(&msg);
-             msg.type = JOIN;
-             strncpy((char *)msg.data, sessionID, MAX_DATA - 1);
-             msg.size = strlen((char *)msg.data);
-             send_message(&msg);
-         }
-         // -------------
-         // /leavesession (leaves the active session)
-         // -------------
-         else if (strcmp(command, "/leavesession") == 0) {
-             if (!loggedIn || sockfd < 0) {
-                 printf("You must be logged in first.\n");
-                 continue;
-             }
-             if (strlen(active_session) == 0) {
-                 printf("No active session to leave.\n");
-                 continue;
-             }
-             struct message msg;
-             clear_message(&msg);
-             msg.type = LEAVE_SESS;
-             strncpy((char *)msg.session, active_session, MAX_NAME - 1);
-             send_message(&msg);
-             int found_index = -1;
-             for (int i = 0; i < session_count; i++) {
-                 if (strcmp(joined_sessions[i], active_session) == 0) {
-                     found_index = i;
-                     break;
-                 }
-             }
-             if (found_index != -1) {
-                 for (int i = found_index; i < session_count - 1; i++) {
-                     strcpy(joined_sessions[i], joined_sessions[i+1]);
-                 }
-                 session_count--;
-             }
-             printf("Left session: %s\n", active_session);
-             if (session_count > 0) {
-                 strncpy(active_session, joined_sessions[0], MAX_NAME - 1);
-             } else {
-                 active_session[0] = '\0';
-             }
+         if (poll(pfd, 2, line_pending() ? 0 : -1) < 0 && errno != EINTR) {
+             perror("poll");
+             exit(1);
          }
-         // ----------------
-         // /createsession <sessionID>
-         // ----------------
-         else if (strcmp(command, "/createsession") == 0) {
-             if (!loggedIn || sockfd < 0) {
-                 printf("You must be logged in first.\n");
-                 continue;
-             }
-             char sessionID[50];
-             if (sscanf(input, "/createsession %s", sessionID) != 1) {
-                 printf("Usage: /createsession <sessionID>\n");
-                 continue;
-             }
-             struct message msg;
-             clear_message(&msg);
-             msg.type = NEW_SESS;
-             strncpy((char *)msg.data, sessionID, MAX_DATA - 1);
-             msg.size = strlen((char *)msg.data);
-             send_message(&msg);
-         }
-         // ----------------
-         // /switchsession <sessionID>  (switch active session)
-         // ----------------
-         else if (strcmp(command, "/switchsession") == 0) {
-             if (!loggedIn || sockfd < 0) {
-                 printf("You must be logged in first.\n");
-                 continue;
-             }
-             char sessionID[50];
-             if (sscanf(input, "/switchsession %s", sessionID) != 1) {
-                 printf("Usage: /switchsession <sessionID>\n");
-                 continue;
-             }
-             int exists = 0;
-             for (int i = 0; i < session_count; i++) {
-                 if (strcmp(joined_sessions[i], sessionID) == 0) {
-                     exists = 1;
-                     break;
-                 }
-             }
-             if (!exists) {
-                 printf("You are not part of session %s.\n", sessionID);
-                 continue;
-             }
-             strncpy(active_session, sessionID, MAX_NAME - 1);
-             printf("Switched active session to: %s\n", active_session);
-         }
-         // -------------
-         // /list
-         // -------------
-         else if (strcmp(command, "/list") == 0) {
-             if (!loggedIn || sockfd < 0) {
-                 printf("You must be logged in first.\n");
-                 continue;
-             }
-             struct message msg;
-             clear_message(&msg);
-             msg.type = QUERY;
-             send_message(&msg);
-         }
-         // -------------
-         // /quit
-         // -------------
-         else if (strcmp(command, "/quit") == 0) {
-             if (loggedIn && sockfd >= 0) {
-                 struct message msg;
-                 clear_message(&msg);
-                 msg.type = EXIT;
-                 send_message(&msg);
-                 pthread_cancel(recv_thread);
-                 pthread_join(recv_thread, NULL);
-                 close(sockfd);
-             }
-             printf("Exiting client.\n");
-             exit(0);
-         }
-         // -------------
-         // Send text message to active session
-         // -------------
-         else {
-             if (!loggedIn || sockfd < 0) {
-                 printf("You must be logged in to send messages.\n");
-                 continue;
+ 
+         if (conn && pfd[1].revents && chat_process(conn, pfd[1].revents) < 0) {
+             // Connection lost or server closed
+             if (errno) {
+                 printf("\nDisconnected from server: %s\n", strerror(errno));
+             } else {
+                 printf("\nDisconnected from server.\n");
              }
-             if (strlen(active_session) == 0) {
-                 printf("No active session selected. Use /joinsession, /createsession, or /switchsession.\n");
-                 continue;
+             // If already logged in and connection is lost, then exit.
+             if (loggedIn) {
+                 printf("Server disconnected. Exiting client.\n");
+                 exit(0);
              }
-             struct message msg;
-             clear_message(&msg);
-             msg.type = MESSAGE;
-             strncpy((char *)msg.data, input, MAX_DATA - 1);
-             msg.size = strlen((char *)msg.data);
-             strncpy((char *)msg.source, clientID, MAX_NAME - 1);
-             strncpy((char *)msg.session, active_session, MAX_NAME - 1);
-             send_message(&msg);
+             reset_login();
+             prompt = 1;
+         }
+         if (pfd[0].revents) {
+             fill_input();
          }
      }
      return 0;
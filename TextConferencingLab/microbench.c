@@ -0,0 +1,395 @@
+/*
+ * microbench.c - Microbenchmarks for the server's state operations
+ *
+ * Usage: ./microbench [-n <max-scale>] [-t <seconds>] [-s <seed>]
+ *
+ * Builds server.c into this program (without its main) and times the
+ * operations that run under the global mutex, directly and on one thread:
+ *   find_client_by_id, find_session, create_session,
+ *   add_client_to_session, remove_client_from_session,
+ *   broadcast_message (recipient lookup only: every client's queue is
+ *   marked dead, so nothing is queued or written), the same with each copy
+ *   queued, and build_list for a full listing and for one 20-entry page.
+ * Each scale (10, 100, ... up to -n, default 100000) is populated with that
+ * many users and sessions, user i being a member of session i % sessions,
+ * and each operation runs for at least -t seconds (default 0.2).  The
+ * report gives ns/op and heap allocations (malloc, calloc, realloc) per op.
+ *
+ * Scales are capped by the tables compiled into the server; "make
+ * microbench" raises MAX_CLIENTS to 100000 but leaves MAX_SESSIONS alone,
+ * so sessions stop at MAX_SESSIONS less a few slots kept free for the
+ * create_session run.  Capped rows show the sizes actually used.
+ * Numbers from different builds are only comparable at the same scale.
+ */
+
+ #define SERVER_NO_MAIN
+ #include "server.c"
+
+ #include <sys/wait.h>
+
+ #define MB_SPARE_SESSIONS 16          // Session slots kept free for create_session
+ #define MB_MAX_BATCH      4096        // Largest number of ops timed in one go
+ #define MB_PAGE           "limit=20"  // Query of the paged build_list run
+
+ // --------------------- Allocation counting ---------------------
+ //
+ // The program's own malloc/calloc/realloc replace the C library's for
+ // every caller, server code included; they count calls made while a
+ // measurement is running and hand the work to glibc.
+
+ extern void *__libc_malloc(size_t n);
+ extern void *__libc_calloc(size_t n, size_t size);
+ extern void *__libc_realloc(void *p, size_t n);
+
+ static int mb_counting = 0;
+ static unsigned long mb_allocs = 0;   // Allocations while mb_counting
+ static unsigned long mb_ns = 0;       // Time spent between mb_start and mb_stop
+ static unsigned long mb_t0;
+
+ void *malloc(size_t n) {
+     mb_allocs += mb_counting;
+     return __libc_malloc(n);
+ }
+
+ void *calloc(size_t n, size_t size) {
+     mb_allocs += mb_counting;
+     return __libc_calloc(n, size);
+ }
+
+ void *realloc(void *p, size_t n) {
+     mb_allocs += mb_counting;
+     return __libc_realloc(p, n);
+ }
+
+ static void mb_start(void) {
+     mb_counting = 1;
+     mb_t0 = now_ns();
+ }
+
+ static void mb_stop(void) {
+     mb_ns += now_ns() - mb_t0;
+     mb_counting = 0;
+ }
+
+ // --------------------- Setup ---------------------
+
+ static int num_users;                 // Users at the current scale
+ static int num_sess;                  // Sessions at the current scale
+ static char (*user_names)[MAX_NAME];
+ static char (*sess_names)[MAX_NAME];
+ static char (*spare_names)[MAX_NAME]; // Sessions the create_session run adds
+ static unsigned int seed = 1;
+ static double min_time = 0.2;
+
+ static int pick(int n) {
+     return rand_r(&seed) % n;
+ }
+
+ /**
+  * Fill the client and session tables the way logins and joins would,
+  * with presence batched into one version as a takeover batches it.
+  */
+ static void mb_populate(int users, int nsess) {
+     num_users = users;
+     num_sess = nsess;
+     user_names = calloc(users, MAX_NAME);
+     sess_names = calloc(nsess, MAX_NAME);
+     spare_names = calloc(MB_SPARE_SESSIONS, MAX_NAME);
+     for (int i = 0; i < users; i++) {
+         snprintf(user_names[i], MAX_NAME, "user%06d", i);
+     }
+     for (int s = 0; s < nsess; s++) {
+         snprintf(sess_names[s], MAX_NAME, "room%06d", s);
+         create_session(sess_names[s]);
+     }
+     for (int s = 0; s < MB_SPARE_SESSIONS; s++) {
+         snprintf(spare_names[s], MAX_NAME, "spare%02d", s);
+     }
+
+     init_client_index();
+     presence_init();
+     presence_batch_begin();
+     for (int i = 0; i < users; i++) {
+         client_t *c = &clients[i];
+         pthread_mutex_init(&out_lock[i], NULL);
+         pthread_cond_init(&out_cond[i], NULL);
+         strcpy(c->clientID, user_names[i]);
+         c->sockfd = -1;
+         c->out_dead = 1;  // send_to_client returns before queueing
+         client_hot.active[i] = 1;
+         index_client(i);
+
+         int s = i % nsess;
+         strcpy(c->sessions[0], sessions[s].sessionID);
+         c->session_count = 1;
+         session_hot.members[s][session_hot.num_members[s]++] = i;
+     }
+     presence_batch_end();
+ }
+
+ // --------------------- Operations ---------------------
+ //
+ // Each function runs up to 'n' operations, timing only the operation
+ // itself, and returns how many it ran.
+
+ static volatile long mb_sink;         // Keeps lookups from being optimized away
+
+ static long op_find_client(long n) {
+     int idx[MB_MAX_BATCH];
+     for (long i = 0; i < n; i++) {
+         idx[i] = pick(num_users);
+     }
+     long found = 0;
+     mb_start();
+     for (long i = 0; i < n; i++) {
+         found += find_client_by_id(user_names[idx[i]]) >= 0;
+     }
+     mb_stop();
+     mb_sink += found;
+     return n;
+ }
+
+ static long op_find_session(long n) {
+     int idx[MB_MAX_BATCH];
+     for (long i = 0; i < n; i++) {
+         idx[i] = pick(num_sess);
+     }
+     long found = 0;
+     mb_start();
+     for (long i = 0; i < n; i++) {
+         found += find_session(sess_names[idx[i]]) >= 0;
+     }
+     mb_stop();
+     mb_sink += found;
+     return n;
+ }
+
+ static long op_create_session(long n) {
+     if (n > MB_SPARE_SESSIONS) {
+         n = MB_SPARE_SESSIONS;
+     }
+     mb_start();
+     for (long i = 0; i < n; i++) {
+         create_session(spare_names[i]);
+     }
+     mb_stop();
+     for (long i = 0; i < n; i++) {
+         remove_client_from_session("", spare_names[i]);  // empty session goes away
+     }
+     return n;
+ }
+
+ /**
+  * Users joined to (or removed from) a second session by op_add/op_remove:
+  * user j and session (j + 1) % num_sess, which it is not yet a member of.
+  */
+ static long mb_extra_pairs(long n) {
+     if (num_sess < 2) {
+         return 0;
+     }
+     return n < num_users ? n : num_users;
+ }
+
+ static long op_add_member(long n) {
+     n = mb_extra_pairs(n);
+     long first = pick(num_users - n + 1);
+     mb_start();
+     for (long j = first; j < first + n; j++) {
+         add_client_to_session(user_names[j], sess_names[(j + 1) % num_sess]);
+     }
+     mb_stop();
+     for (long j = first; j < first + n; j++) {
+         remove_client_from_session(user_names[j], sess_names[(j + 1) % num_sess]);
+     }
+     return n;
+ }
+
+ static long op_remove_member(long n) {
+     n = mb_extra_pairs(n);
+     long first = pick(num_users - n + 1);
+     for (long j = first; j < first + n; j++) {
+         add_client_to_session(user_names[j], sess_names[(j + 1) % num_sess]);
+     }
+     mb_start();
+     for (long j = first; j < first + n; j++) {
+         remove_client_from_session(user_names[j], sess_names[(j + 1) % num_sess]);
+     }
+     mb_stop();
+     return n;
+ }
+
+ static long op_broadcast(long n) {
+     static struct message msg;
+     msg.type = MESSAGE;
+     msg.size = 5;
+     strcpy((char *)msg.data, "hello");
+     int idx[MB_MAX_BATCH];
+     for (long i = 0; i < n; i++) {
+         idx[i] = pick(num_sess);
+     }
+     mb_start();
+     for (long i = 0; i < n; i++) {
+         broadcast_message(sess_names[idx[i]], &msg);
+     }
+     mb_stop();
+     return n;
+ }
+
+ /**
+  * Broadcast with real queueing: copies go through send_to_client into the
+  * members' bulk lanes (no writer threads run), which are emptied untimed
+  * after every broadcast.
+  */
+ static long op_broadcast_queued(long n) {
+     static struct message msg;
+     msg.type = MESSAGE;
+     msg.size = 5;
+     strcpy((char *)msg.data, "hello");
+     for (int i = 0; i < num_users; i++) {
+         clients[i].out_dead = 0;
+     }
+     for (long i = 0; i < n; i++) {
+         int s = pick(num_sess);
+         mb_start();
+         broadcast_message(sess_names[s], &msg);
+         mb_stop();
+         for (int j = 0; j < session_hot.num_members[s]; j++) {
+             outq_free_lane(&clients[session_hot.members[s][j]].lanes[OUT_BULK]);
+         }
+     }
+     for (int i = 0; i < num_users; i++) {
+         clients[i].out_dead = 1;
+     }
+     return n;
+ }
+
+ static long mb_build_list(long n, const char *query) {
+     query_t q;
+     parse_query(query, &q);
+     const presence_snap_t *p = presence_snapshot();
+     int entries = p->users->count + p->sessions->count;
+     if (q.limit && q.limit < entries) {
+         entries = q.limit;
+     }
+     size_t cap = 64 + (entries + 1) * (MAX_NAME + 24);  // as send_listing sizes it
+     char *text = malloc(cap);
+     size_t len = 0;
+     mb_start();
+     for (long i = 0; i < n; i++) {
+         len += build_list(p, &q, text, cap);
+     }
+     mb_stop();
+     free(text);
+     mb_sink += len;
+     return n;
+ }
+
+ static long op_list_full(long n) {
+     return mb_build_list(n, "");
+ }
+
+ static long op_list_page(long n) {
+     return mb_build_list(n, MB_PAGE);
+ }
+
+ // --------------------- Driver ---------------------
+
+ typedef struct {
+     const char *name;
+     long (*run)(long n);
+ } mb_op_t;
+
+ static const mb_op_t ops[] = {
+     { "find_client_by_id",          op_find_client },
+     { "find_session",               op_find_session },
+     { "create_session",             op_create_session },
+     { "add_client_to_session",      op_add_member },
+     { "remove_client_from_session", op_remove_member },
+     { "broadcast_message",          op_broadcast },
+     { "broadcast_message (queued)", op_broadcast_queued },
+     { "build_list (full)",          op_list_full },
+     { "build_list (" MB_PAGE ")",   op_list_page },
+ };
+
+ /**
+  * Run one operation in growing batches until it has been timed for at
+  * least min_time seconds.
+  */
+ static void mb_measure(const mb_op_t *op) {
+     mb_ns = 0;
+     mb_allocs = 0;
+     long total = 0;
+     long batch = 1;
+     while (mb_ns < min_time * 1e9) {
+         long done = op->run(batch);
+         if (done == 0) {
+             printf("  %-28s %10s\n", op->name, "n/a");
+             return;
+         }
+         total += done;
+         if (batch < MB_MAX_BATCH) {
+             batch *= 2;
+         }
+     }
+     printf("  %-28s %12.1f %10.2f\n", op->name, (double)mb_ns / total, (double)mb_allocs / total);
+ }
+
+ static void mb_run_scale(int scale) {
+     int users = scale < MAX_CLIENTS ? scale : MAX_CLIENTS;
+     int nsess = scale < MAX_SESSIONS - MB_SPARE_SESSIONS ? scale : MAX_SESSIONS - MB_SPARE_SESSIONS;
+     printf("scale %d: %d users, %d sessions, ~%d members/session%s\n",
+            scale, users, nsess, (users + nsess / 2) / nsess,
+            (users < scale || nsess < scale) ? " (capped by MAX_CLIENTS/MAX_SESSIONS)" : "");
+     printf("  %-28s %12s %10s\n", "operation", "ns/op", "allocs/op");
+     fflush(stdout);
+     mb_populate(users, nsess);
+     for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+         mb_measure(&ops[i]);
+         fflush(stdout);
+     }
+ }
+
+ static void usage(const char *prog) {
+     fprintf(stderr, "Usage: %s [-n <max-scale>] [-t <seconds>] [-s <seed>]\n", prog);
+     exit(EXIT_FAILURE);
+ }
+
+ int main(int argc, char *argv[]) {
+     int max_scale = 100000;
+     int opt;
+     while ((opt = getopt(argc, argv, "n:t:s:")) != -1) {
+         switch (opt) {
+             case 'n': max_scale = atoi(optarg); break;
+             case 't': min_time = atof(optarg); break;
+             case 's': seed = (unsigned int)atoi(optarg); break;
+             default: usage(argv[0]);
+         }
+     }
+     if (optind != argc || max_scale < 10 || min_time <= 0) {
+         usage(argv[0]);
+     }
+     printf("MAX_CLIENTS=%d MAX_SESSIONS=%d, %.2f s per operation\n",
+            MAX_CLIENTS, MAX_SESSIONS, min_time);
+
+     // Each scale runs in its own process so it starts from empty tables.
+     for (int scale = 10; scale <= max_scale; scale *= 10) {
+         fflush(stdout);
+         pid_t pid = fork();
+         if (pid < 0) {
+             perror("fork");
+             exit(EXIT_FAILURE);
+         }
+         if (pid == 0) {
+             mb_run_scale(scale);
+             fflush(stdout);
+             _exit(0);
+         }
+         int status;
+         waitpid(pid, &status, 0);
+         if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+             fprintf(stderr, "scale %d failed\n", scale);
+             exit(EXIT_FAILURE);
+         }
+     }
+     return 0;
+ }
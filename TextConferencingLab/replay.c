@@ -0,0 +1,489 @@
+/*
+ * replay.c - Plays a traffic capture back against a Text Conferencing Server
+ *
+ * Usage: ./replay [-h <host>] [-p <port>] [-x <speed>] <capture-file>
+ *
+ * Reads a capture written by "server -r <file>" and recreates it: one TCP
+ * connection per recorded connection, opened, fed and closed at the
+ * recorded times.  -x scales the clock (2 = twice as fast, default 1);
+ * -x 0 sends everything as fast as the server takes it.  Frames from the
+ * server are read and discarded so it never blocks on a slow reader.
+ *
+ * Order is kept within each connection.  Across connections only the
+ * schedule orders frames, so at -x 0 or very high speeds one client's
+ * JOIN may reach the server before another's NEW_SESS, and the replay
+ * diverges from the recording.
+ *
+ * Passwords are not recorded, so the target server must be started with
+ * -o (open logins).  The report shows how far behind the schedule the
+ * sends fell; a large lag means the server (or this tool) could not keep
+ * up at the requested speed.
+ */
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <time.h>
+ #include <arpa/inet.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <sys/socket.h>
+ #include <sys/epoll.h>
+ #include <sys/resource.h>
+
+ #include "chatproto.h"
+
+ // Capture format (see TRAFFIC CAPTURE in server.c)
+ #define CAPTURE_VERSION 1
+ #define CAP_OPEN  1
+ #define CAP_FRAME 2
+ #define CAP_CLOSE 3
+
+ #define REPLAY_PASSWORD   "replay"     // Sent in place of the unrecorded password
+ #define MAX_OUTBUF        (256 * 1024) // Unsent bytes per connection before replay waits
+ #define DRAIN_TIME        1.0          // Seconds to keep reading after the last record
+ #define MAX_EVENTS        256
+
+ // One record from the capture, with its time relative to the first record
+ typedef struct {
+     int kind;
+     unsigned int conn;
+     double at;
+     struct message *msg;  // CAP_FRAME only, encoded for the wire
+ } record_t;
+
+ // Life cycle of one replayed connection
+ #define CN_IDLE       0   // not opened yet
+ #define CN_CONNECTING 1
+ #define CN_OPEN       2
+ #define CN_CLOSING    3   // CAP_CLOSE seen, flushing what is left
+ #define CN_DRAINING   4   // write side shut, reading until the server closes
+ #define CN_DONE       5
+
+ typedef struct {
+     int state;
+     int fd;
+     char *out;
+     size_t out_len, out_off, out_cap;
+     unsigned long bytes_in;
+ } conn_t;
+
+ static const char *host = "127.0.0.1";
+ static int port = 5000;
+ static double speed = 1.0;
+
+ static record_t *records = NULL;
+ static size_t num_records = 0;
+ static conn_t *conns = NULL;
+ static unsigned int num_conns = 0;   // highest connection id + 1
+ static int epfd;
+ static int active = 0;               // connections not yet done
+
+ // Counters for the report
+ static unsigned long frames_sent = 0;
+ static unsigned long conn_failures = 0;
+ static double lag_sum = 0, lag_max = 0;
+ static unsigned long lag_samples = 0;
+
+ static double now_sec(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+ }
+
+ static void usage(const char *prog) {
+     fprintf(stderr, "Usage: %s [-h <host>] [-p <port>] [-x <speed>] <capture-file>\n", prog);
+     exit(EXIT_FAILURE);
+ }
+
+ // --------------------- Capture file ---------------------
+
+ static int get_varint(FILE *f, unsigned long *v) {
+     *v = 0;
+     for (int shift = 0; shift < 64; shift += 7) {
+         int c = getc(f);
+         if (c == EOF) {
+             return -1;
+         }
+         *v |= (unsigned long)(c & 0x7f) << shift;
+         if (!(c & 0x80)) {
+             return 0;
+         }
+     }
+     return -1;
+ }
+
+ static int get_bytes(FILE *f, unsigned char *dst, size_t cap) {
+     unsigned long len;
+     if (get_varint(f, &len) < 0 || len > cap || fread(dst, 1, len, f) != len) {
+         return -1;
+     }
+     return 0;
+ }
+
+ /**
+  * Read a whole capture into 'records'.  A truncated last record (the
+  * server was killed mid-write) ends the capture instead of failing it.
+  */
+ static void load_capture(const char *path) {
+     FILE *f = fopen(path, "rb");
+     if (!f) {
+         perror(path);
+         exit(EXIT_FAILURE);
+     }
+     unsigned char head[13];
+     if (fread(head, 1, sizeof(head), f) != sizeof(head) || memcmp(head, "CCAP", 4) != 0) {
+         fprintf(stderr, "%s: not a capture file\n", path);
+         exit(EXIT_FAILURE);
+     }
+     if (head[4] != CAPTURE_VERSION) {
+         fprintf(stderr, "%s: unsupported capture version %d\n", path, head[4]);
+         exit(EXIT_FAILURE);
+     }
+
+     size_t cap = 0;
+     unsigned long t_us = 0;
+     while (1) {
+         int kind = getc(f);
+         unsigned long delta, conn;
+         if (kind == EOF) {
+             break;
+         }
+         if (get_varint(f, &delta) < 0 || get_varint(f, &conn) < 0) {
+             fprintf(stderr, "%s: truncated record, stopping there\n", path);
+             break;
+         }
+         t_us += delta;
+         record_t r = { kind, (unsigned int)conn, t_us / 1e6, NULL };
+         if (kind == CAP_OPEN) {
+             unsigned char addr[6];
+             if (fread(addr, 1, sizeof(addr), f) != sizeof(addr)) {
+                 break;
+             }
+         } else if (kind == CAP_FRAME) {
+             unsigned long type, size;
+             struct message *m = calloc(1, sizeof(*m));
+             if (get_varint(f, &type) < 0 || get_varint(f, &size) < 0 ||
+                 get_bytes(f, m->source, MAX_NAME - 1) < 0 ||
+                 get_bytes(f, m->session, MAX_NAME - 1) < 0 ||
+                 get_bytes(f, m->data, MAX_DATA) < 0) {
+                 fprintf(stderr, "%s: truncated record, stopping there\n", path);
+                 free(m);
+                 break;
+             }
+             m->type = type;
+             m->size = size;
+             if (type == LOGIN) {
+                 snprintf((char *)m->data, MAX_DATA, "%s", REPLAY_PASSWORD);
+                 m->size = strlen(REPLAY_PASSWORD) + 1;
+             }
+             r.msg = chat_encode(m);
+         } else if (kind != CAP_CLOSE) {
+             fprintf(stderr, "%s: unknown record kind %d\n", path, kind);
+             exit(EXIT_FAILURE);
+         }
+         if (num_records == cap) {
+             cap = cap ? cap * 2 : 1024;
+             records = realloc(records, cap * sizeof(record_t));
+         }
+         records[num_records++] = r;
+         if (conn >= num_conns) {
+             num_conns = conn + 1;
+         }
+     }
+     fclose(f);
+
+     conns = calloc(num_conns, sizeof(conn_t));
+     for (unsigned int i = 0; i < num_conns; i++) {
+         conns[i].fd = -1;
+     }
+ }
+
+ // --------------------- Connections ---------------------
+
+ static void watch(conn_t *c, int op) {
+     struct epoll_event ev;
+     ev.events = EPOLLIN | ((c->state == CN_CONNECTING || c->out_len > c->out_off) ? EPOLLOUT : 0);
+     ev.data.u32 = (unsigned int)(c - conns);
+     if (epoll_ctl(epfd, op, c->fd, &ev) < 0) {
+         perror("epoll_ctl");
+     }
+ }
+
+ static void finish(conn_t *c, const char *why) {
+     if (c->state == CN_DONE || c->state == CN_IDLE) {
+         return;
+     }
+     if (why) {
+         if (conn_failures < 5) {
+             fprintf(stderr, "connection %d: %s\n", (int)(c - conns), why);
+         }
+         conn_failures++;
+     }
+     c->state = CN_DONE;
+     active--;
+     epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+     close(c->fd);
+     c->fd = -1;
+     free(c->out);
+     c->out = NULL;
+     c->out_len = c->out_off = c->out_cap = 0;
+ }
+
+ /**
+  * Write as much pending output as the socket takes.  A closing connection
+  * half-closes once everything has gone out, so unread replies do not
+  * turn the close into a reset that could discard the last frames.
+  */
+ static void flush_out(conn_t *c) {
+     if (c->state == CN_CONNECTING) {
+         return;
+     }
+     int had_pending = c->out_len > c->out_off;
+     while (c->out_len > c->out_off) {
+         ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+         if (n < 0) {
+             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                 break;
+             }
+             if (errno == EINTR) {
+                 continue;
+             }
+             finish(c, strerror(errno));
+             return;
+         }
+         c->out_off += n;
+     }
+     if (c->out_off == c->out_len) {
+         c->out_off = c->out_len = 0;
+         if (c->state == CN_CLOSING) {
+             shutdown(c->fd, SHUT_WR);
+             c->state = CN_DRAINING;
+         }
+     }
+     if (had_pending != (c->out_len > c->out_off)) {
+         watch(c, EPOLL_CTL_MOD);
+     }
+ }
+
+ static void start_connect(conn_t *c) {
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_port = htons(port);
+     inet_pton(AF_INET, host, &addr.sin_addr);
+
+     c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+     if (c->fd < 0) {
+         perror("socket");
+         exit(EXIT_FAILURE);
+     }
+     int one = 1;
+     setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+     c->state = CN_CONNECTING;
+     active++;
+     watch(c, EPOLL_CTL_ADD);
+     if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+         finish(c, strerror(errno));
+     }
+ }
+
+ /**
+  * Queue one recorded frame.  Returns -1 if the connection is too far
+  * behind, in which case the caller retries later.
+  */
+ static int queue_frame(conn_t *c, const struct message *m) {
+     if (c->out_len - c->out_off + sizeof(*m) > MAX_OUTBUF) {
+         return -1;
+     }
+     if (c->out_len + sizeof(*m) > c->out_cap) {
+         c->out_cap = c->out_cap ? c->out_cap * 2 : 4 * sizeof(*m);
+         c->out = realloc(c->out, c->out_cap);
+     }
+     memcpy(c->out + c->out_len, m, sizeof(*m));
+     c->out_len += sizeof(*m);
+     frames_sent++;
+     flush_out(c);
+     return 0;
+ }
+
+ static void handle_readable(conn_t *c) {
+     char buf[16 * sizeof(struct message)];
+     while (c->state != CN_DONE) {
+         ssize_t n = read(c->fd, buf, sizeof(buf));
+         if (n < 0) {
+             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                 return;
+             }
+             if (errno == EINTR) {
+                 continue;
+             }
+             finish(c, strerror(errno));
+             return;
+         }
+         if (n == 0) {
+             // The recording may end with the server dropping the client.
+             finish(c, c->state >= CN_CLOSING ? NULL : "server closed the connection");
+             return;
+         }
+         c->bytes_in += n;
+     }
+ }
+
+ static void handle_writable(conn_t *c) {
+     if (c->state == CN_CONNECTING) {
+         int err = 0;
+         socklen_t len = sizeof(err);
+         getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+         if (err) {
+             finish(c, strerror(err));
+             return;
+         }
+         c->state = CN_OPEN;
+         watch(c, EPOLL_CTL_MOD);
+     }
+     flush_out(c);
+ }
+
+ /**
+  * Carry out one record.  Returns -1 if it has to wait (connection still
+  * connecting or its output is full).
+  */
+ static int play(const record_t *r) {
+     conn_t *c = &conns[r->conn];
+     switch (r->kind) {
+         case CAP_OPEN:
+             if (c->state == CN_IDLE) {
+                 start_connect(c);
+             }
+             return 0;
+         case CAP_FRAME:
+             if (c->state == CN_DONE || c->state == CN_IDLE) {
+                 return 0;  // connection failed or never opened; skip
+             }
+             return queue_frame(c, r->msg);
+         case CAP_CLOSE:
+             if (c->state == CN_CONNECTING) {
+                 return -1;  // not connected yet; its frames are still queued
+             }
+             if (c->state == CN_OPEN) {
+                 c->state = CN_CLOSING;
+                 flush_out(c);
+             }
+             return 0;
+     }
+     return 0;
+ }
+
+ int main(int argc, char *argv[]) {
+     int opt;
+     while ((opt = getopt(argc, argv, "h:p:x:")) != -1) {
+         switch (opt) {
+             case 'h': host = optarg; break;
+             case 'p': port = atoi(optarg); break;
+             case 'x': speed = atof(optarg); break;
+             default: usage(argv[0]);
+         }
+     }
+     if (optind != argc - 1 || speed < 0) {
+         usage(argv[0]);
+     }
+     load_capture(argv[optind]);
+     if (num_records == 0) {
+         fprintf(stderr, "Capture is empty.\n");
+         return 0;
+     }
+     double span = records[num_records - 1].at - records[0].at;
+     char pace[32];
+     snprintf(pace, sizeof(pace), speed ? "%gx speed" : "full speed", speed);
+     printf("Replaying %zu records over %u connections (%.2f s recorded) at %s\n",
+            num_records, num_conns ? num_conns - 1 : 0, span, pace);
+     fflush(stdout);
+
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
+     epfd = epoll_create1(0);
+     if (epfd < 0) {
+         perror("epoll_create1");
+         exit(EXIT_FAILURE);
+     }
+
+     struct epoll_event events[MAX_EVENTS];
+     double start = now_sec();
+     double t0 = records[0].at;
+     double done_at = 0;
+     size_t next = 0;
+     while (1) {
+         double now = now_sec();
+         while (next < num_records) {
+             const record_t *r = &records[next];
+             double due = speed ? start + (r->at - t0) / speed : now;
+             if (due > now || play(r) < 0) {
+                 break;
+             }
+             if (r->kind == CAP_FRAME && speed) {
+                 double lag = now - due;
+                 lag_sum += lag;
+                 lag_samples++;
+                 if (lag > lag_max) {
+                     lag_max = lag;
+                 }
+             }
+             next++;
+         }
+         if (next == num_records && !done_at) {
+             done_at = now;
+         }
+         if (done_at && (active == 0 || now - done_at > DRAIN_TIME)) {
+             break;
+         }
+
+         int timeout = 10;
+         if (next < num_records && speed) {
+             double wait = start + (records[next].at - t0) / speed - now;
+             timeout = wait <= 0 ? 0 : (wait < 0.010 ? 1 : 10);
+         }
+         int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+         for (int i = 0; i < n; i++) {
+             conn_t *c = &conns[events[i].data.u32];
+             if (c->state == CN_DONE) {
+                 continue;
+             }
+             if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                 if (c->state != CN_CONNECTING) {
+                     handle_readable(c);
+                 }
+                 finish(c, c->state >= CN_CLOSING ? NULL : "connection error");
+                 continue;
+             }
+             if (events[i].events & EPOLLOUT) {
+                 handle_writable(c);
+             }
+             if ((events[i].events & EPOLLIN) && c->state != CN_DONE) {
+                 handle_readable(c);
+             }
+         }
+     }
+     double elapsed = now_sec() - start;
+
+     unsigned long bytes_in = 0;
+     for (unsigned int i = 0; i < num_conns; i++) {
+         bytes_in += conns[i].bytes_in;
+     }
+     unsigned long frames_recv = bytes_in / sizeof(struct message);
+     printf("Sent %lu frames in %.2f s (%.0f frames/s), received %lu frames, %lu connection failures\n",
+            frames_sent, elapsed, elapsed > 0 ? frames_sent / elapsed : 0.0, frames_recv, conn_failures);
+     if (lag_samples) {
+         printf("Schedule lag: mean %.3f ms, max %.3f ms\n",
+                lag_sum / lag_samples * 1e3, lag_max * 1e3);
+     }
+     printf("RESULT sent=%lu recv=%lu failures=%lu elapsed=%.3f lag_mean_ms=%.3f lag_max_ms=%.3f\n",
+            frames_sent, frames_recv, conn_failures, elapsed,
+            lag_samples ? lag_sum / lag_samples * 1e3 : 0.0, lag_max * 1e3);
+     return conn_failures ? 1 : 0;
+ }
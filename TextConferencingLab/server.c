@@ -2,11 +2,44 @@
  * server.c - Text Conferencing Server Program with Multiple Sessions
  *            and Inactivity Timer
  *
- * Usage: ./server <port>
+ * Usage: ./server <port> [-u <upgrade-socket>] [-a <admin-socket>]
+ *                 [-l <local-socket>] [-r <capture-file>] [-m <mailbox-file>]
+ *                 [-s] [-t] [-o]
  *
  * The server listens on <port>, accepts multiple client connections,
  * routes text messages for conferencing, and disconnects clients that
- * have been inactive for a long time.
+ * have been inactive for a long time.  Frames and packet types are
+ * defined in chatproto.h, which the clients share.
+ *
+ * With -u, the server also listens on a Unix socket at <upgrade-socket>.
+ * Starting a new server binary with the same -u path hands the listening
+ * socket, every client socket and all session state over to the new
+ * process (SCM_RIGHTS), after which the old process exits.  Clients stay
+ * connected across the upgrade.
+ *
+ * Sending SIGUSR1 prints latency percentiles for traffic frames, globally
+ * and per session.  With -t the server also stamps its receive time into
+ * every MESSAGE and DIRECT so clients can show end-to-end latency.
+ *
+ * With -l, the server also accepts clients on a Unix socket at
+ * <local-socket>, for bots on the same host.  Those may ask at login to
+ * exchange frames through shared-memory rings instead (chatshm.h).
+ *
+ * With -a, operators can read metrics (Prometheus text format), inspect a
+ * session or client, and disconnect clients through a Unix socket.
+ *
+ * With -r, inbound traffic is recorded to a capture file that replay.c
+ * can play back against a test server at the original or a faster pace.
+ *
+ * With -m, traffic for users whose connection dropped (and DIRECTs to
+ * users who are offline) is kept in per-user mailboxes, spooled to
+ * <mailbox-file>, and delivered when they log in again.
+ *
+ * With -s, session traffic is indexed as it is posted and members can
+ * look up earlier messages by keyword and time with SEARCH.
+ *
+ * -o accepts any user name and password.  It exists for the load tools
+ * (bench.c, replay.c) and must not be used otherwise.
  *
  * IMPORTANT:
  *  - This code is a skeleton to demonstrate the overall approach.
@@ -24,64 +57,550 @@
  #include <sys/socket.h>
  #include <sys/types.h>
  #include <netinet/in.h>
+ #include <sys/un.h>
+ #include <poll.h>
+ #include <sys/uio.h>
+ #include <sys/resource.h>
+ #include <sys/mman.h>
+ #include <sys/eventfd.h>
+ #include <fcntl.h>
+ #include <stdint.h>
+ #include <stdatomic.h>
+ #include <limits.h>
+ #include <sched.h>
+ #include <ctype.h>
  #include <time.h>   // for time functions
+ #include <signal.h>
+ #include <zlib.h>
+ 
+ #include "chatproto.h"
+ #include "chatzip.h"
+ #include "chatshm.h"
  
  // --------------------- DEFINITIONS ---------------------
+ #ifndef MAX_CLIENTS
  #define MAX_CLIENTS  100   // Max number of concurrently connected clients
+ #endif
+ #ifndef MAX_SESSIONS
  #define MAX_SESSIONS 100   // Max number of conference sessions
- #define MAX_NAME     50
- #define MAX_DATA     1024
+ #endif
+ #define CACHE_ALIGNED __attribute__((aligned(64)))
  #define INACTIVITY_THRESHOLD 60  // Inactivity threshold in seconds
+ #define UPGRADE_PARK_TIMEOUT 5   // Seconds to wait for threads to stop reading
+ #define UPGRADE_ACK_TIMEOUT  10  // Seconds to wait for the new process to confirm
+ #define UPGRADE_TAKEOVER_TRIES 5 // Handoffs a new process asks for before giving up
+ #define HANDOFF_MAX_RECORD   65536
+ #define CLIENT_HASH_SIZE     256  // Buckets in the clientID index (power of 2)
+ #define TOPIC_HASH_SIZE      1024 // Buckets in the topic trie edge table (power of 2)
+ #define MAX_TOPIC_DEPTH      25   // Levels in a hierarchical session name
+ #define MAX_SUBS             16   // Subscription patterns per client
+ #define QUERY_DEFAULT_LIMIT  50   // Page size when a QUERY does not give one
+ #define QUERY_MAX_LIMIT      1000
+ #define LISTEN_BACKLOG       128
+ #define LOGIN_PENDING_MAX    64   // Accepted connections that have not sent LOGIN yet
+ #define LOGIN_TIMEOUT        5    // Seconds a new connection has to send LOGIN
+ #define CLIENT_STACK_SIZE    (256 * 1024) // Reader and writer threads (two per client)
+ #define RCU_MAX_READERS      (MAX_CLIENTS + 16) // Threads that may read snapshots at once
+ #define RCU_RECLAIM_BATCH    32         // Retired objects that trigger a reclaim pass
+ 
+ // Rate limits (see rate_admit / fanout_admit)
+ #define RATE_MSGS_PER_SEC    20         // Traffic frames per client
+ #define RATE_MSGS_BURST      40
+ #define RATE_BYTES_PER_SEC   16384      // Payload bytes per client
+ #define RATE_BYTES_BURST     32768
+ #define FANOUT_BYTES_PER_SEC (4 << 20)  // Bytes written per session, all members
+ #define FANOUT_BYTES_BURST   (8 << 20)
+ #define THROTTLE_NOTICE_GAP  1.0        // Seconds between THROTTLE notices
+ 
+ // Outbound queues (see send_to_client)
+ #define OUTQ_CONTROL_MAX     64         // Queued control frames per client
+ #define OUTQ_BULK_MAX        256        // Queued bulk frames per client
+ #define OUT_CONTROL_WEIGHT   8          // Control frames written per bulk frame
+ #define OUT_BATCH            16         // Frames per writev
+ #define UPGRADE_DRAIN_TIMEOUT 3         // Seconds to flush queues before a handoff
+ 
+ // Session coalescing windows (see session_post)
+ #define WINDOW_MAX_MS        1000       // Longest window an operator may set
+ #define WINDOW_MAX_FRAMES    64         // Most frames one window may hold
+ #define WINDOW_DEFAULT_FRAMES OUT_BATCH  // One writev per member per window
+ 
+ // Offline mailboxes (see mailbox_store)
+ #define MAILBOX_USERS        1024       // Users that may have a mailbox (power of 2)
+ #define MAILBOX_FRAMES       128        // Frames kept per user; fits one bulk lane
+ #define MAILBOX_AWAY_MAX     16         // Dropped members a session keeps traffic for
+ #define MAILBOX_COMPACT_BYTES (1 << 20) // Spool growth that triggers a rewrite
+ #define MAILBOX_BUFFER       (1 << 16)  // stdio buffer of the spool file
+ 
+ // Message search (see search_request)
+ #define SEARCH_MAX_DOCS      (1 << 18)  // Messages kept searchable; the oldest go first
+ #define SEARCH_SEGMENT_DOCS  (1 << 14)  // Largest segment merging may produce
+ #define SEARCH_SEGMENT_SECS  600        // Segments of different 10-minute spans never merge
+ #define SEARCH_PENDING_MAX   4096       // Messages waiting for the indexer
+ #define SEARCH_MAX_TERMS     8          // Words in one query
+ #define SEARCH_WORD_MAX      32         // Longer words are cut here
+ #define SEARCH_DEFAULT_LIMIT 20
+ #define SEARCH_MAX_LIMIT     100
+ 
+ // Latency histograms (see lat_record)
+ #define LAT_SUB_BITS         5          // 32 sub-buckets per power of two (~3% precision)
+ #define LAT_MAX_BITS         40         // Values up to 2^40 ns (about 18 minutes)
+ #define LAT_BUCKETS          ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+ #define ADMIN_IO_TIMEOUT     5          // Seconds an admin connection may stall
+ #define CAPTURE_BUFFER       (1 << 20)  // stdio buffer of the capture file
+ 
+ // Slab allocator and per-connection arenas (see slab_alloc / arena_alloc)
+ #define SLAB_CHUNK           (64 * 1024) // Bytes carved from malloc at a time
+ #define SLAB_CACHE_BYTES     (16 * 1024) // Free objects a thread keeps per type
+ #define SLAB_MAX_BATCH       64          // Objects moved per thread <-> depot trade
+ #define ARENA_BLOCK          (16 * 1024) // Scratch block kept by each connection
  
- // Packet type definitions (must match client)
- #define LOGIN       1
- #define LO_ACK      2
- #define LO_NAK      3
- #define EXIT        4
- #define JOIN        5
- #define JN_ACK      6
- #define JN_NAK      7
- #define LEAVE_SESS  8
- #define NEW_SESS    9
- #define NS_ACK      10
- #define MESSAGE     11
- #define QUERY       12
- #define QU_ACK      13
+ // Per-connection compression (see zconn_new); the window is in chatzip.h
+ #define DEFLATE_LEVEL        6
+ #define DEFLATE_MEM_LEVEL    5          // With the 8KB window, about 48KB per stream
+ #define DEFLATE_IN_BUF       4096       // Compressed bytes read at a time
+ #define DEFLATE_OUT_BUF      8192       // Compressed bytes written at a time
+ 
+ // Shared-memory transport (see shm_write); ring sizes are in chatshm.h
+ #define SHM_WAIT_MS          100        // A writer waiting for ring space rechecks for shutdown
+ 
+ // Subsystems whose heap use is reported by the admin endpoint
+ #define MEM_TOPICS   0
+ #define MEM_PRESENCE 1
+ #define MEM_OUTQ     2
+ #define MEM_LATENCY  3
+ #define MEM_ZIP      4
+ #define MEM_MAILBOX  5
+ #define MEM_SEARCH   6
+ #define MEM_SHM      7   // Shared-memory rings (mapped, not heap)
+ #define MEM_KINDS    8
+ 
+ // Object types served by the slab allocator
+ #define SLAB_FRAME   0   // outframe_t
+ #define SLAB_RETIRED 1   // retired_t
+ #define SLAB_TOPIC   2   // topic_node_t
+ #define SLAB_LATENCY 3   // lat_set_t
+ #define SLAB_KINDS   4
+ 
+ // Latency stages of a traced MESSAGE or DIRECT frame
+ #define LAT_PARSE   0   // read from the socket -> handed to dispatch
+ #define LAT_FANOUT  1   // dispatch -> every copy queued (includes the lock wait)
+ #define LAT_QUEUE   2   // queued -> picked up by the member's writer
+ #define LAT_WRITE   3   // read from the socket -> written to the member's socket
+ #define LAT_STAGES  4
  
  // --------------------- DATA STRUCTURES ---------------------
  
- // Updated message structure with a session field.
- struct message {
-     unsigned int type;
-     unsigned int size;
-     unsigned char source[MAX_NAME];
-     unsigned char session[MAX_NAME];  // holds session id for this message
-     unsigned char data[MAX_DATA];
- };
+ // Token bucket; rate and burst are supplied by the caller.
+ typedef struct {
+     double tokens;
+     double last;                      // Monotonic time of the last refill
+ } token_bucket_t;
+ 
+ // Log-linear latency histogram in nanoseconds: like an HDR histogram,
+ // every bucket is within ~3% of its value across the whole range.
+ // Updated with relaxed atomics from any thread.
+ typedef struct {
+     atomic_ulong counts[LAT_BUCKETS];
+     atomic_ulong total;
+     atomic_ulong sum;
+     atomic_ulong max;
+ } lat_hist_t;
+ 
+ // One histogram per stage plus traffic counters.  There is a global set
+ // and one per session; a session's set lives until the session, its
+ // queued frames and any presence snapshot naming it are gone.
+ typedef struct {
+     atomic_int refs;
+     atomic_ulong messages;            // MESSAGE frames fanned out
+     atomic_ulong bytes_out;           // Bytes of those written to members
+     lat_hist_t stage[LAT_STAGES];
+ } lat_set_t;
+ 
+ // Trace context of the frame the current thread is dispatching.
+ typedef struct {
+     unsigned long ingress;            // now_ns() when the frame was read, 0 if untraced
+     lat_set_t *session;               // Histograms of the target session, or NULL
+ } lat_trace_t;
+ 
+ // Outbound frame queue of one priority class.
+ typedef struct outframe {
+     struct outframe *next;
+     unsigned long t_ingress;          // Trace of the original frame, 0 if untraced
+     unsigned long t_queued;
+     lat_set_t *lat;                   // Holds a reference when set
+     int lane;                         // OUT_CONTROL or OUT_BULK
+     struct message msg;               // Encoded for the wire
+ } outframe_t;
+ 
+ typedef struct {
+     outframe_t *head;
+     outframe_t *tail;
+     int count;
+ } outlane_t;
+ 
+ #define OUT_CONTROL 0
+ #define OUT_BULK    1
  
- // Information about a single client.
- // Updated to support multiple sessions and track last activity time.
+ // Free object of a slab; the link overlays the object's first bytes.
+ typedef struct slab_obj {
+     struct slab_obj *next;
+ } slab_obj_t;
+ 
+ // Allocator for one object type.  Threads take and return objects in
+ // batches through the depot, which is guarded by 'lock'.
+ typedef struct {
+     const char *name;
+     size_t size;                      // Object size before rounding
+     pthread_mutex_t lock;
+     slab_obj_t *depot;                // Free objects not cached by any thread
+     atomic_ulong chunk_bytes;         // Memory carved so far
+     atomic_long  live;                // Objects handed out
+ } slab_t;
+ 
+ // Free objects of one type cached by the current thread.
+ typedef struct {
+     slab_obj_t *head;
+     int count;
+ } slab_cache_t;
+ 
+ // Bump allocator for per-frame scratch memory (see arena_alloc).
+ typedef struct arena_block {
+     struct arena_block *next;
+     size_t size;
+     size_t used;
+     char data[];
+ } arena_block_t;
+ 
+ typedef struct {
+     arena_block_t *head;              // Block being filled; older ones follow
+ } arena_t;
+ 
+ // Compression state of one connection.  The reader owns 'in' and the
+ // writer owns 'out', so neither needs a lock.
+ typedef struct {
+     z_stream in;                      // Inflates what the client sends
+     z_stream out;                     // Deflates what we send
+     unsigned char in_buf[DEFLATE_IN_BUF]; // Read but not yet inflated: in.next_in
+     int  dict;                        // Streams start from zip_dict
+     unsigned long wire_in;            // Compressed bytes read
+     unsigned long wire_out;           // Compressed bytes written
+ } zconn_t;
+ 
+ // Shared-memory transport of one local client (see chatshm.h).  The
+ // reader owns the 'up' ring and the writer 'down'.
+ typedef struct {
+     chat_shm_t *area;
+     int fd[SHM_FDS];                  // SHM_FD_*; the area's is closed once handed over
+ } shmconn_t;
+ 
+ // Information about a single client.  Fields that scans and fan-out read
+ // for every client live in client_hot instead.
  typedef struct {
      int  sockfd;                      // Socket descriptor
      char clientID[MAX_NAME];          // Unique client name (ID)
      char sessions[MAX_SESSIONS][MAX_NAME]; // List of sessions this client has joined
      int  session_count;               // Number of sessions the client is in
-     struct sockaddr_in clientAddr;    // Client address
-     int  active;                      // 1 if logged in, 0 otherwise
-     time_t last_active;               // Timestamp of last activity
+     struct sockaddr_in clientAddr;    // Client address; sin_family AF_UNIX if local (-l)
+     unsigned char rx_buf[sizeof(struct message)] CHAT_FRAME_ALIGNED; // Partially received frame
+     int  rx_len;                      // Bytes currently held in rx_buf
+     char subs[MAX_SUBS][MAX_NAME];    // Topic patterns this client subscribed to
+     int  sub_count;
+     int  presence_sub;                // 1 if this client receives PRESENCE deltas
+     token_bucket_t msg_bucket;        // Owned by the client's thread
+     token_bucket_t byte_bucket;
+     double last_throttle_notice;
+     unsigned long throttled;          // Frames shed by rate limiting
+     outlane_t lanes[2];               // OUT_CONTROL, OUT_BULK; guarded by out_lock
+     int  out_closing;                 // Writer should exit
+     int  out_dead;                    // Socket failed, drop everything
+     int  out_busy;                    // Writer is writing a batch
+     unsigned long out_dropped;        // Frames dropped because the queue was full
+     pthread_t writer_tid;
+     unsigned int cap_id;              // Connection number in the capture file
+     arena_t arena;                    // Reader's scratch memory, reset per frame
+     zconn_t *z;                       // Negotiated compression, NULL if plain
+     shmconn_t *shm;                   // Shared-memory transport, NULL on the socket
  } client_t;
  
- // Information about a single conference session
+ // A MESSAGE held in a session's coalescing window.
+ typedef struct {
+     struct message msg;
+     unsigned long ingress;            // Trace start, 0 if untraced
+ } held_frame_t;
+ 
+ // Information about a single conference session.  The member list is in
+ // session_hot.
  typedef struct {
      char sessionID[MAX_NAME];
-     int  num_members;
-     char members[MAX_CLIENTS][MAX_NAME];  // List of client IDs
+     token_bucket_t fanout;            // Bytes/s budget across all members
+     lat_set_t *lat;                   // Latency histograms of this session
+     unsigned int window_us;           // Coalescing window, 0 if frames go out at once
+     int  window_frames;               // ... released early once this many are held
+     held_frame_t *held;               // window_frames slots, allocated on first use
+     int  held_count;
+     unsigned long held_deadline;      // now_ns() at which the held frames go out
+     int  away[MAILBOX_AWAY_MAX];      // Mailboxes of members whose connection dropped
+     int  num_away;
  } session_t;
  
+ // Offline mailbox of one user (see mailbox_store).  Frame number 's' is
+ // in frames[s % MAILBOX_FRAMES]; those from 'read' to 'next' are unread.
+ typedef struct {
+     char user[MAX_NAME];              // "" if the slot is free
+     held_frame_t *frames;             // Ring, allocated while frames are unread
+     unsigned long next;               // Number of the next frame stored
+     unsigned long read;               // Read position
+     unsigned int mark;                // deliver_epoch of the last frame stored
+ } mailbox_t;
+ 
+ // Bytes gathered for a spool rewrite (see mailbox_rewrite).
+ typedef struct {
+     unsigned char *data;
+     size_t len;
+     size_t cap;
+     int    failed;                    // An append did not fit; the bytes are incomplete
+ } spool_buf_t;
+ 
+ // One level of the subscription trie.  Literal children are found through
+ // the topic_edges hash table; wildcard children hang off the node directly.
+ typedef struct topic_node {
+     char level[MAX_NAME];
+     struct topic_node *parent;
+     struct topic_node *star;          // '*' child (exactly one level)
+     struct topic_node *hash;          // '#' child (all remaining levels)
+     struct topic_node *edge_next;     // Next node in the same topic_edges bucket
+     int  num_children;
+     int *subs;                        // Subscribed client slots
+     int  num_subs;
+     int  cap_subs;
+ } topic_node_t;
+ 
+ // Immutable, sorted member list of one session.
+ typedef struct {
+     int  count;
+     char names[][MAX_NAME];
+ } roster_t;
+ 
+ // Immutable presence listing, sorted by name.  A new version is published
+ // for every login, logout, join and leave; readers access it inside an
+ // rcu_read_lock() section.  A version shares the list it did not change
+ // with the previous one, and so do unchanged rosters: login and logout
+ // copy only the user list, join and leave only the session list.
+ typedef struct {
+     char name[MAX_NAME];
+     int  members;                     // Sessions only
+     const roster_t *roster;           // Sessions only
+     lat_set_t *stats;                 // Sessions only; freed after the session leaves the snapshot
+ } presence_entry_t;
+ 
+ typedef struct {
+     int count;
+     presence_entry_t entries[];
+ } presence_list_t;
+ 
+ typedef struct {
+     unsigned long version;
+     presence_list_t *users;
+     presence_list_t *sessions;
+ } presence_snap_t;
+ 
+ // A MESSAGE waiting for the indexer (see search_ingest).
+ typedef struct search_pending {
+     struct search_pending *next;
+     uint64_t t_ms;                    // Wall-clock time it was posted
+     char session[MAX_NAME];
+     char source[MAX_NAME];
+     char text[];
+ } search_pending_t;
+ 
+ // One indexed message.  Its session, source and text follow each other,
+ // NUL-terminated, at 'off' in the segment's text blob.
+ typedef struct {
+     uint64_t t_ms;
+     uint32_t off;
+ } search_doc_t;
+ 
+ // A term of a segment and its posting list: the docs that contain it,
+ // ascending, as varint deltas (the first from 0).
+ typedef struct {
+     uint32_t term;                    // Offset in the term blob
+     uint32_t post;                    // Offset in the postings blob
+     uint32_t count;
+ } search_term_t;
+ 
+ // An immutable run of consecutive messages and their inverted index.
+ // Doc i of a segment is message number base + i.  Terms are the words of
+ // the text and "#<session>", sorted.
+ typedef struct search_seg {
+     struct search_seg *next;          // Next older segment
+     uint32_t base, num_docs;
+     uint64_t t_min, t_max;            // Time range of the docs
+     search_doc_t *docs;
+     char *text;
+     size_t text_len;
+     search_term_t *terms;
+     uint32_t num_terms;
+     char *term_blob;
+     size_t term_len;
+     unsigned char *postings;
+     size_t post_len;
+ } search_seg_t;
+ 
+ // A parsed SEARCH request (see parse_search).
+ typedef struct {
+     char words[SEARCH_MAX_TERMS + 1][MAX_NAME + 1];  // Plus "#<session>"
+     int  num_words;
+     uint64_t since, until;            // Wall-clock ms, inclusive
+     int  limit;
+ } search_query_t;
+ 
+ // A parsed QUERY request (see parse_query).
+ #define QUERY_USERS    1
+ #define QUERY_SESSIONS 2
+ typedef struct {
+     int  kinds;                       // QUERY_USERS and/or QUERY_SESSIONS
+     char prefix[MAX_NAME];
+     int  after_kind;                  // List the cursor points into, 0 if none
+     char after[MAX_NAME];             // Resume after this name
+     int  limit;                       // Entries per page, 0 for no limit
+ } query_t;
+ 
  // --------------------- GLOBALS ---------------------
  static client_t   clients[MAX_CLIENTS];     // Connected clients
  static session_t  sessions[MAX_SESSIONS];     // Active sessions
+ 
+ // Hot per-slot client state, split out of client_t into one dense array
+ // per field (indexed like clients[]).  The free-slot search, inactivity
+ // sweep, index walks and fan-out touch only these: a few bytes per client
+ // rather than a stride of several kilobytes.
+ static struct {
+     unsigned char active[MAX_CLIENTS] CACHE_ALIGNED;         // 1 if logged in
+     unsigned char thread_running[MAX_CLIENTS] CACHE_ALIGNED; // Reader thread still owns the slot
+     unsigned int  name_hash[MAX_CLIENTS] CACHE_ALIGNED;      // hash_name(clientID) while indexed
+     int           hash_next[MAX_CLIENTS] CACHE_ALIGNED;      // Next slot in the same client_hash bucket
+     unsigned int  deliver_mark[MAX_CLIENTS] CACHE_ALIGNED;   // Last broadcast that reached the client
+     _Atomic time_t last_active[MAX_CLIENTS] CACHE_ALIGNED;   // Time of the last frame (stored unlocked)
+ } client_hot;
+ 
+ // Hot session state, indexed like sessions[].  Members are client slots,
+ // so fan-out goes straight to the recipients without name lookups.
+ static struct {
+     unsigned int name_hash[MAX_SESSIONS] CACHE_ALIGNED;      // hash_name(sessionID)
+     int          num_members[MAX_SESSIONS] CACHE_ALIGNED;
+     int          members[MAX_SESSIONS][MAX_CLIENTS] CACHE_ALIGNED; // In join order
+ } session_hot;
  static int        num_sessions = 0;           // Number of currently active sessions
+ static int        client_hash[CLIENT_HASH_SIZE]; // clientID -> first slot in bucket (-1 if none)
+ static topic_node_t  topic_root;                     // Root of the subscription trie
+ static topic_node_t *topic_edges[TOPIC_HASH_SIZE];   // (parent, level) -> child
+ static unsigned int  deliver_epoch = 0;              // Bumped once per broadcast
+ static pthread_mutex_t out_lock[MAX_CLIENTS];       // Guards a client's outbound queue
+ static pthread_cond_t  out_cond[MAX_CLIENTS];       // Wakes the client's writer thread
+ static presence_snap_t *_Atomic presence_current = NULL; // Latest presence snapshot
+ static int presence_batching = 0;                    // Changes wait for presence_batch_end
+ static lat_set_t    lat_global;                      // Latency of all traced frames
+ static __thread lat_trace_t lat_trace;               // Frame this thread is dispatching
+ static __thread unsigned int reply_id;               // Request ID of the frame being answered
+ static int          lat_stamp = 0;                   // -t: stamp receive time into traffic
+ static int          open_logins = 0;                 // -o: accept any name and password
+ static int          local_sock = -1;                 // -l: listening socket for local clients
+ static pthread_attr_t client_thread_attr;            // Small stacks for per-client threads
+ 
+ // Traffic capture (-r); see capture_frame
+ static FILE        *capture_file = NULL;
+ static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+ static unsigned int capture_next_id = 1;
+ static unsigned long capture_last_us = 0;            // Time of the previous record
+ 
+ // Offline mailboxes (-m); see mailbox_store.  Guarded by the global mutex.
+ static mailbox_t     mailboxes[MAILBOX_USERS];       // Open addressing on hash_name(user)
+ static FILE         *mailbox_spool_file = NULL;      // Spool file, NULL if mailboxes are off
+ static char          mailbox_path[PATH_MAX];
+ static unsigned long mailbox_spool_bytes = 0;        // Size of the spool file
+ static unsigned long mailbox_spool_base = 0;         // ... after the last rewrite
+ static int           mailbox_compact_due = 0;        // Spool outgrew its last rewrite
+ static int           mailbox_rewriting = 0;          // A rewrite is being written out
+ static spool_buf_t   mailbox_tail;                   // Records spooled during that rewrite
+ 
+ // Message search (-s); see search_request
+ static int               search_on = 0;
+ static pthread_mutex_t   search_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the pending queue
+ static pthread_cond_t    search_cond = PTHREAD_COND_INITIALIZER;   // Wakes the indexer
+ static search_pending_t *search_pending = NULL;      // Newest first
+ static int               search_num_pending = 0;
+ static pthread_rwlock_t  search_segs_lock = PTHREAD_RWLOCK_INITIALIZER; // Guards the segment list
+ static search_seg_t     *search_segs = NULL;         // Newest first
+ static uint32_t          search_next_doc = 0;        // Indexer only
+ static uint32_t          search_num_docs = 0;        // Indexer only
+ 
+ // Server-wide counters for the admin endpoint.  The data path updates them
+ // with relaxed atomics; readers never lock.
+ static struct {
+     atomic_ulong connections;         // TCP connections accepted
+     atomic_ulong logins;
+     atomic_ulong login_failures;
+     atomic_long  clients;             // Currently logged in
+     atomic_ulong frames_in;
+     atomic_ulong bytes_in;
+     atomic_ulong frames_out;
+     atomic_ulong bytes_out;
+     atomic_ulong messages;            // MESSAGE frames fanned out
+     atomic_ulong queue_drops;         // Frames dropped by a full outbound lane
+     atomic_ulong throttled;           // Frames shed by rate limiting
+     atomic_ulong kicks;
+     atomic_long  queued[2];           // Frames in outbound lanes, per lane
+     atomic_long  writers;             // Running writer threads
+     atomic_ulong busy_ns[2];          // Time spent handling frames: readers, writers
+     atomic_ulong lock_acquired;       // Global mutex acquisitions
+     atomic_ulong lock_contended;      // ... that had to wait
+     lat_hist_t   lock_wait;           // Wait time of contended acquisitions
+     atomic_long  mem[MEM_KINDS];      // Heap bytes per subsystem
+     atomic_ulong zip_bytes_in;        // Wire bytes of compressed connections
+     atomic_ulong zip_bytes_out;
+     atomic_ulong local_logins[2];     // Logins over the Unix socket: plain, shared memory
+     atomic_ulong shm_wakeups;         // eventfd writes to shared-memory clients
+     atomic_ulong window_batches;      // Coalescing windows released
+     atomic_ulong window_frames;       // Frames they carried
+     atomic_ulong mailbox_stored;      // Frames kept for offline users
+     atomic_ulong mailbox_delivered;   // ... handed to them on login
+     atomic_ulong mailbox_dropped;     // ... lost to a full mailbox
+     atomic_ulong search_indexed;      // Messages added to the search index
+     atomic_ulong search_skipped;      // ... not added because the indexer lagged
+     atomic_ulong search_merges;       // Segment merges
+     atomic_ulong searches;
+ } stats;
+ 
+ #define STAT_ADD(field, n) atomic_fetch_add_explicit(&stats.field, (n), memory_order_relaxed)
+ #define STAT_GET(field)    atomic_load_explicit(&stats.field, memory_order_relaxed)
+ 
+ // Epoch-based reclamation state (see rcu_read_lock)
+ typedef struct retired {
+     void *ptr;
+     void (*destroy)(void *);
+     unsigned long epoch;              // Epoch at which ptr was unpublished
+     struct retired *next;
+ } retired_t;
+ static atomic_ulong rcu_epoch = 1;
+ static atomic_ulong rcu_reader_epoch[RCU_MAX_READERS]; // 0 when the slot is not reading
+ static atomic_int   rcu_slot_used[RCU_MAX_READERS];
+ static atomic_int   rcu_slots_high = 0;              // Slots ever claimed are below this
+ static __thread int rcu_slot = -1;                   // This thread's reader slot
+ static retired_t   *rcu_retired = NULL;              // Guarded by the global mutex
+ static int          rcu_retired_count = 0;           // Length of rcu_retired
+ static int presence_watchers[MAX_CLIENTS];           // Slots with presence_sub set
+ static int num_presence_watchers = 0;
+ 
+ // Slab allocators, indexed by SLAB_*
+ static slab_t slabs[SLAB_KINDS] = {
+     { "frames",  sizeof(outframe_t),   PTHREAD_MUTEX_INITIALIZER },
+     { "retired", sizeof(retired_t),    PTHREAD_MUTEX_INITIALIZER },
+     { "topics",  sizeof(topic_node_t), PTHREAD_MUTEX_INITIALIZER },
+     { "latency", sizeof(lat_set_t),    PTHREAD_MUTEX_INITIALIZER },
+ };
+ static __thread slab_cache_t slab_cache[SLAB_KINDS];
+ static __thread int slab_registered = 0;             // Thread has a slab_key value
+ static pthread_key_t  slab_key;                      // Flushes caches at thread exit
+ static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
  
  // A simple, hard-coded user database
  typedef struct {
@@ -100,400 +619,5439 @@
  // For thread-safety, we use a mutex to guard shared data structures
  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
  
- // --------------------- UTILITY FUNCTIONS ---------------------
+ // Live upgrade state.  Writing to upgrade_pipe wakes every thread that reads
+ // from a socket so it can park at a frame boundary before the handoff.
+ static int  upgrade_pipe[2] = { -1, -1 };
+ static int  upgrade_requested = 0;
+ static int  live_threads = 0;       // Socket-reading threads (clients + accept loop)
+ static int  parked_threads = 0;     // Of those, how many are parked for the upgrade
+ static pthread_mutex_t upgrade_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t  upgrade_cond = PTHREAD_COND_INITIALIZER;
+ 
+ // Handoff record tags (one SOCK_SEQPACKET packet per record)
+ #define HANDOFF_MAGIC   0x434F4E46u  // "CONF"
+ #define HANDOFF_VERSION 1
+ #define HO_HELLO    1
+ #define HO_LISTEN   2   // carries the listening socket
+ #define HO_SESSION  3
+ #define HO_CLIENT   4   // carries the client socket
+ #define HO_END      5
+ #define HO_SUBSCRIPTION 6
+ #define HO_PRESENCE_SUB 7
+ #define HO_PRESENCE_VERSION 8
+ #define HO_LISTEN_LOCAL 9   // carries the Unix listening socket (-l)
+ #define TAKEOVER_FAILED -2  // takeover_state: a server answered but kept running
+ 
+ void *client_thread(void *arg);
+ void park_for_upgrade(void);
+ void thread_started(void);
+ void thread_finished(void);
+ int  send_to_client(int idx, struct message *msg);
+ void window_release(int sidx);
+ void mailbox_session(int sidx, const struct message *msg);
+ void mailbox_unaway(int m);
+ void presence_user_added(const char *clientID);
+ void presence_user_removed(const char *clientID);
+ void presence_membership(const char *clientID, const char *sessionID,
+                          int members, int joined);
+ void presence_watch(int idx, int on);
+ void presence_batch_begin(void);
+ void presence_batch_end(void);
+ void bucket_init(token_bucket_t *b, double burst);
+ int  outq_start(int idx);
+ void outq_stop(int idx);
+ lat_set_t *lat_set_new(void);
+ void lat_set_put(lat_set_t *s);
+ void lat_set_release(void *s);
+ void global_lock(void);
+ void rcu_retire(void *ptr, void (*destroy)(void *));
+ void capture_flush(void);
+ void mailbox_flush(void);
+ 
+ // --------------------- SLAB ALLOCATOR ---------------------
+ //
+ // Objects that churn with traffic -- queued frames, retire records, topic
+ // nodes and session latency sets -- come from per-type slabs rather than
+ // malloc.  Each thread caches a few free objects of every type and trades
+ // them with the type's depot in batches, so queueing a broadcast copy
+ // usually takes no lock at all.  Memory is carved in SLAB_CHUNK blocks and
+ // never given back: once the server has seen its peak load, churn reuses
+ // the same objects and the footprint stays flat.
  
  /**
-  * Send a struct message to the given socket.
+  * Objects moved per trade between a thread cache and the depot.
   */
- int send_message(int sockfd, struct message *msg) {
-     int total = sizeof(struct message);
-     int sent = 0, n;
-     while (sent < total) {
-         n = write(sockfd, ((char*)msg) + sent, total - sent);
-         if (n <= 0) {
-             perror("send_message write");
-             return -1;
+ static int slab_batch(const slab_t *s) {
+     int n = SLAB_CACHE_BYTES / s->size;
+     return n < 1 ? 1 : (n > SLAB_MAX_BATCH ? SLAB_MAX_BATCH : n);
+ }
+ 
+ /**
+  * Return every object cached by the exiting thread to the depots.
+  */
+ static void slab_thread_flush(void *unused) {
+     (void)unused;
+     for (int k = 0; k < SLAB_KINDS; k++) {
+         slab_cache_t *c = &slab_cache[k];
+         if (!c->head) {
+             continue;
          }
-         sent += n;
+         slab_obj_t *tail = c->head;
+         while (tail->next) {
+             tail = tail->next;
+         }
+         pthread_mutex_lock(&slabs[k].lock);
+         tail->next = slabs[k].depot;
+         slabs[k].depot = c->head;
+         pthread_mutex_unlock(&slabs[k].lock);
+         c->head = NULL;
+         c->count = 0;
      }
-     return 0;
+ }
+ 
+ static void slab_make_key(void) {
+     pthread_key_create(&slab_key, slab_thread_flush);
  }
  
  /**
-  * Receive a struct message from the given socket.
+  * Arrange for slab_thread_flush to run when the calling thread exits.
+  * Needed by threads that only free, too (writers free every frame).
   */
- int recv_message(int sockfd, struct message *msg) {
-     int total = sizeof(struct message);
-     int recvd = 0, n;
-     while (recvd < total) {
-         n = read(sockfd, ((char*)msg) + recvd, total - recvd);
-         if (n <= 0) {
-             return -1;
+ static void slab_register_thread(void) {
+     pthread_once(&slab_key_once, slab_make_key);
+     pthread_setspecific(slab_key, slab_cache);  // any non-NULL value runs the destructor
+     slab_registered = 1;
+ }
+ 
+ /**
+  * Move up to one batch from the depot of 'kind' into this thread's cache,
+  * carving a new chunk when the depot is empty.
+  */
+ static void slab_refill(int kind) {
+     slab_t *s = &slabs[kind];
+     slab_cache_t *c = &slab_cache[kind];
+     if (!slab_registered) {
+         slab_register_thread();
+     }
+     int batch = slab_batch(s);
+     pthread_mutex_lock(&s->lock);
+     if (!s->depot) {
+         size_t size = (s->size + 15) & ~(size_t)15;
+         size_t chunk = size > SLAB_CHUNK ? size : SLAB_CHUNK;
+         char *mem = malloc(chunk);
+         if (mem) {
+             atomic_fetch_add(&s->chunk_bytes, chunk);
+             for (size_t off = 0; off + size <= chunk; off += size) {
+                 slab_obj_t *o = (slab_obj_t *)(mem + off);
+                 o->next = s->depot;
+                 s->depot = o;
+             }
          }
-         recvd += n;
      }
-     return 0;
+     while (s->depot && c->count < batch) {
+         slab_obj_t *o = s->depot;
+         s->depot = o->next;
+         o->next = c->head;
+         c->head = o;
+         c->count++;
+     }
+     pthread_mutex_unlock(&s->lock);
  }
  
  /**
-  * Check if username/password is in our user_db.
-  * Return 1 if valid, 0 if invalid.
+  * Allocate an uninitialized object of type 'kind' (SLAB_*), or NULL.
   */
- int authenticate_user(const char *username, const char *password) {
-     for (int i = 0; user_db[i].username[0] != '\0'; i++) {
-         if (strcmp(user_db[i].username, username) == 0 &&
-             strcmp(user_db[i].password, password) == 0) {
-             return 1;
+ void *slab_alloc(int kind) {
+     slab_cache_t *c = &slab_cache[kind];
+     if (!c->head) {
+         slab_refill(kind);
+         if (!c->head) {
+             return NULL;
          }
      }
-     return 0;
+     slab_obj_t *o = c->head;
+     c->head = o->next;
+     c->count--;
+     atomic_fetch_add_explicit(&slabs[kind].live, 1, memory_order_relaxed);
+     return o;
  }
  
  /**
-  * Find an available client slot (or -1 if none).
+  * Allocate a zero-filled object of type 'kind', or NULL.
   */
- int find_free_client_slot() {
-     for (int i = 0; i < MAX_CLIENTS; i++) {
-         if (!clients[i].active) {
-             return i;
-         }
+ void *slab_zalloc(int kind) {
+     void *p = slab_alloc(kind);
+     if (p) {
+         memset(p, 0, slabs[kind].size);
      }
-     return -1;
+     return p;
  }
  
  /**
-  * Find a client slot by client ID (return index or -1).
+  * Give an object back.  Any thread may free what another allocated; a
+  * cache holding two batches hands one to the depot.
   */
- int find_client_by_id(const char *clientID) {
-     for (int i = 0; i < MAX_CLIENTS; i++) {
-         if (clients[i].active &&
-             strcmp(clients[i].clientID, clientID) == 0) {
-             return i;
+ void slab_free(int kind, void *ptr) {
+     if (!ptr) {
+         return;
+     }
+     if (!slab_registered) {
+         slab_register_thread();
+     }
+     slab_t *s = &slabs[kind];
+     slab_cache_t *c = &slab_cache[kind];
+     slab_obj_t *o = ptr;
+     o->next = c->head;
+     c->head = o;
+     c->count++;
+     atomic_fetch_add_explicit(&s->live, -1, memory_order_relaxed);
+     int batch = slab_batch(s);
+     if (c->count >= 2 * batch) {
+         slab_obj_t *first = c->head;
+         slab_obj_t *last = first;
+         for (int i = 1; i < batch; i++) {
+             last = last->next;
          }
+         c->head = last->next;
+         c->count -= batch;
+         pthread_mutex_lock(&s->lock);
+         last->next = s->depot;
+         s->depot = first;
+         pthread_mutex_unlock(&s->lock);
      }
-     return -1;
  }
  
+ // --------------------- CONNECTION ARENAS ---------------------
+ //
+ // Scratch memory a reader needs while it handles one frame (listing text,
+ // for now) is bump-allocated from its connection's arena and released all
+ // at once by arena_reset() before the next frame.  The first ARENA_BLOCK
+ // block is kept across frames; larger one-off blocks are freed.
+ 
  /**
-  * Find a session by sessionID (return index or -1 if not found).
+  * Allocate 'n' bytes that stay valid until the next arena_reset().
   */
- int find_session(const char *sessionID) {
-     for (int i = 0; i < num_sessions; i++) {
-         if (strcmp(sessions[i].sessionID, sessionID) == 0) {
-             return i;
+ void *arena_alloc(arena_t *a, size_t n) {
+     n = (n + 15) & ~(size_t)15;
+     arena_block_t *b = a->head;
+     if (!b || b->size - b->used < n) {
+         size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+         b = malloc(sizeof(*b) + size);
+         if (!b) {
+             return NULL;
          }
+         b->size = size;
+         b->used = 0;
+         b->next = a->head;
+         a->head = b;
      }
-     return -1;
+     void *p = b->data + b->used;
+     b->used += n;
+     return p;
  }
  
  /**
-  * Create a new session (return index or -1 on error).
+  * Release everything allocated since the last reset.
   */
- int create_session(const char *sessionID) {
-     if (num_sessions >= MAX_SESSIONS) {
-         return -1;
+ void arena_reset(arena_t *a) {
+     arena_block_t *keep = NULL;
+     while (a->head) {
+         arena_block_t *b = a->head;
+         a->head = b->next;
+         if (!keep && b->size == ARENA_BLOCK) {
+             keep = b;
+         } else {
+             free(b);
+         }
      }
-     if (find_session(sessionID) != -1) {
-         return -1;  // already exists
+     if (keep) {
+         keep->used = 0;
+         keep->next = NULL;
      }
-     strncpy(sessions[num_sessions].sessionID, sessionID, MAX_NAME - 1);
-     sessions[num_sessions].num_members = 0;
-     num_sessions++;
-     return (num_sessions - 1);
+     a->head = keep;
  }
  
  /**
-  * Add a client to a session (returns 0 on success, -1 on error).
+  * Free the arena's memory when the connection goes away.
   */
- int add_client_to_session(const char *clientID, const char *sessionID) {
-     int sidx = find_session(sessionID);
-     if (sidx < 0) {
-         return -1; // session not found
+ void arena_destroy(arena_t *a) {
+     arena_reset(a);
+     free(a->head);
+     a->head = NULL;
+ }
+ 
+ // --------------------- COMPRESSION ---------------------
+ //
+ // A client that asks for it at login gets one raw deflate stream per
+ // direction for the rest of the connection (see chatzip.h).  Chat traffic
+ // is mostly zero padding and repeated names, so even small windows shrink
+ // it several times over.  zlib's allocations go through zconn_alloc so the
+ // admin endpoint can report them.
+ 
+ static voidpf zconn_alloc(voidpf opaque, uInt items, uInt size) {
+     (void)opaque;
+     size_t n = (size_t)items * size;
+     size_t *p = malloc(sizeof(size_t) + n);
+     if (!p) {
+         return Z_NULL;
      }
-     session_t *sess = &sessions[sidx];
-     for (int i = 0; i < sess->num_members; i++) {
-         if (strcmp(sess->members[i], clientID) == 0) {
-             return 0; // already a member, do nothing
-         }
+     *p = n;
+     STAT_ADD(mem[MEM_ZIP], (long)n);
+     return p + 1;
+ }
+ 
+ static void zconn_release(voidpf opaque, voidpf ptr) {
+     (void)opaque;
+     size_t *p = (size_t *)ptr - 1;
+     STAT_ADD(mem[MEM_ZIP], -(long)*p);
+     free(p);
+ }
+ 
+ /**
+  * Set up compression for a client that asked for 'mode' at login.  Returns
+  * NULL if we do not offer that mode or zlib fails; the client then stays
+  * uncompressed.
+  */
+ zconn_t *zconn_new(const char *mode) {
+     int dict;
+     if (strcmp(mode, ZIP_MODE) == 0) {
+         dict = 0;
+     } else if (strcmp(mode, ZIP_MODE_DICT) == 0) {
+         dict = 1;
+     } else {
+         return NULL;
      }
-     if (sess->num_members < MAX_CLIENTS) {
-         strncpy(sess->members[sess->num_members], clientID, MAX_NAME - 1);
-         sess->num_members++;
-         return 0;
+     zconn_t *z = zconn_alloc(NULL, 1, sizeof(*z));
+     if (!z) {
+         return NULL;
      }
-     return -1;
+     memset(z, 0, sizeof(*z));
+     z->in.zalloc = z->out.zalloc = zconn_alloc;
+     z->in.zfree = z->out.zfree = zconn_release;
+     if (inflateInit2(&z->in, -ZIP_WINDOW_BITS) != Z_OK) {
+         zconn_release(NULL, z);
+         return NULL;
+     }
+     if (deflateInit2(&z->out, DEFLATE_LEVEL, Z_DEFLATED, -ZIP_WINDOW_BITS,
+                      DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+         inflateEnd(&z->in);
+         zconn_release(NULL, z);
+         return NULL;
+     }
+     if (dict) {
+         inflateSetDictionary(&z->in, (const Bytef *)zip_dict, sizeof(zip_dict) - 1);
+         deflateSetDictionary(&z->out, (const Bytef *)zip_dict, sizeof(zip_dict) - 1);
+     }
+     z->dict = dict;
+     return z;
+ }
+ 
+ void zconn_free(zconn_t *z) {
+     if (!z) {
+         return;
+     }
+     inflateEnd(&z->in);
+     deflateEnd(&z->out);
+     zconn_release(NULL, z);
  }
  
  /**
-  * Remove a client from a session.
+  * Read compressed bytes from 'fd' into the input buffer.  Only called once
+  * the previous read has been inflated.  Returns -1 on EOF or error.
   */
- void remove_client_from_session(const char *clientID, const char *sessionID) {
-     int sidx = find_session(sessionID);
-     if (sidx < 0) {
-         return;
+ int zconn_read(int fd, zconn_t *z) {
+     int n = read(fd, z->in_buf, sizeof(z->in_buf));
+     if (n <= 0) {
+         return -1;
      }
-     session_t *sess = &sessions[sidx];
-     int found_index = -1;
-     for (int i = 0; i < sess->num_members; i++) {
-         if (strcmp(sess->members[i], clientID) == 0) {
-             found_index = i;
-             break;
-         }
+     z->in.next_in = z->in_buf;
+     z->in.avail_in = n;
+     z->wire_in += n;
+     STAT_ADD(zip_bytes_in, n);
+     return 0;
+ }
+ 
+ /**
+  * Inflate buffered input into up to 'room' bytes at 'dst'.  Returns the
+  * bytes produced, which may be 0 if the input ended mid-block, or -1 if
+  * the stream is corrupt or was ended by the client.
+  */
+ int zconn_inflate(zconn_t *z, unsigned char *dst, int room) {
+     uInt avail = z->in.avail_in;
+     z->in.next_out = dst;
+     z->in.avail_out = room;
+     int rc = inflate(&z->in, Z_SYNC_FLUSH);
+     if (rc != Z_OK && rc != Z_BUF_ERROR) {
+         return -1;
      }
-     if (found_index != -1) {
-         for (int i = found_index; i < sess->num_members - 1; i++) {
-             strcpy(sess->members[i], sess->members[i + 1]);
-         }
-         sess->num_members--;
+     int got = room - (int)z->in.avail_out;
+     if (got == 0 && z->in.avail_in == avail) {
+         return -1;  // no progress with input and room left
      }
-     if (sess->num_members == 0) {
-         for (int i = sidx; i < num_sessions - 1; i++) {
-             sessions[i] = sessions[i + 1];
+     return got;
+ }
+ 
+ static int zconn_send(int fd, zconn_t *z, const void *buf, size_t len) {
+     const char *p = buf;
+     while (len > 0) {
+         ssize_t w = write(fd, p, len);
+         if (w < 0 && errno == EINTR) {
+             continue;
          }
-         num_sessions--;
+         if (w <= 0) {
+             return -1;
+         }
+         p += w;
+         len -= w;
+         z->wire_out += w;
+         STAT_ADD(zip_bytes_out, w);
      }
+     return 0;
  }
  
  /**
-  * Broadcast a message to all clients in the given session.
+  * Write a batch of encoded frames to a compressed client, flushing the
+  * stream once at the end so the client can decode all of them.  LO_ACK
+  * goes out plain because the client switches only after reading it; it
+  * is always the first frame a client gets.  Returns 0, or -1 if the
+  * socket failed.
   */
- void broadcast_message(const char *sessionID, struct message *msg) {
-     int sidx = find_session(sessionID);
-     if (sidx < 0) {
+ int zconn_write(int fd, zconn_t *z, outframe_t **batch, int n) {
+     unsigned char out[DEFLATE_OUT_BUF];
+     int pending = 0;
+     z->out.next_out = out;
+     z->out.avail_out = sizeof(out);
+     for (int i = 0; i < n; i++) {
+         if (chat_wire_type(&batch[i]->msg) == LO_ACK) {
+             if (zconn_send(fd, z, &batch[i]->msg, sizeof(struct message)) < 0) {
+                 return -1;
+             }
+             continue;
+         }
+         z->out.next_in = (Bytef *)&batch[i]->msg;
+         z->out.avail_in = sizeof(struct message);
+         pending = 1;
+         while (z->out.avail_in > 0) {
+             deflate(&z->out, Z_NO_FLUSH);
+             if (z->out.avail_out == 0) {
+                 if (zconn_send(fd, z, out, sizeof(out)) < 0) {
+                     return -1;
+                 }
+                 z->out.next_out = out;
+                 z->out.avail_out = sizeof(out);
+             }
+         }
+     }
+     while (pending) {
+         deflate(&z->out, Z_SYNC_FLUSH);
+         pending = (z->out.avail_out == 0);  // more output may follow
+         if (zconn_send(fd, z, out, sizeof(out) - z->out.avail_out) < 0) {
+             return -1;
+         }
+         z->out.next_out = out;
+         z->out.avail_out = sizeof(out);
+     }
+     return 0;
+ }
+ 
+ // --------------------- SHARED-MEMORY TRANSPORT ---------------------
+ //
+ // A client on the local socket (-l) may ask at login to exchange frames
+ // through two SPSC rings in shared memory (see chatshm.h).  As with
+ // compression, the reader thread owns one direction ('up') and the writer
+ // the other ('down'), so neither takes a lock.  Each sleeps on its own
+ // eventfd only when its ring is empty or full, and the client writes that
+ // eventfd only when it sees the sleeper's flag.
+ 
+ void shmconn_free(shmconn_t *s) {
+     if (!s) {
          return;
      }
-     session_t *sess = &sessions[sidx];
-     for (int i = 0; i < sess->num_members; i++) {
-         int cidx = find_client_by_id(sess->members[i]);
-         if (cidx >= 0) {
-             send_message(clients[cidx].sockfd, msg);
+     if (s->area) {
+         munmap(s->area, sizeof(chat_shm_t));
+         STAT_ADD(mem[MEM_SHM], -(long)sizeof(chat_shm_t));
+     }
+     for (int i = 0; i < SHM_FDS; i++) {
+         if (s->fd[i] >= 0) {
+             close(s->fd[i]);
          }
      }
+     free(s);
  }
  
  /**
-  * Build a list of all connected clients and sessions for QU_ACK.
+  * Set up the rings and eventfds for a local client that asked for
+  * SHM_MODE at login.  Returns NULL if that fails; the client then stays
+  * on the socket.
   */
- void build_list(char *outbuf, int outbuf_size) {
-     char tmp[1024];
-     memset(tmp, 0, sizeof(tmp));
- 
-     strcat(tmp, "Users:\n");
-     for (int i = 0; i < MAX_CLIENTS; i++) {
-         if (clients[i].active) {
-             strcat(tmp, "  ");
-             strcat(tmp, clients[i].clientID);
-             strcat(tmp, "\n");
+ shmconn_t *shmconn_new(void) {
+     static atomic_uint serial;
+     shmconn_t *s = malloc(sizeof(*s));
+     if (!s) {
+         return NULL;
+     }
+     s->area = NULL;
+     for (int i = 0; i < SHM_FDS; i++) {
+         s->fd[i] = -1;
+     }
+     char name[64];
+     snprintf(name, sizeof(name), "/chat-shm-%d-%u", (int)getpid(), atomic_fetch_add(&serial, 1));
+     s->fd[SHM_FD_AREA] = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+     if (s->fd[SHM_FD_AREA] < 0) {
+         perror("shm_open");
+         shmconn_free(s);
+         return NULL;
+     }
+     shm_unlink(name);  // from now on only reachable through the descriptor
+     void *area = MAP_FAILED;
+     if (ftruncate(s->fd[SHM_FD_AREA], sizeof(chat_shm_t)) == 0) {
+         area = mmap(NULL, sizeof(chat_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     s->fd[SHM_FD_AREA], 0);
+     }
+     if (area == MAP_FAILED) {
+         perror("shared-memory rings");
+         shmconn_free(s);
+         return NULL;
+     }
+     s->area = area;  // zero-filled: both rings empty, nobody waiting
+     STAT_ADD(mem[MEM_SHM], (long)sizeof(chat_shm_t));
+     for (int i = SHM_FD_CLIENT; i < SHM_FDS; i++) {
+         s->fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+         if (s->fd[i] < 0) {
+             perror("eventfd");
+             shmconn_free(s);
+             return NULL;
          }
      }
+     s->area->magic = SHM_MAGIC;
+     s->area->frame_size = CHAT_WIRE_SIZE;
+     return s;
+ }
  
-     strcat(tmp, "\nSessions:\n");
-     for (int i = 0; i < num_sessions; i++) {
-         char line[256];
-         snprintf(line, sizeof(line), "  %s (%d members)\n",
-                  sessions[i].sessionID, sessions[i].num_members);
-         strcat(tmp, line);
+ static void shm_kick(int efd) {
+     uint64_t one = 1;
+     if (write(efd, &one, sizeof(one)) == sizeof(one)) {
+         STAT_ADD(shm_wakeups, 1);
      }
+ }
  
-     strncpy(outbuf, tmp, outbuf_size - 1);
+ static void shm_drain(int efd) {
+     uint64_t count;
+     ssize_t n = read(efd, &count, sizeof(count));  // resets the counter; EAGAIN if already 0
+     (void)n;
  }
  
- // --------------------- INACTIVITY MONITOR THREAD ---------------------
+ /**
+  * Send the encoded LO_ACK 'ack' with the area and eventfds attached, then
+  * drop our descriptor of the area.  Returns 0, or -1 if the socket failed.
+  */
+ static int shm_handover(int sockfd, shmconn_t *s, const struct message *ack) {
+     union {
+         struct cmsghdr hdr;
+         char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+     } ctl;
+     memset(&ctl, 0, sizeof(ctl));
+     struct iovec iov = { (void *)ack, sizeof(*ack) };
+     struct msghdr mh;
+     memset(&mh, 0, sizeof(mh));
+     mh.msg_iov = &iov;
+     mh.msg_iovlen = 1;
+     mh.msg_control = ctl.buf;
+     mh.msg_controllen = sizeof(ctl.buf);
+     struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+     cm->cmsg_level = SOL_SOCKET;
+     cm->cmsg_type = SCM_RIGHTS;
+     cm->cmsg_len = CMSG_LEN(SHM_FDS * sizeof(int));
+     memcpy(CMSG_DATA(cm), s->fd, SHM_FDS * sizeof(int));
+     ssize_t n;
+     do {
+         n = sendmsg(sockfd, &mh, MSG_NOSIGNAL);
+     } while (n < 0 && errno == EINTR);
+     size_t sent = n > 0 ? n : 0;
+     while (n > 0 && sent < sizeof(*ack)) {  // the descriptors went with the first byte
+         n = send(sockfd, (const char *)ack + sent, sizeof(*ack) - sent, MSG_NOSIGNAL);
+         sent += n > 0 ? n : 0;
+     }
+     if (n <= 0) {
+         return -1;
+     }
+     close(s->fd[SHM_FD_AREA]);
+     s->fd[SHM_FD_AREA] = -1;
+     return 0;
+ }
  
- void *inactivity_monitor(void *arg) {
-     while (1) {
-         sleep(5);  // Check every 5 seconds
-         pthread_mutex_lock(&mutex);
-         time_t now = time(NULL);
-         for (int i = 0; i < MAX_CLIENTS; i++) {
-             if (clients[i].active) {
-                 if (difftime(now, clients[i].last_active) > INACTIVITY_THRESHOLD) {
-                     printf("Disconnecting client '%s' due to inactivity.\n", clients[i].clientID);
-                     for (int j = 0; j < clients[i].session_count; j++) {
-                         remove_client_from_session(clients[i].clientID, clients[i].sessions[j]);
-                     }
-                     clients[i].session_count = 0;
-                     close(clients[i].sockfd);
-                     clients[i].active = 0;
-                 }
+ /**
+  * Writer of slot 'idx': sleep until the client has taken frames from the
+  * full 'down' ring.  Returns 0, or -1 if the client hung up or the writer
+  * is being stopped.
+  */
+ static int shm_wait_room(int idx, chat_ring_t *r) {
+     client_t *c = &clients[idx];
+     while (chat_ring_sleep_producer(r)) {
+         struct pollfd pfd[2];
+         pfd[0].fd = c->shm->fd[SHM_FD_WRITER];
+         pfd[0].events = POLLIN;
+         pfd[1].fd = c->sockfd;        // carries nothing once the rings are in use
+         pfd[1].events = POLLIN;
+         if (poll(pfd, 2, SHM_WAIT_MS) < 0) {
+             if (errno == EINTR) {
+                 continue;  // revents are not set
              }
+             return -1;
+         }
+         if (pfd[1].revents) {
+             return -1;
+         }
+         if (pfd[0].revents & POLLIN) {
+             shm_drain(pfd[0].fd);
+         }
+         pthread_mutex_lock(&out_lock[idx]);
+         int closing = c->out_closing;
+         pthread_mutex_unlock(&out_lock[idx]);
+         if (closing) {
+             return -1;
          }
-         pthread_mutex_unlock(&mutex);
      }
-     return NULL;
+     return 0;
+ }
+ 
+ /**
+  * Write a batch of encoded frames to the shared-memory client in slot
+  * 'idx'.  The LO_ACK, always its first frame, goes over the socket with
+  * the descriptors attached; everything else goes into the 'down' ring.
+  * Returns 0, or -1 if the client is gone.
+  */
+ int shm_write(int idx, outframe_t **batch, int n) {
+     shmconn_t *s = clients[idx].shm;
+     chat_ring_t *r = &s->area->down;
+     for (int i = 0; i < n; i++) {
+         if (s->fd[SHM_FD_AREA] >= 0 && chat_wire_type(&batch[i]->msg) == LO_ACK) {
+             if (shm_handover(clients[idx].sockfd, s, &batch[i]->msg) < 0) {
+                 return -1;
+             }
+             continue;
+         }
+         while (chat_ring_put(r, &batch[i]->msg) < 0) {
+             if (chat_ring_wake_consumer(r)) {
+                 shm_kick(s->fd[SHM_FD_CLIENT]);
+             }
+             if (shm_wait_room(idx, r) < 0) {
+                 return -1;
+             }
+         }
+     }
+     if (chat_ring_wake_consumer(r)) {
+         shm_kick(s->fd[SHM_FD_CLIENT]);
+     }
+     return 0;
+ }
+ 
+ /**
+  * Reader of slot 'idx': move the next frame of the 'up' ring, still
+  * encoded, into the slot's rx buffer, sleeping while the ring is empty.
+  * Returns like recv_client_message.
+  */
+ int shm_read(int idx) {
+     client_t *c = &clients[idx];
+     shmconn_t *s = c->shm;
+     chat_ring_t *r = &s->area->up;
+     int hung_up = 0;
+     while (!chat_ring_get(r, c->rx_buf)) {
+         if (!chat_ring_sleep_consumer(r)) {
+             continue;  // a frame arrived meanwhile
+         }
+         if (hung_up) {
+             return -1;  // after reading everything the client sent
+         }
+         struct pollfd pfd[3];
+         pfd[0].fd = s->fd[SHM_FD_READER];
+         pfd[0].events = POLLIN;
+         pfd[1].fd = c->sockfd;
+         pfd[1].events = POLLIN;
+         pfd[2].fd = upgrade_pipe[0];
+         pfd[2].events = POLLIN;
+         if (poll(pfd, 3, -1) < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return -1;
+         }
+         if (pfd[2].revents & POLLIN) {
+             return 1;
+         }
+         if (pfd[0].revents & POLLIN) {
+             shm_drain(pfd[0].fd);
+         }
+         hung_up = pfd[1].revents != 0;
+     }
+     if (chat_ring_wake_producer(r)) {
+         shm_kick(s->fd[SHM_FD_CLIENT]);
+     }
+     return 0;
+ }
+ 
+ // --------------------- UTILITY FUNCTIONS ---------------------
+ 
+ /**
+  * Send a struct message to the given socket.  'msg' is encoded in place.
+  */
+ int send_message(int sockfd, struct message *msg) {
+     int total = sizeof(struct message);
+     chat_encode(msg);
+     int sent = 0, n;
+     while (sent < total) {
+         n = write(sockfd, ((char*)msg) + sent, total - sent);
+         if (n <= 0) {
+             perror("send_message write");
+             return -1;
+         }
+         sent += n;
+     }
+     return 0;
+ }
+ 
+ /**
+  * Remove the request ID trailer from 'msg' and return the ID (0 if none).
+  * It is stripped so that relayed traffic does not carry the sender's ID.
+  */
+ unsigned int req_id_take(struct message *msg) {
+     unsigned char *p = msg->data + REQ_ID_OFF;
+     if (memcmp(p, "\0RQI", 4) != 0) {
+         return 0;
+     }
+     unsigned int id = (unsigned int)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+     memset(p, 0, REQ_ID_LEN);
+     return id;
+ }
+ 
+ void req_id_put(struct message *msg, unsigned int id) {
+     if (id == 0) {
+         return;
+     }
+     unsigned char *p = msg->data + REQ_ID_OFF;
+     memcpy(p, "\0RQI", 4);
+     p[4] = id >> 24;
+     p[5] = id >> 16;
+     p[6] = id >> 8;
+     p[7] = id;
+ }
+ 
+ /**
+  * Queue a reply for slot 'idx' to the frame its reader is handling,
+  * tagged with that frame's request ID.  Reply text must end before
+  * REQ_ID_OFF.
+  */
+ int send_reply(int idx, struct message *msg) {
+     req_id_put(msg, reply_id);
+     return send_to_client(idx, msg);
+ }
+ 
+ /**
+  * Receive the next frame for client slot 'idx'.  Bytes accumulate in the
+  * slot's rx buffer so a partially received frame survives an upgrade, and
+  * a complete frame is decoded where it lies: '*msg' points into the rx
+  * buffer and stays valid until the next call.  Returns 0 on a complete
+  * frame, -1 on disconnect, and 1 if an upgrade asked this thread to stop
+  * reading.
+  */
+ int recv_client_message(int idx, struct message **msg) {
+     client_t *c = &clients[idx];
+     int total = sizeof(struct message);
+     if (c->shm) {
+         int rc = shm_read(idx);
+         if (rc == 0) {
+             *msg = chat_decode(c->rx_buf);
+         }
+         return rc;
+     }
+     while (c->rx_len < total) {
+         if (c->z && c->z->in.avail_in > 0) {
+             int got = zconn_inflate(c->z, c->rx_buf + c->rx_len, total - c->rx_len);
+             if (got < 0) {
+                 return -1;
+             }
+             c->rx_len += got;
+             continue;
+         }
+         struct pollfd pfd[2];
+         pfd[0].fd = c->sockfd;
+         pfd[0].events = POLLIN;
+         pfd[1].fd = upgrade_pipe[0];
+         pfd[1].events = POLLIN;
+         if (poll(pfd, 2, -1) < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             return -1;
+         }
+         if (pfd[1].revents & POLLIN) {
+             return 1;
+         }
+         if (pfd[0].revents & POLLNVAL) {
+             return -1;
+         }
+         if (c->z) {
+             if (zconn_read(c->sockfd, c->z) < 0) {
+                 return -1;
+             }
+             continue;
+         }
+         int n = read(c->sockfd, c->rx_buf + c->rx_len, total - c->rx_len);
+         if (n <= 0) {
+             return -1;
+         }
+         c->rx_len += n;
+     }
+     *msg = chat_decode(c->rx_buf);
+     c->rx_len = 0;
+     return 0;
+ }
+ 
+ /**
+  * Check if username/password is in our user_db.
+  * Return 1 if valid, 0 if invalid.
+  */
+ int authenticate_user(const char *username, const char *password) {
+     if (open_logins) {
+         return username[0] != '\0';  // load testing only
+     }
+     for (int i = 0; user_db[i].username[0] != '\0'; i++) {
+         if (strcmp(user_db[i].username, username) == 0 &&
+             strcmp(user_db[i].password, password) == 0) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * Check if 'username' is in our user_db.
+  */
+ int user_exists(const char *username) {
+     for (int i = 0; user_db[i].username[0] != '\0'; i++) {
+         if (strcmp(user_db[i].username, username) == 0) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * Find an available client slot (or -1 if none).
+  */
+ int find_free_client_slot() {
+     for (int i = 0; i < MAX_CLIENTS; i++) {
+         if (!client_hot.active[i] && !client_hot.thread_running[i]) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ /**
+  * FNV-1a hash of a client or session name.
+  */
+ unsigned int hash_name(const char *name) {
+     unsigned int h = 2166136261u;
+     while (*name) {
+         h ^= (unsigned char)*name++;
+         h *= 16777619u;
+     }
+     return h;
+ }
+ 
+ /**
+  * Empty the clientID index.
+  */
+ void init_client_index(void) {
+     for (int i = 0; i < CLIENT_HASH_SIZE; i++) {
+         client_hash[i] = -1;
+     }
+ }
+ 
+ /**
+  * Add a logged-in client slot to the clientID index.
+  */
+ void index_client(int idx) {
+     STAT_ADD(clients, 1);
+     unsigned int h = hash_name(clients[idx].clientID);
+     unsigned int b = h & (CLIENT_HASH_SIZE - 1);
+     client_hot.name_hash[idx] = h;
+     client_hot.hash_next[idx] = client_hash[b];
+     client_hash[b] = idx;
+     presence_user_added(clients[idx].clientID);
+ }
+ 
+ /**
+  * Remove a client slot from the clientID index.
+  */
+ void unindex_client(int idx) {
+     unsigned int b = hash_name(clients[idx].clientID) & (CLIENT_HASH_SIZE - 1);
+     for (int *p = &client_hash[b]; *p != -1; p = &client_hot.hash_next[*p]) {
+         if (*p == idx) {
+             *p = client_hot.hash_next[idx];
+             STAT_ADD(clients, -1);
+             presence_user_removed(clients[idx].clientID);
+             return;
+         }
+     }
+ }
+ 
+ /**
+  * Find a client slot by client ID (return index or -1).
+  */
+ int find_client_by_id(const char *clientID) {
+     unsigned int h = hash_name(clientID);
+     for (int i = client_hash[h & (CLIENT_HASH_SIZE - 1)]; i != -1; i = client_hot.hash_next[i]) {
+         if (client_hot.name_hash[i] == h && client_hot.active[i] &&
+             strcmp(clients[i].clientID, clientID) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ /**
+  * Find a session by sessionID (return index or -1 if not found).
+  */
+ int find_session(const char *sessionID) {
+     unsigned int h = hash_name(sessionID);
+     for (int i = 0; i < num_sessions; i++) {
+         if (session_hot.name_hash[i] == h && strcmp(sessions[i].sessionID, sessionID) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ /**
+  * Create a new session (return index or -1 on error).
+  */
+ int create_session(const char *sessionID) {
+     if (num_sessions >= MAX_SESSIONS) {
+         return -1;
+     }
+     if (find_session(sessionID) != -1) {
+         return -1;  // already exists
+     }
+     memset(&sessions[num_sessions], 0, sizeof(session_t));
+     strncpy(sessions[num_sessions].sessionID, sessionID, MAX_NAME - 1);
+     bucket_init(&sessions[num_sessions].fanout, FANOUT_BYTES_BURST);
+     sessions[num_sessions].lat = lat_set_new();
+     session_hot.name_hash[num_sessions] = hash_name(sessionID);
+     session_hot.num_members[num_sessions] = 0;
+     num_sessions++;
+     return (num_sessions - 1);
+ }
+ 
+ /**
+  * Delete session 'sidx'; the last session takes its place.
+  */
+ static void destroy_session(int sidx) {
+     rcu_retire(sessions[sidx].lat, lat_set_release);  // presence snapshots may still point to it
+     free(sessions[sidx].held);  // away members lose the session with it
+     int last = num_sessions - 1;
+     if (sidx != last) {
+         sessions[sidx] = sessions[last];
+         session_hot.name_hash[sidx] = session_hot.name_hash[last];
+         session_hot.num_members[sidx] = session_hot.num_members[last];
+         memcpy(session_hot.members[sidx], session_hot.members[last],
+                session_hot.num_members[last] * sizeof(int));
+     }
+     num_sessions--;
+ }
+ 
+ /**
+  * Add a logged-in client to a session (returns 0 on success, -1 on error).
+  */
+ int add_client_to_session(const char *clientID, const char *sessionID) {
+     int sidx = find_session(sessionID);
+     int cidx = find_client_by_id(clientID);
+     if (sidx < 0 || cidx < 0) {
+         return -1; // session or client not found
+     }
+     int *members = session_hot.members[sidx];
+     int n = session_hot.num_members[sidx];
+     for (int i = 0; i < n; i++) {
+         if (members[i] == cidx) {
+             return 0; // already a member, do nothing
+         }
+     }
+     if (n < MAX_CLIENTS) {
+         window_release(sidx);  // held frames predate this member
+         members[n] = cidx;
+         session_hot.num_members[sidx] = n + 1;
+         presence_membership(clientID, sessionID, n + 1, 1);
+         return 0;
+     }
+     return -1;
+ }
+ 
+ /**
+  * Remove a client from a session.  A session left empty is deleted.
+  */
+ void remove_client_from_session(const char *clientID, const char *sessionID) {
+     int sidx = find_session(sessionID);
+     if (sidx < 0) {
+         return;
+     }
+     int cidx = find_client_by_id(clientID);
+     int *members = session_hot.members[sidx];
+     int n = session_hot.num_members[sidx];
+     for (int i = 0; cidx >= 0 && i < n; i++) {
+         if (members[i] == cidx) {
+             window_release(sidx);  // the leaving member still gets what it was sent
+             memmove(&members[i], &members[i + 1], (n - i - 1) * sizeof(int));
+             session_hot.num_members[sidx] = --n;
+             presence_membership(clientID, sessionID, n, 0);
+             break;
+         }
+     }
+     if (n == 0) {
+         destroy_session(sidx);
+     }
+ }
+ 
+ // --------------------- TOPIC SUBSCRIPTIONS ---------------------
+ //
+ // Session names may be hierarchical ("alerts.db.primary").  Clients can
+ // subscribe to patterns where '*' matches exactly one level and a trailing
+ // '#' matches any number of remaining levels.  Patterns live in a trie so
+ // matching a topic costs time proportional to its depth, not to the number
+ // of subscriptions.
+ 
+ /**
+  * Split a topic or pattern into its '.'-separated levels.
+  * Returns the number of levels, or -1 if a level is empty or too many.
+  */
+ int split_topic(const char *name, char levels[][MAX_NAME], int max_levels) {
+     int n = 0;
+     const char *p = name;
+     while (1) {
+         const char *dot = strchr(p, '.');
+         size_t len = dot ? (size_t)(dot - p) : strlen(p);
+         if (len == 0 || len >= MAX_NAME || n >= max_levels) {
+             return -1;
+         }
+         memcpy(levels[n], p, len);
+         levels[n][len] = '\0';
+         n++;
+         if (!dot) {
+             return n;
+         }
+         p = dot + 1;
+     }
+ }
+ 
+ static unsigned int topic_edge_bucket(const topic_node_t *parent, const char *level) {
+     return (hash_name(level) ^ (unsigned int)((uintptr_t)parent >> 4) * 2654435761u)
+            & (TOPIC_HASH_SIZE - 1);
+ }
+ 
+ /**
+  * Find (or create) the child of 'parent' for one pattern level.
+  */
+ topic_node_t *topic_child(topic_node_t *parent, const char *level, int create) {
+     if (strcmp(level, "*") == 0 || strcmp(level, "#") == 0) {
+         topic_node_t **slot = (level[0] == '*') ? &parent->star : &parent->hash;
+         if (*slot == NULL && create) {
+             *slot = slab_zalloc(SLAB_TOPIC);
+             if (*slot) {
+                 STAT_ADD(mem[MEM_TOPICS], sizeof(topic_node_t));
+                 strcpy((*slot)->level, level);
+                 (*slot)->parent = parent;
+                 parent->num_children++;
+             }
+         }
+         return *slot;
+     }
+     unsigned int b = topic_edge_bucket(parent, level);
+     for (topic_node_t *n = topic_edges[b]; n; n = n->edge_next) {
+         if (n->parent == parent && strcmp(n->level, level) == 0) {
+             return n;
+         }
+     }
+     if (!create) {
+         return NULL;
+     }
+     topic_node_t *n = slab_zalloc(SLAB_TOPIC);
+     if (!n) {
+         return NULL;
+     }
+     STAT_ADD(mem[MEM_TOPICS], sizeof(topic_node_t));
+     strcpy(n->level, level);
+     n->parent = parent;
+     n->edge_next = topic_edges[b];
+     topic_edges[b] = n;
+     parent->num_children++;
+     return n;
+ }
+ 
+ /**
+  * Free trie nodes that no longer hold subscribers or children.
+  */
+ void topic_prune(topic_node_t *n) {
+     while (n != &topic_root && n->num_subs == 0 && n->num_children == 0) {
+         topic_node_t *parent = n->parent;
+         if (parent->star == n) {
+             parent->star = NULL;
+         } else if (parent->hash == n) {
+             parent->hash = NULL;
+         } else {
+             unsigned int b = topic_edge_bucket(parent, n->level);
+             for (topic_node_t **p = &topic_edges[b]; *p; p = &(*p)->edge_next) {
+                 if (*p == n) {
+                     *p = n->edge_next;
+                     break;
+                 }
+             }
+         }
+         parent->num_children--;
+         STAT_ADD(mem[MEM_TOPICS], -(long)(sizeof(topic_node_t) + n->cap_subs * sizeof(int)));
+         free(n->subs);
+         slab_free(SLAB_TOPIC, n);
+         n = parent;
+     }
+ }
+ 
+ /**
+  * Validate a subscription pattern and return its trie node.
+  */
+ topic_node_t *topic_lookup(const char *pattern, int create) {
+     char levels[MAX_TOPIC_DEPTH][MAX_NAME];
+     int n = split_topic(pattern, levels, MAX_TOPIC_DEPTH);
+     if (n < 0) {
+         return NULL;
+     }
+     topic_node_t *node = &topic_root;
+     for (int i = 0; i < n && node; i++) {
+         if (strcmp(levels[i], "#") == 0 && i != n - 1) {
+             return NULL;  // '#' is only valid as the last level
+         }
+         if ((strchr(levels[i], '*') || strchr(levels[i], '#')) &&
+             strlen(levels[i]) != 1) {
+             return NULL;  // wildcards must be a whole level
+         }
+         node = topic_child(node, levels[i], create);
+     }
+     return node;
+ }
+ 
+ /**
+  * Subscribe client slot 'idx' to 'pattern' (0 on success, -1 on error).
+  */
+ int topic_subscribe(int idx, const char *pattern) {
+     client_t *c = &clients[idx];
+     for (int i = 0; i < c->sub_count; i++) {
+         if (strcmp(c->subs[i], pattern) == 0) {
+             return 0;  // already subscribed
+         }
+     }
+     if (c->sub_count >= MAX_SUBS) {
+         return -1;
+     }
+     topic_node_t *node = topic_lookup(pattern, 1);
+     if (!node) {
+         return -1;
+     }
+     if (node->num_subs == node->cap_subs) {
+         int cap = node->cap_subs ? node->cap_subs * 2 : 4;
+         int *subs = realloc(node->subs, cap * sizeof(int));
+         if (!subs) {
+             topic_prune(node);
+             return -1;
+         }
+         STAT_ADD(mem[MEM_TOPICS], (long)(cap - node->cap_subs) * sizeof(int));
+         node->subs = subs;
+         node->cap_subs = cap;
+     }
+     node->subs[node->num_subs++] = idx;
+     strncpy(c->subs[c->sub_count++], pattern, MAX_NAME - 1);
+     return 0;
+ }
+ 
+ /**
+  * Remove client slot 'idx' from 'pattern' (0 on success, -1 if absent).
+  */
+ int topic_unsubscribe(int idx, const char *pattern) {
+     client_t *c = &clients[idx];
+     int found = -1;
+     for (int i = 0; i < c->sub_count; i++) {
+         if (strcmp(c->subs[i], pattern) == 0) {
+             found = i;
+             break;
+         }
+     }
+     if (found < 0) {
+         return -1;
+     }
+     for (int i = found; i < c->sub_count - 1; i++) {
+         strcpy(c->subs[i], c->subs[i + 1]);
+     }
+     c->sub_count--;
+ 
+     topic_node_t *node = topic_lookup(pattern, 0);
+     if (!node) {
+         return 0;
+     }
+     for (int i = 0; i < node->num_subs; i++) {
+         if (node->subs[i] == idx) {
+             node->subs[i] = node->subs[--node->num_subs];
+             break;
+         }
+     }
+     topic_prune(node);
+     return 0;
+ }
+ 
+ /**
+  * Send 'msg' to every subscriber of a node that has not been sent a copy
+  * of this message yet (deliver_mark == deliver_epoch).
+  */
+ static void topic_deliver_node(topic_node_t *node, struct message *msg) {
+     for (int i = 0; i < node->num_subs; i++) {
+         int cidx = node->subs[i];
+         if (client_hot.active[cidx] && client_hot.deliver_mark[cidx] != deliver_epoch) {
+             client_hot.deliver_mark[cidx] = deliver_epoch;
+             send_to_client(cidx, msg);
+         }
+     }
+ }
+ 
+ static void topic_deliver_walk(topic_node_t *node, char levels[][MAX_NAME],
+                                int n, int depth, struct message *msg) {
+     if (node->hash) {
+         topic_deliver_node(node->hash, msg);
+     }
+     if (depth == n) {
+         topic_deliver_node(node, msg);
+         return;
+     }
+     topic_node_t *child = topic_child(node, levels[depth], 0);
+     if (child) {
+         topic_deliver_walk(child, levels, n, depth + 1, msg);
+     }
+     if (node->star) {
+         topic_deliver_walk(node->star, levels, n, depth + 1, msg);
+     }
+ }
+ 
+ /**
+  * Deliver 'msg' to all subscribers whose pattern matches 'topic'.
+  */
+ void topic_deliver(const char *topic, struct message *msg) {
+     char levels[MAX_TOPIC_DEPTH][MAX_NAME];
+     int n = split_topic(topic, levels, MAX_TOPIC_DEPTH);
+     if (n < 0 || (topic_root.num_children == 0)) {
+         return;
+     }
+     topic_deliver_walk(&topic_root, levels, n, 0, msg);
+ }
+ 
+ /**
+  * Drop everything a departing client holds: session memberships,
+  * subscriptions and its clientID index entry.  Does not close the socket.
+  */
+ void release_client(int idx) {
+     client_t *c = &clients[idx];
+     for (int i = 0; i < c->session_count; i++) {
+         remove_client_from_session(c->clientID, c->sessions[i]);
+     }
+     c->session_count = 0;
+     while (c->sub_count > 0) {
+         topic_unsubscribe(idx, c->subs[c->sub_count - 1]);
+     }
+     presence_watch(idx, 0);
+     unindex_client(idx);
+     client_hot.active[idx] = 0;
+ }
+ 
+ /**
+  * Send 'msg' to the members of a session and its topic subscribers that
+  * the current delivery (deliver_epoch) has not reached yet.
+  */
+ static void deliver_session(const char *sessionID, struct message *msg) {
+     int sidx = find_session(sessionID);
+     if (sidx >= 0) {
+         const int *members = session_hot.members[sidx];
+         for (int i = 0; i < session_hot.num_members[sidx]; i++) {
+             int cidx = members[i];
+             if (client_hot.deliver_mark[cidx] != deliver_epoch) {
+                 client_hot.deliver_mark[cidx] = deliver_epoch;
+                 send_to_client(cidx, msg);
+             }
+         }
+         mailbox_session(sidx, msg);
+     }
+     topic_deliver(sessionID, msg);
+ }
+ 
+ /**
+  * Broadcast a message to all clients in the given session and to every
+  * client subscribed to a matching topic pattern.  Each recipient gets
+  * exactly one copy.
+  */
+ void broadcast_message(const char *sessionID, struct message *msg) {
+     deliver_epoch++;
+     deliver_session(sessionID, msg);
+ }
+ 
+ /**
+  * Broadcast one message to several sessions.  A recipient reached through
+  * more than one of them still gets a single copy, whose session field
+  * names the first listed session that reached it.
+  */
+ void multicast_message(char targets[][MAX_NAME], int n, struct message *msg) {
+     for (int t = 0; t < n; t++) {
+         int sidx = find_session(targets[t]);
+         if (sidx >= 0) {
+             window_release(sidx);  // keep the order of each session's traffic
+         }
+     }
+     deliver_epoch++;
+     for (int t = 0; t < n; t++) {
+         memset(msg->session, 0, MAX_NAME);
+         strcpy((char*)msg->session, targets[t]);
+         deliver_session(targets[t], msg);
+     }
+ }
+ 
+ /**
+  * Split a CROSSPOST body, "<session> <session>...\n<text>", into its
+  * target sessions (duplicates dropped) and leave only the text in
+  * msg->data, ahead of any latency stamp.  Returns the number of targets,
+  * or -1 if the frame is malformed.
+  */
+ int crosspost_parse(struct message *msg, char targets[][MAX_NAME]) {
+     char *data = (char*)msg->data;
+     char *text = memchr(data, '\n', REQ_ID_OFF);
+     if (!text) {
+         return -1;
+     }
+     *text++ = '\0';
+     int n = 0;
+     char *save = NULL;
+     for (char *name = strtok_r(data, " \t\r", &save); name;
+          name = strtok_r(NULL, " \t\r", &save)) {
+         if (n == CROSSPOST_MAX || strlen(name) >= MAX_NAME) {
+             return -1;
+         }
+         int dup = 0;
+         for (int i = 0; i < n && !dup; i++) {
+             dup = (strcmp(targets[i], name) == 0);
+         }
+         if (!dup) {
+             strcpy(targets[n++], name);
+         }
+     }
+     size_t len = strnlen(text, REQ_ID_OFF - (text - data));
+     memmove(data, text, len);
+     memset(data + len, 0, REQ_ID_OFF - len);
+     msg->size = len;
+     return n > 0 ? n : -1;
+ }
+ 
+ // --------------------- EPOCH-BASED RECLAMATION ---------------------
+ //
+ // Read-mostly state (presence listing, session rosters) is published as
+ // immutable snapshots behind an atomic pointer.  Readers announce the
+ // current epoch in their slot, use the snapshot, then clear the slot; they
+ // never block and never take a lock.  Writers (holding the global mutex)
+ // swap in a new version and retire the old one, which is freed once no
+ // reader announced an epoch at or before its retirement.  Retired objects
+ // are reclaimed in batches, and a pass only looks at the slots below the
+ // high-water mark of readers that ever existed at once.
+ 
+ static int rcu_claim_slot(void) {
+     while (1) {
+         for (int i = 0; i < RCU_MAX_READERS; i++) {
+             int expected = 0;
+             if (atomic_compare_exchange_strong(&rcu_slot_used[i], &expected, 1)) {
+                 // Raised before the slot announces an epoch, so a reclaim
+                 // pass that misses the slot also misses what it reads.
+                 int high = atomic_load(&rcu_slots_high);
+                 while (high <= i) {
+                     if (atomic_compare_exchange_weak(&rcu_slots_high, &high, i + 1)) {
+                         break;
+                     }
+                 }
+                 return i;
+             }
+         }
+         sched_yield();  // every slot busy, wait for a thread to exit
+     }
+ }
+ 
+ /**
+  * Enter a read-side critical section.  Snapshots loaded after this call
+  * stay valid until rcu_read_unlock().  Not reentrant.
+  */
+ void rcu_read_lock(void) {
+     if (rcu_slot < 0) {
+         rcu_slot = rcu_claim_slot();
+     }
+     atomic_store(&rcu_reader_epoch[rcu_slot], atomic_load(&rcu_epoch));
+ }
+ 
+ void rcu_read_unlock(void) {
+     atomic_store(&rcu_reader_epoch[rcu_slot], 0);
+ }
+ 
+ /**
+  * Give up the calling thread's reader slot (call before a reader exits).
+  */
+ void rcu_thread_exit(void) {
+     if (rcu_slot >= 0) {
+         atomic_store(&rcu_reader_epoch[rcu_slot], 0);
+         atomic_store(&rcu_slot_used[rcu_slot], 0);
+         rcu_slot = -1;
+     }
+ }
+ 
+ /**
+  * Free retired objects that no reader can still see.  Global mutex held.
+  */
+ static void rcu_reclaim(void) {
+     unsigned long oldest = ULONG_MAX;
+     int high = atomic_load(&rcu_slots_high);
+     for (int i = 0; i < high; i++) {
+         unsigned long e = atomic_load(&rcu_reader_epoch[i]);
+         if (e != 0 && e < oldest) {
+             oldest = e;
+         }
+     }
+     retired_t **pp = &rcu_retired;
+     while (*pp) {
+         retired_t *r = *pp;
+         if (r->epoch < oldest) {
+             *pp = r->next;
+             r->destroy(r->ptr);
+             slab_free(SLAB_RETIRED, r);
+             rcu_retired_count--;
+         } else {
+             pp = &r->next;
+         }
+     }
+ }
+ 
+ /**
+  * Pass 'ptr' to 'destroy' once all current readers are done with it.  Call
+  * after the object has been unpublished, with the global mutex held.
+  */
+ void rcu_retire(void *ptr, void (*destroy)(void *)) {
+     if (!ptr) {
+         return;
+     }
+     retired_t *r = slab_alloc(SLAB_RETIRED);
+     if (!r) {
+         return;  // leak rather than free under a reader
+     }
+     r->ptr = ptr;
+     r->destroy = destroy;
+     r->epoch = atomic_fetch_add(&rcu_epoch, 1);
+     r->next = rcu_retired;
+     rcu_retired = r;
+     if (++rcu_retired_count >= RCU_RECLAIM_BATCH) {
+         rcu_reclaim();
+     }
+ }
+ 
+ // --------------------- PRESENCE SNAPSHOTS ---------------------
+ //
+ // The user/session listing served to QUERY is kept as an immutable,
+ // versioned snapshot.  Login, logout, join and leave each publish a new
+ // version derived from the previous one, so QUERY and membership checks
+ // never walk the client and session tables and never take a lock.  Clients that
+ // enable PRESENCE_SUB receive each change as a PRESENCE delta instead of
+ // polling with QUERY.
+ //
+ // Users and sessions are kept sorted by name, which doubles as the prefix
+ // index for paginated queries: a page costs O(log n + page size).  Loading
+ // many changes at once (a takeover) is batched into a single version.
+ 
+ /**
+  * Index of the first entry whose name is >= 'key' (binary search).
+  */
+ static int presence_lower_bound(const presence_entry_t *e, int n, const char *key) {
+     int lo = 0, hi = n;
+     while (lo < hi) {
+         int mid = (lo + hi) / 2;
+         if (strcmp(e[mid].name, key) < 0) {
+             lo = mid + 1;
+         } else {
+             hi = mid;
+         }
+     }
+     return lo;
+ }
+ 
+ static int presence_find(const presence_entry_t *e, int n, const char *name) {
+     int i = presence_lower_bound(e, n, name);
+     return (i < n && strcmp(e[i].name, name) == 0) ? i : -1;
+ }
+ 
+ /**
+  * Parse the QUERY payload.  An empty payload asks for the full listing;
+  * otherwise it holds space-separated tokens:
+  *   users | sessions | all      which list(s) to page through (default all)
+  *   prefix=<p>                  only names starting with <p>
+  *   after=<cursor>              resume after a "next:" cursor of a prior page
+  *   limit=<n>                   entries per page
+  * Returns 0 on success, -1 on a malformed query.
+  */
+ int parse_query(const char *data, query_t *q) {
+     memset(q, 0, sizeof(*q));
+     q->kinds = QUERY_USERS | QUERY_SESSIONS;
+     if (data[0] == '\0') {
+         return 0;  // full listing, no limit
+     }
+     q->limit = QUERY_DEFAULT_LIMIT;
+ 
+     char buf[MAX_DATA];
+     strncpy(buf, data, MAX_DATA - 1);
+     buf[MAX_DATA - 1] = '\0';
+     char *save = NULL;
+     for (char *tok = strtok_r(buf, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+         if (strcmp(tok, "users") == 0) {
+             q->kinds = QUERY_USERS;
+         } else if (strcmp(tok, "sessions") == 0) {
+             q->kinds = QUERY_SESSIONS;
+         } else if (strcmp(tok, "all") == 0) {
+             q->kinds = QUERY_USERS | QUERY_SESSIONS;
+         } else if (strncmp(tok, "prefix=", 7) == 0 && strlen(tok + 7) < MAX_NAME) {
+             strcpy(q->prefix, tok + 7);
+         } else if (strncmp(tok, "after=", 6) == 0 && strlen(tok + 6) >= 2 &&
+                    strlen(tok + 8) < MAX_NAME && tok[7] == ':' &&
+                    (tok[6] == 'u' || tok[6] == 's')) {
+             q->after_kind = (tok[6] == 'u') ? QUERY_USERS : QUERY_SESSIONS;
+             strcpy(q->after, tok + 8);
+         } else if (strncmp(tok, "limit=", 6) == 0 && atoi(tok + 6) > 0) {
+             q->limit = atoi(tok + 6);
+             if (q->limit > QUERY_MAX_LIMIT) {
+                 q->limit = QUERY_MAX_LIMIT;
+             }
+         } else {
+             return -1;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * First entry of one list that belongs on the page, or n if none.
+  */
+ static int query_start(const presence_entry_t *e, int n, const query_t *q, int kind) {
+     int i;
+     if (q->after_kind == kind) {
+         i = presence_lower_bound(e, n, q->after);
+         if (i < n && strcmp(e[i].name, q->after) == 0) {
+             i++;  // cursors are exclusive
+         }
+         if (strcmp(q->prefix, q->after) > 0) {
+             i = presence_lower_bound(e, n, q->prefix);
+         }
+     } else {
+         i = presence_lower_bound(e, n, q->prefix);
+     }
+     size_t plen = strlen(q->prefix);
+     return (i < n && strncmp(e[i].name, q->prefix, plen) == 0) ? i : n;
+ }
+ 
+ /**
+  * Render one page of a snapshot into 'out' (QU_ACK format).  When more
+  * entries remain, the last line is "next: <cursor>".
+  * Returns the length written, not counting the terminating NUL.
+  */
+ size_t build_list(const presence_snap_t *p, const query_t *q, char *out, size_t cap) {
+     size_t len = 0;
+     #define LIST_APPEND(...) \
+         do { \
+             int n_ = snprintf(out + len, cap - len, __VA_ARGS__); \
+             len = (n_ < 0 || (size_t)n_ >= cap - len) ? cap - 1 : len + n_; \
+         } while (0)
+ 
+     size_t plen = strlen(q->prefix);
+     int budget = q->limit ? q->limit : -1;
+     out[0] = '\0';
+ 
+     for (int kind = QUERY_USERS; kind <= QUERY_SESSIONS; kind <<= 1) {
+         if (!(q->kinds & kind) || (kind == QUERY_USERS && q->after_kind == QUERY_SESSIONS)) {
+             continue;
+         }
+         const presence_list_t *l = (kind == QUERY_USERS) ? p->users : p->sessions;
+         const presence_entry_t *e = l->entries;
+         int n = l->count;
+         int i = query_start(e, n, q, kind);
+ 
+         if (budget == 0) {
+             break;
+         }
+         if (q->after_kind != kind || q->after[0] == '\0') {
+             LIST_APPEND("%s%s:\n", len ? "\n" : "", kind == QUERY_USERS ? "Users" : "Sessions");
+         }
+         for (; i < n && strncmp(e[i].name, q->prefix, plen) == 0; i++) {
+             if (budget == 0) {
+                 LIST_APPEND("next: %c:%s\n", kind == QUERY_USERS ? 'u' : 's', e[i - 1].name);
+                 return len;
+             }
+             if (kind == QUERY_USERS) {
+                 LIST_APPEND("  %s\n", e[i].name);
+             } else {
+                 LIST_APPEND("  %s (%d members)\n", e[i].name, e[i].members);
+             }
+             if (budget > 0) {
+                 budget--;
+             }
+         }
+         if (budget == 0 && kind == QUERY_USERS && (q->kinds & QUERY_SESSIONS) &&
+             query_start(p->sessions->entries, p->sessions->count, q, QUERY_SESSIONS) <
+             p->sessions->count) {
+             // Page filled exactly at the end of the user list.
+             LIST_APPEND("next: s:\n");
+             return len;
+         }
+     }
+     #undef LIST_APPEND
+     return len;
+ }
+ 
+ /**
+  * Allocate a list with room for 'count' entries.
+  */
+ static presence_list_t *presence_list_alloc(int count) {
+     size_t size = sizeof(presence_list_t) + count * sizeof(presence_entry_t);
+     presence_list_t *l = malloc(size);
+     if (!l) {
+         return NULL;
+     }
+     STAT_ADD(mem[MEM_PRESENCE], size);
+     l->count = count;
+     return l;
+ }
+ 
+ static void presence_list_free(void *ptr) {
+     presence_list_t *l = ptr;
+     if (l) {
+         STAT_ADD(mem[MEM_PRESENCE], -(long)(sizeof(*l) + l->count * sizeof(presence_entry_t)));
+         free(l);
+     }
+ }
+ 
+ static void presence_free(void *ptr) {
+     STAT_ADD(mem[MEM_PRESENCE], -(long)sizeof(presence_snap_t));
+     free(ptr);
+ }
+ 
+ static size_t roster_size(int count) {
+     return sizeof(roster_t) + (count ? count : 1) * MAX_NAME;
+ }
+ 
+ static void roster_free(void *ptr) {
+     roster_t *r = ptr;
+     if (r) {
+         STAT_ADD(mem[MEM_PRESENCE], -(long)roster_size(r->count));
+         free(r);
+     }
+ }
+ 
+ /**
+  * Current snapshot.  Call inside rcu_read_lock()/rcu_read_unlock(), or
+  * with the global mutex held.
+  */
+ const presence_snap_t *presence_snapshot(void) {
+     return atomic_load(&presence_current);
+ }
+ 
+ /**
+  * Lock-free check whether 'clientID' is a member of 'sessionID'.
+  */
+ int presence_is_member(const char *clientID, const char *sessionID) {
+     rcu_read_lock();
+     const presence_list_t *l = presence_snapshot()->sessions;
+     int i = presence_find(l->entries, l->count, sessionID);
+     int member = 0;
+     if (i >= 0) {
+         const roster_t *r = l->entries[i].roster;
+         int lo = 0, hi = r->count;
+         while (lo < hi) {
+             int mid = (lo + hi) / 2;
+             int c = strcmp(r->names[mid], clientID);
+             if (c == 0) {
+                 member = 1;
+                 break;
+             }
+             if (c < 0) {
+                 lo = mid + 1;
+             } else {
+                 hi = mid;
+             }
+         }
+     }
+     rcu_read_unlock();
+     return member;
+ }
+ 
+ /**
+  * Publish a snapshot made of 'users' and 'sessions', and push 'delta' to
+  * watchers.  Either list may be the current snapshot's; a list it replaces
+  * is retired.  Returns 0, or -1 (nothing changed, the caller still owns
+  * the new lists).  Called with the global mutex held.
+  */
+ static int presence_publish(presence_list_t *users, presence_list_t *sessions,
+                             const char *delta) {
+     presence_snap_t *next = malloc(sizeof(*next));
+     if (!next) {
+         return -1;
+     }
+     STAT_ADD(mem[MEM_PRESENCE], sizeof(*next));
+     presence_snap_t *prev = presence_current;
+     next->version = prev ? prev->version + 1 : 1;
+     next->users = users;
+     next->sessions = sessions;
+ 
+     atomic_store(&presence_current, next);
+     if (prev) {
+         if (prev->users != users) {
+             rcu_retire(prev->users, presence_list_free);
+         }
+         if (prev->sessions != sessions) {
+             rcu_retire(prev->sessions, presence_list_free);
+         }
+         rcu_retire(prev, presence_free);
+     }
+ 
+     if (delta) {
+         struct message note;
+         memset(&note, 0, sizeof(note));
+         note.type = PRESENCE;
+         snprintf((char*)note.data, MAX_DATA, "%lu %s", next->version, delta);
+         note.size = strlen((char*)note.data);
+         for (int i = 0; i < num_presence_watchers; i++) {
+             send_to_client(presence_watchers[i], &note);
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * Create the initial, empty snapshot.
+  */
+ void presence_init(void) {
+     presence_publish(presence_list_alloc(0), presence_list_alloc(0), NULL);
+ }
+ 
+ /**
+  * Copy of 'cur' with one entry inserted at (or removed from) position
+  * 'at'.  'delta' is +1 to insert an uninitialized entry, -1 to remove
+  * one, or 0 for an unchanged copy.
+  */
+ static presence_list_t *presence_list_clone(const presence_list_t *cur, int at, int delta) {
+     presence_list_t *l = presence_list_alloc(cur->count + delta);
+     if (!l) {
+         return NULL;
+     }
+     const presence_entry_t *src = cur->entries;
+     memcpy(l->entries, src, at * sizeof(presence_entry_t));
+     if (delta >= 0) {
+         memcpy(l->entries + at + delta, src + at, (cur->count - at) * sizeof(presence_entry_t));
+     } else {
+         memcpy(l->entries + at, src + at + 1, (cur->count - at - 1) * sizeof(presence_entry_t));
+     }
+     return l;
+ }
+ 
+ void presence_user_added(const char *clientID) {
+     if (presence_batching) {
+         return;
+     }
+     const presence_list_t *cur = presence_current->users;
+     int i = presence_lower_bound(cur->entries, cur->count, clientID);
+     presence_list_t *users = presence_list_clone(cur, i, 1);
+     if (!users) {
+         return;
+     }
+     memset(&users->entries[i], 0, sizeof(presence_entry_t));
+     strncpy(users->entries[i].name, clientID, MAX_NAME - 1);
+     char delta[MAX_NAME + 16];
+     snprintf(delta, sizeof(delta), "login %s", clientID);
+     if (presence_publish(users, presence_current->sessions, delta) < 0) {
+         presence_list_free(users);
+     }
+ }
+ 
+ void presence_user_removed(const char *clientID) {
+     if (presence_batching) {
+         return;
+     }
+     const presence_list_t *cur = presence_current->users;
+     int i = presence_find(cur->entries, cur->count, clientID);
+     if (i < 0) {
+         return;
+     }
+     presence_list_t *users = presence_list_clone(cur, i, -1);
+     if (!users) {
+         return;
+     }
+     char delta[MAX_NAME + 16];
+     snprintf(delta, sizeof(delta), "logout %s", clientID);
+     if (presence_publish(users, presence_current->sessions, delta) < 0) {
+         presence_list_free(users);
+     }
+ }
+ 
+ /**
+  * Copy of 'old' (may be NULL) with 'clientID' inserted or removed.
+  */
+ static roster_t *roster_update(const roster_t *old, const char *clientID, int joined) {
+     int n = old ? old->count : 0;
+     int lo = 0, hi = n;
+     while (lo < hi) {
+         int mid = (lo + hi) / 2;
+         if (strcmp(old->names[mid], clientID) < 0) {
+             lo = mid + 1;
+         } else {
+             hi = mid;
+         }
+     }
+     int present = (lo < n && strcmp(old->names[lo], clientID) == 0);
+     int count = n + (joined ? !present : -present);
+     roster_t *r = malloc(roster_size(count));
+     if (!r) {
+         return NULL;
+     }
+     STAT_ADD(mem[MEM_PRESENCE], roster_size(count));
+     r->count = count;
+     if (n > 0) {
+         memcpy(r->names, old->names, lo * sizeof(r->names[0]));
+     }
+     if (joined && !present) {
+         memset(r->names[lo], 0, MAX_NAME);
+         strncpy(r->names[lo], clientID, MAX_NAME - 1);
+         memcpy(r->names + lo + 1, old->names + lo, (n - lo) * sizeof(r->names[0]));
+     } else if (!joined && present) {
+         memcpy(r->names + lo, old->names + lo + 1, (n - lo - 1) * sizeof(r->names[0]));
+     } else if (n > 0) {
+         memcpy(r->names + lo, old->names + lo, (n - lo) * sizeof(r->names[0]));
+     }
+     return r;
+ }
+ 
+ /**
+  * Record that 'clientID' joined (joined != 0) or left 'sessionID', which
+  * now has 'members' members.
+  */
+ void presence_membership(const char *clientID, const char *sessionID,
+                          int members, int joined) {
+     if (presence_batching) {
+         return;
+     }
+     const presence_list_t *cur = presence_current->sessions;
+     int i = presence_lower_bound(cur->entries, cur->count, sessionID);
+     int found = (i < cur->count && strcmp(cur->entries[i].name, sessionID) == 0);
+     const roster_t *old_roster = found ? cur->entries[i].roster : NULL;
+     roster_t *roster = NULL;
+     presence_list_t *list;
+     if (members > 0) {
+         roster = roster_update(old_roster, clientID, joined);
+         if (!roster) {
+             return;
+         }
+     }
+     if (!found && members > 0) {
+         list = presence_list_clone(cur, i, 1);
+         if (list) {
+             int sidx = find_session(sessionID);
+             memset(&list->entries[i], 0, sizeof(presence_entry_t));
+             strncpy(list->entries[i].name, sessionID, MAX_NAME - 1);
+             list->entries[i].stats = sidx >= 0 ? sessions[sidx].lat : NULL;
+         }
+     } else if (found && members == 0) {
+         list = presence_list_clone(cur, i, -1);
+     } else if (found) {
+         list = presence_list_clone(cur, i, 0);
+     } else {
+         return;
+     }
+     if (!list) {
+         roster_free(roster);
+         return;
+     }
+     if (members > 0) {
+         list->entries[i].members = members;
+         list->entries[i].roster = roster;
+     }
+     char delta[2 * MAX_NAME + 16];
+     snprintf(delta, sizeof(delta), "%s %s %s", joined ? "join" : "leave", clientID, sessionID);
+     if (presence_publish(presence_current->users, list, delta) < 0) {
+         presence_list_free(list);
+         roster_free(roster);
+         return;
+     }
+     rcu_retire((void *)old_roster, roster_free);
+ }
+ 
+ /**
+  * Stop publishing a version per change, for loading many changes at once.
+  * Until presence_batch_end() the snapshot lags the tables and watchers
+  * hear nothing.
+  */
+ void presence_batch_begin(void) {
+     presence_batching = 1;
+ }
+ 
+ static int presence_entry_cmp(const void *a, const void *b) {
+     return strcmp(((const presence_entry_t *)a)->name, ((const presence_entry_t *)b)->name);
+ }
+ 
+ static int roster_name_cmp(const void *a, const void *b) {
+     return strcmp(a, b);
+ }
+ 
+ /**
+  * Publish one version rebuilt from the client index and the session table,
+  * sorting each list once rather than copying it per change, and go back to
+  * publishing per change.  Watchers get no delta for it.
+  */
+ void presence_batch_end(void) {
+     presence_batching = 0;
+     int num_users = 0, num_listed = 0;
+     for (int b = 0; b < CLIENT_HASH_SIZE; b++) {
+         for (int i = client_hash[b]; i != -1; i = client_hot.hash_next[i]) {
+             num_users++;
+         }
+     }
+     for (int s = 0; s < num_sessions; s++) {
+         num_listed += session_hot.num_members[s] > 0;
+     }
+     presence_list_t *users = presence_list_alloc(num_users);
+     presence_list_t *list = presence_list_alloc(num_listed);
+     int built = 0;
+     if (users && list) {
+         int n = 0;
+         for (int b = 0; b < CLIENT_HASH_SIZE; b++) {
+             for (int i = client_hash[b]; i != -1; i = client_hot.hash_next[i]) {
+                 memset(&users->entries[n], 0, sizeof(presence_entry_t));
+                 strncpy(users->entries[n++].name, clients[i].clientID, MAX_NAME - 1);
+             }
+         }
+         for (int s = 0; s < num_sessions && built < num_listed; s++) {
+             int count = session_hot.num_members[s];
+             if (count == 0) {
+                 continue;
+             }
+             roster_t *r = malloc(roster_size(count));
+             if (!r) {
+                 break;
+             }
+             STAT_ADD(mem[MEM_PRESENCE], roster_size(count));
+             r->count = count;
+             for (int k = 0; k < count; k++) {
+                 memcpy(r->names[k], clients[session_hot.members[s][k]].clientID, MAX_NAME);
+             }
+             qsort(r->names, count, sizeof(r->names[0]), roster_name_cmp);
+             presence_entry_t *e = &list->entries[built++];
+             memset(e, 0, sizeof(*e));
+             strncpy(e->name, sessions[s].sessionID, MAX_NAME - 1);
+             e->members = count;
+             e->roster = r;
+             e->stats = sessions[s].lat;
+         }
+         qsort(users->entries, num_users, sizeof(presence_entry_t), presence_entry_cmp);
+         qsort(list->entries, built, sizeof(presence_entry_t), presence_entry_cmp);
+     }
+ 
+     // Reading the old session list keeps it, and so its rosters, from
+     // being reclaimed while they are retired.
+     rcu_read_lock();
+     const presence_list_t *old = presence_current->sessions;
+     if (users && list && built == num_listed && presence_publish(users, list, NULL) == 0) {
+         for (int i = 0; i < old->count; i++) {
+             rcu_retire((void *)old->entries[i].roster, roster_free);
+         }
+     } else {
+         for (int i = 0; i < built; i++) {
+             roster_free((void *)list->entries[i].roster);
+         }
+         presence_list_free(users);
+         presence_list_free(list);
+     }
+     rcu_read_unlock();
+ }
+ 
+ /**
+  * Turn presence deltas on or off for client slot 'idx'.
+  */
+ void presence_watch(int idx, int on) {
+     if (on && !clients[idx].presence_sub) {
+         presence_watchers[num_presence_watchers++] = idx;
+         clients[idx].presence_sub = 1;
+     } else if (!on && clients[idx].presence_sub) {
+         for (int i = 0; i < num_presence_watchers; i++) {
+             if (presence_watchers[i] == idx) {
+                 presence_watchers[i] = presence_watchers[--num_presence_watchers];
+                 break;
+             }
+         }
+         clients[idx].presence_sub = 0;
+     }
+ }
+ 
+ /**
+  * Send one page of the current snapshot.  Pages that do not fit in one
+  * frame are streamed as QU_PART frames cut at line boundaries, ending with
+  * QU_ACK.  Every frame carries the snapshot version in its session field.
+  * The page is rendered inside a read-side section; sending happens after.
+  * Runs on the reader of slot 'idx' (the text lives in its arena).
+  */
+ void send_listing(int idx, const query_t *q) {
+     rcu_read_lock();
+     const presence_snap_t *p = presence_snapshot();
+     unsigned long version = p->version;
+     int entries = (q->kinds & QUERY_USERS ? p->users->count : 0) +
+                   (q->kinds & QUERY_SESSIONS ? p->sessions->count : 0);
+     if (q->limit && q->limit < entries) {
+         entries = q->limit;
+     }
+     size_t cap = 64 + (entries + 1) * (MAX_NAME + 24);
+     char *text = arena_alloc(&clients[idx].arena, cap);  // freed by the next arena_reset
+     if (!text) {
+         rcu_read_unlock();
+         return;
+     }
+     size_t len = build_list(p, q, text, cap);
+     rcu_read_unlock();
+ 
+     struct message ack;
+     size_t off = 0;
+     do {
+         memset(&ack, 0, sizeof(ack));
+         snprintf((char*)ack.session, MAX_NAME, "%lu", version);
+         size_t chunk = len - off;
+         if (chunk > REQ_ID_OFF - 1) {
+             chunk = REQ_ID_OFF - 1;
+             while (chunk > 1 && text[off + chunk - 1] != '\n') {
+                 chunk--;
+             }
+         }
+         memcpy(ack.data, text + off, chunk);
+         ack.size = chunk;
+         off += chunk;
+         ack.type = (off < len) ? QU_PART : QU_ACK;
+         send_reply(idx, &ack);
+     } while (off < len);
+ }
+ 
+ // --------------------- RATE LIMITING ---------------------
+ //
+ // Each client has token buckets for traffic frames (MESSAGE, DIRECT) and
+ // their payload bytes; each session has a bucket for the bytes its
+ // fan-out writes across all members.  Traffic over budget is shed and the
+ // sender gets a THROTTLE notice (at most one per THROTTLE_NOTICE_GAP).
+ 
+ double now_seconds(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec + ts.tv_nsec / 1e9;
+ }
+ 
+ void bucket_init(token_bucket_t *b, double burst) {
+     b->tokens = burst;
+     b->last = now_seconds();
+ }
+ 
+ /**
+  * Refill a bucket for the time elapsed since its last use.
+  */
+ static void bucket_refill(token_bucket_t *b, double rate, double burst, double now) {
+     b->tokens += (now - b->last) * rate;
+     if (b->tokens > burst) {
+         b->tokens = burst;
+     }
+     b->last = now;
+ }
+ 
+ /**
+  * Tell a client it is being throttled, unless it was told very recently.
+  * Runs on the client's reader, so the notice answers the shed frame.
+  */
+ void send_throttle(int idx, const char *reason) {
+     double now = now_seconds();
+     if (now - clients[idx].last_throttle_notice < THROTTLE_NOTICE_GAP) {
+         return;
+     }
+     clients[idx].last_throttle_notice = now;
+     struct message note;
+     memset(&note, 0, sizeof(note));
+     note.type = THROTTLE;
+     strncpy((char*)note.data, reason, MAX_DATA - 1);
+     note.size = strlen((char*)note.data);
+     send_reply(idx, &note);
+ }
+ 
+ /**
+  * Charge a traffic frame to its sender's buckets.  Returns 1 if it may be
+  * routed, 0 if it must be shed.  Only the client's own thread calls this.
+  */
+ int rate_admit(int idx, const struct message *msg) {
+     client_t *c = &clients[idx];
+     double now = now_seconds();
+     double bytes = strnlen((const char*)msg->data, MAX_DATA);  // not msg->size, the sender's claim
+     bucket_refill(&c->msg_bucket, RATE_MSGS_PER_SEC, RATE_MSGS_BURST, now);
+     bucket_refill(&c->byte_bucket, RATE_BYTES_PER_SEC, RATE_BYTES_BURST, now);
+     if (c->msg_bucket.tokens < 1 || c->byte_bucket.tokens < bytes) {
+         c->throttled++;
+         STAT_ADD(throttled, 1);
+         send_throttle(idx, "Rate limit exceeded, message dropped");
+         return 0;
+     }
+     c->msg_bucket.tokens -= 1;
+     c->byte_bucket.tokens -= bytes;
+     return 1;
+ }
+ 
+ /**
+  * Charge one broadcast to a session's fan-out budget (global mutex held).
+  * Returns 1 if it may go out, 0 if the session is over budget.
+  */
+ int fanout_admit(const char *sessionID) {
+     int sidx = find_session(sessionID);
+     if (sidx < 0) {
+         return 1;  // subscriber-only topic, bounded by the senders' buckets
+     }
+     session_t *sess = &sessions[sidx];
+     double cost = (double)sizeof(struct message) * session_hot.num_members[sidx];
+     bucket_refill(&sess->fanout, FANOUT_BYTES_PER_SEC, FANOUT_BYTES_BURST, now_seconds());
+     // A broadcast costing more than the whole burst goes out when the bucket
+     // is full and is paid off as debt, so huge sessions slow down instead
+     // of going silent.
+     if (sess->fanout.tokens < cost && sess->fanout.tokens < FANOUT_BYTES_BURST) {
+         return 0;
+     }
+     sess->fanout.tokens -= cost;
+     return 1;
+ }
+ 
+ // --------------------- LATENCY TRACING ---------------------
+ //
+ // MESSAGE and DIRECT frames are timestamped when read.  The reader records
+ // how long it took to dispatch them and to queue every copy; each member's
+ // writer records how long its copy waited in the queue and when it was
+ // written.  Histograms are kept globally and per session and are printed
+ // with p50/p99/p999 on SIGUSR1.  With -t the receive time is also stamped
+ // into the frame so clients can measure end-to-end latency.
+ 
+ unsigned long now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+ }
+ 
+ static int lat_bucket(unsigned long v) {
+     if (v >= (1UL << LAT_MAX_BITS)) {
+         v = (1UL << LAT_MAX_BITS) - 1;
+     }
+     if (v < (1UL << LAT_SUB_BITS)) {
+         return (int)v;
+     }
+     int shift = (63 - __builtin_clzl(v)) - LAT_SUB_BITS;
+     return ((shift + 1) << LAT_SUB_BITS) + (int)(v >> shift) - (1 << LAT_SUB_BITS);
+ }
+ 
+ // Highest value that falls into bucket 'b'.
+ static unsigned long lat_bucket_high(int b) {
+     if (b < (1 << LAT_SUB_BITS)) {
+         return b;
+     }
+     int shift = (b >> LAT_SUB_BITS) - 1;
+     unsigned long sub = (b & ((1 << LAT_SUB_BITS) - 1)) + (1 << LAT_SUB_BITS);
+     return ((sub + 1) << shift) - 1;
+ }
+ 
+ void lat_record(lat_hist_t *h, unsigned long ns) {
+     atomic_fetch_add_explicit(&h->counts[lat_bucket(ns)], 1, memory_order_relaxed);
+     atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+     atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+     unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+     while (ns > max &&
+            !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                   memory_order_relaxed, memory_order_relaxed)) {
+         // 'max' was reloaded, retry
+     }
+ }
+ 
+ /**
+  * Value at quantile 'q' (0..1) in nanoseconds, 0 if nothing was recorded.
+  */
+ unsigned long lat_percentile(lat_hist_t *h, double q) {
+     unsigned long total = atomic_load_explicit(&h->total, memory_order_relaxed);
+     if (total == 0) {
+         return 0;
+     }
+     unsigned long rank = (unsigned long)(q * total + 0.5);
+     if (rank < 1) {
+         rank = 1;
+     }
+     unsigned long seen = 0;
+     unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+     for (int b = 0; b < LAT_BUCKETS; b++) {
+         seen += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+         if (seen >= rank) {
+             unsigned long v = lat_bucket_high(b);
+             return v < max ? v : max;
+         }
+     }
+     return max;
+ }
+ 
+ lat_set_t *lat_set_new(void) {
+     lat_set_t *s = slab_zalloc(SLAB_LATENCY);
+     if (s) {
+         atomic_store(&s->refs, 1);
+         STAT_ADD(mem[MEM_LATENCY], sizeof(*s));
+     }
+     return s;
+ }
+ 
+ void lat_set_get(lat_set_t *s) {
+     if (s) {
+         atomic_fetch_add(&s->refs, 1);
+     }
+ }
+ 
+ void lat_set_put(lat_set_t *s) {
+     if (s && atomic_fetch_sub(&s->refs, 1) == 1) {
+         STAT_ADD(mem[MEM_LATENCY], -(long)sizeof(*s));
+         slab_free(SLAB_LATENCY, s);
+     }
+ }
+ 
+ void lat_set_release(void *s) {
+     lat_set_put(s);
+ }
+ 
+ /**
+  * Record one stage of a traced frame globally and, if given, per session.
+  */
+ void lat_trace_record(lat_set_t *session, int stage, unsigned long ns) {
+     lat_record(&lat_global.stage[stage], ns);
+     if (session) {
+         lat_record(&session->stage[stage], ns);
+     }
+ }
+ 
+ /**
+  * Lock the global mutex, recording how long contended acquisitions wait.
+  */
+ void global_lock(void) {
+     STAT_ADD(lock_acquired, 1);
+     if (pthread_mutex_trylock(&mutex) == 0) {
+         return;
+     }
+     unsigned long start = now_ns();
+     pthread_mutex_lock(&mutex);
+     STAT_ADD(lock_contended, 1);
+     lat_record(&stats.lock_wait, now_ns() - start);
+ }
+ 
+ /**
+  * Stamp the server receive time (microseconds since the epoch, big endian)
+  * after "\0LTS" at the end of the data field, if the text leaves room.
+  */
+ void lat_stamp_frame(struct message *msg) {
+     if (strnlen((char*)msg->data, MAX_DATA) >= MAX_DATA - LAT_STAMP_LEN) {
+         return;
+     }
+     struct timespec ts;
+     clock_gettime(CLOCK_REALTIME, &ts);
+     uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+     unsigned char *p = msg->data + MAX_DATA - LAT_STAMP_LEN;
+     memcpy(p, "\0LTS", 4);
+     for (int i = 0; i < 8; i++) {
+         p[4 + i] = (unsigned char)(us >> (56 - 8 * i));
+     }
+ }
+ 
+ static void lat_report_set(FILE *out, const char *name, lat_set_t *s) {
+     static const char *stage_names[LAT_STAGES] = { "parse", "fanout", "queue", "write" };
+     for (int i = 0; i < LAT_STAGES; i++) {
+         lat_hist_t *h = &s->stage[i];
+         unsigned long total = atomic_load_explicit(&h->total, memory_order_relaxed);
+         if (total == 0) {
+             continue;
+         }
+         fprintf(out, "  %-20s %-7s %10lu %10.1f %10.1f %10.1f %10.1f\n", name, stage_names[i],
+                 total, lat_percentile(h, 0.50) / 1e3, lat_percentile(h, 0.99) / 1e3,
+                 lat_percentile(h, 0.999) / 1e3,
+                 atomic_load_explicit(&h->max, memory_order_relaxed) / 1e3);
+     }
+ }
+ 
+ /**
+  * Print latency percentiles (microseconds), globally and per session.
+  */
+ void lat_report(FILE *out) {
+     fprintf(out, "Latency (us)  %-20s %-7s %10s %10s %10s %10s %10s\n",
+             "session", "stage", "count", "p50", "p99", "p999", "max");
+     lat_report_set(out, "*", &lat_global);
+     global_lock();
+     for (int i = 0; i < num_sessions; i++) {
+         if (sessions[i].lat) {
+             lat_report_set(out, sessions[i].sessionID, sessions[i].lat);
+         }
+     }
+     pthread_mutex_unlock(&mutex);
+     fflush(out);
+ }
+ 
+ /**
+  * Prints the latency report whenever the server receives SIGUSR1.  The
+  * signal is blocked in every other thread.  While capturing or spooling
+  * mailboxes, SIGINT and SIGTERM come here too so buffered records are
+  * written out before the server dies.
+  */
+ void *lat_reporter(void *arg) {
+     sigset_t *set = arg;
+     int sig;
+     while (sigwait(set, &sig) == 0) {
+         if (sig != SIGUSR1) {
+             capture_flush();
+             global_lock();
+             mailbox_flush();
+             pthread_mutex_unlock(&mutex);
+             signal(sig, SIG_DFL);
+             pthread_sigmask(SIG_UNBLOCK, set, NULL);
+             raise(sig);
+         }
+         lat_report(stdout);
+     }
+     return NULL;
+ }
+ 
+ // --------------------- OUTBOUND QUEUES ---------------------
+ //
+ // Frames for a client are queued and written by that client's writer
+ // thread, so a slow socket never stalls the thread that produced the frame.
+ // Each queue has two lanes: control replies (acks, naks, listings,
+ // notices) and bulk traffic (MESSAGE, DIRECT, PRESENCE).  The writer
+ // prefers control frames but lets one bulk frame through after every
+ // OUT_CONTROL_WEIGHT control frames, and writes each batch with writev.
+ // A full bulk lane drops new traffic (slow consumer).  Control frames are
+ // almost all replies, so a client's reader stops reading requests while
+ // its control lane is half full; if the lane still overflows the client
+ // is disconnected.
+ 
+ int frame_lane(unsigned int type) {
+     // Search results share a lane so SE_ACK cannot overtake its SE_HITs.
+     return (type == MESSAGE || type == DIRECT || type == PRESENCE ||
+             type == SE_HIT || type == SE_ACK) ? OUT_BULK : OUT_CONTROL;
+ }
+ 
+ /**
+  * Append a frame to slot 'idx''s queue.  'ingress' and 'lat' are its
+  * latency trace (0 and NULL if untraced).  Called with out_lock[idx] held;
+  * the caller wakes the writer.  Returns 0 if queued, -1 if dropped.
+  */
+ static int outq_push(int idx, const struct message *msg, unsigned long ingress, lat_set_t *lat) {
+     client_t *c = &clients[idx];
+     int lane = frame_lane(msg->type);
+     int limit = (lane == OUT_CONTROL) ? OUTQ_CONTROL_MAX : OUTQ_BULK_MAX;
+     if (c->out_closing || c->out_dead) {
+         return -1;
+     }
+     if (c->lanes[lane].count >= limit) {
+         c->out_dropped++;
+         STAT_ADD(queue_drops, 1);
+         if (lane == OUT_CONTROL) {
+             c->out_dead = 1;
+             shutdown(c->sockfd, SHUT_RDWR);  // reader thread cleans up
+         }
+         return -1;
+     }
+     outframe_t *f = slab_alloc(SLAB_FRAME);
+     if (!f) {
+         c->out_dropped++;
+         STAT_ADD(queue_drops, 1);
+         return -1;
+     }
+     f->next = NULL;
+     f->t_ingress = 0;
+     f->lat = NULL;
+     if (ingress) {
+         f->t_ingress = ingress;
+         f->t_queued = now_ns();
+         f->lat = lat;
+         lat_set_get(f->lat);
+     }
+     f->lane = lane;
+     f->msg = *msg;
+     chat_encode(&f->msg);
+     outlane_t *l = &c->lanes[lane];
+     if (l->tail) {
+         l->tail->next = f;
+     } else {
+         l->head = f;
+     }
+     l->tail = f;
+     l->count++;
+     STAT_ADD(queued[lane], 1);
+     STAT_ADD(mem[MEM_OUTQ], sizeof(*f));
+     return 0;
+ }
+ 
+ /**
+  * Queue a frame for client slot 'idx'.  Returns 0 if queued, -1 if dropped.
+  */
+ int send_to_client(int idx, struct message *msg) {
+     unsigned long ingress = 0;
+     if (lat_trace.ingress && (msg->type == MESSAGE || msg->type == DIRECT)) {
+         ingress = lat_trace.ingress;
+     }
+     pthread_mutex_lock(&out_lock[idx]);
+     int rc = outq_push(idx, msg, ingress, lat_trace.session);
+     if (rc == 0) {
+         pthread_cond_broadcast(&out_cond[idx]);
+     }
+     pthread_mutex_unlock(&out_lock[idx]);
+     return rc;
+ }
+ 
+ /**
+  * Queue 'n' frames for slot 'idx' with one lock round trip and one
+  * wake-up, so its writer sends them together.  Returns the number queued.
+  */
+ int send_frames_to_client(int idx, const held_frame_t *frames, int n, lat_set_t *lat) {
+     int queued = 0;
+     pthread_mutex_lock(&out_lock[idx]);
+     for (int i = 0; i < n; i++) {
+         queued += (outq_push(idx, &frames[i].msg, frames[i].ingress, lat) == 0);
+     }
+     if (queued > 0) {
+         pthread_cond_broadcast(&out_cond[idx]);
+     }
+     pthread_mutex_unlock(&out_lock[idx]);
+     return queued;
+ }
+ 
+ static outframe_t *outq_pop(outlane_t *l) {
+     outframe_t *f = l->head;
+     l->head = f->next;
+     if (!l->head) {
+         l->tail = NULL;
+     }
+     l->count--;
+     return f;
+ }
+ 
+ static void outq_free_frame(outframe_t *f) {
+     STAT_ADD(queued[f->lane], -1);
+     STAT_ADD(mem[MEM_OUTQ], -(long)sizeof(*f));
+     lat_set_put(f->lat);
+     slab_free(SLAB_FRAME, f);
+ }
+ 
+ static void outq_free_lane(outlane_t *l) {
+     while (l->head) {
+         outq_free_frame(outq_pop(l));
+     }
+ }
+ 
+ /**
+  * Writer thread: drains one client's queue until outq_stop().
+  */
+ void *client_writer(void *arg) {
+     int idx = (int)(intptr_t)arg;
+     client_t *c = &clients[idx];
+     outframe_t *batch[OUT_BATCH];
+     struct iovec iov[OUT_BATCH];
+     int control_run = 0;
+ 
+     pthread_mutex_lock(&out_lock[idx]);
+     while (1) {
+         while (!c->out_closing && c->lanes[OUT_CONTROL].count == 0 &&
+                c->lanes[OUT_BULK].count == 0) {
+             pthread_cond_wait(&out_cond[idx], &out_lock[idx]);
+         }
+         if (c->out_closing) {
+             break;
+         }
+ 
+         int n = 0;
+         while (n < OUT_BATCH) {
+             outlane_t *ctl = &c->lanes[OUT_CONTROL];
+             outlane_t *bulk = &c->lanes[OUT_BULK];
+             if (ctl->count > 0 && (control_run < OUT_CONTROL_WEIGHT || bulk->count == 0)) {
+                 batch[n++] = outq_pop(ctl);
+                 control_run++;
+             } else if (bulk->count > 0) {
+                 batch[n++] = outq_pop(bulk);
+                 control_run = 0;
+             } else {
+                 break;
+             }
+         }
+         c->out_busy = 1;
+         pthread_cond_broadcast(&out_cond[idx]);  // room for a stalled reader
+         pthread_mutex_unlock(&out_lock[idx]);
+ 
+         unsigned long t_pick = 0;
+         for (int i = 0; i < n; i++) {
+             if (batch[i]->t_ingress) {
+                 if (!t_pick) {
+                     t_pick = now_ns();
+                 }
+                 lat_trace_record(batch[i]->lat, LAT_QUEUE, t_pick - batch[i]->t_queued);
+             }
+             iov[i].iov_base = &batch[i]->msg;
+             iov[i].iov_len = sizeof(struct message);
+         }
+         int failed = 0;
+         unsigned long t_write = now_ns();
+         struct iovec *v = iov;
+         int vcnt = (c->z || c->shm) ? 0 : n;
+         if (c->z) {
+             failed = zconn_write(c->sockfd, c->z, batch, n) < 0;
+         } else if (c->shm) {
+             failed = shm_write(idx, batch, n) < 0;
+         }
+         while (vcnt > 0 && !failed) {
+             ssize_t w = writev(c->sockfd, v, vcnt);
+             if (w <= 0) {
+                 if (w < 0 && errno == EINTR) {
+                     continue;
+                 }
+                 failed = 1;
+                 break;
+             }
+             while (vcnt > 0 && (size_t)w >= v->iov_len) {
+                 w -= v->iov_len;
+                 v++;
+                 vcnt--;
+             }
+             if (vcnt > 0) {
+                 v->iov_base = (char *)v->iov_base + w;
+                 v->iov_len -= w;
+             }
+         }
+         unsigned long t_done = now_ns();
+         STAT_ADD(busy_ns[1], t_done - t_write);
+         if (!failed) {
+             STAT_ADD(frames_out, n);
+             STAT_ADD(bytes_out, n * sizeof(struct message));
+         }
+         for (int i = 0; i < n; i++) {
+             if (!failed && batch[i]->lat) {
+                 atomic_fetch_add_explicit(&batch[i]->lat->bytes_out, sizeof(struct message),
+                                           memory_order_relaxed);
+             }
+             if (!failed && batch[i]->t_ingress) {
+                 lat_trace_record(batch[i]->lat, LAT_WRITE, t_done - batch[i]->t_ingress);
+             }
+             outq_free_frame(batch[i]);
+         }
+ 
+         pthread_mutex_lock(&out_lock[idx]);
+         c->out_busy = 0;
+         if (failed && !c->out_dead) {
+             c->out_dead = 1;
+             shutdown(c->sockfd, SHUT_RDWR);
+         }
+         if (c->out_dead) {
+             outq_free_lane(&c->lanes[OUT_CONTROL]);
+             outq_free_lane(&c->lanes[OUT_BULK]);
+         }
+     }
+     pthread_mutex_unlock(&out_lock[idx]);
+     return NULL;
+ }
+ 
+ /**
+  * Set up an empty queue for slot 'idx' and start its writer thread.
+  */
+ int outq_start(int idx) {
+     client_t *c = &clients[idx];
+     memset(c->lanes, 0, sizeof(c->lanes));
+     c->out_closing = 0;
+     c->out_dead = 0;
+     c->out_busy = 0;
+     c->out_dropped = 0;
+     if (pthread_create(&c->writer_tid, &client_thread_attr, client_writer,
+                        (void *)(intptr_t)idx) != 0) {
+         perror("pthread_create for writer");
+         return -1;
+     }
+     STAT_ADD(writers, 1);
+     return 0;
+ }
+ 
+ /**
+  * Stop the writer of slot 'idx' and discard anything still queued.
+  */
+ void outq_stop(int idx) {
+     client_t *c = &clients[idx];
+     pthread_mutex_lock(&out_lock[idx]);
+     c->out_closing = 1;
+     pthread_cond_broadcast(&out_cond[idx]);
+     pthread_mutex_unlock(&out_lock[idx]);
+     pthread_join(c->writer_tid, NULL);
+     STAT_ADD(writers, -1);
+     outq_free_lane(&c->lanes[OUT_CONTROL]);
+     outq_free_lane(&c->lanes[OUT_BULK]);
+ }
+ 
+ /**
+  * Called by the reader of slot 'idx' before it takes the next request:
+  * wait while the control lane is half full.  Gives way to an upgrade so
+  * the reader can park.
+  */
+ void outq_wait_room(int idx) {
+     client_t *c = &clients[idx];
+     pthread_mutex_lock(&out_lock[idx]);
+     while (c->lanes[OUT_CONTROL].count >= OUTQ_CONTROL_MAX / 2 &&
+            !c->out_dead && !c->out_closing && !upgrade_requested) {
+         struct timespec until;
+         clock_gettime(CLOCK_REALTIME, &until);
+         until.tv_nsec += 100000000;  // recheck for an upgrade every 100ms
+         if (until.tv_nsec >= 1000000000) {
+             until.tv_sec++;
+             until.tv_nsec -= 1000000000;
+         }
+         pthread_cond_timedwait(&out_cond[idx], &out_lock[idx], &until);
+     }
+     pthread_mutex_unlock(&out_lock[idx]);
+ }
+ 
+ /**
+  * 1 if slot 'idx' has nothing queued and no write in progress.
+  */
+ int outq_idle(int idx) {
+     pthread_mutex_lock(&out_lock[idx]);
+     int idle = clients[idx].lanes[OUT_CONTROL].count == 0 &&
+                clients[idx].lanes[OUT_BULK].count == 0 && !clients[idx].out_busy;
+     pthread_mutex_unlock(&out_lock[idx]);
+     return idle;
+ }
+ 
+ /**
+  * Wait up to 'timeout' seconds for every active client's queue to drain.
+  */
+ void outq_wait_idle(int timeout) {
+     double deadline = now_seconds() + timeout;
+     while (now_seconds() < deadline) {
+         int idle = 1;
+         for (int i = 0; i < MAX_CLIENTS && idle; i++) {
+             if (client_hot.active[i] && !outq_idle(i)) {
+                 idle = 0;
+             }
+         }
+         if (idle) {
+             return;
+         }
+         usleep(10000);
+     }
+ }
+ 
+ // --------------------- SESSION WINDOWS ---------------------
+ //
+ // A busy session can be given a coalescing window (admin "window"
+ // command).  MESSAGE frames posted to it are held for up to window_us, or
+ // until window_frames of them are waiting, and then go out together: each
+ // member's writer is woken once for the whole batch and writes it with
+ // one writev, instead of once per frame.  Every frame is delayed by at
+ // most the window.  A window that fills is released by the sender; the
+ // window thread releases the ones whose time is up.  All of this runs
+ // under the global mutex.
+ 
+ static pthread_cond_t window_cond;    // Signalled when a window opens; monotonic clock
+ 
+ /**
+  * Fan out everything held in session 'sidx''s window.
+  */
+ void window_release(int sidx) {
+     session_t *sess = &sessions[sidx];
+     int n = sess->held_count;
+     if (n == 0) {
+         return;
+     }
+     sess->held_count = 0;
+     const int *members = session_hot.members[sidx];
+     int num_members = session_hot.num_members[sidx];
+     for (int i = 0; i < num_members; i++) {
+         send_frames_to_client(members[i], sess->held, n, sess->lat);
+     }
+     // Topic subscribers and mailboxes get frames one at a time, skipping members.
+     if (topic_root.num_children > 0 || sess->num_away > 0) {
+         for (int f = 0; f < n; f++) {
+             deliver_epoch++;
+             for (int i = 0; i < num_members; i++) {
+                 client_hot.deliver_mark[members[i]] = deliver_epoch;
+             }
+             mailbox_session(sidx, &sess->held[f].msg);
+             lat_trace.ingress = sess->held[f].ingress;
+             lat_trace.session = sess->lat;
+             topic_deliver(sess->sessionID, &sess->held[f].msg);
+         }
+         lat_trace.ingress = 0;
+     }
+     STAT_ADD(window_batches, 1);
+     STAT_ADD(window_frames, n);
+ }
+ 
+ void window_release_all(void) {
+     for (int i = 0; i < num_sessions; i++) {
+         window_release(i);
+     }
+ }
+ 
+ /**
+  * Set session 'sidx''s window; 'us' 0 turns it off.  Frames already held
+  * go out first.  Returns 0, or -1 if the values are out of range.
+  */
+ int window_set(int sidx, unsigned int us, int frames) {
+     if (us > WINDOW_MAX_MS * 1000U || frames < 1 || frames > WINDOW_MAX_FRAMES) {
+         return -1;
+     }
+     session_t *sess = &sessions[sidx];
+     window_release(sidx);
+     if (frames != sess->window_frames) {
+         free(sess->held);
+         sess->held = NULL;
+     }
+     sess->window_us = us;
+     sess->window_frames = us ? frames : 0;
+     return 0;
+ }
+ 
+ /**
+  * Broadcast a MESSAGE to session 'sidx', or hold it in the session's
+  * window if it has one.  'ingress' is the frame's trace start.
+  */
+ void session_post(int sidx, struct message *msg, unsigned long ingress) {
+     session_t *sess = &sessions[sidx];
+     if (sess->window_us == 0) {
+         broadcast_message(sess->sessionID, msg);
+         return;
+     }
+     if (!sess->held) {
+         sess->held = malloc(sess->window_frames * sizeof(held_frame_t));
+         if (!sess->held) {
+             broadcast_message(sess->sessionID, msg);
+             return;
+         }
+     }
+     if (sess->held_count == 0) {
+         sess->held_deadline = now_ns() + sess->window_us * 1000UL;
+         pthread_cond_signal(&window_cond);
+     }
+     sess->held[sess->held_count].msg = *msg;
+     sess->held[sess->held_count].ingress = ingress;
+     if (++sess->held_count == sess->window_frames) {
+         window_release(sidx);
+     }
+ }
+ 
+ /**
+  * Window thread: releases windows as their time runs out.
+  */
+ void *window_thread(void *arg) {
+     global_lock();
+     while (1) {
+         unsigned long now = now_ns(), next = 0;
+         for (int i = 0; i < num_sessions; i++) {
+             session_t *sess = &sessions[i];
+             if (sess->held_count == 0) {
+                 continue;
+             }
+             if (sess->held_deadline <= now) {
+                 window_release(i);
+             } else if (!next || sess->held_deadline < next) {
+                 next = sess->held_deadline;
+             }
+         }
+         if (next) {
+             struct timespec ts = { next / 1000000000UL, next % 1000000000UL };
+             pthread_cond_timedwait(&window_cond, &mutex, &ts);
+         } else {
+             pthread_cond_wait(&window_cond, &mutex);
+         }
+     }
+     return NULL;
+ }
+ 
+ // --------------------- TRAFFIC CAPTURE ---------------------
+ //
+ // With -r <file> the server appends every inbound frame to a capture that
+ // replay.c can play back against a test server.  Integers are LEB128
+ // varints unless noted:
+ //   header:    "CCAP", u8 version, u64 start time (us since the epoch, big endian)
+ //   record:    u8 kind, varint us since the previous record, varint connection
+ //   CAP_OPEN:  u32 IPv4 address, u16 port (network order)
+ //   CAP_FRAME: varint type, varint size, then source, session and data,
+ //              each as varint length + bytes
+ //   CAP_CLOSE: nothing more
+ // Data is stored without its trailing zero padding and LOGIN passwords
+ // are never written.  Records are buffered; the inactivity monitor
+ // flushes them every few seconds.  A capture covers one process: after a
+ // live upgrade the new server records to the file given to it.
+ 
+ #define CAPTURE_VERSION 1
+ #define CAP_OPEN  1
+ #define CAP_FRAME 2
+ #define CAP_CLOSE 3
+ 
+ static size_t cap_put_varint(unsigned char *p, unsigned long v) {
+     size_t n = 0;
+     while (v >= 0x80) {
+         p[n++] = (unsigned char)(v | 0x80);
+         v >>= 7;
+     }
+     p[n++] = (unsigned char)v;
+     return n;
+ }
+ 
+ static size_t cap_put_bytes(unsigned char *p, const void *src, size_t len) {
+     size_t n = cap_put_varint(p, len);
+     memcpy(p + n, src, len);
+     return n + len;
+ }
+ 
+ /**
+  * Append one record; 'body' follows the common record header.  Callers
+  * test capture_file without the lock only as a shortcut: a write error
+  * on another thread may have closed it since.
+  */
+ static void capture_write(int kind, unsigned int conn, const unsigned char *body, size_t len) {
+     unsigned char head[1 + 10 + 10];
+     pthread_mutex_lock(&capture_lock);
+     if (!capture_file) {
+         pthread_mutex_unlock(&capture_lock);
+         return;
+     }
+     unsigned long now = now_ns() / 1000;
+     size_t n = 0;
+     head[n++] = (unsigned char)kind;
+     n += cap_put_varint(head + n, now - capture_last_us);
+     n += cap_put_varint(head + n, conn);
+     capture_last_us = now;
+     if (fwrite(head, 1, n, capture_file) != n || fwrite(body, 1, len, capture_file) != len) {
+         perror("capture write");
+         fclose(capture_file);
+         capture_file = NULL;  // stop capturing, keep serving
+     }
+     pthread_mutex_unlock(&capture_lock);
+ }
+ 
+ /**
+  * Start capturing to 'path'.  Returns -1 if the file cannot be created.
+  */
+ int capture_start(const char *path) {
+     capture_file = fopen(path, "wb");
+     if (!capture_file) {
+         perror(path);
+         return -1;
+     }
+     setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER);
+     struct timespec ts;
+     clock_gettime(CLOCK_REALTIME, &ts);
+     uint64_t start = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+     unsigned char head[13] = { 'C', 'C', 'A', 'P', CAPTURE_VERSION };
+     for (int i = 0; i < 8; i++) {
+         head[5 + i] = (unsigned char)(start >> (56 - 8 * i));
+     }
+     fwrite(head, 1, sizeof(head), capture_file);
+     capture_last_us = now_ns() / 1000;
+     return 0;
+ }
+ 
+ void capture_flush(void) {
+     pthread_mutex_lock(&capture_lock);
+     if (capture_file) {
+         fflush(capture_file);
+     }
+     pthread_mutex_unlock(&capture_lock);
+ }
+ 
+ /**
+  * Encode the fields of 'msg' as in a CAP_FRAME record; returns the length.
+  * 'p' needs room for sizeof(struct message) + 40 bytes.
+  */
+ static size_t cap_put_frame(unsigned char *p, const struct message *msg) {
+     size_t n = 0;
+     size_t data_len = MAX_DATA;
+     while (data_len > 0 && msg->data[data_len - 1] == 0) {
+         data_len--;
+     }
+     if (msg->type == LOGIN) {
+         data_len = 0;  // password
+     }
+     n += cap_put_varint(p + n, msg->type);
+     n += cap_put_varint(p + n, msg->type == LOGIN ? 0 : msg->size);
+     n += cap_put_bytes(p + n, msg->source, strnlen((char*)msg->source, MAX_NAME));
+     n += cap_put_bytes(p + n, msg->session, strnlen((char*)msg->session, MAX_NAME));
+     n += cap_put_bytes(p + n, msg->data, data_len);
+     return n;
+ }
+ 
+ /**
+  * Record one frame from client slot 'idx'.
+  */
+ void capture_frame(int idx, const struct message *msg) {
+     if (!capture_file) {
+         return;
+     }
+     unsigned char body[sizeof(struct message) + 40];
+     capture_write(CAP_FRAME, clients[idx].cap_id, body, cap_put_frame(body, msg));
+ }
+ 
+ /**
+  * Record a new connection on slot 'idx' and its LOGIN frame.
+  */
+ void capture_connect(int idx, const struct message *login) {
+     if (!capture_file) {
+         return;
+     }
+     pthread_mutex_lock(&capture_lock);
+     clients[idx].cap_id = capture_next_id++;
+     pthread_mutex_unlock(&capture_lock);
+     unsigned char body[6];
+     memcpy(body, &clients[idx].clientAddr.sin_addr.s_addr, 4);
+     memcpy(body + 4, &clients[idx].clientAddr.sin_port, 2);
+     capture_write(CAP_OPEN, clients[idx].cap_id, body, sizeof(body));
+     capture_frame(idx, login);
+ }
+ 
+ void capture_close(int idx) {
+     if (capture_file && clients[idx].cap_id) {
+         capture_write(CAP_CLOSE, clients[idx].cap_id, NULL, 0);
+     }
+ }
+ 
+ // --------------------- OFFLINE MAILBOXES ---------------------
+ //
+ // With -m <file> the server keeps traffic for users who are offline.  A
+ // DIRECT to a known user who is not logged in, and every MESSAGE to a
+ // session a user was in when their connection dropped or timed out, goes
+ // into that user's mailbox: a ring of the last MAILBOX_FRAMES frames.
+ // When the user logs in again, the unread frames are queued behind the
+ // LO_ACK in one batch and the read position moves past them, so each
+ // frame is delivered once and a reconnect never replays older history.
+ // A user who sends EXIT has left their sessions; nothing is kept for them
+ // but DIRECTs.
+ //
+ // Mailboxes survive restarts and upgrades in an append-only spool file,
+ // with integers and strings encoded as in a capture:
+ //   header:    "CMBX", u8 version
+ //   MBX_PUT:   u8 kind, user, then the frame as in a CAP_FRAME record
+ //   MBX_READ:  u8 kind, user, varint frames delivered
+ // Replaying the records in order rebuilds every ring and read position.
+ // Records are buffered, like a capture, and reach the file on each tick of
+ // the inactivity monitor, before a handoff and on SIGINT/SIGTERM; a crash
+ // loses the last few seconds, and a torn last record is ignored on load.
+ // The file is rewritten with only the unread frames at startup and
+ // whenever it has grown well past that.  Past startup the inactivity
+ // monitor does the rewrite, holding the global mutex only to copy the
+ // unread frames and to swap the files.
+ 
+ #define MAILBOX_VERSION 1
+ #define MBX_PUT  1
+ #define MBX_READ 2
+ 
+ /**
+  * The mailbox of 'user', or with 'create' a new empty one.  NULL if there
+  * is none, or the table is full.
+  */
+ static mailbox_t *mailbox_find(const char *user, int create) {
+     unsigned int h = hash_name(user);
+     for (int i = 0; i < MAILBOX_USERS; i++) {
+         mailbox_t *mb = &mailboxes[(h + i) & (MAILBOX_USERS - 1)];
+         if (mb->user[0] == '\0') {
+             if (!create) {
+                 return NULL;
+             }
+             strncpy(mb->user, user, MAX_NAME - 1);
+             return mb;
+         }
+         if (strcmp(mb->user, user) == 0) {
+             return mb;
+         }
+     }
+     return NULL;
+ }
+ 
+ static size_t mailbox_record(unsigned char *p, int kind, const mailbox_t *mb) {
+     p[0] = (unsigned char)kind;
+     return 1 + cap_put_bytes(p + 1, mb->user, strlen(mb->user));
+ }
+ 
+ static void spool_buf_put(spool_buf_t *b, const void *p, size_t n) {
+     if (b->failed) {
+         return;
+     }
+     if (b->len + n > b->cap) {
+         size_t cap = b->cap ? b->cap : (1 << 16);
+         while (cap < b->len + n) {
+             cap *= 2;
+         }
+         unsigned char *grown = realloc(b->data, cap);
+         if (!grown) {
+             b->failed = 1;
+             return;
+         }
+         b->data = grown;
+         b->cap = cap;
+     }
+     memcpy(b->data + b->len, p, n);
+     b->len += n;
+ }
+ 
+ static void spool_buf_free(spool_buf_t *b) {
+     free(b->data);
+     memset(b, 0, sizeof(*b));
+ }
+ 
+ static void mailbox_spool(const unsigned char *rec, size_t len) {
+     if (fwrite(rec, 1, len, mailbox_spool_file) != len) {
+         perror("mailbox spool");
+     }
+     if (mailbox_rewriting) {
+         spool_buf_put(&mailbox_tail, rec, len);
+     }
+     mailbox_spool_bytes += len;
+ }
+ 
+ /**
+  * Write out buffered spool records.  Global mutex held.
+  */
+ void mailbox_flush(void) {
+     if (mailbox_spool_file && fflush(mailbox_spool_file) != 0) {
+         perror("mailbox spool");
+     }
+ }
+ 
+ /**
+  * Append 'msg' to 'mb', dropping the oldest unread frame if it is full,
+  * and log it to the spool if 'spool'.
+  */
+ static void mailbox_store(mailbox_t *mb, const struct message *msg, int spool) {
+     if (!mb->frames) {
+         mb->frames = malloc(MAILBOX_FRAMES * sizeof(held_frame_t));
+         if (!mb->frames) {
+             STAT_ADD(mailbox_dropped, 1);
+             return;
+         }
+         STAT_ADD(mem[MEM_MAILBOX], MAILBOX_FRAMES * sizeof(held_frame_t));
+     }
+     if (mb->next - mb->read == MAILBOX_FRAMES) {
+         mb->read++;
+         STAT_ADD(mailbox_dropped, 1);
+     }
+     mb->frames[mb->next % MAILBOX_FRAMES].msg = *msg;
+     mb->frames[mb->next % MAILBOX_FRAMES].ingress = 0;
+     mb->next++;
+     if (spool) {
+         unsigned char rec[MAX_NAME + sizeof(struct message) + 64];
+         size_t n = mailbox_record(rec, MBX_PUT, mb);
+         n += cap_put_frame(rec + n, msg);
+         mailbox_spool(rec, n);
+         STAT_ADD(mailbox_stored, 1);
+     }
+ }
+ 
+ /**
+  * Mark 'len' frames from 'read' on as delivered.
+  */
+ static void mailbox_consume(mailbox_t *mb, unsigned long len) {
+     mb->read = (len < mb->next - mb->read) ? mb->read + len : mb->next;
+     if (mb->read == mb->next && mb->frames) {
+         free(mb->frames);
+         mb->frames = NULL;
+         STAT_ADD(mem[MEM_MAILBOX], -(long)(MAILBOX_FRAMES * sizeof(held_frame_t)));
+     }
+ }
+ 
+ /**
+  * Encode the unread frames of every mailbox into 'b' as a whole spool.
+  * Global mutex held.
+  */
+ static void mailbox_snapshot(spool_buf_t *b) {
+     unsigned char rec[MAX_NAME + sizeof(struct message) + 64] = { 'C', 'M', 'B', 'X', MAILBOX_VERSION };
+     spool_buf_put(b, rec, 5);
+     for (int i = 0; i < MAILBOX_USERS && !b->failed; i++) {
+         mailbox_t *mb = &mailboxes[i];
+         for (unsigned long s = mb->read; s < mb->next; s++) {
+             size_t n = mailbox_record(rec, MBX_PUT, mb);
+             n += cap_put_frame(rec + n, &mb->frames[s % MAILBOX_FRAMES].msg);
+             spool_buf_put(b, rec, n);
+         }
+     }
+ }
+ 
+ // Name of the file a rewrite is written to.  It carries the pid, as a
+ // retiring process may still be writing one while its successor starts.
+ static void mailbox_tmp_path(char *tmp, size_t size) {
+     snprintf(tmp, size, "%s.%d.tmp", mailbox_path, (int)getpid());
+ }
+ 
+ /**
+  * Write 'b' to a new file beside the spool and sync it.  Returns the
+  * stream, positioned at its end, or NULL.  Needs no lock.
+  */
+ static FILE *mailbox_write_new(const spool_buf_t *b) {
+     char tmp[PATH_MAX + 32];
+     mailbox_tmp_path(tmp, sizeof(tmp));
+     if (b->failed) {
+         fprintf(stderr, "mailbox spool rewrite: out of memory\n");
+         return NULL;
+     }
+     FILE *f = fopen(tmp, "wb");
+     if (!f) {
+         perror(tmp);
+         return NULL;
+     }
+     setvbuf(f, NULL, _IOFBF, MAILBOX_BUFFER);
+     if (fwrite(b->data, 1, b->len, f) != b->len || fflush(f) != 0 || fsync(fileno(f)) < 0) {
+         perror("mailbox spool rewrite");
+         fclose(f);
+         unlink(tmp);
+         return NULL;
+     }
+     return f;
+ }
+ 
+ /**
+  * Append 'tail' to 'f', from mailbox_write_new, and make it the spool.
+  * Returns -1 if that fails; 'f' is dropped and the old spool stays in
+  * use.  Global mutex held.
+  */
+ static int mailbox_install(FILE *f, const spool_buf_t *tail) {
+     char tmp[PATH_MAX + 32];
+     mailbox_tmp_path(tmp, sizeof(tmp));
+     long size = -1;
+     if (!tail->failed && (tail->len == 0 || fwrite(tail->data, 1, tail->len, f) == tail->len)) {
+         size = ftell(f);
+     }
+     if (size < 0 || rename(tmp, mailbox_path) < 0) {
+         perror("mailbox spool rewrite");
+         fclose(f);
+         unlink(tmp);
+         return -1;
+     }
+     if (mailbox_spool_file) {
+         fclose(mailbox_spool_file);  // what it still buffers is in the rewrite too
+     }
+     mailbox_spool_file = f;  // appended to from here on
+     mailbox_spool_bytes = mailbox_spool_base = size;
+     return 0;
+ }
+ 
+ /**
+  * Rewrite the spool with just the unread frames, all under the global
+  * mutex (startup).  Returns -1 if the new file cannot be written; the old
+  * one stays in use.
+  */
+ static int mailbox_compact(void) {
+     spool_buf_t b, none;
+     memset(&b, 0, sizeof(b));
+     memset(&none, 0, sizeof(none));
+     mailbox_snapshot(&b);
+     FILE *f = mailbox_write_new(&b);
+     spool_buf_free(&b);
+     return f ? mailbox_install(f, &none) : -1;
+ }
+ 
+ /**
+  * Note that the spool has grown well past its size after the last
+  * rewrite, for mailbox_rewrite.  Global mutex held.
+  */
+ static void mailbox_check_growth(void) {
+     if (mailbox_spool_bytes > 2 * mailbox_spool_base + MAILBOX_COMPACT_BYTES) {
+         mailbox_compact_due = 1;
+     }
+ }
+ 
+ /**
+  * Rewrite the spool if mailbox_check_growth found it due.  The unread
+  * frames are copied under the global mutex; the file is written and
+  * synced without it, while records spooled meanwhile collect in
+  * mailbox_tail to be appended before the new file takes over.  Runs on
+  * the inactivity monitor, without the mutex.
+  */
+ static void mailbox_rewrite(void) {
+     global_lock();
+     if (!mailbox_compact_due || !mailbox_spool_file) {
+         pthread_mutex_unlock(&mutex);
+         return;
+     }
+     mailbox_compact_due = 0;
+     spool_buf_t b;
+     memset(&b, 0, sizeof(b));
+     mailbox_snapshot(&b);
+     mailbox_rewriting = 1;
+     pthread_mutex_unlock(&mutex);
+ 
+     FILE *f = mailbox_write_new(&b);
+     spool_buf_free(&b);
+ 
+     global_lock();
+     mailbox_rewriting = 0;
+     if (f) {
+         mailbox_install(f, &mailbox_tail);
+     }
+     spool_buf_free(&mailbox_tail);
+     pthread_mutex_unlock(&mutex);
+ }
+ 
+ static int mbx_get_varint(const unsigned char **p, const unsigned char *end, unsigned long *v) {
+     *v = 0;
+     for (int shift = 0; *p < end && shift < 64; shift += 7) {
+         unsigned char b = *(*p)++;
+         *v |= (unsigned long)(b & 0x7f) << shift;
+         if (!(b & 0x80)) {
+             return 0;
+         }
+     }
+     return -1;
+ }
+ 
+ static int mbx_get_bytes(const unsigned char **p, const unsigned char *end,
+                          void *dst, size_t max) {
+     unsigned long len;
+     if (mbx_get_varint(p, end, &len) < 0 || len > max || len > (size_t)(end - *p)) {
+         return -1;
+     }
+     memcpy(dst, *p, len);
+     *p += len;
+     return 0;
+ }
+ 
+ /**
+  * Replay the spool records in 'buf'.  Returns the number of bytes that
+  * held whole records.
+  */
+ static size_t mailbox_load(const unsigned char *buf, size_t len) {
+     const unsigned char *p = buf + 5, *end = buf + len;
+     const unsigned char *good = p;
+     while (p < end) {
+         int kind = *p++;
+         char user[MAX_NAME] = "";
+         unsigned long v;
+         if (mbx_get_bytes(&p, end, user, MAX_NAME - 1) < 0 || !user[0]) {
+             break;
+         }
+         if (kind == MBX_PUT) {
+             struct message msg;
+             unsigned long type, size;
+             memset(&msg, 0, sizeof(msg));
+             if (mbx_get_varint(&p, end, &type) < 0 || mbx_get_varint(&p, end, &size) < 0 ||
+                 mbx_get_bytes(&p, end, msg.source, MAX_NAME - 1) < 0 ||
+                 mbx_get_bytes(&p, end, msg.session, MAX_NAME - 1) < 0 ||
+                 mbx_get_bytes(&p, end, msg.data, MAX_DATA) < 0) {
+                 break;
+             }
+             msg.type = type;
+             msg.size = size;
+             mailbox_t *mb = mailbox_find(user, 1);
+             if (mb) {
+                 mailbox_store(mb, &msg, 0);
+             }
+         } else if (kind == MBX_READ && mbx_get_varint(&p, end, &v) == 0) {
+             mailbox_t *mb = mailbox_find(user, 0);
+             if (mb) {
+                 mailbox_consume(mb, v);
+             }
+         } else {
+             break;
+         }
+         good = p;
+     }
+     return good - buf;
+ }
+ 
+ /**
+  * Load the spool at 'path' (if it exists) and start appending to it.
+  * Returns -1 if it cannot be used.
+  */
+ int mailbox_open(const char *path) {
+     if (strlen(path) >= sizeof(mailbox_path)) {
+         fprintf(stderr, "%s: path too long\n", path);
+         return -1;
+     }
+     strcpy(mailbox_path, path);
+     FILE *f = fopen(path, "rb");
+     if (!f && errno != ENOENT) {
+         perror(path);
+         return -1;
+     }
+     global_lock();
+     if (f) {
+         unsigned char *buf = NULL;
+         size_t len = 0, cap = 0, n;
+         do {
+             if (len == cap) {
+                 cap = cap ? cap * 2 : (1 << 16);
+                 unsigned char *grown = realloc(buf, cap);
+                 if (!grown) {
+                     break;
+                 }
+                 buf = grown;
+             }
+             n = fread(buf + len, 1, cap - len, f);
+             len += n;
+         } while (n > 0);
+         fclose(f);
+         if (len < 5 || memcmp(buf, "CMBX", 4) != 0 || buf[4] != MAILBOX_VERSION) {
+             fprintf(stderr, "%s: not a mailbox spool\n", path);
+             free(buf);
+             pthread_mutex_unlock(&mutex);
+             return -1;
+         }
+         size_t used = mailbox_load(buf, len);
+         if (used < len) {
+             fprintf(stderr, "%s: ignoring %zu bytes of damaged records\n", path, len - used);
+         }
+         free(buf);
+     }
+     int rc = mailbox_compact();
+     pthread_mutex_unlock(&mutex);
+     return rc;
+ }
+ 
+ /**
+  * Keep session traffic for slot 'idx', whose connection dropped.  Called
+  * with the global mutex held, before release_client.
+  */
+ void mailbox_away(int idx) {
+     if (!mailbox_spool_file) {
+         return;
+     }
+     client_t *c = &clients[idx];
+     mailbox_t *mb = mailbox_find(c->clientID, 1);
+     if (!mb) {
+         return;
+     }
+     for (int i = 0; i < c->session_count; i++) {
+         int sidx = find_session(c->sessions[i]);
+         if (sidx >= 0 && sessions[sidx].num_away < MAILBOX_AWAY_MAX) {
+             sessions[sidx].away[sessions[sidx].num_away++] = mb - mailboxes;
+         }
+     }
+ }
+ 
+ /**
+  * Stop keeping session traffic for mailbox 'm'.
+  */
+ void mailbox_unaway(int m) {
+     for (int sidx = 0; sidx < num_sessions; sidx++) {
+         session_t *sess = &sessions[sidx];
+         for (int i = 0; i < sess->num_away; i++) {
+             if (sess->away[i] == m) {
+                 sess->away[i] = sess->away[--sess->num_away];
+                 break;
+             }
+         }
+     }
+ }
+ 
+ /**
+  * Keep 'msg' for the away members of session 'sidx' that the current
+  * delivery (deliver_epoch) has not reached yet.
+  */
+ void mailbox_session(int sidx, const struct message *msg) {
+     session_t *sess = &sessions[sidx];
+     if (!mailbox_spool_file) {
+         return;
+     }
+     for (int i = 0; i < sess->num_away; i++) {
+         mailbox_t *mb = &mailboxes[sess->away[i]];
+         if (mb->mark != deliver_epoch) {
+             mb->mark = deliver_epoch;
+             mailbox_store(mb, msg, 1);
+         }
+     }
+     mailbox_check_growth();
+ }
+ 
+ /**
+  * Keep a DIRECT for 'user', who is not logged in.  Returns 0 if kept, -1
+  * if mailboxes are off or the user is unknown.
+  */
+ int mailbox_direct(const char *user, const struct message *msg) {
+     if (!mailbox_spool_file) {
+         return -1;
+     }
+     mailbox_t *mb = mailbox_find(user, 0);
+     if (!mb && user_exists(user)) {
+         mb = mailbox_find(user, 1);
+     }
+     if (!mb) {
+         return -1;
+     }
+     mailbox_store(mb, msg, 1);
+     mailbox_check_growth();
+     return 0;
+ }
+ 
+ /**
+  * Queue everything unread in the mailbox of slot 'idx', which has just
+  * logged in, as one batch and move its read position past it.
+  */
+ void mailbox_deliver(int idx) {
+     if (!mailbox_spool_file) {
+         return;
+     }
+     mailbox_t *mb = mailbox_find(clients[idx].clientID, 0);
+     if (!mb) {
+         return;
+     }
+     mailbox_unaway(mb - mailboxes);
+     unsigned long n = mb->next - mb->read;
+     if (n == 0) {
+         return;
+     }
+     pthread_mutex_lock(&out_lock[idx]);
+     for (unsigned long s = mb->read; s < mb->next; s++) {
+         outq_push(idx, &mb->frames[s % MAILBOX_FRAMES].msg, 0, NULL);
+     }
+     pthread_cond_broadcast(&out_cond[idx]);
+     pthread_mutex_unlock(&out_lock[idx]);
+ 
+     unsigned char rec[MAX_NAME + 32];
+     size_t len = mailbox_record(rec, MBX_READ, mb);
+     len += cap_put_varint(rec + len, n);
+     mailbox_spool(rec, len);
+     mailbox_consume(mb, n);
+     STAT_ADD(mailbox_delivered, n);
+     printf("Delivered %lu offline frames to '%s'.\n", n, clients[idx].clientID);
+     mailbox_check_growth();
+ }
+ 
+ // --------------------- MESSAGE SEARCH ---------------------
+ //
+ // With -s every MESSAGE posted to a session is indexed so members can
+ // find it again with SEARCH instead of asking the room.  Posting only
+ // queues a copy (search_ingest); the index thread takes the queue in
+ // batches and turns each batch into a segment: the messages, plus an
+ // inverted index from every word and the session to the sorted list of
+ // messages that contain it, stored as varint deltas.  Segments never
+ // change once published.  The index thread merges the newest two while
+ // the older is at most twice the size of the newer, so a span holds a
+ // logarithmic number of segments, but never across a SEARCH_SEGMENT_SECS
+ // boundary: each segment covers a bounded time span, and a time-limited
+ // search skips whole segments by their range.  Past SEARCH_MAX_DOCS the
+ // oldest segment is dropped.  Searches walk the segments newest first
+ // under a read lock; the index thread takes it for writing only to swap
+ // segments in and out.  The index is in memory and starts empty with
+ // each process.
+ 
+ /**
+  * Copy the next word of 's' from '*pos', lowercased and cut at
+  * SEARCH_WORD_MAX, into 'word'.  Words are runs of letters, digits and
+  * non-ASCII bytes, at least two long.  Returns its length, 0 at the end.
+  */
+ static int search_word(const char *s, size_t *pos, char *word) {
+     size_t i = *pos;
+     while (s[i]) {
+         while (s[i] && !(isalnum((unsigned char)s[i]) || (unsigned char)s[i] >= 0x80)) {
+             i++;
+         }
+         int n = 0;
+         while (isalnum((unsigned char)s[i]) || (unsigned char)s[i] >= 0x80) {
+             if (n < SEARCH_WORD_MAX) {
+                 word[n++] = (char)tolower((unsigned char)s[i]);
+             }
+             i++;
+         }
+         if (n >= 2) {
+             word[n] = '\0';
+             *pos = i;
+             return n;
+         }
+     }
+     *pos = i;
+     return 0;
+ }
+ 
+ static size_t search_varint_get(const unsigned char *p, uint32_t *v) {
+     size_t n = 0;
+     *v = 0;
+     do {
+         *v |= (uint32_t)(p[n] & 0x7f) << (7 * n);
+     } while (p[n++] & 0x80);
+     return n;
+ }
+ 
+ /**
+  * Decode the posting list of term 't' into 'out'; returns its length.
+  */
+ static uint32_t search_postings(const search_seg_t *seg, const search_term_t *t, uint32_t *out) {
+     const unsigned char *p = seg->postings + t->post;
+     uint32_t doc = 0, d;
+     for (uint32_t i = 0; i < t->count; i++) {
+         p += search_varint_get(p, &d);
+         doc += d;
+         out[i] = doc;
+     }
+     return t->count;
+ }
+ 
+ static size_t search_postings_end(const search_seg_t *seg, uint32_t i) {
+     return (i + 1 < seg->num_terms) ? seg->terms[i + 1].post : seg->post_len;
+ }
+ 
+ static const search_term_t *search_find_term(const search_seg_t *seg, const char *word) {
+     uint32_t lo = 0, hi = seg->num_terms;
+     while (lo < hi) {
+         uint32_t mid = (lo + hi) / 2;
+         int c = strcmp(seg->term_blob + seg->terms[mid].term, word);
+         if (c == 0) {
+             return &seg->terms[mid];
+         }
+         if (c < 0) {
+             lo = mid + 1;
+         } else {
+             hi = mid;
+         }
+     }
+     return NULL;
+ }
+ 
+ static size_t search_seg_bytes(const search_seg_t *seg) {
+     return sizeof(*seg) + seg->num_docs * sizeof(search_doc_t) + seg->text_len +
+            seg->num_terms * sizeof(search_term_t) + seg->term_len + seg->post_len;
+ }
+ 
+ static void search_seg_free(search_seg_t *seg) {
+     STAT_ADD(mem[MEM_SEARCH], -(long)search_seg_bytes(seg));
+     free(seg->docs);
+     free(seg->text);
+     free(seg->terms);
+     free(seg->term_blob);
+     free(seg->postings);
+     free(seg);
+ }
+ 
+ typedef struct {
+     const char *term;
+     uint32_t doc;
+ } search_pair_t;
+ 
+ static int search_pair_cmp(const void *a, const void *b) {
+     const search_pair_t *x = a, *y = b;
+     int c = strcmp(x->term, y->term);
+     return c ? c : (x->doc > y->doc) - (x->doc < y->doc);
+ }
+ 
+ /**
+  * Build a segment from 'n' pending messages, oldest first, numbered from
+  * 'base'.  Returns NULL if out of memory.
+  */
+ static search_seg_t *search_seg_build(search_pending_t *p, uint32_t n, uint32_t base) {
+     size_t text_len = 0, text_only = 0;
+     for (search_pending_t *q = p; q; q = q->next) {
+         size_t t = strlen(q->text);
+         text_len += strlen(q->session) + strlen(q->source) + t + 3;
+         text_only += t;
+     }
+     size_t max_pairs = text_only / 2 + 2 * (size_t)n;
+     search_seg_t *seg = calloc(1, sizeof(*seg));
+     char *scratch = malloc(2 * text_only + (size_t)n * (MAX_NAME + 2) + 1);
+     search_pair_t *pairs = malloc(max_pairs * sizeof(search_pair_t));
+     if (seg) {
+         seg->docs = malloc(n * sizeof(search_doc_t));
+         seg->text = malloc(text_len);
+     }
+     if (!seg || !scratch || !pairs || !seg->docs || !seg->text) {
+         goto fail;
+     }
+     seg->base = base;
+     seg->num_docs = n;
+     seg->t_min = p->t_ms;
+     size_t off = 0, words = 0, npairs = 0;
+     uint32_t i = 0;
+     for (search_pending_t *q = p; q; q = q->next, i++) {
+         seg->docs[i].t_ms = q->t_ms;
+         seg->docs[i].off = off;
+         seg->t_max = q->t_ms;
+         off += sprintf(seg->text + off, "%s", q->session) + 1;
+         off += sprintf(seg->text + off, "%s", q->source) + 1;
+         off += sprintf(seg->text + off, "%s", q->text) + 1;
+         pairs[npairs].term = scratch + words;
+         pairs[npairs++].doc = i;
+         words += sprintf(scratch + words, "#%s", q->session) + 1;
+         size_t pos = 0;
+         int len;
+         while ((len = search_word(q->text, &pos, scratch + words)) > 0) {
+             pairs[npairs].term = scratch + words;
+             pairs[npairs++].doc = i;
+             words += len + 1;
+         }
+     }
+     seg->text_len = off;
+     qsort(pairs, npairs, sizeof(search_pair_t), search_pair_cmp);
+ 
+     size_t term_len = 0;
+     uint32_t num_terms = 0;
+     for (size_t k = 0; k < npairs; k++) {
+         if (k == 0 || strcmp(pairs[k].term, pairs[k - 1].term) != 0) {
+             term_len += strlen(pairs[k].term) + 1;
+             num_terms++;
+         }
+     }
+     seg->terms = malloc((num_terms + 1) * sizeof(search_term_t));
+     seg->term_blob = malloc(term_len + 1);
+     seg->postings = malloc(npairs * 5 + 1);
+     if (!seg->terms || !seg->term_blob || !seg->postings) {
+         goto fail;
+     }
+     for (size_t k = 0; k < npairs; k++) {
+         int new_term = (k == 0 || strcmp(pairs[k].term, pairs[k - 1].term) != 0);
+         if (new_term) {
+             search_term_t *t = &seg->terms[seg->num_terms++];
+             t->term = seg->term_len;
+             t->post = seg->post_len;
+             t->count = 0;
+             seg->term_len += sprintf(seg->term_blob + seg->term_len, "%s", pairs[k].term) + 1;
+         } else if (pairs[k].doc == pairs[k - 1].doc) {
+             continue;  // word repeated within one message
+         }
+         uint32_t prev = new_term ? 0 : pairs[k - 1].doc;
+         seg->post_len += cap_put_varint(seg->postings + seg->post_len, pairs[k].doc - prev);
+         seg->terms[seg->num_terms - 1].count++;
+     }
+     free(scratch);
+     free(pairs);
+     STAT_ADD(mem[MEM_SEARCH], search_seg_bytes(seg));
+     return seg;
+ 
+ fail:
+     if (seg) {
+         free(seg->docs);
+         free(seg->text);
+         free(seg->terms);
+         free(seg->term_blob);
+         free(seg->postings);
+         free(seg);
+     }
+     free(scratch);
+     free(pairs);
+     return NULL;
+ }
+ 
+ /**
+  * Append the posting list of term 'i' of 'from' to 'to', whose docs are
+  * numbered 'shift' lower and whose last listed doc was 'last' (or none if
+  * 'first').  Returns the last doc appended, in 'to''s numbering.
+  */
+ static uint32_t search_append_postings(search_seg_t *to, const search_seg_t *from, uint32_t i,
+                                        uint32_t shift, uint32_t last, int first) {
+     const search_term_t *t = &from->terms[i];
+     const unsigned char *p = from->postings + t->post;
+     const unsigned char *end = from->postings + search_postings_end(from, i);
+     uint32_t doc;
+     p += search_varint_get(p, &doc);
+     doc += shift;
+     to->post_len += cap_put_varint(to->postings + to->post_len, first ? doc : doc - last);
+     memcpy(to->postings + to->post_len, p, end - p);  // later deltas are unchanged
+     to->post_len += end - p;
+     while (p < end) {
+         uint32_t d;
+         p += search_varint_get(p, &d);
+         doc += d;
+     }
+     to->terms[to->num_terms - 1].count += t->count;
+     return doc;
+ }
+ 
+ /**
+  * Merge two adjacent segments into a new one.  Returns NULL if out of
+  * memory.
+  */
+ static search_seg_t *search_seg_merge(const search_seg_t *older, const search_seg_t *newer) {
+     search_seg_t *seg = calloc(1, sizeof(*seg));
+     if (!seg) {
+         return NULL;
+     }
+     seg->base = older->base;
+     seg->num_docs = older->num_docs + newer->num_docs;
+     seg->t_min = older->t_min < newer->t_min ? older->t_min : newer->t_min;
+     seg->t_max = older->t_max > newer->t_max ? older->t_max : newer->t_max;
+     seg->text_len = older->text_len + newer->text_len;
+     seg->docs = malloc(seg->num_docs * sizeof(search_doc_t));
+     seg->text = malloc(seg->text_len);
+     seg->terms = malloc((older->num_terms + newer->num_terms + 1) * sizeof(search_term_t));
+     seg->term_blob = malloc(older->term_len + newer->term_len + 1);
+     seg->postings = malloc(older->post_len + newer->post_len + 5 * (size_t)newer->num_terms + 1);
+     if (!seg->docs || !seg->text || !seg->terms || !seg->term_blob || !seg->postings) {
+         free(seg->docs);
+         free(seg->text);
+         free(seg->terms);
+         free(seg->term_blob);
+         free(seg->postings);
+         free(seg);
+         return NULL;
+     }
+     memcpy(seg->docs, older->docs, older->num_docs * sizeof(search_doc_t));
+     for (uint32_t k = 0; k < newer->num_docs; k++) {
+         seg->docs[older->num_docs + k].t_ms = newer->docs[k].t_ms;
+         seg->docs[older->num_docs + k].off = newer->docs[k].off + older->text_len;
+     }
+     memcpy(seg->text, older->text, older->text_len);
+     memcpy(seg->text + older->text_len, newer->text, newer->text_len);
+ 
+     uint32_t i = 0, j = 0;
+     while (i < older->num_terms || j < newer->num_terms) {
+         const char *a = i < older->num_terms ? older->term_blob + older->terms[i].term : NULL;
+         const char *b = j < newer->num_terms ? newer->term_blob + newer->terms[j].term : NULL;
+         int c = !a ? 1 : !b ? -1 : strcmp(a, b);
+         search_term_t *t = &seg->terms[seg->num_terms++];
+         t->term = seg->term_len;
+         t->post = seg->post_len;
+         t->count = 0;
+         seg->term_len += sprintf(seg->term_blob + seg->term_len, "%s", c <= 0 ? a : b) + 1;
+         uint32_t last = 0;
+         int first = 1;
+         if (c <= 0) {
+             last = search_append_postings(seg, older, i++, 0, 0, 1);
+             first = 0;
+         }
+         if (c >= 0) {
+             search_append_postings(seg, newer, j++, older->num_docs, last, first);
+         }
+     }
+     STAT_ADD(mem[MEM_SEARCH], search_seg_bytes(seg));
+     return seg;
+ }
+ 
+ /**
+  * Queue a MESSAGE posted by 'source' to 'session' for indexing.  Never
+  * blocks on the index: if the indexer is SEARCH_PENDING_MAX behind, the
+  * message is not indexed.
+  */
+ void search_ingest(const char *session, const char *source, const struct message *msg) {
+     if (!search_on) {
+         return;
+     }
+     size_t len = strnlen((const char*)msg->data, MAX_DATA - 1);
+     search_pending_t *p = malloc(sizeof(*p) + len + 1);
+     if (!p) {
+         STAT_ADD(search_skipped, 1);
+         return;
+     }
+     struct timespec ts;
+     clock_gettime(CLOCK_REALTIME, &ts);
+     p->t_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+     strncpy(p->session, session, MAX_NAME - 1);
+     p->session[MAX_NAME - 1] = '\0';
+     strncpy(p->source, source, MAX_NAME - 1);
+     p->source[MAX_NAME - 1] = '\0';
+     memcpy(p->text, msg->data, len);
+     p->text[len] = '\0';
+     pthread_mutex_lock(&search_lock);
+     if (search_num_pending >= SEARCH_PENDING_MAX) {
+         pthread_mutex_unlock(&search_lock);
+         free(p);
+         STAT_ADD(search_skipped, 1);
+         return;
+     }
+     p->next = search_pending;
+     search_pending = p;
+     if (search_num_pending++ == 0) {
+         pthread_cond_signal(&search_cond);
+     }
+     pthread_mutex_unlock(&search_lock);
+ }
+ 
+ /**
+  * Merge the two newest segments while the tiering rule allows it.
+  */
+ static void search_merge_newest(void) {
+     while (search_segs && search_segs->next) {
+         search_seg_t *newer = search_segs, *older = newer->next;
+         uint64_t span = SEARCH_SEGMENT_SECS * 1000ULL;
+         if (older->num_docs > 2 * newer->num_docs ||
+             older->num_docs + newer->num_docs > SEARCH_SEGMENT_DOCS ||
+             older->t_min / span != newer->t_max / span) {
+             return;
+         }
+         search_seg_t *merged = search_seg_merge(older, newer);
+         if (!merged) {
+             return;
+         }
+         pthread_rwlock_wrlock(&search_segs_lock);
+         merged->next = older->next;
+         search_segs = merged;
+         pthread_rwlock_unlock(&search_segs_lock);
+         search_seg_free(newer);
+         search_seg_free(older);
+         STAT_ADD(search_merges, 1);
+     }
+ }
+ 
+ /**
+  * Index thread: turns queued messages into segments and merges them.
+  */
+ void *search_indexer(void *arg) {
+     while (1) {
+         pthread_mutex_lock(&search_lock);
+         while (!search_pending) {
+             pthread_cond_wait(&search_cond, &search_lock);
+         }
+         search_pending_t *batch = search_pending;
+         search_pending = NULL;
+         search_num_pending = 0;
+         pthread_mutex_unlock(&search_lock);
+ 
+         // The queue is newest first; index oldest first.
+         search_pending_t *fifo = NULL;
+         while (batch) {
+             search_pending_t *next = batch->next;
+             batch->next = fifo;
+             fifo = batch;
+             batch = next;
+         }
+         while (fifo) {
+             // Large bursts are cut into segments of at most SEARCH_SEGMENT_DOCS.
+             search_pending_t *chunk = fifo, *tail = fifo;
+             uint32_t k = 1;
+             while (tail->next && k < SEARCH_SEGMENT_DOCS) {
+                 tail = tail->next;
+                 k++;
+             }
+             fifo = tail->next;
+             tail->next = NULL;
+             search_seg_t *seg = search_seg_build(chunk, k, search_next_doc);
+             while (chunk) {
+                 search_pending_t *next = chunk->next;
+                 free(chunk);
+                 chunk = next;
+             }
+             if (!seg) {
+                 STAT_ADD(search_skipped, k);
+                 continue;
+             }
+             search_next_doc += k;
+             search_num_docs += k;
+             pthread_rwlock_wrlock(&search_segs_lock);
+             seg->next = search_segs;
+             search_segs = seg;
+             pthread_rwlock_unlock(&search_segs_lock);
+             STAT_ADD(search_indexed, k);
+             search_merge_newest();
+         }
+ 
+         // Drop the oldest segments past the limit.
+         while (search_num_docs > SEARCH_MAX_DOCS && search_segs && search_segs->next) {
+             pthread_rwlock_wrlock(&search_segs_lock);
+             search_seg_t **pp = &search_segs;
+             while ((*pp)->next) {
+                 pp = &(*pp)->next;
+             }
+             search_seg_t *oldest = *pp;
+             *pp = NULL;
+             pthread_rwlock_unlock(&search_segs_lock);
+             search_num_docs -= oldest->num_docs;
+             search_seg_free(oldest);
+         }
+     }
+     return NULL;
+ }
+ 
+ /**
+  * Parse SEARCH data, "<words> [since=<t>] [until=<t>] [limit=<n>]", where
+  * times are Unix seconds or, if negative, seconds before now.  Returns
+  * 0, or -1 if it is malformed.
+  */
+ int parse_search(const char *data, search_query_t *q) {
+     memset(q, 0, sizeof(*q));
+     q->until = UINT64_MAX;
+     q->limit = SEARCH_DEFAULT_LIMIT;
+     time_t now = time(NULL);
+ 
+     char buf[MAX_DATA];
+     strncpy(buf, data, MAX_DATA - 1);
+     buf[MAX_DATA - 1] = '\0';
+     char *save = NULL;
+     for (char *tok = strtok_r(buf, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+         if (strncmp(tok, "since=", 6) == 0 || strncmp(tok, "until=", 6) == 0) {
+             char *end;
+             long long t = strtoll(tok + 6, &end, 10);
+             if (*end || end == tok + 6) {
+                 return -1;
+             }
+             if (t < 0) {
+                 t += now;
+             }
+             uint64_t ms = t > 0 ? (uint64_t)t * 1000 : 0;
+             if (tok[0] == 's') {
+                 q->since = ms;
+             } else {
+                 q->until = ms + 999;
+             }
+         } else if (strncmp(tok, "limit=", 6) == 0 && atoi(tok + 6) > 0) {
+             q->limit = atoi(tok + 6);
+             if (q->limit > SEARCH_MAX_LIMIT) {
+                 q->limit = SEARCH_MAX_LIMIT;
+             }
+         } else {
+             size_t pos = 0;
+             char word[SEARCH_WORD_MAX + 1];
+             while (search_word(tok, &pos, word) > 0) {
+                 if (q->num_words == SEARCH_MAX_TERMS) {
+                     return -1;
+                 }
+                 strcpy(q->words[q->num_words++], word);
+             }
+         }
+     }
+     return 0;
+ }
+ 
+ static void search_reply(int idx, const char *text) {
+     struct message ack;
+     memset(&ack, 0, sizeof(ack));
+     ack.type = SE_ACK;
+     snprintf((char*)ack.data, MAX_DATA, "%s", text);
+     ack.size = strlen((char*)ack.data);
+     send_reply(idx, &ack);
+ }
+ 
+ /**
+  * Answer a SEARCH from slot 'idx' with an SE_HIT per match, newest first,
+  * then an SE_ACK.  Only sessions the client is in are searched.  Runs
+  * without the global mutex except to copy the client's session list.
+  */
+ void search_request(int idx, struct message *msg) {
+     if (!search_on) {
+         search_reply(idx, "Search is not enabled on this server");
+         return;
+     }
+     search_query_t q;
+     msg->data[MAX_DATA - 1] = '\0';
+     if (parse_search((char*)msg->data, &q) < 0) {
+         search_reply(idx, "Invalid search. Use: <words> [since=<t>] [until=<t>] [limit=<n>]");
+         return;
+     }
+     char session[MAX_NAME];
+     strncpy(session, (char*)msg->session, MAX_NAME - 1);
+     session[MAX_NAME - 1] = '\0';
+ 
+     char joined[MAX_SESSIONS][MAX_NAME];
+     int num_joined = 0, member = 0;
+     global_lock();
+     client_t *c = &clients[idx];
+     for (int i = 0; i < c->session_count && num_joined < MAX_SESSIONS; i++) {
+         strcpy(joined[num_joined++], c->sessions[i]);
+         member |= (strcmp(c->sessions[i], session) == 0);
+     }
+     pthread_mutex_unlock(&mutex);
+     if (session[0] && !member) {
+         char text[MAX_NAME + 32];
+         snprintf(text, sizeof(text), "%s: not a member", session);
+         search_reply(idx, text);
+         return;
+     }
+     if (session[0]) {
+         snprintf(q.words[q.num_words++], MAX_NAME + 1, "#%s", session);
+     }
+     if (q.num_words == 0) {
+         search_reply(idx, "Invalid search. Use: <words> [since=<t>] [until=<t>] [limit=<n>]");
+         return;
+     }
+     STAT_ADD(searches, 1);
+ 
+     uint32_t *cand = malloc(2 * SEARCH_SEGMENT_DOCS * sizeof(uint32_t));
+     if (!cand) {
+         search_reply(idx, "Search failed: out of memory");
+         return;
+     }
+     uint32_t *other = cand + SEARCH_SEGMENT_DOCS;
+     int hits = 0;
+     pthread_rwlock_rdlock(&search_segs_lock);
+     for (search_seg_t *seg = search_segs; seg && hits < q.limit; seg = seg->next) {
+         if (seg->t_max < q.since || seg->t_min > q.until) {
+             continue;
+         }
+         // Intersect the posting lists, shortest first.
+         const search_term_t *terms[SEARCH_MAX_TERMS + 1];
+         int shortest = 0, missing = 0;
+         for (int w = 0; w < q.num_words && !missing; w++) {
+             terms[w] = search_find_term(seg, q.words[w]);
+             missing = !terms[w];
+             if (!missing && terms[w]->count < terms[shortest]->count) {
+                 shortest = w;
+             }
+         }
+         if (missing) {
+             continue;
+         }
+         uint32_t n = search_postings(seg, terms[shortest], cand);
+         for (int w = 0; w < q.num_words && n > 0; w++) {
+             if (w == shortest) {
+                 continue;
+             }
+             uint32_t m = search_postings(seg, terms[w], other), kept = 0;
+             for (uint32_t a = 0, b = 0; a < n && b < m; ) {
+                 if (cand[a] < other[b]) {
+                     a++;
+                 } else if (cand[a] > other[b]) {
+                     b++;
+                 } else {
+                     cand[kept++] = cand[a++];
+                     b++;
+                 }
+             }
+             n = kept;
+         }
+         for (uint32_t k = n; k-- > 0 && hits < q.limit; ) {
+             const search_doc_t *d = &seg->docs[cand[k]];
+             if (d->t_ms < q.since || d->t_ms > q.until) {
+                 continue;
+             }
+             const char *sess = seg->text + d->off;
+             const char *source = sess + strlen(sess) + 1;
+             const char *text = source + strlen(source) + 1;
+             int allowed = (session[0] != '\0');
+             for (int i = 0; i < num_joined && !allowed; i++) {
+                 allowed = (strcmp(joined[i], sess) == 0);
+             }
+             if (!allowed) {
+                 continue;
+             }
+             struct message hit;
+             memset(&hit, 0, sizeof(hit));
+             hit.type = SE_HIT;
+             strncpy((char*)hit.source, source, MAX_NAME - 1);
+             strncpy((char*)hit.session, sess, MAX_NAME - 1);
+             snprintf((char*)hit.data, REQ_ID_OFF, "%llu %s", (unsigned long long)d->t_ms, text);
+             hit.size = strlen((char*)hit.data);
+             send_reply(idx, &hit);
+             hits++;
+         }
+     }
+     pthread_rwlock_unlock(&search_segs_lock);
+     free(cand);
+ 
+     char text[32];
+     snprintf(text, sizeof(text), "%d hits", hits);
+     search_reply(idx, text);
+ }
+ 
+ // --------------------- INACTIVITY MONITOR THREAD ---------------------
+ 
+ void *inactivity_monitor(void *arg) {
+     while (1) {
+         sleep(5);  // Check every 5 seconds
+         global_lock();
+         time_t now = time(NULL);
+         for (int i = 0; i < MAX_CLIENTS; i++) {
+             if (client_hot.active[i]) {
+                 time_t last = atomic_load_explicit(&client_hot.last_active[i], memory_order_relaxed);
+                 if (difftime(now, last) > INACTIVITY_THRESHOLD) {
+                     printf("Disconnecting client '%s' due to inactivity.\n", clients[i].clientID);
+                     mailbox_away(i);
+                     release_client(i);
+                     shutdown(clients[i].sockfd, SHUT_RDWR);  // reader thread closes it
+                 }
+             }
+         }
+         rcu_reclaim();  // what a quiet server retired since the last batch
+         mailbox_flush();
+         pthread_mutex_unlock(&mutex);
+         capture_flush();
+         mailbox_rewrite();
+     }
+     return NULL;
+ }
+ 
+ // --------------------- PER-CLIENT THREAD ---------------------
+ 
+ /**
+  * Join slot 'idx' to an existing session and answer with JN_ACK or JN_NAK.
+  * Returns 0 if the client is a member afterwards.  Called with the global
+  * mutex held.
+  */
+ int join_session(int idx, const char *sessionID) {
+     client_t *c = &clients[idx];
+     struct message reply;
+     memset(&reply, 0, sizeof(reply));
+     int rc = -1;
+     if (find_session(sessionID) < 0) {
+         reply.type = JN_NAK;
+         snprintf((char*)reply.data, MAX_DATA, "%s: session not found", sessionID);
+     } else {
+         int alreadyIn = 0;
+         for (int i = 0; i < c->session_count; i++) {
+             if (strcmp(c->sessions[i], sessionID) == 0) {
+                 alreadyIn = 1;
+                 break;
+             }
+         }
+         if (alreadyIn) {
+             rc = 0;
+         } else if (add_client_to_session(c->clientID, sessionID) == 0) {
+             if (c->session_count < MAX_SESSIONS) {
+                 strncpy(c->sessions[c->session_count], sessionID, MAX_NAME - 1);
+                 c->session_count++;
+             }
+             printf("Client '%s' joined session '%s'.\n", c->clientID, sessionID);
+             rc = 0;
+         }
+         if (rc == 0) {
+             reply.type = JN_ACK;
+             strncpy((char*)reply.data, sessionID, MAX_DATA - 1);
+         } else {
+             reply.type = JN_NAK;
+             strcpy((char*)reply.data, "Session is full or error adding");
+         }
+     }
+     send_reply(idx, &reply);
+     return rc;
+ }
+ 
+ /**
+  * Remove slot 'idx' from a session it belongs to.  Returns 0 if it left,
+  * -1 if it was not a member.  Called with the global mutex held.
+  */
+ int leave_session(int idx, const char *sessionID) {
+     client_t *c = &clients[idx];
+     int found = -1;
+     for (int i = 0; i < c->session_count; i++) {
+         if (strcmp(c->sessions[i], sessionID) == 0) {
+             found = i;
+             break;
+         }
+     }
+     if (found == -1) {
+         return -1;
+     }
+     remove_client_from_session(c->clientID, sessionID);
+     for (int i = found; i < c->session_count - 1; i++) {
+         strcpy(c->sessions[i], c->sessions[i+1]);
+     }
+     c->session_count--;
+     printf("Client '%s' left session '%s'.\n", c->clientID, sessionID);
+     return 0;
+ }
+ 
+ void *client_thread(void *arg) {
+     int my_index = (int)(intptr_t)arg;
+     int sockfd = clients[my_index].sockfd;
+     char clientID[MAX_NAME];
+     strcpy(clientID, clients[my_index].clientID);
+     bucket_init(&clients[my_index].msg_bucket, RATE_MSGS_BURST);
+     bucket_init(&clients[my_index].byte_bucket, RATE_BYTES_BURST);
+ 
+     struct message *msg;              // Decoded in place in the rx buffer
+     unsigned long busy_since = 0;     // Start of the frame being handled
+ 
+     while (1) {
+         if (busy_since) {
+             STAT_ADD(busy_ns[0], now_ns() - busy_since);
+             busy_since = 0;
+         }
+         arena_reset(&clients[my_index].arena);
+         outq_wait_room(my_index);
+         int rc = recv_client_message(my_index, &msg);
+         if (rc == 1) {
+             park_for_upgrade();
+             continue;
+         }
+         if (rc < 0) {
+             break;
+         }
+         unsigned long ingress = now_ns();
+         busy_since = ingress;
+         lat_trace.ingress = 0;
+         STAT_ADD(frames_in, 1);
+         STAT_ADD(bytes_in, sizeof(struct message));
+         capture_frame(my_index, msg);
+         reply_id = req_id_take(msg);
+         // Update last activity time upon receiving any message.
+         atomic_store_explicit(&client_hot.last_active[my_index], time(NULL), memory_order_relaxed);
+ 
+         // Per-client rate limits; excess traffic is shed before any locking.
+         unsigned long dispatch = 0;
+         if (msg->type == MESSAGE || msg->type == DIRECT || msg->type == CROSSPOST) {
+             if (!rate_admit(my_index, msg)) {
+                 continue;
+             }
+             if (lat_stamp) {
+                 lat_stamp_frame(msg);
+             }
+             dispatch = now_ns();
+         }
+ 
+         // QUERY is answered from the presence snapshot without the global mutex.
+         if (msg->type == QUERY) {
+             query_t q;
+             msg->data[MAX_DATA - 1] = '\0';
+             if (parse_query((char*)msg->data, &q) < 0) {
+                 struct message nak;
+                 memset(&nak, 0, sizeof(nak));
+                 nak.type = QU_NAK;
+                 snprintf((char*)nak.data, MAX_DATA,
+                          "Invalid query. Use: [users|sessions|all] [prefix=<p>] [after=<cursor>] [limit=<n>]");
+                 nak.size = strlen((char*)nak.data);
+                 send_reply(my_index, &nak);
+                 continue;
+             }
+             send_listing(my_index, &q);
+             continue;
+         }
+ 
+         // SEARCH runs against the index, not the session tables.
+         if (msg->type == SEARCH) {
+             search_request(my_index, msg);
+             continue;
+         }
+ 
+         // Re-joining a session we are already in changes nothing.
+         if (msg->type == JOIN) {
+             msg->data[MAX_NAME - 1] = '\0';
+             if (presence_is_member(clientID, (char*)msg->data)) {
+                 struct message ack;
+                 memset(&ack, 0, sizeof(ack));
+                 ack.type = JN_ACK;
+                 strncpy((char*)ack.data, (char*)msg->data, MAX_DATA - 1);
+                 send_reply(my_index, &ack);
+                 continue;
+             }
+         }
+ 
+         global_lock();
+ 
+         if (msg->type == EXIT) {
+             release_client(my_index);
+             pthread_mutex_unlock(&mutex);
+             printf("Client '%s' logged out.\n", clientID);
+             break;
+         }
+         else if (msg->type == JOIN) {
+             char sessionID[MAX_NAME] = {0};
+             strncpy(sessionID, (char*)msg->data, MAX_NAME - 1);
+             join_session(my_index, sessionID);
+         }
+         else if (msg->type == LEAVE_SESS) {
+             char sessionID[MAX_NAME] = {0};
+             strncpy(sessionID, (char*)msg->session, MAX_NAME - 1);
+             leave_session(my_index, sessionID);
+         }
+         else if (msg->type == JOIN_BATCH || msg->type == LEAVE_BATCH) {
+             int done = 0, total = 0;
+             char *save = NULL;
+             msg->data[REQ_ID_OFF - 1] = '\0';
+             for (char *name = strtok_r((char*)msg->data, " \t\r\n", &save); name;
+                  name = strtok_r(NULL, " \t\r\n", &save)) {
+                 char sessionID[MAX_NAME] = {0};
+                 strncpy(sessionID, name, MAX_NAME - 1);
+                 int rc = (msg->type == JOIN_BATCH) ? join_session(my_index, sessionID)
+                                                   : leave_session(my_index, sessionID);
+                 done += (rc == 0);
+                 total++;
+             }
+             struct message ack;
+             memset(&ack, 0, sizeof(ack));
+             ack.type = BATCH_ACK;
+             snprintf((char*)ack.data, MAX_DATA, "%s %d/%d",
+                      msg->type == JOIN_BATCH ? "join" : "leave", done, total);
+             ack.size = strlen((char*)ack.data);
+             send_reply(my_index, &ack);
+         }
+         else if (msg->type == NEW_SESS) {
+             char newSessionID[MAX_NAME];
+             strncpy(newSessionID, (char*)msg->data, MAX_NAME - 1);
+             int sidx = create_session(newSessionID);
+             if (sidx < 0) {
+                 struct message nak;
+                 memset(&nak, 0, sizeof(nak));
+                 nak.type = JN_NAK;
+                 snprintf((char*)nak.data, MAX_DATA, "Failed to create session %s", newSessionID);
+                 send_reply(my_index, &nak);
+             } else {
+                 add_client_to_session(clientID, newSessionID);
+                 if (clients[my_index].session_count < MAX_SESSIONS) {
+                     strncpy(clients[my_index].sessions[clients[my_index].session_count],
+                             newSessionID, MAX_NAME - 1);
+                     clients[my_index].session_count++;
+                 }
+                 struct message ack;
+                 memset(&ack, 0, sizeof(ack));
+                 ack.type = NS_ACK;
+                 strncpy((char*)ack.data, newSessionID, MAX_DATA - 1);
+                 send_reply(my_index, &ack);
+                 printf("Client '%s' created session '%s'.\n", clientID, newSessionID);
+             }
+         }
+         else if (msg->type == MESSAGE) {
+             strncpy((char*)msg->source, clientID, MAX_NAME - 1);
+             if (fanout_admit((char*)msg->session)) {
+                 int sidx = find_session((char*)msg->session);
+                 lat_trace.ingress = ingress;
+                 lat_trace.session = sidx >= 0 ? sessions[sidx].lat : NULL;
+                 lat_trace_record(lat_trace.session, LAT_PARSE, dispatch - ingress);
+                 STAT_ADD(messages, 1);
+                 if (lat_trace.session) {
+                     atomic_fetch_add_explicit(&lat_trace.session->messages, 1,
+                                               memory_order_relaxed);
+                 }
+                 if (sidx >= 0) {
+                     session_post(sidx, msg, ingress);
+                     search_ingest(sessions[sidx].sessionID, clientID, msg);
+                 } else {
+                     broadcast_message((char*)msg->session, msg);  // topic subscribers only
+                 }
+                 lat_trace_record(lat_trace.session, LAT_FANOUT, now_ns() - dispatch);
+                 lat_trace.ingress = 0;
+             } else {
+                 clients[my_index].throttled++;
+                 STAT_ADD(throttled, 1);
+                 send_throttle(my_index, "Session is over its fan-out budget, message dropped");
+             }
+         }
+         else if (msg->type == CROSSPOST) {
+             // One frame for all targets; each still pays its own fan-out budget.
+             char targets[CROSSPOST_MAX][MAX_NAME];
+             int n = crosspost_parse(msg, targets);
+             if (n < 0) {
+                 struct message nak;
+                 memset(&nak, 0, sizeof(nak));
+                 nak.type = CP_NAK;
+                 snprintf((char*)nak.data, MAX_DATA,
+                          "Malformed CROSSPOST. Use: <session> <session>... (at most %d), newline, text",
+                          CROSSPOST_MAX);
+                 nak.size = strlen((char*)nak.data);
+                 send_reply(my_index, &nak);
+             }
+             int admitted = 0;
+             for (int t = 0; t < n; t++) {
+                 if (!fanout_admit(targets[t])) {
+                     continue;
+                 }
+                 if (admitted < t) {
+                     strcpy(targets[admitted], targets[t]);
+                 }
+                 admitted++;
+             }
+             if (admitted > 0) {
+                 strncpy((char*)msg->source, clientID, MAX_NAME - 1);
+                 msg->type = MESSAGE;
+                 int sidx = find_session(targets[0]);
+                 lat_trace.ingress = ingress;
+                 lat_trace.session = sidx >= 0 ? sessions[sidx].lat : NULL;
+                 lat_trace_record(lat_trace.session, LAT_PARSE, dispatch - ingress);
+                 STAT_ADD(messages, 1);
+                 if (lat_trace.session) {
+                     atomic_fetch_add_explicit(&lat_trace.session->messages, 1,
+                                               memory_order_relaxed);
+                 }
+                 multicast_message(targets, admitted, msg);
+                 for (int t = 0; t < admitted; t++) {
+                     if (find_session(targets[t]) >= 0) {
+                         search_ingest(targets[t], clientID, msg);
+                     }
+                 }
+                 lat_trace_record(lat_trace.session, LAT_FANOUT, now_ns() - dispatch);
+                 lat_trace.ingress = 0;
+             }
+             if (admitted < n) {
+                 clients[my_index].throttled++;
+                 STAT_ADD(throttled, 1);
+                 send_throttle(my_index, "Session is over its fan-out budget, message dropped");
+             }
+         }
+         else if (msg->type == DIRECT) {
+             char targetID[MAX_NAME];
+             strncpy(targetID, (char*)msg->session, MAX_NAME - 1);
+             targetID[MAX_NAME - 1] = '\0';
+             int tidx = find_client_by_id(targetID);
+             strncpy((char*)msg->source, clientID, MAX_NAME - 1);
+             if (tidx < 0 && mailbox_direct(targetID, msg) == 0) {
+                 // kept until the recipient logs in
+             } else if (tidx < 0) {
+                 struct message nak;
+                 memset(&nak, 0, sizeof(nak));
+                 nak.type = DM_NAK;
+                 strncpy((char*)nak.session, targetID, MAX_NAME - 1);
+                 snprintf((char*)nak.data, MAX_DATA, "%s: user not logged in", targetID);
+                 send_reply(my_index, &nak);
+             } else {
+                 lat_trace.ingress = ingress;
+                 lat_trace.session = NULL;
+                 lat_trace_record(NULL, LAT_PARSE, dispatch - ingress);
+                 send_to_client(tidx, msg);
+                 lat_trace_record(NULL, LAT_FANOUT, now_ns() - dispatch);
+                 lat_trace.ingress = 0;
+             }
+         }
+         else if (msg->type == SUBSCRIBE || msg->type == UNSUBSCRIBE) {
+             char pattern[MAX_NAME];
+             strncpy(pattern, (char*)msg->data, MAX_NAME - 1);
+             pattern[MAX_NAME - 1] = '\0';
+             int rc = (msg->type == SUBSCRIBE) ? topic_subscribe(my_index, pattern)
+                                              : topic_unsubscribe(my_index, pattern);
+             struct message reply;
+             memset(&reply, 0, sizeof(reply));
+             if (rc == 0) {
+                 reply.type = SUB_ACK;
+                 snprintf((char*)reply.data, MAX_DATA, "%s%s",
+                          msg->type == SUBSCRIBE ? "+" : "-", pattern);
+                 printf("Client '%s' %s '%s'.\n", clientID,
+                        msg->type == SUBSCRIBE ? "subscribed to" : "unsubscribed from", pattern);
+             } else {
+                 reply.type = SUB_NAK;
+                 snprintf((char*)reply.data, MAX_DATA, "%s: %s", pattern,
+                          msg->type == SUBSCRIBE ? "invalid pattern or too many subscriptions"
+                                                : "not subscribed");
+             }
+             send_reply(my_index, &reply);
+         }
+         else if (msg->type == PRESENCE_SUB) {
+             int on = (strcmp((char*)msg->data, "off") != 0);
+             presence_watch(my_index, on);
+             if (on) {
+                 // Baseline listing; deltas with higher versions follow.
+                 query_t all;
+                 parse_query("", &all);
+                 send_listing(my_index, &all);
+             }
+         }
+         else {
+             fprintf(stderr, "Unknown message type %d from client %s\n",
+                     msg->type, clientID);
+         }
+         pthread_mutex_unlock(&mutex);
+     }
+ 
+     // Handle abrupt disconnection.
+     global_lock();
+     if (client_hot.active[my_index]) {
+         mailbox_away(my_index);
+         release_client(my_index);
+         printf("Client '%s' disconnected.\n", clientID);
+     }
+     pthread_mutex_unlock(&mutex);
+ 
+     capture_close(my_index);
+     outq_stop(my_index);
+     zconn_free(clients[my_index].z);
+     clients[my_index].z = NULL;
+     shmconn_free(clients[my_index].shm);
+     clients[my_index].shm = NULL;
+     close(sockfd);
+     arena_destroy(&clients[my_index].arena);
+     global_lock();
+     client_hot.thread_running[my_index] = 0;  // slot may be reused now
+     pthread_mutex_unlock(&mutex);
+ 
+     rcu_thread_exit();
+     thread_finished();
+     return NULL;
  }
  
- // --------------------- PER-CLIENT THREAD ---------------------
+ /**
+  * Start the reader thread of a logged-in slot whose writer is running.
+  * Returns 0 on success; on failure the slot is released and its socket
+  * closed.  Called with the global mutex held.
+  */
+ int start_client(int idx) {
+     pthread_t tid;
+     client_hot.thread_running[idx] = 1;
+     thread_started();
+     if (pthread_create(&tid, &client_thread_attr, client_thread, (void *)(intptr_t)idx) != 0) {
+         perror("pthread_create");
+         thread_finished();
+         release_client(idx);
+         outq_stop(idx);
+         zconn_free(clients[idx].z);
+         clients[idx].z = NULL;
+         shmconn_free(clients[idx].shm);
+         clients[idx].shm = NULL;
+         close(clients[idx].sockfd);
+         client_hot.thread_running[idx] = 0;
+         return -1;
+     }
+     pthread_detach(tid);
+     return 0;
+ }
+ 
+ // --------------------- ADMIN ENDPOINT ---------------------
+ //
+ // With -a <path> the server accepts operator commands on a Unix socket,
+ // one per line (e.g. "echo metrics | nc -U <path>"):
+ //   metrics          counters and gauges in Prometheus text format
+ //   latency          the latency report also printed on SIGUSR1
+ //   session <name>   members, traffic and latency of one session
+ //   client <name>    state and queues of one client
+ //   kick <name>      disconnect a client
+ //   window <session> <ms> [frames]
+ //                    coalesce the session's MESSAGEs for up to <ms>
+ //                    (fractional; 0 turns it off) or [frames] frames
+ // "metrics" reads only atomics and the presence snapshot, so scraping
+ // never takes the global mutex; the other commands hold it briefly.
+ 
+ static void prom_help(FILE *out, const char *name, const char *type, const char *help) {
+     fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+ }
+ 
+ // Write a label value with '\\', '"' and newlines escaped.
+ static void prom_label(FILE *out, const char *value) {
+     for (const char *p = value; *p; p++) {
+         if (*p == '\\' || *p == '"') {
+             fputc('\\', out);
+             fputc(*p, out);
+         } else if (*p == '\n') {
+             fputs("\\n", out);
+         } else {
+             fputc(*p, out);
+         }
+     }
+ }
+ 
+ static void prom_summary(FILE *out, const char *name, const char *labels, lat_hist_t *h) {
+     static const double quantiles[] = { 0.5, 0.99, 0.999 };
+     for (int i = 0; i < 3; i++) {
+         fprintf(out, "%s{%s%squantile=\"%g\"} %.9f\n", name, labels, *labels ? "," : "",
+                 quantiles[i], lat_percentile(h, quantiles[i]) / 1e9);
+     }
+     char braced[64] = "";
+     if (*labels) {
+         snprintf(braced, sizeof(braced), "{%s}", labels);
+     }
+     fprintf(out, "%s_sum%s %.9f\n", name, braced,
+             atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9);
+     fprintf(out, "%s_count%s %lu\n", name, braced,
+             atomic_load_explicit(&h->total, memory_order_relaxed));
+ }
+ 
+ void admin_metrics(FILE *out) {
+     prom_help(out, "conf_connections_total", "counter", "TCP and Unix socket connections accepted.");
+     fprintf(out, "conf_connections_total %lu\n", STAT_GET(connections));
+     prom_help(out, "conf_logins_total", "counter", "Successful logins.");
+     fprintf(out, "conf_logins_total %lu\n", STAT_GET(logins));
+     prom_help(out, "conf_login_failures_total", "counter", "Rejected logins.");
+     fprintf(out, "conf_login_failures_total %lu\n", STAT_GET(login_failures));
+     prom_help(out, "conf_clients", "gauge", "Clients currently logged in.");
+     fprintf(out, "conf_clients %ld\n", STAT_GET(clients));
+     prom_help(out, "conf_kicks_total", "counter", "Clients disconnected by an operator.");
+     fprintf(out, "conf_kicks_total %lu\n", STAT_GET(kicks));
+ 
+     prom_help(out, "conf_frames_total", "counter", "Frames read from and written to clients.");
+     fprintf(out, "conf_frames_total{direction=\"in\"} %lu\n", STAT_GET(frames_in));
+     fprintf(out, "conf_frames_total{direction=\"out\"} %lu\n", STAT_GET(frames_out));
+     prom_help(out, "conf_bytes_total", "counter", "Bytes read from and written to clients.");
+     fprintf(out, "conf_bytes_total{direction=\"in\"} %lu\n", STAT_GET(bytes_in));
+     fprintf(out, "conf_bytes_total{direction=\"out\"} %lu\n", STAT_GET(bytes_out));
+     prom_help(out, "conf_compressed_bytes_total", "counter",
+               "Wire bytes of compressed connections; conf_bytes_total counts them inflated.");
+     fprintf(out, "conf_compressed_bytes_total{direction=\"in\"} %lu\n", STAT_GET(zip_bytes_in));
+     fprintf(out, "conf_compressed_bytes_total{direction=\"out\"} %lu\n", STAT_GET(zip_bytes_out));
+     prom_help(out, "conf_local_logins_total", "counter", "Logins over the Unix socket (-l), by transport.");
+     fprintf(out, "conf_local_logins_total{transport=\"unix\"} %lu\n", STAT_GET(local_logins[0]));
+     fprintf(out, "conf_local_logins_total{transport=\"shm\"} %lu\n", STAT_GET(local_logins[1]));
+     prom_help(out, "conf_shm_wakeups_total", "counter",
+               "eventfd writes to shared-memory clients; frames sent while they were busy need none.");
+     fprintf(out, "conf_shm_wakeups_total %lu\n", STAT_GET(shm_wakeups));
+     prom_help(out, "conf_messages_total", "counter", "MESSAGE frames fanned out to a session.");
+     fprintf(out, "conf_messages_total %lu\n", STAT_GET(messages));
+     prom_help(out, "conf_throttled_total", "counter", "Frames shed by rate limiting.");
+     fprintf(out, "conf_throttled_total %lu\n", STAT_GET(throttled));
+     prom_help(out, "conf_window_batches_total", "counter", "Session coalescing windows released.");
+     fprintf(out, "conf_window_batches_total %lu\n", STAT_GET(window_batches));
+     prom_help(out, "conf_window_frames_total", "counter", "MESSAGE frames released from coalescing windows.");
+     fprintf(out, "conf_window_frames_total %lu\n", STAT_GET(window_frames));
+     prom_help(out, "conf_mailbox_frames_total", "counter", "Frames kept for offline users.");
+     fprintf(out, "conf_mailbox_frames_total{event=\"stored\"} %lu\n", STAT_GET(mailbox_stored));
+     fprintf(out, "conf_mailbox_frames_total{event=\"delivered\"} %lu\n", STAT_GET(mailbox_delivered));
+     fprintf(out, "conf_mailbox_frames_total{event=\"dropped\"} %lu\n", STAT_GET(mailbox_dropped));
+     prom_help(out, "conf_search_messages_total", "counter", "Messages offered to the search index.");
+     fprintf(out, "conf_search_messages_total{event=\"indexed\"} %lu\n", STAT_GET(search_indexed));
+     fprintf(out, "conf_search_messages_total{event=\"skipped\"} %lu\n", STAT_GET(search_skipped));
+     prom_help(out, "conf_search_merges_total", "counter", "Index segments merged.");
+     fprintf(out, "conf_search_merges_total %lu\n", STAT_GET(search_merges));
+     prom_help(out, "conf_searches_total", "counter", "SEARCH requests answered.");
+     fprintf(out, "conf_searches_total %lu\n", STAT_GET(searches));
+ 
+     prom_help(out, "conf_outq_frames", "gauge", "Frames waiting in outbound queues.");
+     fprintf(out, "conf_outq_frames{lane=\"control\"} %ld\n", STAT_GET(queued[OUT_CONTROL]));
+     fprintf(out, "conf_outq_frames{lane=\"bulk\"} %ld\n", STAT_GET(queued[OUT_BULK]));
+     prom_help(out, "conf_outq_dropped_total", "counter",
+               "Frames dropped because a slow consumer's queue was full.");
+     fprintf(out, "conf_outq_dropped_total %lu\n", STAT_GET(queue_drops));
+ 
+     prom_help(out, "conf_lock_acquisitions_total", "counter", "Global mutex acquisitions.");
+     fprintf(out, "conf_lock_acquisitions_total %lu\n", STAT_GET(lock_acquired));
+     prom_help(out, "conf_lock_contended_total", "counter", "Acquisitions that had to wait.");
+     fprintf(out, "conf_lock_contended_total %lu\n", STAT_GET(lock_contended));
+     prom_help(out, "conf_lock_wait_seconds", "summary", "Wait time of contended acquisitions.");
+     prom_summary(out, "conf_lock_wait_seconds", "", &stats.lock_wait);
+ 
+     pthread_mutex_lock(&upgrade_lock);
+     int readers = live_threads;
+     pthread_mutex_unlock(&upgrade_lock);
+     prom_help(out, "conf_threads", "gauge", "Socket reader and writer threads.");
+     fprintf(out, "conf_threads{role=\"reader\"} %d\n", readers);
+     fprintf(out, "conf_threads{role=\"writer\"} %ld\n", STAT_GET(writers));
+     prom_help(out, "conf_thread_busy_seconds_total", "counter",
+               "Time threads spent handling frames rather than waiting.");
+     fprintf(out, "conf_thread_busy_seconds_total{role=\"reader\"} %.6f\n", STAT_GET(busy_ns[0]) / 1e9);
+     fprintf(out, "conf_thread_busy_seconds_total{role=\"writer\"} %.6f\n", STAT_GET(busy_ns[1]) / 1e9);
+ 
+     static const char *mem_names[MEM_KINDS] = { "topics", "presence", "outq", "latency", "zip", "mailbox", "search", "shm" };
+     prom_help(out, "conf_memory_bytes", "gauge", "Memory by subsystem.");
+     fprintf(out, "conf_memory_bytes{subsystem=\"tables\"} %zu\n",
+             sizeof(clients) + sizeof(sessions) + sizeof(topic_edges) + sizeof(stats));
+     for (int i = 0; i < MEM_KINDS; i++) {
+         fprintf(out, "conf_memory_bytes{subsystem=\"%s\"} %ld\n", mem_names[i], STAT_GET(mem[i]));
+     }
+ 
+     prom_help(out, "conf_slab_bytes", "gauge", "Memory carved by each slab allocator (never returned).");
+     for (int k = 0; k < SLAB_KINDS; k++) {
+         fprintf(out, "conf_slab_bytes{slab=\"%s\"} %lu\n", slabs[k].name,
+                 atomic_load_explicit(&slabs[k].chunk_bytes, memory_order_relaxed));
+     }
+     prom_help(out, "conf_slab_objects", "gauge", "Slab objects in use.");
+     for (int k = 0; k < SLAB_KINDS; k++) {
+         fprintf(out, "conf_slab_objects{slab=\"%s\"} %ld\n", slabs[k].name,
+                 atomic_load_explicit(&slabs[k].live, memory_order_relaxed));
+     }
+ 
+     static const char *stage_names[LAT_STAGES] = { "parse", "fanout", "queue", "write" };
+     prom_help(out, "conf_latency_seconds", "summary", "Latency of MESSAGE and DIRECT by stage.");
+     for (int i = 0; i < LAT_STAGES; i++) {
+         char labels[32];
+         snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[i]);
+         prom_summary(out, "conf_latency_seconds", labels, &lat_global.stage[i]);
+     }
+ 
+     // Per-session series come from the presence snapshot, not the session table.
+     rcu_read_lock();
+     const presence_list_t *l = presence_snapshot()->sessions;
+     prom_help(out, "conf_session_members", "gauge", "Members per session.");
+     for (int i = 0; i < l->count; i++) {
+         fputs("conf_session_members{session=\"", out);
+         prom_label(out, l->entries[i].name);
+         fprintf(out, "\"} %d\n", l->entries[i].members);
+     }
+     prom_help(out, "conf_session_messages_total", "counter", "MESSAGE frames per session.");
+     for (int i = 0; i < l->count; i++) {
+         if (l->entries[i].stats) {
+             fputs("conf_session_messages_total{session=\"", out);
+             prom_label(out, l->entries[i].name);
+             fprintf(out, "\"} %lu\n", atomic_load_explicit(&l->entries[i].stats->messages,
+                                                           memory_order_relaxed));
+         }
+     }
+     prom_help(out, "conf_session_bytes_out_total", "counter", "Bytes written to members per session.");
+     for (int i = 0; i < l->count; i++) {
+         if (l->entries[i].stats) {
+             fputs("conf_session_bytes_out_total{session=\"", out);
+             prom_label(out, l->entries[i].name);
+             fprintf(out, "\"} %lu\n", atomic_load_explicit(&l->entries[i].stats->bytes_out,
+                                                           memory_order_relaxed));
+         }
+     }
+     rcu_read_unlock();
+ }
+ 
+ static void admin_session(FILE *out, const char *name) {
+     global_lock();
+     int sidx = find_session(name);
+     if (sidx < 0) {
+         pthread_mutex_unlock(&mutex);
+         fprintf(out, "ERR no such session\n");
+         return;
+     }
+     session_t *sess = &sessions[sidx];
+     fprintf(out, "session %s\n", sess->sessionID);
+     fprintf(out, "  members (%d):", session_hot.num_members[sidx]);
+     for (int i = 0; i < session_hot.num_members[sidx]; i++) {
+         fprintf(out, " %s", clients[session_hot.members[sidx][i]].clientID);
+     }
+     fprintf(out, "\n  fanout budget: %.0f bytes\n", sess->fanout.tokens);
+     if (sess->window_us) {
+         fprintf(out, "  window: %.3f ms or %d frames, %d held\n",
+                 sess->window_us / 1000.0, sess->window_frames, sess->held_count);
+     }
+     if (sess->lat) {
+         fprintf(out, "  messages: %lu\n  bytes out: %lu\n",
+                 atomic_load(&sess->lat->messages), atomic_load(&sess->lat->bytes_out));
+         lat_report_set(out, sess->sessionID, sess->lat);
+     }
+     pthread_mutex_unlock(&mutex);
+ }
+ 
+ static void admin_client(FILE *out, const char *name) {
+     global_lock();
+     int idx = find_client_by_id(name);
+     if (idx < 0) {
+         pthread_mutex_unlock(&mutex);
+         fprintf(out, "ERR no such client\n");
+         return;
+     }
+     client_t *c = &clients[idx];
+     char addr[INET_ADDRSTRLEN + 8];
+     if (c->clientAddr.sin_family == AF_UNIX) {
+         strcpy(addr, "local");
+     } else {
+         inet_ntop(AF_INET, &c->clientAddr.sin_addr, addr, INET_ADDRSTRLEN);
+         sprintf(addr + strlen(addr), ":%d", ntohs(c->clientAddr.sin_port));
+     }
+     fprintf(out, "client %s\n  address: %s\n  idle: %.0f s\n", c->clientID, addr,
+             difftime(time(NULL), atomic_load_explicit(&client_hot.last_active[idx],
+                                                       memory_order_relaxed)));
+     fprintf(out, "  sessions (%d):", c->session_count);
+     for (int i = 0; i < c->session_count; i++) {
+         fprintf(out, " %s", c->sessions[i]);
+     }
+     fprintf(out, "\n  subscriptions (%d):", c->sub_count);
+     for (int i = 0; i < c->sub_count; i++) {
+         fprintf(out, " %s", c->subs[i]);
+     }
+     fprintf(out, "\n  presence: %s\n  throttled: %lu\n", c->presence_sub ? "on" : "off", c->throttled);
+     if (c->z) {
+         fprintf(out, "  compression: %s, wire in %lu, wire out %lu\n",
+                 c->z->dict ? ZIP_MODE_DICT : ZIP_MODE, c->z->wire_in, c->z->wire_out);
+     }
+     if (c->shm) {
+         chat_shm_t *a = c->shm->area;
+         fprintf(out, "  transport: shared memory, ring up %u/%d, down %u/%d\n",
+                 atomic_load(&a->up.head) - atomic_load(&a->up.tail), SHM_RING_FRAMES,
+                 atomic_load(&a->down.head) - atomic_load(&a->down.tail), SHM_RING_FRAMES);
+     }
+     pthread_mutex_lock(&out_lock[idx]);
+     fprintf(out, "  queued: control %d, bulk %d\n  dropped: %lu\n  writer: %s\n",
+             c->lanes[OUT_CONTROL].count, c->lanes[OUT_BULK].count, c->out_dropped,
+             c->out_dead ? "dead" : (c->out_busy ? "writing" : "idle"));
+     pthread_mutex_unlock(&out_lock[idx]);
+     pthread_mutex_unlock(&mutex);
+ }
+ 
+ static void admin_kick(FILE *out, const char *name) {
+     global_lock();
+     int idx = find_client_by_id(name);
+     if (idx < 0) {
+         pthread_mutex_unlock(&mutex);
+         fprintf(out, "ERR no such client\n");
+         return;
+     }
+     printf("Disconnecting client '%s' on operator request.\n", clients[idx].clientID);
+     release_client(idx);
+     shutdown(clients[idx].sockfd, SHUT_RDWR);  // reader thread closes it
+     STAT_ADD(kicks, 1);
+     pthread_mutex_unlock(&mutex);
+     fprintf(out, "OK\n");
+ }
+ 
+ /**
+  * "window <session> <ms> [frames]": set a session's coalescing window.
+  */
+ static void admin_window(FILE *out, const char *line) {
+     char name[MAX_NAME];
+     double ms;
+     int frames = WINDOW_DEFAULT_FRAMES;
+     if (sscanf(line, "%*15s %49s %lf %d", name, &ms, &frames) < 2 || ms < 0) {
+         fprintf(out, "ERR usage: window <session> <ms> [frames]\n");
+         return;
+     }
+     global_lock();
+     int sidx = find_session(name);
+     int rc = sidx >= 0 ? window_set(sidx, (unsigned int)(ms * 1000 + 0.5), frames) : 0;
+     pthread_mutex_unlock(&mutex);
+     if (sidx < 0) {
+         fprintf(out, "ERR no such session\n");
+     } else if (rc < 0) {
+         fprintf(out, "ERR window is at most %d ms and 1-%d frames\n",
+                 WINDOW_MAX_MS, WINDOW_MAX_FRAMES);
+     } else {
+         fprintf(out, "OK\n");
+     }
+ }
+ 
+ /**
+  * Run one admin command line, writing the reply to 'out'.
+  */
+ void admin_command(FILE *out, char *line) {
+     char cmd[16] = "", arg[MAX_NAME] = "";
+     line[strcspn(line, "\r\n")] = '\0';
+     sscanf(line, "%15s %49s", cmd, arg);
+     if (strcmp(cmd, "metrics") == 0) {
+         admin_metrics(out);
+     } else if (strcmp(cmd, "latency") == 0) {
+         lat_report(out);
+     } else if (strcmp(cmd, "session") == 0 && arg[0]) {
+         admin_session(out, arg);
+     } else if (strcmp(cmd, "client") == 0 && arg[0]) {
+         admin_client(out, arg);
+     } else if (strcmp(cmd, "kick") == 0 && arg[0]) {
+         admin_kick(out, arg);
+     } else if (strcmp(cmd, "window") == 0) {
+         admin_window(out, line);
+     } else if (cmd[0]) {
+         fprintf(out, "ERR commands: metrics | latency | session <name> | client <name> | kick <name>"
+                      " | window <session> <ms> [frames]\n");
+     }
+ }
+ 
+ /**
+  * Serve admin connections one at a time.
+  */
+ void *admin_listener(void *arg) {
+     int sock = *(int *)arg;
+     while (1) {
+         int conn = accept(sock, NULL, NULL);
+         if (conn < 0) {
+             if (errno != EINTR) {
+                 perror("admin accept");
+             }
+             continue;
+         }
+         struct timeval tv = { ADMIN_IO_TIMEOUT, 0 };
+         setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+         setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+         int out_fd = dup(conn);
+         FILE *in = fdopen(conn, "r");
+         FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+         if (!in || !out) {
+             perror("admin fdopen");
+             if (in) {
+                 fclose(in);
+             } else {
+                 close(conn);
+             }
+             if (out) {
+                 fclose(out);
+             } else if (out_fd >= 0) {
+                 close(out_fd);
+             }
+             continue;
+         }
+         char line[256];
+         while (fgets(line, sizeof(line), in)) {
+             admin_command(out, line);
+             if (fflush(out) != 0) {
+                 break;
+             }
+         }
+         fclose(in);
+         fclose(out);
+     }
+     return NULL;
+ }
+ 
+ /**
+  * Create the admin Unix socket at 'path', replacing a stale one.
+  */
+ int open_admin_socket(const char *path) {
+     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+     if (sock < 0) {
+         perror("admin socket");
+         return -1;
+     }
+     struct sockaddr_un addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+     unlink(path);
+     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(sock, 4) < 0) {
+         perror("admin bind");
+         close(sock);
+         return -1;
+     }
+     return sock;
+ }
+ 
+ // --------------------- LIVE UPGRADE ---------------------
+ 
+ /**
+  * Park the calling thread until the current upgrade attempt is over.
+  * If the handoff succeeds the process exits while threads are parked.
+  */
+ void park_for_upgrade(void) {
+     pthread_mutex_lock(&upgrade_lock);
+     parked_threads++;
+     pthread_cond_broadcast(&upgrade_cond);
+     while (upgrade_requested) {
+         pthread_cond_wait(&upgrade_cond, &upgrade_lock);
+     }
+     parked_threads--;
+     pthread_mutex_unlock(&upgrade_lock);
+ }
+ 
+ /**
+  * Register / unregister a thread that reads from a socket.
+  */
+ void thread_started(void) {
+     pthread_mutex_lock(&upgrade_lock);
+     live_threads++;
+     pthread_mutex_unlock(&upgrade_lock);
+ }
+ 
+ void thread_finished(void) {
+     pthread_mutex_lock(&upgrade_lock);
+     live_threads--;
+     pthread_cond_broadcast(&upgrade_cond);
+     pthread_mutex_unlock(&upgrade_lock);
+ }
+ 
+ // Simple serializer for handoff records (network byte order).
+ typedef struct {
+     unsigned char data[HANDOFF_MAX_RECORD];
+     size_t len;
+     size_t pos;
+     int    err;
+ } handoff_buf_t;
+ 
+ static void hb_put(handoff_buf_t *b, const void *p, size_t n) {
+     if (b->len + n > sizeof(b->data)) {
+         b->err = 1;
+         return;
+     }
+     memcpy(b->data + b->len, p, n);
+     b->len += n;
+ }
+ 
+ static void hb_put_u32(handoff_buf_t *b, uint32_t v) {
+     v = htonl(v);
+     hb_put(b, &v, sizeof(v));
+ }
+ 
+ static void hb_put_str(handoff_buf_t *b, const char *s) {
+     uint32_t n = strlen(s);
+     hb_put_u32(b, n);
+     hb_put(b, s, n);
+ }
+ 
+ static void hb_get(handoff_buf_t *b, void *p, size_t n) {
+     if (b->pos + n > b->len) {
+         b->err = 1;
+         memset(p, 0, n);
+         return;
+     }
+     memcpy(p, b->data + b->pos, n);
+     b->pos += n;
+ }
+ 
+ static uint32_t hb_get_u32(handoff_buf_t *b) {
+     uint32_t v;
+     hb_get(b, &v, sizeof(v));
+     return ntohl(v);
+ }
+ 
+ static void hb_get_str(handoff_buf_t *b, char *out, size_t outsz) {
+     uint32_t n = hb_get_u32(b);
+     if (b->err || n >= outsz || b->pos + n > b->len) {
+         b->err = 1;
+         out[0] = '\0';
+         return;
+     }
+     hb_get(b, out, n);
+     out[n] = '\0';
+ }
+ 
+ /**
+  * Send one record, optionally passing a file descriptor along with it.
+  */
+ static int handoff_send(int sock, handoff_buf_t *b, int fd) {
+     if (b->err) {
+         return -1;
+     }
+     struct iovec iov = { b->data, b->len };
+     struct msghdr mh;
+     char ctrl[CMSG_SPACE(sizeof(int))];
+     memset(&mh, 0, sizeof(mh));
+     mh.msg_iov = &iov;
+     mh.msg_iovlen = 1;
+     if (fd >= 0) {
+         memset(ctrl, 0, sizeof(ctrl));
+         mh.msg_control = ctrl;
+         mh.msg_controllen = sizeof(ctrl);
+         struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+         cm->cmsg_level = SOL_SOCKET;
+         cm->cmsg_type = SCM_RIGHTS;
+         cm->cmsg_len = CMSG_LEN(sizeof(int));
+         memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+     }
+     if (sendmsg(sock, &mh, MSG_NOSIGNAL) != (ssize_t)b->len) {
+         perror("handoff sendmsg");
+         return -1;
+     }
+     return 0;
+ }
+ 
+ /**
+  * Receive one record.  Returns the record tag, or -1 on error.
+  * A passed file descriptor (if any) is stored in *fd, else -1.
+  */
+ static int handoff_recv(int sock, handoff_buf_t *b, int *fd) {
+     struct iovec iov = { b->data, sizeof(b->data) };
+     struct msghdr mh;
+     char ctrl[CMSG_SPACE(sizeof(int))];
+     memset(&mh, 0, sizeof(mh));
+     mh.msg_iov = &iov;
+     mh.msg_iovlen = 1;
+     mh.msg_control = ctrl;
+     mh.msg_controllen = sizeof(ctrl);
+     *fd = -1;
+     ssize_t n = recvmsg(sock, &mh, 0);
+     if (n <= 0 || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+         return -1;
+     }
+     struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+     if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+         memcpy(fd, CMSG_DATA(cm), sizeof(int));
+     }
+     b->len = n;
+     b->pos = 0;
+     b->err = 0;
+     return (int)hb_get_u32(b);
+ }
+ 
+ static void hb_begin(handoff_buf_t *b, uint32_t tag) {
+     b->len = 0;
+     b->pos = 0;
+     b->err = 0;
+     hb_put_u32(b, tag);
+ }
+ 
+ /**
+  * Stop all socket readers at a frame boundary.  Returns 0 once every
+  * reader is parked, -1 if they did not park in time.
+  */
+ static int quiesce_readers(void) {
+     struct timespec deadline;
+     clock_gettime(CLOCK_REALTIME, &deadline);
+     deadline.tv_sec += UPGRADE_PARK_TIMEOUT;
+ 
+     pthread_mutex_lock(&upgrade_lock);
+     upgrade_requested = 1;
+     if (write(upgrade_pipe[1], "u", 1) != 1) {
+         perror("upgrade pipe");
+     }
+     int rc = 0;
+     while (parked_threads < live_threads && rc == 0) {
+         rc = pthread_cond_timedwait(&upgrade_cond, &upgrade_lock, &deadline);
+     }
+     int ok = (parked_threads >= live_threads);
+     pthread_mutex_unlock(&upgrade_lock);
+     return ok ? 0 : -1;
+ }
+ 
+ static void resume_readers(void) {
+     char c;
+     pthread_mutex_lock(&upgrade_lock);
+     while (read(upgrade_pipe[0], &c, 1) == 1) {
+         // drain the wakeup byte(s)
+     }
+     upgrade_requested = 0;
+     pthread_cond_broadcast(&upgrade_cond);
+     pthread_mutex_unlock(&upgrade_lock);
+ }
+ 
+ /**
+  * Hand the listening socket, all clients and all sessions to the process
+  * connected on 'conn'.  Called with the global mutex held and all readers
+  * parked.  Returns 0 when the new process confirmed the takeover.
+  */
+ static int send_state(int conn, int server_sock) {
+     static handoff_buf_t b;
+ 
+     hb_begin(&b, HO_HELLO);
+     hb_put_u32(&b, HANDOFF_MAGIC);
+     hb_put_u32(&b, HANDOFF_VERSION);
+     if (handoff_send(conn, &b, -1) < 0) {
+         return -1;
+     }
+ 
+     hb_begin(&b, HO_LISTEN);
+     if (handoff_send(conn, &b, server_sock) < 0) {
+         return -1;
+     }
+     if (local_sock >= 0) {
+         hb_begin(&b, HO_LISTEN_LOCAL);
+         if (handoff_send(conn, &b, local_sock) < 0) {
+             return -1;
+         }
+     }
+ 
+     for (int i = 0; i < num_sessions; i++) {
+         hb_begin(&b, HO_SESSION);
+         hb_put_str(&b, sessions[i].sessionID);
+         hb_put_u32(&b, session_hot.num_members[i]);
+         for (int j = 0; j < session_hot.num_members[i]; j++) {
+             hb_put_str(&b, clients[session_hot.members[i][j]].clientID);
+         }
+         hb_put_u32(&b, sessions[i].window_us);
+         hb_put_u32(&b, sessions[i].window_frames);
+         hb_put_u32(&b, sessions[i].num_away);
+         for (int j = 0; j < sessions[i].num_away; j++) {
+             hb_put_str(&b, mailboxes[sessions[i].away[j]].user);
+         }
+         if (handoff_send(conn, &b, -1) < 0) {
+             return -1;
+         }
+     }
+ 
+     for (int i = 0; i < MAX_CLIENTS; i++) {
+         client_t *c = &clients[i];
+         if (!client_hot.active[i]) {
+             continue;
+         }
+         if (!outq_idle(i)) {
+             // A consumer this slow would lose frames mid-write; let it reconnect.
+             printf("Not handing off '%s': outbound queue did not drain.\n", c->clientID);
+             continue;
+         }
+         if (c->z) {
+             // zlib stream state cannot be moved to another process.
+             printf("Not handing off '%s': connection is compressed.\n", c->clientID);
+             continue;
+         }
+         if (c->shm) {
+             // The client would have to remap its rings; it reconnects instead.
+             printf("Not handing off '%s': connection uses shared memory.\n", c->clientID);
+             continue;
+         }
+         hb_begin(&b, HO_CLIENT);
+         hb_put_str(&b, c->clientID);
+         hb_put_u32(&b, ntohl(c->clientAddr.sin_addr.s_addr));
+         hb_put_u32(&b, ntohs(c->clientAddr.sin_port));
+         hb_put_u32(&b, (uint32_t)atomic_load_explicit(&client_hot.last_active[i],
+                                                            memory_order_relaxed));
+         hb_put_u32(&b, c->session_count);
+         for (int j = 0; j < c->session_count; j++) {
+             hb_put_str(&b, c->sessions[j]);
+         }
+         hb_put_u32(&b, c->rx_len);
+         hb_put(&b, c->rx_buf, c->rx_len);
+         if (handoff_send(conn, &b, c->sockfd) < 0) {
+             return -1;
+         }
+     }
+ 
+     for (int i = 0; i < MAX_CLIENTS; i++) {
+         for (int j = 0; client_hot.active[i] && j < clients[i].sub_count; j++) {
+             hb_begin(&b, HO_SUBSCRIPTION);
+             hb_put_str(&b, clients[i].clientID);
+             hb_put_str(&b, clients[i].subs[j]);
+             if (handoff_send(conn, &b, -1) < 0) {
+                 return -1;
+             }
+         }
+     }
+ 
+     for (int i = 0; i < num_presence_watchers; i++) {
+         hb_begin(&b, HO_PRESENCE_SUB);
+         hb_put_str(&b, clients[presence_watchers[i]].clientID);
+         if (handoff_send(conn, &b, -1) < 0) {
+             return -1;
+         }
+     }
+ 
+     // Keep presence versions monotonic for watchers across the upgrade.
+     hb_begin(&b, HO_PRESENCE_VERSION);
+     hb_put_u32(&b, (uint32_t)(presence_current->version >> 32));
+     hb_put_u32(&b, (uint32_t)presence_current->version);
+     if (handoff_send(conn, &b, -1) < 0) {
+         return -1;
+     }
+ 
+     hb_begin(&b, HO_END);
+     if (handoff_send(conn, &b, -1) < 0) {
+         return -1;
+     }
  
- void *client_thread(void *arg) {
-     int my_index = *(int*)arg;
-     free(arg);  // allocated in main accept loop
-     int sockfd = clients[my_index].sockfd;
-     char clientID[MAX_NAME];
-     strcpy(clientID, clients[my_index].clientID);
+     struct timeval tv = { UPGRADE_ACK_TIMEOUT, 0 };
+     setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+     char ack[4] = {0};
+     if (recv(conn, ack, sizeof(ack) - 1, 0) <= 0 || strcmp(ack, "OK") != 0) {
+         return -1;
+     }
+     return 0;
+ }
  
-     struct message msg;
+ /**
+  * Thread that waits for a new server binary to connect on the upgrade
+  * socket and hands the running state over to it.
+  */
+ void *upgrade_listener(void *arg) {
+     int *socks = (int*)arg;
+     int upgrade_sock = socks[0];
+     int server_sock = socks[1];
  
      while (1) {
-         if (recv_message(sockfd, &msg) < 0) {
-             break;
+         int conn = accept(upgrade_sock, NULL, NULL);
+         if (conn < 0) {
+             if (errno != EINTR) {
+                 perror("upgrade accept");
+             }
+             continue;
          }
-         pthread_mutex_lock(&mutex);
-         // Update last activity time upon receiving any message.
-         clients[my_index].last_active = time(NULL);
+         printf("Upgrade requested, handing off to new server process...\n");
+         if (quiesce_readers() < 0) {
+             fprintf(stderr, "Upgrade aborted: threads did not stop reading in time.\n");
+             resume_readers();
+             close(conn);
+             continue;
+         }
+         global_lock();
+         window_release_all();  // held frames are not part of the handoff
+         outq_wait_idle(UPGRADE_DRAIN_TIMEOUT);
+         mailbox_flush();  // the new process loads the spool once it has taken over
+         if (send_state(conn, server_sock) == 0) {
+             printf("Handoff complete, exiting.\n");
+             fflush(stdout);
+             capture_flush();
+             _exit(0);
+         }
+         pthread_mutex_unlock(&mutex);
+         fprintf(stderr, "Upgrade aborted: handoff failed, resuming service.\n");
+         close(conn);
+         resume_readers();
+     }
+     return NULL;
+ }
  
-         if (msg.type == EXIT) {
-             for (int i = 0; i < clients[my_index].session_count; i++) {
-                 remove_client_from_session(clientID, clients[my_index].sessions[i]);
-             }
-             clients[my_index].session_count = 0;
-             clients[my_index].active = 0;
-             close(sockfd);
-             pthread_mutex_unlock(&mutex);
-             printf("Client '%s' logged out.\n", clientID);
-             return NULL;
+ /**
+  * Try to take over from a running server listening on 'path'.
+  * Returns the inherited listening socket, -1 if no server answered (in
+  * which case the caller starts fresh), or TAKEOVER_FAILED if one answered
+  * but the handoff did not complete; that server resumed service and still
+  * holds the port.
+  */
+ int takeover_state(const char *path) {
+     int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+     if (sock < 0) {
+         perror("socket");
+         return -1;
+     }
+     struct sockaddr_un addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+         close(sock);
+         return -1;
+     }
+ 
+     static handoff_buf_t b;
+     int fd, tag;
+     int listen_fd = -1;
+     int restored[MAX_CLIENTS];
+     int num_restored = 0;
+     unsigned long presence_version = 0;
+ 
+     tag = handoff_recv(sock, &b, &fd);
+     if (tag != HO_HELLO || hb_get_u32(&b) != HANDOFF_MAGIC ||
+         hb_get_u32(&b) != HANDOFF_VERSION) {
+         fprintf(stderr, "takeover: unexpected handoff peer\n");
+         close(sock);
+         return TAKEOVER_FAILED;
+     }
+ 
+     presence_batch_begin();  // one version for the whole handoff
+     while ((tag = handoff_recv(sock, &b, &fd)) > 0 && tag != HO_END) {
+         if (tag == HO_LISTEN) {
+             listen_fd = fd;
          }
-         else if (msg.type == JOIN) {
-             char sessionID[MAX_NAME];
-             strncpy(sessionID, (char*)msg.data, MAX_NAME - 1);
-             int sidx = find_session(sessionID);
-             if (sidx < 0) {
-                 struct message nak;
-                 memset(&nak, 0, sizeof(nak));
-                 nak.type = JN_NAK;
-                 snprintf((char*)nak.data, MAX_DATA, "%s: session not found", sessionID);
-                 send_message(sockfd, &nak);
-             } else {
-                 int alreadyIn = 0;
-                 for (int i = 0; i < clients[my_index].session_count; i++) {
-                     if (strcmp(clients[my_index].sessions[i], sessionID) == 0) {
-                         alreadyIn = 1;
-                         break;
-                     }
+         else if (tag == HO_LISTEN_LOCAL) {
+             local_sock = fd;
+         }
+         else if (tag == HO_SESSION) {
+             // Members are client slots here; each client record rejoins
+             // its sessions once the client has a slot.
+             char sessionID[MAX_NAME], skip[MAX_NAME];
+             hb_get_str(&b, sessionID, sizeof(sessionID));
+             uint32_t n = hb_get_u32(&b);
+             for (uint32_t i = 0; i < n && !b.err; i++) {
+                 hb_get_str(&b, skip, sizeof(skip));
+             }
+             uint32_t window_us = hb_get_u32(&b);
+             uint32_t window_frames = hb_get_u32(&b);
+             if (!b.err) {
+                 int sidx = create_session(sessionID);
+                 if (sidx >= 0 && window_us) {
+                     window_set(sidx, window_us, window_frames);
                  }
-                 if (alreadyIn) {
-                     struct message ack;
-                     memset(&ack, 0, sizeof(ack));
-                     ack.type = JN_ACK;
-                     strncpy((char*)ack.data, sessionID, MAX_DATA - 1);
-                     send_message(sockfd, &ack);
-                 } else {
-                     if (add_client_to_session(clientID, sessionID) == 0) {
-                         if (clients[my_index].session_count < MAX_SESSIONS) {
-                             strncpy(clients[my_index].sessions[clients[my_index].session_count],
-                                     sessionID, MAX_NAME - 1);
-                             clients[my_index].session_count++;
-                         }
-                         struct message ack;
-                         memset(&ack, 0, sizeof(ack));
-                         ack.type = JN_ACK;
-                         strncpy((char*)ack.data, sessionID, MAX_DATA - 1);
-                         send_message(sockfd, &ack);
-                         printf("Client '%s' joined session '%s'.\n", clientID, sessionID);
-                     } else {
-                         struct message nak;
-                         memset(&nak, 0, sizeof(nak));
-                         nak.type = JN_NAK;
-                         strcpy((char*)nak.data, "Session is full or error adding");
-                         send_message(sockfd, &nak);
+                 // Away members; their mailboxes fill once -m loads the spool.
+                 uint32_t num_away = hb_get_u32(&b);
+                 for (uint32_t i = 0; sidx >= 0 && i < num_away && !b.err; i++) {
+                     hb_get_str(&b, skip, sizeof(skip));
+                     mailbox_t *mb = mailbox_find(skip, 1);
+                     if (mb && !b.err && sessions[sidx].num_away < MAILBOX_AWAY_MAX) {
+                         sessions[sidx].away[sessions[sidx].num_away++] = mb - mailboxes;
                      }
                  }
              }
          }
-         else if (msg.type == LEAVE_SESS) {
-             char sessionID[MAX_NAME];
-             strncpy(sessionID, (char*)msg.session, MAX_NAME - 1);
-             int found = -1;
-             for (int i = 0; i < clients[my_index].session_count; i++) {
-                 if (strcmp(clients[my_index].sessions[i], sessionID) == 0) {
-                     found = i;
-                     break;
-                 }
+         else if (tag == HO_CLIENT) {
+             if (fd < 0) {
+                 fprintf(stderr, "takeover: dropping client, record came without its socket\n");
+                 continue;
              }
-             if (found != -1) {
-                 remove_client_from_session(clientID, sessionID);
-                 for (int i = found; i < clients[my_index].session_count - 1; i++) {
-                     strcpy(clients[my_index].sessions[i], clients[my_index].sessions[i+1]);
+             int idx = find_free_client_slot();
+             if (idx < 0) {
+                 fprintf(stderr, "takeover: dropping client, no free slot\n");
+                 close(fd);
+                 continue;
+             }
+             client_t *c = &clients[idx];
+             memset(c, 0, sizeof(*c));
+             hb_get_str(&b, c->clientID, sizeof(c->clientID));
+             c->clientAddr.sin_addr.s_addr = htonl(hb_get_u32(&b));
+             c->clientAddr.sin_port = htons((uint16_t)hb_get_u32(&b));
+             // Local clients travel as address 0, port 0.
+             c->clientAddr.sin_family = c->clientAddr.sin_addr.s_addr || c->clientAddr.sin_port ?
+                                        AF_INET : AF_UNIX;
+             atomic_store_explicit(&client_hot.last_active[idx], (time_t)hb_get_u32(&b),
+                                   memory_order_relaxed);
+             uint32_t n = hb_get_u32(&b);
+             for (uint32_t i = 0; i < n && !b.err; i++) {
+                 char sessionID[MAX_NAME];
+                 hb_get_str(&b, sessionID, sizeof(sessionID));
+                 if (c->session_count < MAX_SESSIONS) {
+                     strcpy(c->sessions[c->session_count++], sessionID);
                  }
-                 clients[my_index].session_count--;
-                 printf("Client '%s' left session '%s'.\n", clientID, sessionID);
              }
-         }
-         else if (msg.type == NEW_SESS) {
-             char newSessionID[MAX_NAME];
-             strncpy(newSessionID, (char*)msg.data, MAX_NAME - 1);
-             int sidx = create_session(newSessionID);
-             if (sidx < 0) {
-                 struct message nak;
-                 memset(&nak, 0, sizeof(nak));
-                 nak.type = JN_NAK;
-                 snprintf((char*)nak.data, MAX_DATA, "Failed to create session %s", newSessionID);
-                 send_message(sockfd, &nak);
+             uint32_t rx = hb_get_u32(&b);
+             if (rx <= sizeof(c->rx_buf)) {
+                 hb_get(&b, c->rx_buf, rx);
+                 c->rx_len = rx;
              } else {
-                 add_client_to_session(clientID, newSessionID);
-                 if (clients[my_index].session_count < MAX_SESSIONS) {
-                     strncpy(clients[my_index].sessions[clients[my_index].session_count],
-                             newSessionID, MAX_NAME - 1);
-                     clients[my_index].session_count++;
+                 b.err = 1;
+             }
+             if (b.err) {
+                 fprintf(stderr, "takeover: malformed client record\n");
+                 close(fd);
+                 memset(c, 0, sizeof(*c));
+                 continue;
+             }
+             c->sockfd = fd;
+             client_hot.active[idx] = 1;
+             index_client(idx);
+             int kept = 0;
+             for (int i = 0; i < c->session_count; i++) {
+                 if (add_client_to_session(c->clientID, c->sessions[i]) == 0) {
+                     memmove(c->sessions[kept++], c->sessions[i], MAX_NAME);
                  }
-                 struct message ack;
-                 memset(&ack, 0, sizeof(ack));
-                 ack.type = NS_ACK;
-                 strncpy((char*)ack.data, newSessionID, MAX_DATA - 1);
-                 send_message(sockfd, &ack);
-                 printf("Client '%s' created session '%s'.\n", clientID, newSessionID);
              }
+             c->session_count = kept;
+             restored[num_restored++] = idx;
          }
-         else if (msg.type == MESSAGE) {
-             strncpy((char*)msg.source, clientID, MAX_NAME - 1);
-             broadcast_message((char*)msg.session, &msg);
+         else if (tag == HO_SUBSCRIPTION) {
+             char subscriber[MAX_NAME];
+             char pattern[MAX_NAME];
+             hb_get_str(&b, subscriber, sizeof(subscriber));
+             hb_get_str(&b, pattern, sizeof(pattern));
+             int idx = b.err ? -1 : find_client_by_id(subscriber);
+             if (idx >= 0) {
+                 topic_subscribe(idx, pattern);
+             }
          }
-         else if (msg.type == QUERY) {
-             char buf[1024];
-             memset(buf, 0, sizeof(buf));
-             build_list(buf, sizeof(buf));
-             struct message ack;
-             memset(&ack, 0, sizeof(ack));
-             ack.type = QU_ACK;
-             strncpy((char*)ack.data, buf, MAX_DATA - 1);
-             ack.size = strlen((char*)ack.data);
-             send_message(sockfd, &ack);
+         else if (tag == HO_PRESENCE_SUB) {
+             char watcher[MAX_NAME];
+             hb_get_str(&b, watcher, sizeof(watcher));
+             int idx = b.err ? -1 : find_client_by_id(watcher);
+             if (idx >= 0) {
+                 presence_watch(idx, 1);
+             }
          }
-         else {
-             fprintf(stderr, "Unknown message type %d from client %s\n",
-                     msg.type, clientID);
+         else if (tag == HO_PRESENCE_VERSION) {
+             unsigned long version = (unsigned long)hb_get_u32(&b) << 32;
+             version |= hb_get_u32(&b);
+             if (!b.err) {
+                 presence_version = version;
+             }
+         }
+         else if (fd >= 0) {
+             close(fd);  // unknown record from a newer server, skip it
          }
-         pthread_mutex_unlock(&mutex);
      }
  
-     // Handle abrupt disconnection.
-     pthread_mutex_lock(&mutex);
-     if (clients[my_index].active) {
-         for (int i = 0; i < clients[my_index].session_count; i++) {
-             remove_client_from_session(clientID, clients[my_index].sessions[i]);
+     if (tag != HO_END || listen_fd < 0) {
+         fprintf(stderr, "takeover: handoff incomplete, starting fresh\n");
+         for (int i = 0; i < num_restored; i++) {
+             release_client(restored[i]);
+             close(clients[restored[i]].sockfd);
          }
-         clients[my_index].session_count = 0;
-         clients[my_index].active = 0;
-         close(sockfd);
-         printf("Client '%s' disconnected.\n", clientID);
+         memset(clients, 0, sizeof(clients));
+         memset(&client_hot, 0, sizeof(client_hot));
+         for (int i = 0; i < num_sessions; i++) {
+             lat_set_put(sessions[i].lat);
+         }
+         memset(sessions, 0, sizeof(sessions));
+         memset(&session_hot, 0, sizeof(session_hot));
+         num_sessions = 0;
+         init_client_index();
+         presence_batch_end();
+         if (listen_fd >= 0) {
+             close(listen_fd);
+         }
+         if (local_sock >= 0) {
+             close(local_sock);
+             local_sock = -1;
+         }
+         close(sock);
+         return TAKEOVER_FAILED;
      }
-     pthread_mutex_unlock(&mutex);
  
-     return NULL;
- }
+     // Sessions whose members were all left behind are gone.
+     for (int i = num_sessions - 1; i >= 0; i--) {
+         if (session_hot.num_members[i] == 0) {
+             destroy_session(i);
+         }
+     }
+     presence_batch_end();
+     if (presence_version > presence_current->version) {
+         presence_current->version = presence_version;  // not yet visible to readers
+     }
  
- // --------------------- MAIN FUNCTION ---------------------
+     for (int i = 0; i < num_restored; i++) {
+         if (outq_start(restored[i]) < 0) {
+             release_client(restored[i]);
+             close(clients[restored[i]].sockfd);
+             continue;
+         }
+         start_client(restored[i]);
+     }
  
- int main(int argc, char *argv[]) {
-     if (argc != 2) {
-         fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-         exit(EXIT_FAILURE);
+     if (send(sock, "OK", 2, MSG_NOSIGNAL) != 2) {
+         perror("takeover ack");
      }
-     int port = atoi(argv[1]);
+     close(sock);
+     printf("Took over %d client(s) and %d session(s) from previous server.\n",
+            num_restored, num_sessions);
+     return listen_fd;
+ }
  
-     memset(clients, 0, sizeof(clients));
-     memset(sessions, 0, sizeof(sessions));
+ /**
+  * Bind the Unix socket that a future server binary connects to.
+  */
+ int open_upgrade_socket(const char *path) {
+     int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+     if (sock < 0) {
+         perror("upgrade socket");
+         return -1;
+     }
+     struct sockaddr_un addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+     unlink(path);
+     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(sock, 1) < 0) {
+         perror("upgrade bind");
+         close(sock);
+         return -1;
+     }
+     return sock;
+ }
+ 
+ // --------------------- MAIN FUNCTION ---------------------
  
+ /**
+  * Create the TCP listening socket (exits on failure).
+  */
+ int open_listen_socket(int port) {
      int server_sock = socket(AF_INET, SOCK_STREAM, 0);
      if (server_sock < 0) {
          perror("socket");
@@ -515,109 +6073,436 @@
          exit(EXIT_FAILURE);
      }
  
-     if (listen(server_sock, 10) < 0) {
+     if (listen(server_sock, LISTEN_BACKLOG) < 0) {
          perror("listen");
          close(server_sock);
          exit(EXIT_FAILURE);
      }
+     return server_sock;
+ }
  
-     printf("Server listening on port %d...\n", port);
- 
-     // Start the inactivity monitor thread.
-     pthread_t monitor_tid;
-     if (pthread_create(&monitor_tid, NULL, inactivity_monitor, NULL) != 0) {
-         perror("pthread_create for inactivity monitor");
+ /**
+  * Create the Unix listening socket for local clients at 'path', replacing
+  * a stale one (exits on failure).
+  */
+ int open_local_socket(const char *path) {
+     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+     if (sock < 0) {
+         perror("local socket");
+         exit(EXIT_FAILURE);
+     }
+     struct sockaddr_un addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+     unlink(path);
+     if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(sock, LISTEN_BACKLOG) < 0) {
+         perror("local bind");
+         close(sock);
          exit(EXIT_FAILURE);
      }
+     return sock;
+ }
  
-     while (1) {
-         struct sockaddr_in client_addr;
-         socklen_t addr_len = sizeof(client_addr);
-         int client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_len);
-         if (client_sock < 0) {
-             perror("accept");
-             continue;
+ // Connections accepted by the main loop that have not sent LOGIN yet.  The
+ // loop polls them next to the listening sockets, so a client that connects
+ // and stays silent neither delays other logins nor keeps the loop from
+ // parking for an upgrade.  They are not handed off: when an upgrade goes
+ // through they close with the old process and have to connect again.
+ typedef struct {
+     int    fd;
+     int    local;
+     struct sockaddr_in addr;
+     time_t deadline;               // Closed if LOGIN is not complete by then
+     size_t len;                    // Bytes of msg received so far
+     struct message msg;
+ } pending_login_t;
+ 
+ static pending_login_t logins[LOGIN_PENDING_MAX];
+ static int num_logins = 0;
+ 
+ /**
+  * Start waiting for the LOGIN frame of an accepted connection.  When the
+  * set is full the connection that has waited longest is closed.
+  */
+ void pending_login_add(int fd, int local, const struct sockaddr_in *addr, time_t now) {
+     if (num_logins == LOGIN_PENDING_MAX) {
+         int oldest = 0;
+         for (int i = 1; i < num_logins; i++) {
+             if (logins[i].deadline < logins[oldest].deadline) {
+                 oldest = i;
+             }
          }
+         close(logins[oldest].fd);
+         logins[oldest] = logins[--num_logins];
+     }
+     pending_login_t *p = &logins[num_logins++];
+     p->fd = fd;
+     p->local = local;
+     p->addr = *addr;
+     p->deadline = now + LOGIN_TIMEOUT;
+     p->len = 0;
+ }
  
-         struct message msg;
-         if (recv_message(client_sock, &msg) < 0) {
-             close(client_sock);
-             continue;
+ /**
+  * Read what has arrived of the LOGIN frame without blocking.  Returns 1
+  * once the whole frame is in p->msg, 0 if more is needed, -1 if the peer
+  * hung up or the socket failed.
+  */
+ int pending_login_read(pending_login_t *p) {
+     ssize_t n = recv(p->fd, (char *)&p->msg + p->len, sizeof(p->msg) - p->len, MSG_DONTWAIT);
+     if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+         return -1;
+     }
+     if (n > 0) {
+         p->len += n;
+     }
+     if (p->len < sizeof(p->msg)) {
+         return 0;
+     }
+     chat_decode(&p->msg);
+     return 1;
+ }
+ 
+ /**
+  * Finish a login once the LOGIN frame of 'client_sock' has arrived: check
+  * the credentials, take a client slot and start the client's threads.
+  * Closes the socket if the login is refused.
+  */
+ void login_client(int client_sock, int local, const struct sockaddr_in *client_addr,
+                   struct message *msg) {
+     if (msg->type != LOGIN) {
+         close(client_sock);
+         return;
+     }
+ 
+     char clientID[MAX_NAME];
+     char password[MAX_DATA];
+     char mode[MAX_NAME];          // Compression or transport the client asked for
+     unsigned int login_id = req_id_take(msg);
+     strncpy(clientID, (char*)msg->source, MAX_NAME - 1);
+     strncpy(password, (char*)msg->data, MAX_DATA - 1);
+     strncpy(mode, (char*)msg->session, MAX_NAME - 1);
+     mode[MAX_NAME - 1] = '\0';
+ 
+     global_lock();
+ 
+     if (find_client_by_id(clientID) != -1) {
+         struct message nak;
+         memset(&nak, 0, sizeof(nak));
+         nak.type = LO_NAK;
+         strcpy((char*)nak.data, "Client ID already in use");
+         req_id_put(&nak, login_id);
+         send_message(client_sock, &nak);
+         STAT_ADD(login_failures, 1);
+         close(client_sock);
+         pthread_mutex_unlock(&mutex);
+         return;
+     }
+ 
+     if (!authenticate_user(clientID, password)) {
+         struct message nak;
+         memset(&nak, 0, sizeof(nak));
+         nak.type = LO_NAK;
+         strcpy((char*)nak.data, "Invalid username/password");
+         req_id_put(&nak, login_id);
+         send_message(client_sock, &nak);
+         STAT_ADD(login_failures, 1);
+         close(client_sock);
+         pthread_mutex_unlock(&mutex);
+         return;
+     }
+ 
+     int idx = find_free_client_slot();
+     if (idx < 0) {
+         struct message nak;
+         memset(&nak, 0, sizeof(nak));
+         nak.type = LO_NAK;
+         strcpy((char*)nak.data, "Server full");
+         req_id_put(&nak, login_id);
+         send_message(client_sock, &nak);
+         STAT_ADD(login_failures, 1);
+         close(client_sock);
+         pthread_mutex_unlock(&mutex);
+         return;
+     }
+ 
+     clients[idx].sockfd = client_sock;
+     strncpy(clients[idx].clientID, clientID, MAX_NAME - 1);
+     clients[idx].clientAddr = *client_addr;
+     client_hot.active[idx] = 1;
+     index_client(idx);
+     clients[idx].session_count = 0;
+     clients[idx].rx_len = 0;
+     // Set initial activity time
+     atomic_store_explicit(&client_hot.last_active[idx], time(NULL), memory_order_relaxed);
+     clients[idx].cap_id = 0;
+     clients[idx].shm = local && strcmp(mode, SHM_MODE) == 0 ? shmconn_new() : NULL;
+     clients[idx].z = mode[0] && !clients[idx].shm ? zconn_new(mode) : NULL;
+     capture_connect(idx, msg);
+ 
+     if (outq_start(idx) < 0) {
+         release_client(idx);
+         zconn_free(clients[idx].z);
+         clients[idx].z = NULL;
+         shmconn_free(clients[idx].shm);
+         clients[idx].shm = NULL;
+         close(client_sock);
+         pthread_mutex_unlock(&mutex);
+         return;
+     }
+ 
+     struct message ack;
+     memset(&ack, 0, sizeof(ack));
+     ack.type = LO_ACK;
+     strcpy((char*)ack.data, "Login successful");
+     if (clients[idx].z || clients[idx].shm) {
+         strcpy((char*)ack.session, mode);  // from here on, compressed or in shared memory
+     }
+     req_id_put(&ack, login_id);
+     send_to_client(idx, &ack);
+     mailbox_deliver(idx);
+ 
+     if (start_client(idx) == 0) {
+         STAT_ADD(logins, 1);
+         if (local) {
+             STAT_ADD(local_logins[clients[idx].shm != NULL], 1);
          }
+         printf("Client '%s' logged in.\n", clientID);
+     }
  
-         if (msg.type != LOGIN) {
-             close(client_sock);
-             continue;
+     pthread_mutex_unlock(&mutex);
+ }
+ 
+ // microbench.c includes this file with SERVER_NO_MAIN to time the state
+ // operations above in isolation.
+ #ifndef SERVER_NO_MAIN
+ int main(int argc, char *argv[]) {
+     const char *upgrade_path = NULL;
+     const char *admin_path = NULL;
+     const char *capture_path = NULL;
+     const char *mailbox_file = NULL;
+     const char *local_path = NULL;
+     int opt;
+     while ((opt = getopt(argc, argv, "u:ta:l:or:m:s")) != -1) {
+         if (opt == 'u') {
+             upgrade_path = optarg;
+         } else if (opt == 'l') {
+             local_path = optarg;
+         } else if (opt == 'r') {
+             capture_path = optarg;
+         } else if (opt == 'm') {
+             mailbox_file = optarg;
+         } else if (opt == 's') {
+             search_on = 1;
+         } else if (opt == 'o') {
+             open_logins = 1;
+         } else if (opt == 'a') {
+             admin_path = optarg;
+         } else if (opt == 't') {
+             lat_stamp = 1;
+         } else {
+             optind = argc + 1;  // force usage error
+             break;
          }
+     }
+     if (optind != argc - 1) {
+         fprintf(stderr, "Usage: %s <port> [-u <upgrade-socket>] [-a <admin-socket>] [-l <local-socket>] [-r <capture-file>] [-m <mailbox-file>] [-s] [-t] [-o]\n", argv[0]);
+         exit(EXIT_FAILURE);
+     }
+     int port = atoi(argv[optind]);
+ 
+     memset(clients, 0, sizeof(clients));
+     memset(sessions, 0, sizeof(sessions));
+     init_client_index();
+     for (int i = 0; i < MAX_CLIENTS; i++) {
+         pthread_mutex_init(&out_lock[i], NULL);
+         pthread_cond_init(&out_cond[i], NULL);
+     }
+     presence_init();
  
-         char clientID[MAX_NAME];
-         char password[MAX_DATA];
-         strncpy(clientID, (char*)msg.source, MAX_NAME - 1);
-         strncpy(password, (char*)msg.data, MAX_DATA - 1);
+     if (capture_path && capture_start(capture_path) < 0) {
+         exit(EXIT_FAILURE);
+     }
  
-         pthread_mutex_lock(&mutex);
+     // Peers that hang up must not kill the server; writes fail with EPIPE.
+     signal(SIGPIPE, SIG_IGN);
  
-         if (find_client_by_id(clientID) != -1) {
-             struct message nak;
-             memset(&nak, 0, sizeof(nak));
-             nak.type = LO_NAK;
-             strcpy((char*)nak.data, "Client ID already in use");
-             send_message(client_sock, &nak);
-             close(client_sock);
-             pthread_mutex_unlock(&mutex);
-             continue;
-         }
+     // Two threads and one socket per client.
+     pthread_attr_init(&client_thread_attr);
+     pthread_attr_setstacksize(&client_thread_attr, CLIENT_STACK_SIZE);
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
  
-         if (!authenticate_user(clientID, password)) {
-             struct message nak;
-             memset(&nak, 0, sizeof(nak));
-             nak.type = LO_NAK;
-             strcpy((char*)nak.data, "Invalid username/password");
-             send_message(client_sock, &nak);
-             close(client_sock);
-             pthread_mutex_unlock(&mutex);
-             continue;
+     // SIGUSR1 prints the latency report; only lat_reporter receives it.
+     // It also handles SIGINT/SIGTERM while capturing or spooling mailboxes,
+     // so buffered records are written out first.
+     static sigset_t report_sigs;
+     sigemptyset(&report_sigs);
+     sigaddset(&report_sigs, SIGUSR1);
+     if (capture_file || mailbox_file) {
+         sigaddset(&report_sigs, SIGINT);
+         sigaddset(&report_sigs, SIGTERM);
+     }
+     pthread_sigmask(SIG_BLOCK, &report_sigs, NULL);
+     pthread_t report_tid;
+     if (pthread_create(&report_tid, NULL, lat_reporter, &report_sigs) == 0) {
+         pthread_detach(report_tid);
+     }
+ 
+     if (pipe(upgrade_pipe) < 0) {
+         perror("pipe");
+         exit(EXIT_FAILURE);
+     }
+     fcntl(upgrade_pipe[0], F_SETFL, O_NONBLOCK);
+ 
+     // The accept loop reads from sockets too, so it parks during upgrades.
+     thread_started();
+ 
+     int server_sock = -1;
+     for (int tries = 1; upgrade_path; tries++) {
+         server_sock = takeover_state(upgrade_path);
+         if (server_sock != TAKEOVER_FAILED) {
+             break;
          }
+         // The old process is still listening, so binding the port would fail.
+         if (tries == UPGRADE_TAKEOVER_TRIES) {
+             fprintf(stderr, "takeover: previous server kept running, giving up\n");
+             exit(EXIT_FAILURE);
+         }
+         fprintf(stderr, "takeover: retrying\n");
+         sleep(1);
+     }
+     if (server_sock >= 0) {
+         printf("Server resumed on inherited listening socket.\n");
+     } else {
+         server_sock = open_listen_socket(port);
+         printf("Server listening on port %d...\n", port);
+     }
+     // An inherited local socket stays in use.
+     if (local_path && local_sock < 0) {
+         local_sock = open_local_socket(local_path);
+         printf("Accepting local clients on %s.\n", local_path);
+     }
  
-         int idx = find_free_client_slot();
-         if (idx < 0) {
-             struct message nak;
-             memset(&nak, 0, sizeof(nak));
-             nak.type = LO_NAK;
-             strcpy((char*)nak.data, "Server full");
-             send_message(client_sock, &nak);
-             close(client_sock);
-             pthread_mutex_unlock(&mutex);
-             continue;
+     // After a takeover, so the old process has stopped appending.
+     if (mailbox_file && mailbox_open(mailbox_file) < 0) {
+         exit(EXIT_FAILURE);
+     }
+ 
+     static int upgrade_socks[2];
+     if (upgrade_path) {
+         upgrade_socks[0] = open_upgrade_socket(upgrade_path);
+         upgrade_socks[1] = server_sock;
+         pthread_t upgrade_tid;
+         if (upgrade_socks[0] < 0 ||
+             pthread_create(&upgrade_tid, NULL, upgrade_listener, upgrade_socks) != 0) {
+             fprintf(stderr, "Live upgrade disabled.\n");
+         }
+     }
+
+     static int admin_sock;
+     if (admin_path) {
+         admin_sock = open_admin_socket(admin_path);
+         pthread_t admin_tid;
+         if (admin_sock < 0 ||
+             pthread_create(&admin_tid, NULL, admin_listener, &admin_sock) != 0) {
+             fprintf(stderr, "Admin endpoint disabled.\n");
          }
+     }
  
-         clients[idx].sockfd = client_sock;
-         strncpy(clients[idx].clientID, clientID, MAX_NAME - 1);
-         clients[idx].clientAddr = client_addr;
-         clients[idx].active = 1;
-         clients[idx].session_count = 0;
-         clients[idx].last_active = time(NULL);  // Set initial activity time
+     // Start the window thread; its waits use the monotonic clock of now_ns().
+     pthread_condattr_t window_attr;
+     pthread_condattr_init(&window_attr);
+     pthread_condattr_setclock(&window_attr, CLOCK_MONOTONIC);
+     pthread_cond_init(&window_cond, &window_attr);
+     pthread_condattr_destroy(&window_attr);
+     pthread_t window_tid;
+     if (pthread_create(&window_tid, NULL, window_thread, NULL) != 0) {
+         perror("pthread_create for window thread");
+         exit(EXIT_FAILURE);
+     }
  
-         struct message ack;
-         memset(&ack, 0, sizeof(ack));
-         ack.type = LO_ACK;
-         strcpy((char*)ack.data, "Login successful");
-         send_message(client_sock, &ack);
+     pthread_t search_tid;
+     if (search_on && pthread_create(&search_tid, NULL, search_indexer, NULL) != 0) {
+         perror("pthread_create for search indexer");
+         exit(EXIT_FAILURE);
+     }
  
-         printf("Client '%s' logged in.\n", clientID);
+     // Start the inactivity monitor thread.
+     pthread_t monitor_tid;
+     if (pthread_create(&monitor_tid, NULL, inactivity_monitor, NULL) != 0) {
+         perror("pthread_create for inactivity monitor");
+         exit(EXIT_FAILURE);
+     }
  
-         pthread_t tid;
-         int *arg = malloc(sizeof(int));
-         *arg = idx;
-         if (pthread_create(&tid, NULL, client_thread, arg) != 0) {
-             perror("pthread_create");
-             clients[idx].active = 0;
-             close(client_sock);
+     while (1) {
+         struct pollfd pfd[3 + LOGIN_PENDING_MAX];
+         pfd[0].fd = server_sock;
+         pfd[0].events = POLLIN;
+         pfd[1].fd = upgrade_pipe[0];
+         pfd[1].events = POLLIN;
+         pfd[2].fd = local_sock;       // ignored by poll while -1
+         pfd[2].events = POLLIN;
+         for (int i = 0; i < num_logins; i++) {
+             pfd[3 + i].fd = logins[i].fd;
+             pfd[3 + i].events = POLLIN;
+         }
+         // Wake once a second while connections wait, to expire them.
+         if (poll(pfd, 3 + num_logins, num_logins ? 1000 : -1) < 0) {
+             continue;
+         }
+         if (pfd[1].revents & POLLIN) {
+             park_for_upgrade();
+             continue;
          }
  
-         pthread_mutex_unlock(&mutex);
+         // Backwards, so that removing an entry leaves the rest of pfd in place.
+         time_t now = time(NULL);
+         for (int i = num_logins - 1; i >= 0; i--) {
+             int rc = pfd[3 + i].revents ? pending_login_read(&logins[i]) : 0;
+             if (rc == 0 && now < logins[i].deadline) {
+                 continue;
+             }
+             pending_login_t p = logins[i];
+             logins[i] = logins[--num_logins];
+             if (rc > 0) {
+                 login_client(p.fd, p.local, &p.addr, &p.msg);
+             } else {
+                 close(p.fd);
+             }
+         }
+ 
+         if (!(pfd[0].revents & POLLIN) && !(pfd[2].revents & POLLIN)) {
+             continue;
+         }
+         struct sockaddr_in client_addr;
+         socklen_t addr_len = sizeof(client_addr);
+         int local = (pfd[2].revents & POLLIN) && !(pfd[0].revents & POLLIN);
+         int client_sock;
+         if (local) {
+             client_sock = accept(local_sock, NULL, NULL);
+             memset(&client_addr, 0, sizeof(client_addr));
+             client_addr.sin_family = AF_UNIX;
+         } else {
+             client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_len);
+         }
+         if (client_sock < 0) {
+             perror("accept");
+             continue;
+         }
+         STAT_ADD(connections, 1);
+         pending_login_add(client_sock, local, &client_addr, now);
      }
  
      close(server_sock);
+     if (local_sock >= 0) {
+         close(local_sock);
+     }
      return 0;
- }
\ No newline at end of file
+ }
+ #endif
\ No newline at end of file